@@ -15,6 +15,8 @@
   #include <hal/amp-1.0.0/amp-storage.h>
 #endif
 
+class App;
+
 class Amp {
   public:
     static Power *power;
@@ -28,10 +30,11 @@ class Amp {
     static BluetoothLE *ble;
 #endif
 
-    LifecycleBase *app = nullptr;
+    App *app = nullptr;
 
     static Amp* instance() { static Amp amp; return &amp; }
 
     void init();
     void process();
+    void wait(TickType_t timeout);
 };
\ No newline at end of file
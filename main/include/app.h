@@ -3,7 +3,7 @@
 
 #include <amp.h>
 #include <interfaces/lifecycle.h>
-#include <interfaces/motion-listener.h>
+#include <hal/event-bus.h>
 #include <interfaces/render-host.h>
 
 #ifdef BLE_ENABLED
@@ -12,17 +12,17 @@
   #include <services/vehicle-service.h>
   #include <services/config-service.h>
   #include <services/update-service.h>
+  #include <services/diagnostics-service.h>
 #endif
 
 static const char* APP_TAG = "app";
 
-class App : public LifecycleBase, public ConfigListener, public MotionListener, public RenderHost {
+class App : public LifecycleBase, public ConfigListener, public RenderHost, public EventSubscriber {
   TaskHandle_t *renderHostHandle = NULL;
   static Amp *amp;
   AmpConfig *config;
   VehicleState vehicleState;
   bool _renderHostActive = false;
-  std::vector<RenderListener*> renderListeners;
 
   Actions _motionCommand = Actions::LightsMotionNeutral;
   Actions _headlightCommand = Actions::LightsHeadlightNormal;
@@ -30,12 +30,15 @@ class App : public LifecycleBase, public ConfigListener, public MotionListener,
   Actions _orientationCommand = Actions::LightsOrientationUnknown;
 
 #if defined(BLE_ENABLED)
-  // services
-  DeviceInfoService *deviceInfoService;
-  BatteryService *batteryService;
-  VehicleService *vehicleService;
-  ConfigService *configService;
-  UpdateService *updateService;
+  // services, created by the first pass of the app loop after the BLE host is up
+  DeviceInfoService *deviceInfoService = nullptr;
+  BatteryService *batteryService = nullptr;
+  VehicleService *vehicleService = nullptr;
+  ConfigService *configService = nullptr;
+  UpdateService *updateService = nullptr;
+  DiagnosticsService *diagnosticsService = nullptr;
+  bool _servicesStarted = false;
+  void startServices();
 #endif
   
   public:
@@ -43,14 +46,18 @@ class App : public LifecycleBase, public ConfigListener, public MotionListener,
     void onPowerUp();
     void onPowerDown();
     void process();
+    void waitForEvents(TickType_t timeout);
     void onConfigUpdated();
+    void onConfigChanged(uint8_t changes);
+    void onEvent(const Event &event);
+    void onVehicleStateChanged(VehicleState state);
     // void setLightMode(LightMode mode);
-    void addRenderListener(RenderListener* listener) { renderListeners.push_back(listener); }
 
     void onAccelerationStateChanged(AccelerationState state);
     void onTurnStateChanged(TurnState state);
     void onOrientationChanged(Orientation state);
 
+    void applyAction(ActionGroup group, Actions command);
     void setHeadlight(Actions command);
     void setMotion(Actions command);
     void setTurnLights(Actions command);
@@ -32,6 +32,9 @@
 #define IMU_MISO            GPIO_NUM_19
 #define IMU_MOSI            GPIO_NUM_23
 #define IMU_CS              GPIO_NUM_5
+// INT1 isn't confirmed against the board schematic yet. Until it is the IMU
+// is polled and the board doesn't light sleep, as nothing would wake it on motion
+// #define IMU_INT1            GPIO_NUM_4
 #define BLE_ENABLED
 
 #include "AddressableLED.h"
@@ -70,6 +73,13 @@ static const Color updateError(127, 0, 0);
 #define DEFAULT_TURN_THRESHOLD 7.0      // degrees
 #define DEFAULT_BRAKE_THRESHOLD 0.2     // g
 #define DEFAULT_ACCELERATION_THRESHOLD 0.2     // g
+#define DEFAULT_MOTION_EXIT_RATIO 0.5f  // exit thresholds default to this much of their enter thresholds
+#define DEFAULT_BRAKE_JERK_THRESHOLD 2.0f  // g/s
+#define DEFAULT_BRAKE_HOLD 1000         // ms
+#define DEFAULT_MOTION_HOLD 100         // ms
+#define DEFAULT_SAMPLE_RATE 100         // Hz
+#define DEFAULT_PARKED_SAMPLE_RATE 10   // Hz
+#define DEFAULT_GRAVITY_CUTOFF 0.5f     // Hz
 
 #define DEFAULT_ORIENTATION_UP_MIN 70   // degrees
 #define DEFAULT_ORIENTATION_UP_MAX 110  // degrees
@@ -138,21 +148,37 @@ const float voltageBreakpoints[21] = {
   3.27
 };
 
+// breakpoints are 5% apart, interpolated between
 inline uint8_t percentageFromReading(float reading) {
-  for (uint8_t i = 0; i < sizeof(voltageBreakpoints); i++)
-    if (reading >= voltageBreakpoints[i])
-      return 100 - (5 * i);
-  
+  const uint8_t count = sizeof(voltageBreakpoints) / sizeof(voltageBreakpoints[0]);
+  if (reading >= voltageBreakpoints[0])
+    return 100;
+
+  for (uint8_t i = 1; i < count; i++) {
+    if (reading >= voltageBreakpoints[i]) {
+      float span = voltageBreakpoints[i - 1] - voltageBreakpoints[i];
+      float fraction = (reading - voltageBreakpoints[i]) / span;
+      return 100 - (5 * i) + (uint8_t) (5 * fraction + 0.5f);
+    }
+  }
+
   return 0;
 }
 
 inline Color hexToColor(std::string hex) {
   Color color;
-  sscanf(hex.c_str(), "#%02x%02x%02x", (uint*) &color.r, (uint*) &color.g, (uint*) &color.b);
+  sscanf(hex.c_str(), "#%02hhx%02hhx%02hhx", &color.r, &color.g, &color.b);
 
   return color;
 }
 
+inline std::string colorToHex(Color color) {
+  char hex[8];
+  snprintf(hex, sizeof(hex), "#%02x%02x%02x", color.r, color.g, color.b);
+
+  return std::string(hex);
+}
+
 inline std::vector<std::string> split(const std::string &s, char delim) {
   std::stringstream ss(s);
   std::string item;
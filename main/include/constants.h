@@ -7,6 +7,10 @@ extern std::string vehicleStateCharacteristicUUID;
 extern std::string vehicleLightsCharacteristicUUID;
 extern std::string vehicleCalibrationCharacteristicUUID;
 extern std::string vehicleRestartCharactersticUUID;
+extern std::string vehicleTelemetryCharacteristicUUID;
+extern std::string vehicleStatusCharacteristicUUID;
+extern std::string vehicleClockCharacteristicUUID;
+extern std::string vehicleTraceCharacteristicUUID;
 
 extern std::string configServiceUUID;
 extern std::string configRxCharacteristicUUID;
@@ -16,4 +20,13 @@ extern std::string configStatusCharacteristicUUID;
 extern std::string updateServiceUUID;
 extern std::string updateControlCharacteristicUUID;
 extern std::string updateRxCharacteristicUUID;
-extern std::string updateStatusCharacteristicUUID;
\ No newline at end of file
+extern std::string updateStatusCharacteristicUUID;
+
+extern std::string diagnosticsServiceUUID;
+extern std::string diagnosticsRenderCharacteristicUUID;
+extern std::string diagnosticsLatencyCharacteristicUUID;
+extern std::string diagnosticsTasksCharacteristicUUID;
+extern std::string diagnosticsEffectsCharacteristicUUID;
+extern std::string diagnosticsMemoryCharacteristicUUID;
+extern std::string diagnosticsBootCharacteristicUUID;
+extern std::string diagnosticsPerformanceCharacteristicUUID;
\ No newline at end of file
@@ -0,0 +1,60 @@
+#pragma once
+#include "FreeRTOS.h"
+#include <atomic>
+#include <stdint.h>
+
+/**
+ * Single writer, many reader double buffer. Readers pin the published side
+ * with a Reader for as long as they use it and never block. The writer fills
+ * the other side once the last reader still on it has let go, then hands it
+ * over with one atomic store, so a reader only ever sees a whole version.
+ *
+ * Writers have to be serialized by the caller.
+ */
+template <typename T>
+class DoubleBuffer {
+  T _buffers[2];
+  std::atomic<uint8_t> _published { 0 };
+  std::atomic<uint32_t> _readers[2];
+
+  public:
+    DoubleBuffer() {
+      _readers[0].store(0);
+      _readers[1].store(0);
+    }
+
+    class Reader {
+      DoubleBuffer *_buffer;
+      uint8_t _side;
+
+      public:
+        explicit Reader(DoubleBuffer &buffer) : _buffer(&buffer) {
+          // a publish between looking and pinning means the side may be about to be rewritten
+          for (;;) {
+            _side = buffer._published.load();
+            buffer._readers[_side].fetch_add(1);
+            if (buffer._published.load() == _side)
+              break;
+            buffer._readers[_side].fetch_sub(1);
+          }
+        }
+
+        ~Reader() { _buffer->_readers[_side].fetch_sub(1); }
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        const T& operator*() const { return _buffer->_buffers[_side]; }
+        const T* operator->() const { return &_buffer->_buffers[_side]; }
+    };
+
+    // writer side, the unpublished buffer once no reader is left on it
+    T& back() {
+      uint8_t side = 1 - _published.load();
+      while (_readers[side].load() > 0)
+        vTaskDelay(1);
+
+      return _buffers[side];
+    }
+
+    void publish() { _published.store(1 - _published.load()); }
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include <common.h>
+#include <models/motion.h>
+
+// time constant of the jerk smoothing in seconds, a raw derivative of the
+// linear acceleration is mostly sensor noise
+#define ACCELERATION_JERK_TIME_CONSTANT 0.02f
+
+/**
+ * Brake and acceleration detection over the filtered signal on the motion axis.
+ * Each state is entered past its enter threshold and only left once the signal
+ * falls back past its lower exit threshold, so a reading sitting on the line
+ * doesn't flicker the brake lights.
+ *
+ * Braking also starts early when the signal is already past the brake exit
+ * threshold and rising faster than the jerk threshold, which catches the
+ * onset of a hard stop a few samples before it crosses the enter threshold.
+ * Early onset only fires while the vehicle is moving, standing on a parked
+ * board is all jerk and no braking. Braking is never held off, every other
+ * change waits out the hold of the state it leaves.
+ */
+class AccelerationDetector {
+  float _brakeEnter = DEFAULT_BRAKE_THRESHOLD;
+  float _brakeExit = DEFAULT_BRAKE_THRESHOLD * DEFAULT_MOTION_EXIT_RATIO;
+  float _accelerationEnter = DEFAULT_ACCELERATION_THRESHOLD;
+  float _accelerationExit = DEFAULT_ACCELERATION_THRESHOLD * DEFAULT_MOTION_EXIT_RATIO;
+  // g/s, 0 turns early onset off
+  float _brakeJerk = DEFAULT_BRAKE_JERK_THRESHOLD;
+  // ms
+  unsigned long _brakeHold = DEFAULT_BRAKE_HOLD;
+  unsigned long _motionHold = DEFAULT_MOTION_HOLD;
+
+  float _acceleration = 0.0f;
+  float _jerk = 0.0f;
+  // highest jerk since the last evaluate, so a spike mid batch isn't lost
+  float _peakJerk = 0.0f;
+  bool _primed = false;
+  // fed from MovementEstimator, left set when nothing tells us otherwise
+  bool _moving = true;
+
+  bool brakeOnset() const;
+
+  public:
+    void configure(const MotionConfig &config);
+    // exit thresholds are kept at or below their enter thresholds
+    void setThresholds(float brake, float acceleration);
+    float brakeThreshold() { return _brakeEnter; }
+    float accelerationThreshold() { return _accelerationEnter; }
+
+    // acceleration in g along the motion axis, positive when braking. dt in seconds since the previous sample
+    void update(float acceleration, float dt);
+    void reset();
+    void setMoving(bool moving) { _moving = moving; }
+
+    // the state to move to from current, which has been held for held ms
+    AccelerationState evaluate(AccelerationState current, unsigned long held);
+
+    float acceleration() { return _acceleration; }
+    float jerk() { return _jerk; }
+};
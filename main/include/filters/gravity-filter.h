@@ -0,0 +1,48 @@
+#pragma once
+#include <common.h>
+#include <models/motion.h>
+
+/**
+ * Separates gravity from linear acceleration over a batch of samples. The
+ * batch is split per axis so each kernel is a single dependent recurrence over
+ * contiguous floats with no branches inside the loop.
+ *
+ * SinglePole is the original exponential filter (gravity += (1 - alpha) * delta).
+ * Biquad is a second order Butterworth low pass at the configured cutoff; the
+ * linear output (raw - gravity) is its high pass complement and settles a
+ * sustained brake much more slowly than the single pole does.
+ */
+class GravityFilter {
+  struct AxisState {
+    float z1 = 0.0f;
+    float z2 = 0.0f;
+    float gravity = 0.0f;
+  };
+
+  GravityFilterType _type = GravityFilterType::SinglePole;
+  float _alpha = 0.5f;
+  float _cutoff = DEFAULT_GRAVITY_CUTOFF;
+  float _sampleRate = DEFAULT_SAMPLE_RATE;
+  float _b0, _b1, _b2, _a1, _a2;
+
+  AxisState _state[3];
+  bool _primed = false;
+
+  void updateCoefficients();
+  void prime(const AccelBatch &raw);
+  void singlePole(AxisState &state, const float *in, float *gravity, float *linear, size_t count);
+  void biquad(AxisState &state, const float *in, float *gravity, float *linear, size_t count);
+
+  public:
+    GravityFilter() { updateCoefficients(); }
+
+    void setType(GravityFilterType type);
+    GravityFilterType getType() { return _type; }
+    void setAlpha(float alpha) { _alpha = alpha; }
+    void setCutoff(float hz);
+    void setSampleRate(float hz);
+
+    // filters raw.count samples, gravity and linear may not alias raw
+    void process(const AccelBatch &raw, AccelBatch &gravity, AccelBatch &linear);
+    void reset();
+};
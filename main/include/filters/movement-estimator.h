@@ -0,0 +1,56 @@
+#pragma once
+#include <common.h>
+#include <models/motion.h>
+
+// samples of vibration energy averaged over, power of two. ~0.6 s at the riding rate
+#define MOVEMENT_WINDOW 64
+// g, road vibration below this is sensor noise or someone shifting their weight
+#define MOVEMENT_VIBRATION_FLOOR 0.03f
+// seconds, the integrated speed decays over this so accelerometer drift never builds up
+#define MOVEMENT_SPEED_LEAK 2.0f
+// g·s (~5 m/s) of integrated speed that counts as fully moving on its own
+#define MOVEMENT_SPEED_REFERENCE 0.5f
+// confidence from which the vehicle counts as moving
+#define MOVEMENT_CONFIDENT 0.5f
+// g rms of vibration between slow / cruising and cruising / fast
+#define MOVEMENT_CRUISING_VIBRATION 0.08f
+#define MOVEMENT_FAST_VIBRATION 0.2f
+// fraction of a boundary the signal must cross it by to change class
+#define MOVEMENT_HYSTERESIS 0.2f
+
+/**
+ * Estimates whether and roughly how fast the vehicle is moving from the
+ * accelerometer alone. Two cues are combined:
+ *
+ *  - vibration energy, the road shaking the board. The share of the window
+ *    above the vibration floor says whether we're rolling, its rms how fast
+ *  - acceleration along the motion axis, integrated with a leak, which still
+ *    registers a smooth push off before the road gets rough enough to show
+ *
+ * Each update is a fixed few multiplies and a ring buffer slot, the window's
+ * sums are kept running and rebuilt once per lap so float error can't creep in.
+ */
+class MovementEstimator {
+  float _energy[MOVEMENT_WINDOW] = { 0 };
+  uint16_t _index = 0;
+  uint16_t _filled = 0;
+  float _sum = 0.0f;
+  // samples in the window above the vibration floor
+  uint16_t _active = 0;
+  float _speed = 0.0f;
+  SpeedClass _class = SpeedClass::SpeedStopped;
+
+  public:
+    // linear acceleration in g, axis the part of it along the motion axis, dt in seconds since the previous sample
+    void update(const Vector3D &linear, float axis, float dt);
+    void reset();
+
+    // 0 - 1
+    float confidence() const;
+    // g rms over the window
+    float vibration() const;
+    // moves the speed class on with hysteresis, called once per batch
+    SpeedClass classify();
+    SpeedClass speedClass() const { return _class; }
+    bool moving() const { return _class != SpeedClass::SpeedStopped; }
+};
@@ -0,0 +1,31 @@
+#pragma once
+#include <common.h>
+#include <models/motion.h>
+
+/**
+ * Accelerometer only attitude estimate. Roll and pitch come from the direction
+ * of the acceleration vector; yaw isn't observable without a gyro or mag and
+ * stays at 0. Each update is a fixed handful of multiplies, one inverse sqrt
+ * and two atan2 approximations, whatever the filter type.
+ */
+class TiltFilter {
+  AttitudeFilter _type = AttitudeFilter::SmoothedTilt;
+  // time constant of the smoothed filter in seconds
+  float _timeConstant = 0.1f;
+  Vector3D _attitude;
+
+  public:
+    static float invSqrt(float value);
+    static float fastAtan2(float y, float x);
+
+    void setType(AttitudeFilter type) { _type = type; }
+    AttitudeFilter getType() { return _type; }
+    void setTimeConstant(float seconds) { _timeConstant = seconds; }
+
+    // accel in g, dt in seconds since the previous sample
+    void update(Vector3D accel, float dt);
+    void reset() { _attitude = Vector3D(); }
+
+    // degrees, x = roll, y = pitch, z = yaw
+    Vector3D getAttitude() { return _attitude; }
+};
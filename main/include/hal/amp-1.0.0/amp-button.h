@@ -4,18 +4,34 @@
 #include "driver/gpio.h"
 #include <interfaces/touch-listener.h>
 
+// edges closer together than this are contact bounce
+#define BUTTON_DEBOUNCE_MS 20
+#define BUTTON_QUEUE_SIZE 16
+
+// captured in the isr
+struct ButtonEdge {
+  uint32_t time;
+  uint8_t level;
+};
+
 class AmpButton {
   TouchTaskListener *_listener = nullptr;
-  long touchEventTimeout = 500;
-  long holdDuration = 500;
-  long touchStart, touchEnd;
   static bool goingDown;
 
+  // the last edge handed to the listener, the button idles high
+  uint8_t lastLevel = 1;
+  uint32_t lastEdge = 0;
+  // a bounce was dropped, the level is re-read once the contacts settle
+  bool settling = false;
+  uint32_t settleStart = 0;
+
+  void emit(uint8_t level, uint32_t time);
+
   public:
     void init(TouchTaskListener *listener);
     void deinit();
 
-    void process();
-    static void onButtonInteraction();
+    // waits up to timeout for the button to change
+    void process(TickType_t timeout = 0);
     static QueueHandle_t buttonEventQueue;
 };
\ No newline at end of file
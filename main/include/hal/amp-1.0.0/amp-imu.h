@@ -1,26 +1,61 @@
 #pragma once
 
 #include "lis3dh.h"
+#include "driver/gpio.h"
 #include <common.h>
 #include <models/motion.h>
+#include <hal/power-lock.h>
+
+// the FIFO raises INT1 after roughly this much data, whatever the rate
+#define IMU_BATCH_PERIOD      50
+#define IMU_FIFO_MAX          16
+// the sample task drains the FIFO at least this often if the interrupt never fires,
+// without one it's polled once a batch
+#if defined(IMU_INT1)
+  #define IMU_SAMPLE_TIMEOUT  100
+#else
+  #define IMU_SAMPLE_TIMEOUT  IMU_BATCH_PERIOD
+#endif
+// wake on motion threshold, 16mg per count at 2g full scale
+#define IMU_WAKE_THRESHOLD    6
+
+// accel calibration averages this many samples at a high data rate, after
+// discarding the first few while the new rate settles
+#define IMU_CALIBRATION_RATE      200
+#define IMU_CALIBRATION_SAMPLES   256
+#define IMU_CALIBRATION_SETTLE    20
+#define IMU_CALIBRATION_TIMEOUT   5000
+// the board has to be lying still on one face, within these limits in g
+#define IMU_CALIBRATION_MAX_STDDEV        0.02f
+#define IMU_CALIBRATION_GRAVITY_TOLERANCE 0.1f
 
 static const char* IMU_TAG = "imu";
 
 class AmpIMU {
   static lis3dh_sensor_t* sensor;
-  lis3dh_float_data_t data;
+  lis3dh_float_data_fifo_t samples;
+  uint8_t sampleCount = 0;
   IMUState imuStatus;
+  uint16_t sampleRate = 0;
+  // keeps the SPI clock steady for the length of a FIFO burst
+  PowerLock readLock { ESP_PM_APB_FREQ_MAX, "imu" };
+
+  static lis3dh_odr_mode_t odrForRate(uint16_t rate, uint16_t *actual);
 
   Vector3D accel, gyro, mag;
 
   public:
     AmpIMU();
 
+    static TaskHandle_t sampleTask;
+
     uint8_t init();
     void deinit();
-    void process();
+    uint8_t process();
+    void setSampleTask(TaskHandle_t task) { sampleTask = task; }
 
     Vector3D getAccelData();
+    Vector3D getAccelSample(uint8_t index);
     Vector3D getGyroData();
     Vector3D getMagData();
 
@@ -28,10 +63,13 @@ class AmpIMU {
     bool gyroAvailable() { return false; }
     bool magAvailable() { return false; }
 
-    void setPowerMode(IMUState state);
+    void setPowerMode(IMUState state, uint16_t rate);
+    uint16_t configure(uint16_t rate, lis3dh_resolution_t resolution, lis3dh_scale_t scale = lis3dh_scale_2_g);
+    uint16_t getSampleRate() { return sampleRate; }
+    void setWakeOnMotion(bool enabled);
 
     void calibrateMag(Vector3D *outOffsets);
-    void calibrateXG(Vector3D *outOffsets);
+    bool calibrateXG(Vector3D *outOffsets);
 
     IMUState getIMUState() { return imuStatus; }
 };
\ No newline at end of file
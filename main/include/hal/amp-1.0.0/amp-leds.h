@@ -4,6 +4,7 @@
 #include <map>
 
 #include <models/light.h>
+#include <hal/power-lock.h>
 
 #include <OneWireLED.h>
 #include <TwoWireLED.h>
@@ -26,13 +27,34 @@ const uint8_t gamma8[] = {
   177,180,182,184,186,189,191,193,196,198,200,203,205,208,210,213,
   215,218,220,223,225,228,231,233,236,239,241,244,247,249,252,255 };
 
+// rough per-led draw used to estimate a strip's current, in mA
+#define LED_COLOR_CURRENT   20   // each color at full duty
+#define LED_IDLE_CURRENT    1    // driver quiescent draw
+
+// what a controller's pixel bytes mean on the wire
+enum PixelFormat : uint8_t {
+  PixelRGB = 0,
+  // the fourth byte drives the white die, pulled out of the color's common component
+  PixelRGBW,
+  // the fourth byte is the strip's 5 bit global brightness
+  PixelDotStar
+};
+
+// dark in every format, lightOff would leave a white die or dotstar brightness at full
+static const Color wireOff(0, 0, 0, 0);
+
 static const char* LEDS_TAG = "leds";
 
 class AmpLeds {
   LightController* status;
   std::map<uint8_t, LightController*> channels;
   std::map<uint8_t, uint16_t> leds;
-  // std::map<uint8_t, bool> dirty;
+  std::map<uint8_t, uint16_t> currentLimits;
+  // what each live controller was created from
+  std::map<uint8_t, LightChannel> definitions;
+  // back buffers painted by effects, handed to the controllers on flush
+  std::map<uint8_t, std::vector<Color>> frames;
+  std::map<uint8_t, PixelFormat> formats;
 
   std::map<uint8_t, uint8_t> lightMap {
     std::make_pair(1, STRIP_ONE_DATA),
@@ -47,23 +69,44 @@ class AmpLeds {
   };
 
   uint8_t _brightness = 255;
-  // bool statusDirty = false;
-  bool dirty;
+  // gamma correction with brightness folded in, applied to every pixel on flush
+  uint8_t output[256];
+  void buildOutputTable();
+  bool statusDirty = false;
+  // one bit per channel number, set when a channel's pixels change
+  uint16_t dirty = 0;
+
+  void markDirty(uint8_t channelNumber) { dirty |= 1 << channelNumber; }
+  bool isDirty(uint8_t channelNumber) { return dirty & (1 << channelNumber); }
+
+  void swapFrame(uint8_t channelNumber, LightController *controller);
+  Color wirePixel(PixelFormat format, const Color &pixel);
+  static PixelFormat formatForType(LEDType type);
+
+  // RMT clocks off the APB, so it has to stay at full speed until every strip is idle
+  PowerLock transmitLock { ESP_PM_APB_FREQ_MAX, "leds" };
+  bool idle();
 
   public:
     void init();
     void deinit();
     void process();
+    void sleep();
+    void wake();
     void setStatus(Color color);
     void render(bool all = false, int8_t channel = -1);
+    // something is waiting to go out, or still going out and holding the clocks
+    bool pending() { return statusDirty || dirty || transmitLock.held(); }
     Color gammaCorrected(Color color);
-    void setBrightness(uint8_t brightness) { _brightness = brightness; /*FastLED.setBrightness(_brightness);*/ }
+    void setBrightness(uint8_t brightness);
 
     void setPixel(uint8_t channelNumber, Color color, uint16_t index);
     Color getPixel(uint8_t channelNumber, uint16_t index);
     void setPixels(uint8_t channelNumber, Color color, uint16_t start, uint16_t end);
+    void setFrame(uint8_t channelNumber, const std::vector<Color> &pixels);
 
     LightController* addLEDStrip(LightChannel data);
+    void removeLEDStrip(uint8_t channelNumber);
 
     static FreeRTOS::Semaphore ledsReady;
 };
\ No newline at end of file
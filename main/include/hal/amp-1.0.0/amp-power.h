@@ -8,16 +8,38 @@
 #include "driver/adc.h"
 #include "esp_adc_cal.h"
 #include <esp_bt.h>
+#include <esp_pm.h>
 
 #if defined(OTA_ENABLED)
 #include <WiFi.h>
 #endif
 
+static const char* PM_TAG = "pm";
+
+// the cpu runs at CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ while anything holds a PowerLock, this otherwise
+#define POWER_MIN_FREQ_MHZ  40
+
+// battery sense divider. matches the old raw / 500 at the ADC's nominal 1100mV reference
+#define BATTERY_DIVIDER_RATIO   7.445f
+#define BATTERY_DEFAULT_VREF    1100
+// raw reads per sample, the median is kept
+#define BATTERY_OVERSAMPLE      9
+// sample quickly around charger changes and at boot, slowly otherwise
+#define BATTERY_FAST_INTERVAL   250
+#define BATTERY_SLOW_INTERVAL   5000
+#define BATTERY_FAST_WINDOW     10000
+// weight of a new sample in the running average
+#define BATTERY_FILTER_WEIGHT   0.2f
+
 class AmpPower {
-  // filter co-efficient
-  const float alpha = 0.999;
-  esp_adc_cal_characteristics_t *adc_chars;  
-  float batteryReading;
+  esp_adc_cal_characteristics_t adcCharacteristics;
+  // filtered battery voltage, 0 until the first sample
+  float batteryReading = 0;
+  unsigned long lastSample = 0;
+  unsigned long lastChargeChange = 0;
+
+  void sampleBattery();
+  uint32_t readBatteryMillivolts();
   
   public:
     bool charging;
@@ -26,6 +48,8 @@ class AmpPower {
     uint8_t batteryLevel;
     uint32_t batteryAdcReading;
     void init();
+    void configurePowerManagement();
     void deinit();
     void process();
+    esp_sleep_wakeup_cause_t lightSleep();
 };
\ No newline at end of file
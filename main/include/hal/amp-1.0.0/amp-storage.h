@@ -1,5 +1,9 @@
 #pragma once
+#include "FreeRTOS.h"
+
 #include <common.h>
+#include <string>
+#include <map>
 #include <soc/efuse_reg.h>
 #include <esp_efuse.h>
 #include "esp_vfs.h"
@@ -10,17 +14,55 @@
 #include "nvs.h"
 #include <esp_spiffs.h>
 #include <models/motion.h>
+#include <models/update-status.h>
+#include <hal/tasks.h>
 
 static const char* STORAGE_TAG = "storage";
 
+enum SettingType : uint8_t {
+  SettingU8,
+  SettingU32,
+  SettingString
+};
+
+// a value waiting for the writer task, strings keep their text in text
+struct PendingSetting {
+  SettingType type;
+  uint32_t value;
+  std::string text;
+};
+
+/**
+ * Settings are write-behind: a save only records the value and wakes the
+ * writer task, which waits out TaskStorageWriter's period so a burst of
+ * saves lands in one NVS commit. Reads see pending values, and deinit
+ * flushes whatever is left before power down.
+ *
+ * OTA progress is the exception, its checkpoints are committed in line
+ * since the updater relies on them being durable before it moves on.
+ */
 class AmpStorage {
   static const char* storage;
   static esp_vfs_spiffs_conf_t conf;
 
+  static std::map<std::string, PendingSetting> pending;
+  static FreeRTOS::Semaphore pendingLock;
+  // held for a whole flush, so an older batch can never commit over a newer one
+  static FreeRTOS::Semaphore flushLock;
+  static TaskHandle_t writerHandle;
+
+  static void queue(const char* key, const PendingSetting &setting);
+  static void wakeWriter();
+  static bool pendingValue(const char* key, PendingSetting *setting);
+  static void writerTask(void *parameters);
+
   public:
     bool init();
     void deinit();
 
+    // commits every pending setting now, on the calling task
+    static void flush();
+
     static std::string getHardwareRevision();
     static std::string getSerialNumber();
     static std::string getDefaultName();
@@ -41,6 +83,14 @@ class AmpStorage {
 
     static void saveFloat(const char* key, float value);
     static float getFloat(const char* key, float defaultValue = 0);
+    static void saveFloats(const char** keys, const float* values, size_t count);
+
+    static void saveUpdateProgress(const UpdateProgress &progress);
+    static bool getUpdateProgress(UpdateProgress *progress);
+    static void clearUpdateProgress();
+
+    static uint8_t getActivePreset(uint8_t defaultValue);
+    static void saveActivePreset(uint8_t slot);
 
     static void saveString(std::string key, std::string value);
     static std::string getString(std::string key);
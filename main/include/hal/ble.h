@@ -2,10 +2,15 @@
 #include <interfaces/lifecycle.h>
 #include <interfaces/touch-listener.h>
 #include <interfaces/ble-listener.h>
+#include <hal/event-bus.h>
+#include <hal/tasks.h>
+#include <hal/power-lock.h>
 #include <hal/config.h>
 #include <models/config.h>
 #include <constants.h>
 #include "FreeRTOS.h"
+#include <vector>
+#include <atomic>
 
 #if defined(AMP_1_0_x)
   #include <hal/amp-1.0.0/amp-storage.h>
@@ -16,17 +21,53 @@
 
 #define PUBLIC_ADVERTISEMENT_MS   15000
 
+// connection parameters, intervals in 1.25ms units and timeouts in 10ms units
+#define BLE_FAST_INTERVAL_MIN     6       // 7.5ms
+#define BLE_FAST_INTERVAL_MAX     12      // 15ms
+#define BLE_FAST_LATENCY          0
+#define BLE_FAST_TIMEOUT          400
+#define BLE_IDLE_INTERVAL_MIN     60      // 75ms
+#define BLE_IDLE_INTERVAL_MAX     120     // 150ms
+#define BLE_IDLE_LATENCY          4
+#define BLE_IDLE_TIMEOUT          600
+// how long a link stays fast after the last activity that asked for it
+#define BLE_FAST_LINK_HOLD_MS     3000
+// connections waiting for the ble task to give them the current policy
+#define BLE_CONNECT_QUEUE         4
+// ble task notification bit for a link policy that may need switching
+#define BLE_LINK_WAKE_BIT         (1 << 1)
+
+// what's keeping the link fast
+enum BleLinkDemand : uint8_t {
+  LinkConfig = 0x01,
+  LinkUpdate = 0x02,
+  LinkStreaming = 0x04
+};
+
 static const char* BLE_TAG = "ble";
 
-class BluetoothLE : public LifecycleBase, public TouchListener, public NimBLEServerCallbacks {
+class BluetoothLE : public LifecycleBase, public TouchListener, public EventSubscriber, public NimBLEServerCallbacks {
   NimBLEAdvertising *advertising;
   NimBLEAdvertisementData advertisementData;
-  TaskHandle_t bleTaskHandle;
-  std::vector<BleListener*> listeners;
-  std::vector<TouchType> touches;
+  TaskHandle_t bleTaskHandle = NULL;
 
   bool publicAdvertising = false;
   unsigned long publicAdvertiseStart = 0;
+  static volatile bool ready;
+
+  // link policy, fast while any demand was refreshed within BLE_FAST_LINK_HOLD_MS.
+  // only the ble task switches it or touches the connections, everyone else
+  // stamps a demand or queues a handle and wakes it
+  std::vector<uint16_t> connections;
+  QueueHandle_t connectQueue;
+  std::atomic<uint8_t> linkDemand { 0 };
+  volatile unsigned long linkDemandAt[3] = { 0, 0, 0 };
+  volatile bool fastLink = false;
+  // bulk transfers keep the cpu at full speed, the controller holds its own locks for the radio
+  PowerLock linkLock { ESP_PM_CPU_FREQ_MAX, "ble" };
+  uint8_t activeDemand();
+  void applyLinkPolicy(uint16_t conn, bool fast);
+  void updateLinkPolicy();
 
   public:
     NimBLEServer *server;
@@ -38,6 +79,8 @@ class BluetoothLE : public LifecycleBase, public TouchListener, public NimBLESer
     void onPowerUp();
     void onPowerDown();
     void process();
+    // advertising pauses while we sleep, so stay up for connected or pairing clients
+    bool canSleep() { return server == nullptr || (server->getConnectedCount() == 0 && !publicAdvertising); }
 
     // NimBLEServerCallbacks
     void onConnect(NimBLEServer *server) { }
@@ -46,15 +89,20 @@ class BluetoothLE : public LifecycleBase, public TouchListener, public NimBLESer
     void onAuthenticationComplete(ble_gap_conn_desc *conn);
 
     // TouchListener
-    void onTouchEvent(std::vector<TouchType> *touches);
+    void onTouchEvent(const TouchSequence &touches);
+    void onEvent(const Event &event);
 
     void startAdvertising();
     void updateAdvertising(std::string name, bool publicAdvertise = false);
     NimBLEService* createService(std::string uuid);
 
-    void addAdvertisingListener(BleListener *listener);
+    // asks for a short interval and 2M PHY, call again to keep it for longer
+    void requestFastLink(BleLinkDemand demand);
+
     void notifyListeners(bool isPublic);
 
     static void startServer(void *params);
     static FreeRTOS::Semaphore bleReady;
+    // set alongside bleReady, for callers that mustn't block on it
+    static bool isReady() { return ready; }
 };
\ No newline at end of file
@@ -9,30 +9,31 @@
 #endif
 
 #include <hal/power.h>
+#include <hal/event-bus.h>
+#include <hal/tasks.h>
 
 #include <memory>
 
 static const char* BUTTONS_TAG = "buttons";
 
 class Buttons : public LifecycleBase, public TouchTaskListener {
-  std::vector<TouchListener*> touchListeners;
-  std::vector<TouchType> touches;
+  TouchSequence touches;
   AmpButton ampButtons;
   TaskHandle_t inputTaskHandle;
 
   long touchEventTimeout = 500;
   long holdDuration = 500;
-  long touchStart, touchEnd;
+  // edge times from the isr
+  unsigned long touchStart = 0, touchEnd = 0;
+  TickType_t inputTimeout();
 
   public:
     void onPowerUp();
     void onPowerDown();
     void process();
 
-    void onTouchDown();
-    void onTouchUp();
-
-    void addTouchListener(TouchListener *listener);
+    void onTouchDown(unsigned long time);
+    void onTouchUp(unsigned long time);
 
     static void inputTask(void* params);
 };
\ No newline at end of file
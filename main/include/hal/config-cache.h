@@ -0,0 +1,45 @@
+#pragma once
+#include <common.h>
+#include <string>
+#include <models/config.h>
+
+#if defined(AMP_1_0_x)
+  #include <hal/amp-1.0.0/amp-storage.h>
+#endif
+
+// bump whenever the image layout changes
+#define CONFIG_CACHE_VERSION  5
+#define CONFIG_CACHE_MAGIC    0x43504d41    // "AMPC"
+#define CONFIG_CACHE_BLOCK_SIZE 256
+
+static const char* CONFIG_CACHE_TAG = "config-cache";
+
+/**
+ * Compiled image of a loaded config so boot doesn't have to deserialize the
+ * MsgPack DOM and re-parse every effect string. The image is flat packed
+ * structs behind a small header:
+ *
+ *    magic (4), version (2), reserved (2), source hash (4), body hash (4), body length (4)
+ *    motion config, channel count (1) + channels,
+ *    region count (1) + { name length (1), name, section count (1) + sections, pixel count (4) + pixels },
+ *    action count (1) + { name length (1), name, effect count (2) + effects },
+ *    pattern count (1) + { length (2), hex program },
+ *    palette count (1) + { length (2), stops }
+ *
+ * Structs are written as they sit in memory; their sizes and the firmware
+ * version are folded into the source hash so an image from another build is
+ * never loaded.
+ */
+class ConfigCache {
+  static uint32_t layoutSeed();
+
+  public:
+    static uint32_t hash(const uint8_t *data, size_t length, uint32_t seed = 2166136261u);
+    static uint32_t hash(const std::string &data);
+    // same hash as above, streamed from a file a block at a time
+    static bool hashFile(std::string path, uint32_t *hash);
+
+    static bool save(std::string path, uint32_t sourceHash, const AmpConfig &config);
+    // fills config's motion, lights and actions, leaving config untouched on failure
+    static bool load(std::string path, uint32_t sourceHash, AmpConfig &config);
+};
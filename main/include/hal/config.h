@@ -1,4 +1,9 @@
 #pragma once
+
+// keep the MsgPack DOM resident after load and edit it in place, instead of
+// regenerating the file from AmpConfig on save. costs CONFIG_DOCUMENT_SIZE of heap
+// #define CONFIG_RETAIN_DOCUMENT
+
 #include <common.h>
 #include <string>
 #include <vector>
@@ -11,13 +16,25 @@
 #include <models/light.h>
 #include <models/motion.h>
 #include <models/config.h>
+#include <models/pattern.h>
 #include <interfaces/config-listener.h>
 #include <interfaces/lifecycle.h>
+#include <hal/config-cache.h>
+#include <hal/event-bus.h>
+#include <hal/memory-stats.h>
+#include <double-buffer.h>
+#include <esp32/rom/crc.h>
 
 #if defined(AMP_1_0_x)
   #include <hal/amp-1.0.0/amp-storage.h>
 #endif
 
+#define CONFIG_DOCUMENT_SIZE 10000
+
+// compiled configs kept alongside the source, switched between without parsing
+#define CONFIG_PRESETS      4
+#define CONFIG_PRESET_NONE  0xFF
+
 static const char* CONFIG_TAG = "config";
 
 struct MsgPackFileWriter {
@@ -39,7 +56,6 @@ struct MsgPackFileReader {
 };
 
 class Config : public LifecycleBase {
-  std::vector<ConfigListener*> configListeners;
   AmpStorage ampStorage;
   
   std::string rawConfig;
@@ -51,14 +67,46 @@ class Config : public LifecycleBase {
 
   std::string configPath = "/spiffs/config.mp";
   std::string userConfigPath = "/spiffs/config.user.mp";
+  std::string configCachePath = "/spiffs/config.cache";
+  std::string uploadPath = "/spiffs/config.upload";
+
+  // a config being streamed in, written straight through to uploadPath
+  FILE *_upload = nullptr;
+  uint32_t _uploadLength = 0;
+  uint32_t _uploadReceived = 0;
+  uint32_t _uploadCrc = 0;
+  uint32_t _uploadExpectedCrc = 0;
+  void closeUpload(bool remove);
+
+  // the file the running config came from
+  std::string _sourcePath;
+  bool loadConfigSource(std::string path);
+  // compiles the running config into the cache for the source it was parsed from
+  void saveCache(uint32_t sourceHash);
+
+  // the preset running in place of the source config
+  uint8_t _activePreset = CONFIG_PRESET_NONE;
+  static std::string presetPath(uint8_t slot);
+  static uint32_t presetHash();
+  void setActivePreset(uint8_t slot);
 
-  JsonObject serializeEffects();
   static bool parseEffect(std::string data, LightingParameters *params);
   static ColorOption parseColorOption(std::string data);
+  static std::string serializeEffect(const LightingParameters &params);
+  static std::string serializeColorOption(const ColorOption &option);
 
-  StaticJsonDocument<10000> document;
-
+  // only allocated while a config is being parsed, AmpConfig is the source of
+  // truth afterwards. booting from the cache never allocates it at all
+  DynamicJsonDocument *document = nullptr;
+  bool parseDocument(const std::string &data);
   bool loadConfigFile(std::string path);
+  void releaseDocument();
+  void buildDocument(JsonDocument &out);
+  void serializeMotionConfig(JsonObject motionJson);
+  std::string serializeConfig();
+#if defined(CONFIG_RETAIN_DOCUMENT)
+  bool ensureDocument();
+#endif
 
   public:
     static AmpConfig ampConfig;
@@ -73,20 +121,73 @@ class Config : public LifecycleBase {
     void saveConfig();
     void saveUserConfig(std::string data, bool load = false);
 
+    // chunked upload of a user config, never holds more than one chunk in memory
+    bool beginUpload(uint32_t length, uint32_t crc);
+    bool appendUpload(const uint8_t *data, size_t length);
+    bool isUploading() { return _upload != nullptr; }
+    bool uploadReceived() { return _upload != nullptr && _uploadReceived == _uploadLength; }
+    bool finishUpload();
+
+    // presets are config cache images, so switching to one is a read and a table swap
+    bool savePreset(uint8_t slot);
+    bool selectPreset(uint8_t slot);
+    bool deletePreset(uint8_t slot);
+    bool cyclePreset();
+    bool presetExists(uint8_t slot);
+    uint8_t activePreset() { return _activePreset; }
+
     void loadActionConfig(JsonObject actionJson);
     void loadMotionConfig(JsonObject motionJson);
     void loadLightsConfig(JsonObject lightsJson);
+    static void buildRegionPixels(LightRegion &region);
     std::string readFile(std::string filename);
-    void addConfigListener(ConfigListener *listener);
-    void notifyConfigListeners();
+    void notifyConfigListeners(uint8_t changes = ConfigChange::ConfigAll);
 
     void updateDeviceName(std::string name);
     bool addEffect(std::string action, std::string region, std::string data, bool updateJson = false);
+
+    // patches to the running config, each only notifies the listeners it affects
+    bool setEffect(std::string action, std::string region, std::string data, bool save = false);
+    bool setRegion(std::string name, std::string sections, bool save = false);
+    bool setMotionValue(std::string key, std::string value, bool save = false);
+    bool setPattern(uint8_t index, std::string program, bool save = false);
     // void removeEffect(std::string, std::string region, bool updateJson = false);
-    std::vector<LightingParameters>* getActionEffects(std::string action);
+    // rebuilds the unpublished action table from ampConfig.actions and publishes it
+    static void buildActionTable();
 
     bool isValid() { return _valid; }
-    std::string getRawConfig() { std::string data; serializeMsgPack(document, data); return data; }
+    std::string getRawConfig();
+
+    // serializes the running config into writer, calling writer.begin(length) first
+    template <typename TWriter>
+    size_t streamConfig(TWriter &writer) {
+#if defined(CONFIG_RETAIN_DOCUMENT)
+      // the setters edit the retained document too, so it's held for the whole stream
+      effectsUpdating.wait(CONFIG_TAG);
+      effectsUpdating.take(CONFIG_TAG);
+      if (!ensureDocument()) {
+        effectsUpdating.give();
+        return 0;
+      }
+      JsonDocument &out = *document;
+#else
+      // the built document is a copy, only building it needs the lock
+      DynamicJsonDocument out(CONFIG_DOCUMENT_SIZE);
+      effectsUpdating.wait(CONFIG_TAG);
+      effectsUpdating.take(CONFIG_TAG);
+      buildDocument(out);
+      effectsUpdating.give();
+#endif
+      writer.begin(measureMsgPack(out));
+      auto written = serializeMsgPack(out, writer);
+#if defined(CONFIG_RETAIN_DOCUMENT)
+      effectsUpdating.give();
+#endif
+      return written;
+    }
 
+    // guards ampConfig, every edit holds it. the renderer copies what it needs
+    // under it when it hears of a change, the app reads through actionTables
     static FreeRTOS::Semaphore effectsUpdating;
+    static DoubleBuffer<ActionTable> actionTables;
 };
\ No newline at end of file
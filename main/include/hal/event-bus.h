@@ -0,0 +1,110 @@
+#pragma once
+#include "FreeRTOS.h"
+
+#include <atomic>
+#include <cstring>
+#include <common.h>
+
+// events a subscriber can hold before it has to drain them
+#define EVENT_MAILBOX_SIZE  8
+#define EVENT_PAYLOAD_SIZE  16
+#define EVENT_SUBSCRIBERS   16
+
+// task notification bit the bus sets on a subscriber's task, other bits are the task's own
+#define EVENT_NOTIFY_BIT    (1 << 0)
+
+#define EVENT_MASK(type)    (1UL << (type))
+
+static const char* EVENTS_TAG = "events";
+
+enum EventType : uint8_t {
+  // state, a newer event replaces one still waiting in a mailbox
+  EventPowerStatus = 0,     // PowerStatus, on level changes and percentage ticks
+  EventPowerLevel,          // PowerStatus, only when level, charging or presence change
+  EventVehicleState,        // VehicleState
+  EventConfigChanged,       // uint8_t ConfigChange bits, 0 when the config is invalid
+  EventLightsChanged,       // LightCommands
+  EventAdvertising,         // bool, true while advertising publicly
+  EventMovement,            // MovementState, on speed class changes and confidence steps
+
+  // discrete, every one is delivered in order
+  EventUpdateStatus,        // UpdateStatus
+  EventCalibrateXG,         // CalibrationState
+  EventCalibrateMag,        // CalibrationState
+  EventTouch,               // bool, true on down
+  EventTouchSequence,       // TouchSequence
+
+  EventTypes
+};
+
+struct Event {
+  EventType type;
+  uint8_t payload[EVENT_PAYLOAD_SIZE];
+
+  template <typename T>
+  static Event of(EventType type, const T &value) {
+    static_assert(sizeof(T) <= EVENT_PAYLOAD_SIZE, "event payload is too large");
+    Event event;
+    event.type = type;
+    memcpy(event.payload, (const void*) &value, sizeof(T));
+    return event;
+  }
+
+  template <typename T>
+  T as() const {
+    static_assert(sizeof(T) <= EVENT_PAYLOAD_SIZE, "event payload is too large");
+    T value;
+    memcpy((void*) &value, payload, sizeof(T));
+    return value;
+  }
+};
+
+/**
+ * Anything that wants events off the bus. Each subscriber owns a small
+ * mailbox the bus writes into, so a publisher never blocks and is never
+ * handed a queue per listener. Subscribers with a task are woken with
+ * EVENT_NOTIFY_BIT, the rest drain their mailbox from their own process().
+ */
+class EventSubscriber {
+  friend class EventBus;
+
+  Event _mailbox[EVENT_MAILBOX_SIZE];
+  uint8_t _head = 0;
+  uint8_t _count = 0;
+  uint32_t _dropped = 0;
+  portMUX_TYPE _mailboxLock = portMUX_INITIALIZER_UNLOCKED;
+
+  bool deliver(const Event &event);
+
+  protected:
+    uint32_t eventInterests = 0;
+    // notified when an event lands, NULL for subscribers that poll
+    TaskHandle_t eventTask = NULL;
+
+  public:
+    bool nextEvent(Event *event);
+    bool hasEvents();
+    void dispatchEvents();
+    uint32_t droppedEvents() { return _dropped; }
+
+    virtual void onEvent(const Event &event) = 0;
+};
+
+/**
+ * Fan-out from every publisher to every interested subscriber. Subscribers
+ * are registered once at startup and never removed, so publishing reads the
+ * list without a lock.
+ */
+class EventBus {
+  EventSubscriber *_subscribers[EVENT_SUBSCRIBERS];
+  std::atomic<uint8_t> _subscriberCount { 0 };
+
+  public:
+    static EventBus* instance() { static EventBus bus; return &bus; }
+
+    void subscribe(EventSubscriber *subscriber, uint32_t interests, TaskHandle_t task = NULL);
+    void publish(const Event &event);
+
+    template <typename T>
+    void publish(EventType type, const T &value) { publish(Event::of(type, value)); }
+};
@@ -3,7 +3,7 @@
 
 #include <common.h>
 #include <math.h>
-#include <queue>
+#include <algorithm>
 #include <interfaces/lifecycle.h>
 #include <interfaces/power-listener.h>
 #include <interfaces/touch-listener.h>
@@ -11,8 +11,12 @@
 #include <interfaces/ble-listener.h>
 #include <interfaces/calibration-listener.h>
 #include <interfaces/update-listener.h>
+#include <hal/event-bus.h>
+#include <hal/tasks.h>
 #include <models/light.h>
+#include <ring-buffer.h>
 #include <functional>
+#include <array>
 
 #if defined(AMP_1_0_x)
   #include <hal/amp-1.0.0/amp-leds.h>
@@ -20,63 +24,175 @@
 #endif
 
 #include <hal/config.h>
+#include <hal/profiler.h>
+#include <hal/sync-clock.h>
+#include <hal/pattern.h>
 
 #define REFRESH_NEVER   0
 
+// breathe, in ms. dim for BREATHE_HOLD of every cycle then up and back down
+#define BREATHE_CYCLE   5200
+#define BREATHE_HOLD    1000
+#define BREATHE_FRAME   20
+#define BREATHE_FLOOR   15
+
+// patterns that read the time repaint at this interval, in ms
+#define PATTERN_FRAME   20
+
+// speed adaptive effects run this much faster (of SPEED_SCALE_ONE) in each speed class
+#define SPEED_SCALE_ONE 256
+
+// seeds a step's generator when it wasn't given one, fixed so benchmarks repeat
+#define RENDER_SEED     0x9E3779B9
+
+// us of painting a pass may spend before decorative regions wait for the next one,
+// safety regions always paint
+#define RENDER_FRAME_BUDGET 8000
+
+// renderer notification bit for a frame that's due early, EVENT_NOTIFY_BIT is the bus
+#define RENDER_WAKE_BIT (1 << 1)
+
+// actions queued for the renderer, power of two. an entry is a whole group's action
+// however many regions it covers, so a reset of every group is just a few of them
+#define LIGHTS_COMMAND_BUFFER 64
+
+// status led animations, highest precedence last
+enum StatusAnimation : uint8_t {
+  StatusNone = 0,
+  StatusAdvertising,
+  StatusUpdating,
+  StatusCalibratingMag,
+  StatusCalibratingXG
+};
+
 static const char* LIGHTS_TAG = "lights";
 
+// an action handed to the renderer from another task, its effects are looked up
+// in the published action table once the renderer gets to it
+struct ActionCommand {
+  ActionGroup group;
+  Actions command;
+  // a motion or turn change, painted on a pass of its own ahead of anything else due
+  bool urgent;
+};
+
 class Lights : public LifecycleBase,
   public PowerListener, public TouchListener, public ConfigListener, 
-  public CalibrationListener, public UpdateListener, public BleListener {
+  public CalibrationListener, public UpdateListener, public BleListener, public EventSubscriber {
 
   AmpLeds leds;
-  LightsConfig *lightsConfig;
+  // adopted from the config whenever it changes, see onConfigChanged
+  LightsConfig lightsConfig;
   bool init = false;
   bool calibratingXG = false;
   bool calibratingMag = false;
   bool safeToLight = false;
-  TaskHandle_t calibrateLightHandle;
-
   bool updating = false;
-  bool updateToggle = false;
-  TaskHandle_t updateLightHandle;
-
   bool advertising = false;
-  bool advertisingToggle = false;
-  TaskHandle_t advertisingLightHandle;
 
-  std::map<std::string, LightingParameters> _effects;
-  std::map<std::string, RenderStep> _steps;
-  std::map<std::string, uint32_t> _pixelCounts;
+  // the status led's own effect slot, run by the renderer beside the regions.
+  // only the most important animation shows, see updateStatusEffect
+  StatusAnimation _statusAnimation = StatusAnimation::StatusNone;
+  LightingParameters _statusEffect;
+  RenderStep _statusStep = { false, false, false, false, 0, REFRESH_NEVER, 0, { 0 }, 0 };
+  void updateStatusEffect();
+  void renderStatusEffect();
+
+  // effect slots indexed by region id, sized at config load
+  std::vector<LightingParameters> _effects;
+  std::vector<RenderStep> _steps;
+  // compiled from the config, indexed like LightsConfig::patterns
+  std::vector<PatternProgram> _patterns;
+
+  // gradients looked up by effects instead of computing colors per pixel
+  typedef std::array<Color, PALETTE_SIZE> Palette;
+  Palette _rainbow;
+  std::vector<Palette> _palettes;
+  // breathe's blend weight through one breath, baked once so frames never touch a cosine
+  std::array<uint8_t, PALETTE_SIZE> _breathe;
+  bool bakePalette(const std::string &stops, Palette &out);
+  const Palette& paletteFor(const ColorOption &option);
+  std::vector<uint8_t> _compositor;
+  // regions painted by a motion or turn action, they paint first and are never skipped
+  std::vector<bool> _safety;
+  void configureSafety();
+
+  // each region's effect paints its own layer. layers are blended bottom up into
+  // per-channel canvases, but only at pixels that were damaged since the last frame
+  std::vector<std::vector<Color>> _layers;
+  std::vector<uint8_t> _layerOrder;
+  bool _layerOrderChanged = false;
+  std::vector<std::vector<Color>> _canvas;
+  std::vector<std::vector<bool>> _damage;
+  // one bit per channel number, set when any pixel on the channel is damaged
+  uint16_t _damagedChannels = 0;
+
+  void damagePixel(const LightPixel &pixel);
+  void damageRegion(const LightRegion &region);
+  void composite();
 
   static void renderer(void *args);
-  void renderLightingEffect(LightingParameters *params, RenderStep *step);
-  void color(LightingParameters *params, RenderStep *step);
-  void blink(LightingParameters *params, RenderStep *step);
-  void alternate(LightingParameters *params, RenderStep *step);
-  void colorWipe(LightingParameters *params, RenderStep *step);
-  void breathe(LightingParameters *params, RenderStep *step);
-  void fade(LightingParameters *params, RenderStep *step);
-  void scan(LightingParameters *params, RenderStep *step);
-  void rainbow(LightingParameters *params, RenderStep *step);
-  void rainbowCycle(LightingParameters *params, RenderStep *step);
-  void colorChase(LightingParameters *params, RenderStep *step);
-  void theaterChase(LightingParameters *params, RenderStep *step);
-  void twinkle(LightingParameters *params, RenderStep *step);
-  void sparkle(LightingParameters *params, RenderStep *step);
-
-  TaskHandle_t renderHandle;
+  // the instant the current frame is painted for
+  unsigned long _frameTime = 0;
+  // how fast speed adaptive effects are running, SPEED_SCALE_ONE in real time
+  uint16_t _speedScale = SPEED_SCALE_ONE;
+  void onMovementChanged(MovementState movement);
+  unsigned long stepTime(RenderStep *step);
+  unsigned long frameAt(RenderStep *step, unsigned long period);
+  void scheduleFrame(RenderStep *step, unsigned long frame, unsigned long period);
+  // effects are compiled once with their colors read straight from the parameters and
+  // once resolving random / rainbow options, startEffect picks the variant a slot needs
+  typedef void (Lights::*EffectKernel)(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  std::vector<EffectKernel> _kernels;
+  static EffectKernel selectKernel(const LightingParameters &params);
+  template <bool Dynamic>
+  Color stepColor(RenderStep *step, const ColorOption &option);
+
+  void renderLightingEffect(EffectKernel kernel, const LightRegion &region, LightingParameters *params, RenderStep *step);
+  void benchmarkEffects();
+  template <bool Dynamic> void color(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  template <bool Dynamic> void blink(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  template <bool Dynamic> void alternate(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  template <bool Dynamic> void colorWipe(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  template <bool Dynamic> void breathe(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  template <bool Dynamic> void fade(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  template <bool Dynamic> void scan(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  template <bool Dynamic> void colorChase(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  template <bool Dynamic> void theaterChase(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  template <bool Dynamic> void twinkle(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  template <bool Dynamic> void sparkle(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  void rainbow(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  void rainbowCycle(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  void transparent(const LightRegion &region, LightingParameters *params, RenderStep *step);
+  void pattern(const LightRegion &region, LightingParameters *params, RenderStep *step);
+
+  TaskHandle_t renderHandle = NULL;
+
+  void processEvents(TickType_t timeout);
+  TickType_t nextFrameDelay();
+  void wake();
 
   unsigned long _lastRender = millis();
 
-  void setRegionPixel(std::string regionName, uint32_t index, Color pixel);
-  Color getRegionPixel(std::string regionName, uint32_t index);
-  Color blend(Color first, Color second, float weight);
+  void setRegionPixel(const LightRegion &region, uint32_t index, Color pixel);
+  void fillRegion(const LightRegion &region, Color color);
+  Color getRegionPixel(const LightRegion &region, uint32_t index);
+  Color blend(Color first, Color second, uint16_t weight);
+
+  void startEffect(const LightingParameters &parameters);
+  void applyEffect(const LightingParameters &parameters);
 
-  void startEffect(LightingParameters parameters);
-  void endEffect(LightingParameters parameters);
+  // the renderer is the only task that touches effects and steps, everyone else
+  // queues here. producers share a short critical section, the renderer never waits
+  RingBuffer<ActionCommand, LIGHTS_COMMAND_BUFFER> _commands;
+  portMUX_TYPE _commandLock = portMUX_INITIALIZER_UNLOCKED;
+  bool applyCommands();
+  static bool isPeriodic(LightEffect effect);
 
   Color getStepColor(RenderStep *step, ColorOption option);
+  static uint32_t stepRandom(RenderStep *step);
+  // uniform in [0, range) without a divide
+  static uint32_t stepRandom(RenderStep *step, uint32_t range) { return ((uint64_t) stepRandom(step) * range) >> 32; }
 
   public:
     Lights();
@@ -86,18 +202,28 @@ class Lights : public LifecycleBase,
     // LifecycleBase
     void onPowerUp();
     void onPowerDown();
+    bool canSleep() { return !updating && !advertising && !calibratingXG && !calibratingMag; }
+    void onSleep();
+    void onWake();
 
     // PowerListener
     void onPowerStatusChanged(PowerStatus status);
     void updateLightForPowerStatus(PowerStatus status);
 
+    // EventSubscriber
+    void onEvent(const Event &event);
+
     // TouchListener
-    void onTouchEvent(std::vector<TouchType> *touches) { }
     void onTouchDown();
     void onTouchUp();
 
     // ConfigListener
     void onConfigUpdated();
+    void onConfigChanged(uint8_t changes);
+    void configureRegions();
+    void configurePatterns();
+    void configurePalettes();
+    void configureChannels();
 
     // CalibrationListener
     void onCalibrateXGStarted();
@@ -117,23 +243,22 @@ class Lights : public LifecycleBase,
     uint16_t getLEDCountForChannel(uint8_t channel);
     LightRegion getLightRegion(std::string region);
     std::map<uint8_t, LightChannel> getAvailableChannels();
-    std::map<std::string, LightRegion> getAvailableRegions();
+    std::vector<LightRegion> getAvailableRegions();
 
     void setStatus(Color color);
 
-    void colorRegion(std::string regionName, Color color);
-    void colorRegionSection(std::string regionName, uint8_t section, Color color);
+    void colorRegion(uint8_t regionId, Color color);
+    void colorRegionSection(uint8_t regionId, uint8_t section, Color color);
     void colorLEDs(uint8_t channel, uint16_t led, uint16_t count, Color color);
     void render(bool all = false, int8_t channel = -1);
 
     Color colorWheel(uint8_t pos);
     Color randomColor();
 
-    static void startCalibrateLight(void* params);
-    static void startUpdateLight(void *params);
-    static void startAdvertisingLight(void *params);
-
-    void applyEffect(LightingParameters parameters);
+    // queues the action for the renderer, urgent ones wake it for a safety only pass
+    void applyAction(ActionGroup group, Actions command, bool urgent = false);
+    // times every effect on the renderer, results go to the profiler
+    void requestBenchmark();
 
     static std::map<Actions, std::string> headlightActions;
     static std::map<Actions, std::string> motionActions;
@@ -0,0 +1,68 @@
+#pragma once
+#include "FreeRTOS.h"
+
+#include <common.h>
+#include <string>
+#include <atomic>
+#include <esp_heap_caps.h>
+
+#define MEMORY_STATS_VERSION  1
+// a scope leaving the largest free block under this is logged as memory pressure
+#define MEMORY_LOW_BLOCK      8192
+
+static const char* MEMORY_TAG = "memory";
+
+enum MemorySubsystem : uint8_t {
+  MemoryConfig = 0,
+  MemoryLights,
+  MemoryBle,
+  MemorySubsystems
+};
+
+struct MemoryUsage {
+  // bytes still held after every scope so far, negative when more was freed
+  std::atomic<int32_t> retained { 0 };
+  std::atomic<uint32_t> scopes { 0 };
+  // the most any one scope kept
+  std::atomic<int32_t> largest { 0 };
+  // open scopes, only the outermost one records
+  std::atomic<uint8_t> depth { 0 };
+};
+
+/**
+ * Heap state and a rough per subsystem account of it. Rather than hooking the
+ * allocator, the work each subsystem does on a config push or transfer is
+ * wrapped in a MemoryScope that records how much free heap it used up. Other
+ * tasks allocating at the same time land in whichever scope is open, so the
+ * figures are for spotting trends like churn across config pushes, not exact.
+ * A scope costs two heap size reads, cheap enough to leave on.
+ */
+class MemoryStats {
+  static MemoryUsage usage[MemorySubsystems];
+
+  public:
+    static bool enter(MemorySubsystem subsystem) { return usage[subsystem].depth++ == 0; }
+    static void leave(MemorySubsystem subsystem) { usage[subsystem].depth--; }
+    static size_t freeHeap() { return heap_caps_get_free_size(MALLOC_CAP_8BIT); }
+    static void record(MemorySubsystem subsystem, int32_t retained);
+
+    // packed little endian snapshot for the diagnostics service, see memory-stats.cpp
+    static std::string serialize();
+    static void log();
+};
+
+class MemoryScope {
+  MemorySubsystem _subsystem;
+  bool _outer;
+  size_t _free;
+
+  public:
+    MemoryScope(MemorySubsystem subsystem)
+      : _subsystem(subsystem), _outer(MemoryStats::enter(subsystem)), _free(MemoryStats::freeHeap()) { }
+
+    ~MemoryScope() {
+      MemoryStats::leave(_subsystem);
+      if (_outer)
+        MemoryStats::record(_subsystem, (int32_t) _free - (int32_t) MemoryStats::freeHeap());
+    }
+};
@@ -5,19 +5,19 @@
 // #define LOG_MOTION_GRAVITY
 // #define LOG_MOTION_LINEAR_ACCELERATION
 // #define LOG_MOTION_AHRS
-// #define LOG_MOTION_AHRS_COMPENSATED
 // #define LOG_SAMPLE_RATE
 
-// #define USE_MADGWICK_FILTER
-
 #include <common.h>
 #include <interfaces/lifecycle.h>
 #include <interfaces/power-listener.h>
 #include <interfaces/config-listener.h>
-#include <interfaces/motion-listener.h>
 #include <interfaces/calibration-listener.h>
+#include <hal/event-bus.h>
+#include <hal/tasks.h>
 #include <models/motion.h>
 #include <models/control.h>
+#include <models/motion-trace.h>
+#include <ring-buffer.h>
 #include "FreeRTOS.h"
 
 #if defined(AMP_1_0_x)
@@ -27,34 +27,91 @@
 
 #include <hal/power.h>
 #include <hal/config.h>
+#include <hal/profiler.h>
+#include <hal/trace-recorder.h>
 
-#if defined(USE_MADGWICK_FILTER)
-  #include <filters/madgwick.h>
-#elif defined(USE_SIMPLE_AHRS_FILTER)
-  #include <filters/simple-ahrs.h>
-#endif
+#include <filters/tilt-filter.h>
+#include <filters/gravity-filter.h>
+#include <filters/acceleration-detector.h>
+#include <filters/movement-estimator.h>
+
+// samples queued between the sampler and its consumers, power of two
+#define MOTION_SAMPLE_BUFFER 64
+
+// how long lifecycle callers wait for the sampler to act on a command
+#define MOTION_COMMAND_TIMEOUT 500
+
+// a replayed detection this long after its label in ms counts as finding it
+#define MOTION_REPLAY_WINDOW 1500
+#define MOTION_REPLAY_VERSION 1
+
+// a new orientation has to hold this long in ms before it's reported
+#define MOTION_ORIENTATION_DWELL 250
+// g, gravity has to be at least this long to tell which side is up
+#define MOTION_ORIENTATION_MIN_GRAVITY 0.5f
+
+// movement is republished when its confidence moves this far (of 255) without the speed class changing
+#define MOTION_MOVEMENT_STEP 32
 
 static const char* MOTION_TAG = "motion";
 
-class Motion : public LifecycleBase, public PowerListener, public ConfigListener {
-  std::vector<MotionListener*> motionListeners;
-  std::vector<CalibrationListener*> calibrationListeners;
+// requests handled by the sampler task, the only context that talks to the IMU
+enum MotionCommand : uint8_t {
+  CalibrateXG = 0x01,
+  CalibrateMag = 0x02,
+  SleepIMU,
+  WakeIMU,
+  ShutdownIMU,
+  ReplayTrace
+};
+
+// how a recorded trace fared, costs in us per sample and latencies in ms
+struct MotionReplayStats {
+  bool running = false;
+  uint32_t samples = 0;
+  TimingStats cost;
+
+  struct Detector {
+    uint32_t labels = 0;
+    uint32_t matched = 0;
+    uint32_t falsePositives = 0;
+    TimingStats latency;
+  } detectors[MotionTraceLabels];
+};
+
+class Motion : public LifecycleBase, public PowerListener, public ConfigListener, public EventSubscriber {
 
   Vector3D rawAccel, rawGyro, rawMag;
-  Vector3D linearAcceleration, gravity, absoluteGravity, attitude;
+  Vector3D linearAcceleration, gravity, attitude;
   Vector3D accelBias, gyroBias, magBias;
+
+  // raw samples from the sampler to filtering, filtered samples out to telemetry
+  RingBuffer<MotionSample, MOTION_SAMPLE_BUFFER> _samples;
+  RingBuffer<MotionSample, MOTION_SAMPLE_BUFFER> _telemetry;
+  void processSamples();
   IMUState imuState = IMUState::IMU_Disabled;
   static AmpIMU ampIMU;
-#if defined(USE_MADGWICK_FILTER)
-  Madgwick *filter = nullptr;
-#elif defined(USE_SIMPLE_AHRS_FILTER)
-  SimpleAHRS *filter = nullptr;
-#endif
-
-  float _sampleRate = 0;
-
-  // alpha for high pass filter for linear acceleration / gravity calc
-  float _alpha = 0.5f;
+  TiltFilter _tilt;
+  unsigned long _lastSampleTime = 0;
+  // filtered samples are only published while someone's reading them
+  volatile bool _telemetryEnabled = false;
+
+  // target sensor rate in Hz for riding / parked, 0 when sampling is off
+  uint16_t _sampleRate = 0;
+  uint16_t _ridingSampleRate = DEFAULT_SAMPLE_RATE;
+  uint16_t _parkedSampleRate = DEFAULT_PARKED_SAMPLE_RATE;
+
+  // parked once linear acceleration has stayed under the still threshold for a while
+  bool _parked = false;
+  unsigned long _lastMovement = millis();
+  const float MOTION_STILL_THRESHOLD = 0.05f;
+  const unsigned long MOTION_PARKED_TIMEOUT = 30000;
+  // parked and still for this long, ask power to light sleep until we move
+  const unsigned long MOTION_SLEEP_TIMEOUT = 300000;
+
+  // splits raw acceleration into gravity and linear acceleration a batch at a time
+  GravityFilter _gravityFilter;
+  AccelBatch _rawBatch, _gravityBatch, _linearBatch;
   float expFilterWeight = 0.2f;
 
   // turn center
@@ -64,21 +121,34 @@ class Motion : public LifecycleBase, public PowerListener, public ConfigListener
   bool _calibrating = false;
 
   VehicleState _vehicleState;
+  // last state handed to listeners, the sampler only publishes when this differs
+  VehicleState _notifiedState;
 
   AccelerationAxis _motionAxis;
   AttitudeAxis _turnAxis;
   Orientation _orientationTrigger;
 
+  // least share of gravity's squared magnitude on an axis for that side to count as up
+  float _orientationUp;
+  // the orientation waiting out its dwell, and since when
+  Orientation _orientationCandidate = Orientation::UnknownSideUp;
+  unsigned long _orientationSince = 0;
+
   bool _autoMotion, _autoTurn, _autoOrientation, _useRelativeTurnZero;
-  float _brakeThreshold, _accelerationThreshold, _turnThreshold, _turnCenter;
+  float _turnThreshold, _turnCenter;
+  // fed every filtered sample, evaluated once per batch by detectMotion
+  AccelerationDetector _accelerationDetector;
+  // fed alongside it, gates early brake onset and is published for speed adaptive lighting
+  MovementEstimator _movement;
+  MovementState _notifiedMovement = { SpeedClass::SpeedStopped, 0 };
   bool _enabled = false;
 
   unsigned long _lastUpdate = micros();
   unsigned long _lastSample = micros();
+  // when the last FIFO read finished, the start of a latency trace
+  int64_t _sampleArrival = 0;
 
   unsigned long _lastMotionUpdate = millis();
-  const unsigned long MOTION_DEBOUNCE = 100;
-  const unsigned long MOTION_ACTIVE_DEBOUNCE = 1000;
 
   // update config
   void updateGravityFilter(float alpha);
@@ -87,49 +157,79 @@ class Motion : public LifecycleBase, public PowerListener, public ConfigListener
   void sampleSensorOffsets();
   void setSensorOffsets();
 
-  float getAccelerationFromAxis(AccelerationAxis axis);
+  static float getAccelerationFromAxis(AccelerationAxis axis, const Vector3D &linear);
   float getAttitudeFromAxis(AttitudeAxis axis);
   TaskHandle_t samplerHandle = NULL;
+  QueueHandle_t commandQueue;
+  SemaphoreHandle_t commandDone;
+  bool _shutdown = false;
+  bool sendCommand(MotionCommand command, bool wait);
+  bool handleCommand(MotionCommand command);
+  void sleepIMU();
+
+  // replays run the live filters and detectors over a recorded trace on the
+  // sampler, on the trace's own clock and without telling anyone
+  volatile bool _replaying = false;
+  unsigned long _replayTime = 0;
+  MotionReplayStats _replay;
+  unsigned long motionTime() { return _replaying ? _replayTime : millis(); }
+  void replayTrace();
+  void replayDetection(MotionTraceLabel label, uint8_t state, unsigned long *labelTime, int16_t *labelState);
 
   void calibrateXG();
   void calibrateMag();
 
   public:
-    static QueueHandle_t calibrationRequestQueue;
-    static FreeRTOS::Semaphore holdInterface;
     Motion();
 
     // lifecycle listener
     void onPowerUp();
     void onPowerDown();
+    bool canSleep() { return !_calibrating; }
+    void onSleep();
+    void onWake();
     
     // power status listener
     void onPowerStatusChanged(PowerStatus status);
     void updateMotionForPowerStatus(PowerStatus status);
+    void updateSampleRate();
 
     // config listener
     void onConfigUpdated();
 
-    // register listeners
-    void addMotionListener(MotionListener *listener);
-    void removeMotionListener(MotionListener *listener);
+    // event subscriber, drained from process()
+    void onEvent(const Event &event);
     void notifyMotionListeners();
 
-    void addCalibrationListener(CalibrationListener *listener);
+    void requestCalibration(uint8_t request);
+    // a replay holds up live detection while it runs, so it's only started while parked
+    bool canReplay() { return _parked && !_movement.moving(); }
+    bool requestReplay() { return canReplay() && sendCommand(MotionCommand::ReplayTrace, false); }
+    uint16_t getSampleRate() { return _sampleRate; }
+    // version (1), running (1), samples (4), cost min/avg/max (4 each), detector count (1), then
+    // per detector labels, matched, false positives and latency min/avg/max (4 each)
+    std::string serializeReplay();
     void process();
     void sample();
+    // filtered, timestamped samples for a single reader outside the sampler task
+    RingBuffer<MotionSample, MOTION_SAMPLE_BUFFER>& telemetry() { return _telemetry; }
+    void setTelemetry(bool enabled) { _telemetryEnabled = enabled; }
 
     // attitude calculations
     void calculateAccelerations(Vector3D accel);
+    void calculateAccelerations(const AccelBatch &raw);
 
     // motion detection
     void resetMotionDetection();
 
+    bool detectMovement();
     bool detectMotion();
     bool detectTurning();
     bool detectOrientation();
 
-    void setMotionDetection(bool enabled) { setMotionDetection(enabled, _motionAxis, _brakeThreshold, _accelerationThreshold); }
+    void setMotionDetection(bool enabled) {
+      setMotionDetection(enabled, _motionAxis, _accelerationDetector.brakeThreshold(), _accelerationDetector.accelerationThreshold());
+    }
     void setMotionDetection(bool enabled, AccelerationAxis axis, float brakeThreshold, float acclerationThreshold);
 
     void setTurnDetection(bool enabled) { setTurnDetection(enabled, _useRelativeTurnZero, _turnAxis, _turnThreshold); }
@@ -0,0 +1,46 @@
+#pragma once
+#include <common.h>
+#include <string>
+#include <vector>
+
+#include <models/pattern.h>
+
+static const char* PATTERN_TAG = "pattern";
+
+/**
+ * A user pattern compiled for the renderer. Compiling validates the program
+ * and splits it in two: instructions that can't see the pixel index run once
+ * per frame, only the rest run per pixel.
+ *
+ * A register stays with the frame program only if it's written once, by an
+ * instruction whose sources are frame registers, and isn't read before that
+ * write. Everything else runs per pixel in program order, so the split never
+ * changes what a program computes.
+ */
+class PatternProgram {
+  std::vector<PatternInstruction> _frame;
+  std::vector<PatternInstruction> _pixel;
+  // registers reset before every pixel
+  uint8_t _pixelRegisters = 0;
+  bool _animated = false;
+  int32_t _registers[PATTERN_REGISTERS];
+  uint32_t _count = 0;
+  uint32_t _time = 0;
+  uint32_t _phase = 0;
+
+  void reset(uint8_t mask);
+  static void execute(const std::vector<PatternInstruction> &program, int32_t *r);
+
+  public:
+    // source is the hex encoded program
+    static bool compile(const std::string &source, PatternProgram *out);
+
+    bool valid() const { return !_frame.empty() || !_pixel.empty(); }
+    // reads the time, so it has to be repainted every frame
+    bool animated() const { return _animated; }
+    // instructions paid per pixel
+    size_t cost() const { return _pixel.size(); }
+
+    void beginFrame(uint32_t count, uint32_t time, uint32_t phase);
+    void evaluate(uint32_t index, int32_t *mix, int32_t *level);
+};
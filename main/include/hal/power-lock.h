@@ -0,0 +1,48 @@
+#pragma once
+#include <common.h>
+#include <esp_pm.h>
+
+/**
+ * esp_pm lock held while a piece of hardware needs the clocks to stay put.
+ * Created on first use and idempotent, so owners can acquire and release it
+ * from their state changes without counting. Does nothing unless
+ * CONFIG_PM_ENABLE is set.
+ */
+class PowerLock {
+  esp_pm_lock_type_t _type;
+  const char *_name;
+  bool _held = false;
+#if defined(CONFIG_PM_ENABLE)
+  esp_pm_lock_handle_t _lock = NULL;
+#endif
+
+  public:
+    PowerLock(esp_pm_lock_type_t type, const char *name) : _type(type), _name(name) { }
+
+    void acquire() {
+      if (_held)
+        return;
+
+#if defined(CONFIG_PM_ENABLE)
+      if (_lock == NULL && esp_pm_lock_create(_type, 0, _name, &_lock) != ESP_OK) {
+        _lock = NULL;
+        return;
+      }
+
+      esp_pm_lock_acquire(_lock);
+#endif
+      _held = true;
+    }
+
+    void release() {
+      if (!_held)
+        return;
+
+#if defined(CONFIG_PM_ENABLE)
+      esp_pm_lock_release(_lock);
+#endif
+      _held = false;
+    }
+
+    bool held() { return _held; }
+};
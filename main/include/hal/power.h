@@ -2,14 +2,23 @@
 #include "FreeRTOS.h"
 
 #include <vector>
+#include <freertos/event_groups.h>
 #include <common.h>
 #include <interfaces/lifecycle.h>
 #include <interfaces/power-listener.h>
 #include <interfaces/touch-listener.h>
+#include <hal/event-bus.h>
 
 #define BATTERY_NORMAL 20
 #define BATTERY_LOW 5
 #define BATTERY_CHARGED 95
+// a level is only left once the percentage is this far past its threshold
+#define BATTERY_HYSTERESIS 3
+// smallest percentage change that's worth a status notification
+#define BATTERY_PERCENTAGE_STEP 2
+
+// how long to wait before trying to sleep again after a listener held us awake
+#define SLEEP_RETRY_MS 60000
 
 #if defined(AMP_1_0_x)
   #include <hal/amp-1.0.0/amp-power.h>
@@ -17,16 +26,32 @@
 
 static const char* POWER_TAG = "power";
 
-class Power : public LifecycleBase, public TouchListener {
-  std::vector<PowerListener*> powerLevelListeners;
+// listener bits in the startup event group, FreeRTOS keeps the top byte for itself
+#define POWER_STARTUP_LISTENERS 24
+
+// a listener waiting to be brought up, dependencies are indices into lifecycleListeners
+struct StartupStep {
+  StartupMode mode;
+  uint32_t after;
+  std::vector<LifecycleBase*> dependencies;
+};
+
+class Power : public LifecycleBase, public TouchListener, public EventSubscriber {
   std::vector<LifecycleBase*> lifecycleListeners;
-  std::vector<TouchType> touches;
+  std::vector<StartupStep> startupSteps;
   PowerStatus status;
   AmpPower ampPower;
   bool restartNext = false;
+  bool sleepRequested = false;
+  unsigned long lastSleepAttempt = 0;
+
+  void sleep();
+  void startListeners();
+  static void startupTask(void *parameters);
 
-  void notifyPowerListeners();
+  void notifyPowerListeners(bool levelChanged);
   PowerStatus calculatePowerStatus(bool batteryPresent, bool charging, bool done, uint8_t batteryLevel);
+  PowerLevel levelForPercentage(uint8_t percentage);
 
   public:
     Power();
@@ -35,11 +60,15 @@ class Power : public LifecycleBase, public TouchListener {
     void onPowerDown();
     void process();
 
-    void onTouchEvent(std::vector<TouchType> *touches);
+    void onEvent(const Event &event);
+    void onTouchEvent(const TouchSequence &touches);
     void shutdown(bool restart = false);
+    void requestSleep() { sleepRequested = true; }
+    PowerStatus getStatus() { return status; }
 
-    void addPowerLevelListener(PowerListener *listener);
-    void addLifecycleListener(LifecycleBase *listener);
+    // listeners start once everything they depend on is up, see startListeners
+    void addLifecycleListener(LifecycleBase *listener, StartupMode mode = StartInline,
+      std::vector<LifecycleBase*> dependencies = {});
 
     static FreeRTOS::Semaphore powerDown;
 };
\ No newline at end of file
@@ -0,0 +1,157 @@
+#pragma once
+#include <common.h>
+#include <models/light.h>
+
+#define ARDUINOJSON_ENABLE_STD_STRING 1
+#include <ArduinoJson.h>
+
+// one slot per LightEffect, Transparent through Pattern
+#define PROFILER_EFFECTS        16
+// flush timings are indexed by channel number
+#define PROFILER_CHANNELS       9
+// a due effect painted later than this counts as a dropped frame
+#define PROFILER_FRAME_BUDGET   20
+
+#define PROFILER_VERSION        2
+
+// brake latency histogram, the last bucket also holds anything slower
+#define PROFILER_LATENCY_BUCKETS    16
+#define PROFILER_LATENCY_BUCKET_US  2000
+
+// effect benchmark, every effect is painted this many frames over each synthetic region size
+#define PROFILER_BENCH_FRAMES   64
+#define PROFILER_BENCH_LAYOUTS  3
+static const uint16_t profilerBenchLayouts[PROFILER_BENCH_LAYOUTS] = { 16, 60, 144 };
+
+// performance report, a metric more than this much over its baseline is a regression
+#define PROFILER_REGRESSION_PERCENT 10
+#define PROFILER_REPORT_VERSION     1
+#define PROFILER_REPORT_SIZE        1536
+#define PROFILER_BASELINE_PATH      "/spiffs/perf.baseline.json"
+
+static const char* PROFILER_TAG = "profiler";
+
+// timings in microseconds
+struct TimingStats {
+  uint32_t count = 0;
+  uint32_t min = UINT32_MAX;
+  uint32_t max = 0;
+  uint64_t total = 0;
+
+  void record(uint32_t elapsed) {
+    count++;
+    total += elapsed;
+    if (elapsed < min) min = elapsed;
+    if (elapsed > max) max = elapsed;
+  }
+
+  uint32_t average() const { return count > 0 ? total / count : 0; }
+};
+
+// checkpoints from an accelerometer FIFO read to the LEDs showing the result
+enum LatencyStage : uint8_t {
+  SampleArrived = 0,
+  StateChanged,
+  AppNotified,
+  EffectApplied,
+  Composited,
+  Flushed,
+  LatencyStages
+};
+
+// milestones from reset to a lit and connectable board, each kept the first time it's reached
+enum BootStage : uint8_t {
+  BootConfigLoaded = 0,
+  BootPoweredUp,
+  BootFirstLight,
+  BootAdvertising,
+  BootStages
+};
+
+// where a config came from when it was loaded
+enum ConfigLoadPath : uint8_t {
+  ConfigLoadCache = 0,
+  ConfigLoadParse,
+  ConfigLoadPaths
+};
+
+/**
+ * Lightweight timing for the render pipeline. Stats are written by the render task
+ * and read by the diagnostics service, so reads may be a frame out of date.
+ */
+class Profiler {
+  TimingStats _effects[PROFILER_EFFECTS];
+  TimingStats _composite;
+  TimingStats _frame;
+  TimingStats _flush[PROFILER_CHANNELS];
+  uint32_t _frames = 0;
+  uint32_t _dropped = 0;
+  // region paints deferred to a later pass by the frame budget
+  uint32_t _skipped = 0;
+
+  // latency benchmark. one trace is in flight at a time, each stage is only
+  // accepted straight after the one before it so unrelated renders are ignored
+  volatile bool _benchmarking = false;
+  portMUX_TYPE _traceLock = portMUX_INITIALIZER_UNLOCKED;
+  int64_t _trace[LatencyStages];
+  uint8_t _traceStage = LatencyStages;
+  TimingStats _stages[LatencyStages];
+  TimingStats _latency;
+  uint32_t _histogram[PROFILER_LATENCY_BUCKETS] = { 0 };
+
+  void completeTrace();
+
+  // ns per frame by effect and layout, 0 until the benchmark has run
+  uint32_t _effectCost[PROFILER_EFFECTS][PROFILER_BENCH_LAYOUTS] = { { 0 } };
+  volatile bool _effectBenchRequested = false;
+
+  // us since reset, 0 until the stage is reached
+  uint32_t _boot[BootStages] = { 0 };
+
+  // us per load, and the last motion replay's cost per sample in us and brake detection latency in ms
+  TimingStats _configLoad[ConfigLoadPaths];
+  TimingStats _replayCost;
+  TimingStats _replayLatency;
+  uint32_t _replayFalsePositives = 0;
+  bool _replayed = false;
+
+  void collectMetrics(JsonObject metrics);
+
+  public:
+    static Profiler* instance() { static Profiler profiler; return &profiler; }
+    static int64_t now() { return esp_timer_get_time(); }
+
+    void recordEffect(LightEffect effect, int64_t start);
+    void recordComposite(int64_t start);
+    void recordFrame(int64_t start, unsigned long lateness);
+    void recordSkipped(uint8_t regions) { _skipped += regions; }
+    void recordFlush(uint8_t channel, int64_t start);
+    void reset();
+
+    void setBenchmarking(bool enabled);
+    bool isBenchmarking() { return _benchmarking; }
+    void beginLatency(int64_t sampleArrived);
+    void markLatency(LatencyStage stage) { if (_benchmarking) mark(stage); }
+    void mark(LatencyStage stage);
+
+    // the renderer runs the effect benchmark between frames once it's requested
+    void requestEffectBenchmark() { _effectBenchRequested = true; }
+    bool takeEffectBenchmark() { bool requested = _effectBenchRequested; _effectBenchRequested = false; return requested; }
+    void recordEffectCost(LightEffect effect, uint8_t layout, int64_t start, uint32_t frames);
+
+    void markBoot(BootStage stage);
+    bool booted(BootStage stage) { return _boot[stage] != 0; }
+
+    void recordConfigLoad(ConfigLoadPath path, int64_t start) { _configLoad[path].record(now() - start); }
+    void recordReplay(const TimingStats &cost, const TimingStats &latency, uint32_t falsePositives);
+
+    // the numbers releases are gated on as json, compared against the saved baseline
+    std::string report();
+    bool saveBaseline();
+
+    // packed little endian snapshots for the diagnostics service
+    std::string serialize();
+    std::string serializeLatency();
+    std::string serializeEffectCost();
+    std::string serializeBoot();
+};
@@ -0,0 +1,35 @@
+#pragma once
+#include <common.h>
+#include <atomic>
+
+// samples arriving later than the best one in this window are ignored, after
+// it the next sample is taken regardless so crystal drift is followed
+#define SYNC_CLOCK_WINDOW 30000
+
+static const char* SYNC_CLOCK_TAG = "sync-clock";
+
+/**
+ * A time base shared between devices on the same vehicle. The phone writes
+ * the same clock to each of them, every device keeps the offset from its own
+ * millis() so periodic effects can be phased off the shared time rather than
+ * whenever the command happened to arrive.
+ *
+ * A sample is only ever late, never early, so within a window the largest
+ * offset seen is the one with the least transport delay in it.
+ */
+class SyncClock {
+  std::atomic<uint32_t> _offset { 0 };
+  std::atomic<bool> _synced { false };
+  unsigned long _lastAccepted = 0;
+
+  public:
+    static SyncClock* instance() { static SyncClock clock; return &clock; }
+
+    // shared time in ms, as written by the phone
+    void sync(uint32_t sharedTime);
+    bool synced() { return _synced; }
+
+    unsigned long now() { return millis() + _offset; }
+    // the local millis() at which shared time was 0
+    unsigned long epoch() { return 0UL - _offset; }
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include "FreeRTOS.h"
+
+#include <common.h>
+#include <string>
+#include <map>
+
+#define TASKS_VERSION 1
+
+static const char* TASKS_TAG = "tasks";
+
+enum TaskId : uint8_t {
+  TaskApp = 0,
+  TaskMotion,
+  TaskRenderer,
+  TaskButtons,
+  TaskBle,
+  TaskOtaWriter,
+  TaskConfigTx,
+  TaskTraceWriter,
+  TaskStorageWriter,
+  TaskStartup,
+  TaskIds
+};
+
+// where and how a task runs. period is how long a polling task sleeps between
+// passes in ms, 0 for tasks that only ever block on their inputs
+struct TaskSpec {
+  const char *name;
+  BaseType_t core;
+  UBaseType_t priority;
+  uint32_t stack;
+  uint32_t period;
+};
+
+/**
+ * Every task the firmware starts, in one place so placement can be reasoned
+ * about as a whole. NimBLE's host and the controller live on core 0, so
+ * anything latency sensitive sits on core 1 and the motion sampler outranks
+ * everything of ours.
+ */
+class Tasks {
+  static const TaskSpec table[TaskIds];
+
+  // run time counters at the last report, per FreeRTOS task number
+  static std::map<UBaseType_t, uint32_t> lastRunTime;
+  static uint32_t lastTotalRunTime;
+
+  public:
+    static const TaskSpec& spec(TaskId id) { return table[id]; }
+    static TickType_t period(TaskId id) { return pdMS_TO_TICKS(table[id].period); }
+    static bool create(TaskId id, TaskFunction_t task, void *parameters, TaskHandle_t *handle);
+
+    // packed little endian snapshot of every task for the diagnostics service, see tasks.cpp
+    static std::string serialize();
+    static void log();
+};
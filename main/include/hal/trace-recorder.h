@@ -0,0 +1,75 @@
+#pragma once
+#include "FreeRTOS.h"
+
+#include <atomic>
+#include <common.h>
+#include <ring-buffer.h>
+#include <esp_spiffs.h>
+#include <models/motion.h>
+#include <models/motion-trace.h>
+#include <hal/tasks.h>
+
+// the file is written a flash sector at a time and never grows past this
+#define TRACE_SECTOR_SIZE     4096
+#define TRACE_MAX_SIZE        (48 * TRACE_SECTOR_SIZE)
+// samples in flight between the sampler and the writer, power of two
+#define TRACE_SAMPLE_BUFFER   256
+#define TRACE_LABEL_BUFFER    8
+// how often the writer drains the buffers while recording, in ms
+#define TRACE_DRAIN_INTERVAL  100
+
+static const char* TRACE_TAG = "trace";
+
+/**
+ * Records raw accelerometer samples to MOTION_TRACE_PATH for replaying
+ * later. The sampler only ever pushes into a lock free buffer, the writer
+ * task packs records into a sector sized buffer and writes whole sectors,
+ * so flash never stalls sampling. Labels come from the BLE host through
+ * their own buffer, each buffer has a single producer.
+ *
+ * The space for a full trace is checked up front, a recording never fails
+ * part way for want of room; it just stops once TRACE_MAX_SIZE is reached.
+ */
+class TraceRecorder {
+  RingBuffer<MotionTraceRecord, TRACE_SAMPLE_BUFFER> _samples;
+  RingBuffer<MotionTraceRecord, TRACE_LABEL_BUFFER> _labels;
+  std::atomic<bool> _recording { false };
+  std::atomic<bool> _startRequested { false };
+  std::atomic<bool> _stopRequested { false };
+  TaskHandle_t _writerHandle = NULL;
+
+  // writer task only
+  FILE *_file = nullptr;
+  uint8_t _sector[TRACE_SECTOR_SIZE];
+  size_t _fill = 0;
+  size_t _written = 0;
+  uint32_t _records = 0;
+  uint16_t _sampleRate = 0;
+
+  void open();
+  void drain(bool flush = false);
+  void append(const MotionTraceRecord &record);
+  bool writeSector();
+  void close();
+  static void writerTask(void *parameters);
+
+  public:
+    static TraceRecorder* instance() { static TraceRecorder recorder; return &recorder; }
+
+    void start(uint16_t sampleRate);
+    void stop();
+    bool recording() { return _recording || _startRequested; }
+
+    // sampler side, acceleration in g
+    void record(uint32_t timestamp, const Vector3D &acceleration) {
+      if (!_recording)
+        return;
+
+      MotionTraceRecord record = { timestamp, MotionTraceType::TraceSample,
+        (int16_t) (acceleration.x * 1000), (int16_t) (acceleration.y * 1000), (int16_t) (acceleration.z * 1000) };
+      _samples.push(record);
+    }
+
+    // BLE host side, marks where the rider says a detector should have changed state
+    void label(MotionTraceLabel label, uint8_t state);
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include <common.h>
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include <esp32/rom/crc.h>
+#include <esp32/rom/miniz.h>
+#include <cstring>
+#include <algorithm>
+
+// first byte of a plain esp32 app image
+#define UPDATE_IMAGE_MAGIC        0xE9
+#define UPDATE_COMPRESSED_MAGIC   0x5a504d41    // "AMPZ"
+#define UPDATE_DELTA_MAGIC        0x44504d41    // "AMPD"
+// copies from the running partition are read through a buffer this size
+#define UPDATE_COPY_CHUNK         256
+
+static const char* UPDATE_DECODER_TAG = "ota-decoder";
+
+enum UpdateFormat : uint8_t {
+  UpdateUnknown = 0,
+  UpdateRaw,
+  UpdateCompressed,
+  UpdateDelta
+};
+
+// delta ops, each followed by its little endian arguments
+enum UpdateDeltaOp : uint8_t {
+  DeltaCopy = 0x01,     // offset (4), length (4) - bytes from the running image
+  DeltaInsert = 0x02    // length (4), then that many literal bytes
+};
+
+/**
+ * In front of compressed and delta images. base length and crc are the
+ * running image a delta was built against, zero for compressed images
+ */
+struct UpdateImageHeader {
+  uint32_t magic;
+  uint32_t imageLength;
+  uint32_t baseLength;
+  uint32_t baseCrc;
+};
+
+typedef bool (*UpdateSink)(void *context, const uint8_t *data, size_t length);
+
+/**
+ * Turns the bytes of an update as they arrive into the image that gets
+ * written to flash. The format is picked from the first bytes:
+ *
+ *    raw         a plain app image, passed through
+ *    compressed  header, then the image as a zlib stream
+ *    delta       header, then a zlib stream of copy/insert ops against the
+ *                running partition
+ *
+ * Inflating keeps a 32KB window, which is only allocated for the formats
+ * that need it
+ */
+class UpdateDecoder {
+  UpdateSink _sink;
+  void *_context;
+  UpdateFormat _format;
+
+  UpdateImageHeader _header;
+  size_t _headerFill = 0;
+  size_t _output = 0;
+
+  tinfl_decompressor *_inflator = nullptr;
+  uint8_t *_window = nullptr;
+  size_t _windowOffset = 0;
+  bool _inflated = false;
+
+  const esp_partition_t *_base = nullptr;
+  uint8_t _op = 0;
+  uint8_t _args[8];
+  size_t _argsFill = 0;
+  uint32_t _insertRemaining = 0;
+
+  bool begin();
+  bool inflate(const uint8_t *data, size_t length);
+  bool applyDelta(const uint8_t *data, size_t length);
+  bool copyBase(uint32_t offset, uint32_t length);
+  bool emit(const uint8_t *data, size_t length);
+
+  public:
+    UpdateDecoder(UpdateSink sink, void *context, UpdateFormat format = UpdateUnknown);
+    ~UpdateDecoder();
+
+    bool write(const uint8_t *data, size_t length);
+    // true once the whole image has come out
+    bool finish();
+
+    UpdateFormat format() { return _format; }
+};
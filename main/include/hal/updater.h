@@ -1,29 +1,87 @@
 #pragma once
 #include <common.h>
 #include "esp_ota_ops.h"
+#include "esp_partition.h"
 #include "esp_system.h"
+#include "freertos/stream_buffer.h"
+#include <esp32/rom/crc.h>
 #include <vector>
 #include "interfaces/update-listener.h"
+#include <hal/update-decoder.h>
+#include <hal/event-bus.h>
+#include <hal/tasks.h>
+
+#if defined(AMP_1_0_x)
+  #include <hal/amp-1.0.0/amp-storage.h>
+#endif
+
+// flash writes are coalesced into blocks of this size, one flash sector
+#define UPDATER_BLOCK_SIZE      4096
+#define UPDATER_BUFFER_SIZE     (UPDATER_BLOCK_SIZE * 4)
+// how much the writer pulls from the buffer to decode at a time
+#define UPDATER_INPUT_SIZE      512
+// how far apart resumable progress is saved to NVS, a multiple of the block size
+#define UPDATER_CHECKPOINT_SIZE (UPDATER_BLOCK_SIZE * 16)
+// how long a BLE write may wait for room in the buffer before it's dropped
+#define UPDATER_SEND_TIMEOUT    1000
+#define UPDATER_PROGRESS_MS     250
+// offset (4) + crc32 of the payload (4) in front of every addressed block
+#define UPDATER_BLOCK_HEADER    8
 
 static const char* UPDATER_TAG = "ota";
 
+/**
+ * BLE writes land in a stream buffer and a writer task drains it into whole
+ * sectors, erasing and writing the update partition one sector at a time,
+ * so flash time never stalls the BLE host. The buffer and task only exist
+ * while an update is running. What arrives can be a plain image, compressed
+ * or a delta against the running image, see UpdateDecoder.
+ *
+ * An update started with an image id is resumable: every block carries its
+ * offset and a crc32, and progress is checkpointed to NVS so a dropped link
+ * or a reboot picks up where it left off (across reboots only for plain
+ * images, the inflate state isn't saved). The image is verified as a whole
+ * when it's made the boot partition.
+ */
 class Updater {
-  std::vector<UpdateListener*> updateListeners;
-  UpdateStatus status;
+  volatile UpdateStatus status;
 
   const esp_partition_t *updatePartition;
-  esp_ota_handle_t updateHandle;
-  uint16_t updatePacketsCount;
-  size_t dataLength;
+  StreamBufferHandle_t updateStream = NULL;
+  uint8_t *updateBlock = nullptr;
+  size_t blockFill = 0;
+  UpdateDecoder *decoder = nullptr;
+  TaskHandle_t writerHandle = NULL;
+
+  uint32_t image = 0;
+  volatile bool ending = false;
+  volatile bool aborting = false;
+  volatile size_t received = 0;
+  volatile size_t written = 0;
+  size_t checkpoint = 0;
+  unsigned long lastProgress = 0;
 
-  void notifyUpdateListeners();
+  void notifyUpdateListeners(UpdateStatus update);
+  void notifyUpdateListeners() { notifyUpdateListeners(status); }
+  void queueData(const uint8_t *data, size_t length);
+  bool writeBlock(const uint8_t *data, size_t length);
+  void finishUpdate();
+  void stopWriter();
+  static bool emitDecoded(void *context, const uint8_t *data, size_t length);
+  static void writerTask(void *parameters);
 
   public:
     static Updater* instance() { static Updater updater; return &updater; }
 
-    void startUpdate();
+    // image 0 is a one shot update that always starts from the beginning
+    void startUpdate(uint32_t imageId = 0);
     void endUpdate();
-    void writeUpdate(std::string data);
+    void queryResume(uint32_t imageId);
+
+    void writeUpdate(const uint8_t *data, size_t length);
+    void writeBlock(uint32_t offset, uint32_t crc, const uint8_t *data, size_t length);
+
+    // the next byte the updater expects
+    size_t nextOffset() { return received; }
 
-    void addUpdateListener(UpdateListener *listener);
-};
\ No newline at end of file
+};
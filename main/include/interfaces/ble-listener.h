@@ -1,10 +1,8 @@
-#pragma once
-#include "FreeRTOS.h"
-
-class BleListener {
-  public:
-    QueueHandle_t advertisingQueue = NULL;
-
-    virtual void onAdvertisingStarted() = 0;
-    virtual void onAdvertisingStopped() = 0;
+#pragma once
+#include "FreeRTOS.h"
+
+class BleListener {
+  public:
+    virtual void onAdvertisingStarted() = 0;
+    virtual void onAdvertisingStopped() = 0;
 };
\ No newline at end of file
@@ -3,9 +3,6 @@
 
 class CalibrationListener {
   public:
-    QueueHandle_t calibrateXGQueue = NULL;
-    QueueHandle_t calibrateMagQueue = NULL;
-    
     virtual void onCalibrateXGStarted() = 0;
     virtual void onCalibrateXGEnded() = 0;
 
@@ -2,8 +2,20 @@
 #include <models/config.h>
 #include "FreeRTOS.h"
 
+// parts of the config a change touched, listeners only hear about the parts they're interested in
+enum ConfigChange : uint8_t {
+  ConfigChannels = (1 << 0),
+  ConfigRegions = (1 << 1),
+  ConfigActions = (1 << 2),
+  ConfigMotion = (1 << 3),
+  ConfigAll = 0x0F
+};
+
 class ConfigListener {
   public:
-    QueueHandle_t configUpdatedQueue = NULL;
+    uint8_t configInterests = ConfigChange::ConfigAll;
+
     virtual void onConfigUpdated() = 0;
+    // scoped changes, anything not overridden reloads everything
+    virtual void onConfigChanged(uint8_t changes) { onConfigUpdated(); }
 };
\ No newline at end of file
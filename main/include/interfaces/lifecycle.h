@@ -1,10 +1,21 @@
 #pragma once
 #include "FreeRTOS.h"
 
+// how a listener is brought up, see Power::onPowerUp
+enum StartupMode : uint8_t {
+  StartInline = 0,    // on the powering task, in registration order
+  StartParallel       // on its own short lived task, alongside everything else
+};
+
 class LifecycleBase {
   public:  
     virtual void onPowerUp() = 0;
     virtual void onPowerDown() = 0;
 
     virtual void process() = 0;
+
+    // light sleep while parked. any listener can hold the board awake
+    virtual bool canSleep() { return true; }
+    virtual void onSleep() { }
+    virtual void onWake() { }
 };
\ No newline at end of file
@@ -1,8 +0,0 @@
-#pragma once
-#include <models/motion.h>
-#include "FreeRTOS.h"
-
-class MotionListener {  
-  public:
-    QueueHandle_t vehicleQueue = NULL;
-};
\ No newline at end of file
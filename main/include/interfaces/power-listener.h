@@ -7,7 +7,5 @@ class PowerListener {
     PowerStatus _powerStatus;
 
   public:
-    QueueHandle_t powerStatusQueue = NULL;
-    
     virtual void onPowerStatusChanged(PowerStatus status) = 0;
 };
\ No newline at end of file
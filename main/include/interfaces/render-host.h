@@ -11,6 +11,5 @@ class RenderHost {
 
 class RenderListener {
   public:
-    QueueHandle_t lightsChangedQueue = NULL;
     virtual void onLightsChanged(LightCommands commands) = 0;
 };
\ No newline at end of file
@@ -1,15 +1,17 @@
 #pragma once
-#include <vector>
 #include <models/touch-type.h>
 
 class TouchListener {
   public:
-    QueueHandle_t touchQueue = NULL;
-    QueueHandle_t touchEventQueue = NULL;
+    virtual void onTouchDown() { }
+    virtual void onTouchUp() { }
+    // an interaction that finished, once the button has been idle for a moment
+    virtual void onTouchEvent(const TouchSequence &touches) { }
 };
 
+// time is in millis, taken when the edge was seen rather than when it was handled
 class TouchTaskListener {
   public:
-    virtual void onTouchDown() = 0;
-    virtual void onTouchUp() = 0;
-};
\ No newline at end of file
+    virtual void onTouchDown(unsigned long time) = 0;
+    virtual void onTouchUp(unsigned long time) = 0;
+};
@@ -1,13 +1,11 @@
-#pragma once
-#include <models/update-status.h>
-#include "FreeRTOS.h"
-
-class UpdateListener {
-  protected:
-    UpdateStatus _updateStatus;
-    
-  public:
-    QueueHandle_t updateStatusQueue = NULL;
-
-    virtual void onUpdateStatusChanged(UpdateStatus status) = 0;
+#pragma once
+#include <models/update-status.h>
+#include "FreeRTOS.h"
+
+class UpdateListener {
+  protected:
+    UpdateStatus _updateStatus;
+    
+  public:
+    virtual void onUpdateStatusChanged(UpdateStatus status) = 0;
 };
\ No newline at end of file
@@ -16,11 +16,30 @@ struct DeviceInfo {
 struct AmpConfig {
   MotionConfig motion;
   LightsConfig lights;
-  std::map<std::string, std::vector<LightingParameters>*> actions;
+  // owned by value, a reload tears the lot down with the map
+  std::map<std::string, std::vector<LightingParameters>> actions;
   DeviceInfo info;
 };
 
+/**
+ * Actions resolved by group and command, the read only copy of AmpConfig::actions
+ * the app and renderer look effects up in. Every command's effects sit back to
+ * back so a rebuild reuses the same allocation.
+ */
+struct ActionTable {
+  std::vector<LightingParameters> effects;
+  // a command's effects run from its offset up to the next command's
+  uint16_t offsets[ActionGroups][ACTION_COUNT + 1] = {};
+
+  const LightingParameters* begin(ActionGroup group, Actions command) const { return effects.data() + offsets[group][command]; }
+  const LightingParameters* end(ActionGroup group, Actions command) const { return effects.data() + offsets[group][command + 1]; }
+};
+
 enum ConfigControl : uint8_t {
   ReceiveStart = 0x01,
-  TransmitStart
+  TransmitStart,
+  // followed by the length and crc32 of a config streamed to file
+  UploadStart,
+  UploadComplete,
+  UploadFailed
 };
\ No newline at end of file
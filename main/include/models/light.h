@@ -5,6 +5,13 @@
 #include <string>
 #include <map>
 
+#define REGION_NONE   0xFF
+
+// palettes are baked into PALETTE_SIZE entry tables when the config loads
+#define PALETTE_NONE  0xFF
+#define PALETTE_SIZE  256
+#define PALETTE_MAX   8
+
 enum StripType : uint8_t {
   NeoPixel_GRB = 0,
   NeoPixel_GRBW,
@@ -20,6 +27,8 @@ struct LightChannel {
   uint8_t channel;
   uint16_t leds;
   LEDType type;
+  // estimated current budget for the strip in mA, 0 for no limit
+  uint16_t maxCurrent;
 };
 
 struct LightSection {
@@ -28,16 +37,30 @@ struct LightSection {
   uint16_t end;
 };
 
+// physical location of a single region pixel
+struct LightPixel {
+  uint8_t channel;
+  uint16_t offset;
+};
+
 struct LightRegion {
+  uint8_t id;
   std::string name;
   std::vector<LightSection> sections;
   uint32_t count;
-  std::vector<uint16_t> breaks;
+  // flattened (channel, offset) for every pixel in the region, built at config load
+  std::vector<LightPixel> pixels;
 };
 
 struct LightsConfig {
-  std::map<std::string, LightRegion> regions;
+  // regions are indexed by the id assigned at config load
+  std::vector<LightRegion> regions;
+  std::map<std::string, uint8_t> regionIds;
   std::map<uint8_t, LightChannel> channels;
+  // hex encoded pattern programs, referenced by index from Pattern effects
+  std::vector<std::string> patterns;
+  // gradient stops, RRGGBB[@position] separated by commas
+  std::vector<std::string> palettes;
 };
 
 enum LightEffect : uint8_t {
@@ -55,7 +78,9 @@ enum LightEffect : uint8_t {
   ColorChase,
   TheaterChase,
   Twinkle,
-  Sparkle
+  Sparkle,
+  // a user program from LightsConfig::patterns
+  Pattern
 };
 
 enum Actions {
@@ -80,6 +105,18 @@ enum Actions {
   LightsOrientationBack
 };
 
+// sizes the per group action tables
+#define ACTION_COUNT (Actions::LightsOrientationBack + 1)
+
+// the same command, eg LightsOff, names a different action in each group
+enum ActionGroup : uint8_t {
+  ActionHeadlight = 0,
+  ActionMotion,
+  ActionTurn,
+  ActionOrientation,
+  ActionGroups
+};
+
 struct LightCommands {
   Actions motionCommand;
   Actions headlightCommand;
@@ -91,22 +128,46 @@ struct ColorOption {
   Color color;
   bool random;
   bool rainbow;
+  // steps through a configured palette instead of the rainbow
+  uint8_t palette = PALETTE_NONE;
 };
 
 struct LightingParameters {
-  std::string region;
+  uint8_t region = REGION_NONE;
   LightEffect effect;
   uint8_t layer;
+  // 0 leaves the layers below untouched, 255 covers them
+  uint8_t opacity = 255;
+  // Pattern: which of the configured patterns to run
+  uint8_t pattern = 0;
   ColorOption first;
   ColorOption second;
   ColorOption third;
   uint32_t duration;
+  // runs faster or slower with the vehicle's speed, set by a trailing ",adaptive"
+  bool adaptive = false;
 };
 
 struct RenderStep {
+  bool active;
+  // set when an effect is (re)started so the renderer recomposites its whole region
+  bool changed;
+  // phased off the shared clock rather than when the effect started
+  bool synced;
+  // timed on a clock scaled by the speed class, see Lights::stepTime
+  bool adaptive;
+  // the last frame painted, or for effects that build up, how many have been
   unsigned long step;
   unsigned long next;
-  void* data;
+  // when the effect started, every frame is timed from here
+  unsigned long start;
+  // per-effect state kept inline so switching effects never allocates
+  union {
+    uint32_t pixel;     // Sparkle: the pixel currently sparkling
+    uint32_t remaining; // Twinkle: pixels left to light before starting over
+  } state;
+  // xorshift state for the effect's random choices, 0 until it's seeded
+  uint32_t seed;
 };
 
 inline bool operator< (const LightingParameters& lhs, const LightingParameters& rhs){ return lhs.layer < rhs.layer; }
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+#define MOTION_TRACE_MAGIC    0x54504d41    // "AMPT"
+// bump whenever the record layout changes
+#define MOTION_TRACE_VERSION  1
+#define MOTION_TRACE_PATH     "/spiffs/motion.trace"
+
+enum MotionTraceType : uint8_t {
+  TraceSample = 0,
+  TraceLabel
+};
+
+// the detector a label is for
+enum MotionTraceLabel : uint8_t {
+  LabelAcceleration = 0,
+  LabelTurn,
+  LabelOrientation,
+  MotionTraceLabels
+};
+
+struct __attribute__((packed)) MotionTraceHeader {
+  uint32_t magic;
+  uint16_t version;
+  // the rate the samples were taken at, in Hz
+  uint16_t sampleRate;
+  // samples and labels that follow
+  uint32_t records;
+};
+
+/**
+ * A trace is a header followed by header.records records. Samples
+ * carry raw acceleration in mg. Labels mark where a rider says a state
+ * change happened, x is the MotionTraceLabel and y the state it changed to
+ */
+struct __attribute__((packed)) MotionTraceRecord {
+  // micros() when the sample was taken
+  uint32_t timestamp;
+  uint8_t type;
+  int16_t x, y, z;
+};
@@ -4,6 +4,7 @@
 #include <map>
 #include <string>
 #include <cstring>
+#include <stddef.h>
 
 enum IMUState : uint8_t {
   IMU_Error = 0,
@@ -48,6 +49,21 @@ struct VehicleState {
   }
 };
 
+// coarse speed from how hard the road is shaking the sensor, see MovementEstimator
+enum SpeedClass : uint8_t {
+  SpeedStopped = 0,
+  SpeedSlow,
+  SpeedCruising,
+  SpeedFast,
+  SpeedClasses
+};
+
+struct MovementState {
+  SpeedClass speed;
+  // 0 - 255, how sure the estimator is that the vehicle is moving
+  uint8_t confidence;
+};
+
 enum CalibrationState : uint8_t {
   Started = 0,
   Ended = 1
@@ -84,6 +100,13 @@ static std::map<Orientation, std::string> OrientationMap = {
   { BackSideUp, "Back Side Up" },
 };
 
+static std::map<SpeedClass, std::string> SpeedClassMap = {
+  { SpeedStopped, "Stopped" },
+  { SpeedSlow, "Slow" },
+  { SpeedCruising, "Cruising" },
+  { SpeedFast, "Fast" }
+};
+
 struct Vector3D {
   float x = 0.0f;
   float y = 0.0f;
@@ -111,6 +134,36 @@ struct Vector3D {
   }
 };
 
+// an accelerometer sample (g) timestamped in microseconds since boot
+struct MotionSample {
+  unsigned long timestamp;
+  Vector3D acceleration;
+  Vector3D linear;
+  Vector3D attitude;
+};
+
+// samples filtered together, sized to a full IMU FIFO read
+#define MOTION_SAMPLE_BATCH 16
+
+// a batch of accelerometer samples laid out per axis so filter kernels walk contiguous floats
+struct AccelBatch {
+  float x[MOTION_SAMPLE_BATCH];
+  float y[MOTION_SAMPLE_BATCH];
+  float z[MOTION_SAMPLE_BATCH];
+  size_t count = 0;
+};
+
+enum GravityFilterType : uint8_t {
+  SinglePole = 0,
+  Biquad
+};
+
+enum AttitudeFilter : uint8_t {
+  NoAttitude = 0,
+  Tilt,
+  SmoothedTilt
+};
+
 enum AccelerationAxis : uint8_t {
   X_Pos = 0,
   X_Neg,
@@ -138,7 +191,18 @@ struct MotionConfig {
   float turnThreshold;
   float brakeThreshold;
   float accelerationThreshold;
+  // hysteresis and early onset, see AccelerationDetector
+  float brakeExitThreshold;
+  float accelerationExitThreshold;
+  float brakeJerkThreshold;
+  uint16_t brakeHold;
+  uint16_t motionHold;
   AccelerationAxis motionAxis;
   AttitudeAxis turnAxis;
   Orientation orientationTrigger;
+  AttitudeFilter attitudeFilter;
+  GravityFilterType gravityFilter;
+  float gravityCutoff;
+  uint16_t sampleRate;
+  uint16_t parkedSampleRate;
 };
\ No newline at end of file
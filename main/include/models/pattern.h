@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+
+#define PATTERN_MAX_INSTRUCTIONS  48
+#define PATTERN_REGISTERS         8
+#define PATTERN_MAX_PATTERNS      16
+
+// loaded before every pixel
+#define PATTERN_REG_INDEX   0   // pixel index within the region
+#define PATTERN_REG_COUNT   1   // pixels in the region
+#define PATTERN_REG_TIME    2   // ms since the effect started
+#define PATTERN_REG_PHASE   3   // 0-255 through the effect's duration
+// read back after every pixel
+#define PATTERN_REG_MIX     6   // 0-255 first to second color, 256-511 second to third
+#define PATTERN_REG_LEVEL   7   // 0-255 brightness, starts at full
+
+enum PatternOp : uint8_t {
+  OpConst = 0,  // dst = a | b << 8
+  OpMove,       // dst = a
+  OpAdd,
+  OpSub,
+  OpMul,
+  OpScale,      // dst = a * b >> 8
+  OpDiv,        // 0 when b is 0
+  OpMod,        // 0 when b is 0
+  OpMin,
+  OpMax,
+  OpAnd,
+  OpOr,
+  OpXor,
+  OpShl,
+  OpShr,
+  OpWave,       // eased 0-255-0 over a & 255
+  OpTriangle,   // linear 0-255-0 over a & 255
+  OpNoise,      // 0-255 hashed from a and b
+  OpLess,       // dst = a < b
+  OpSelect,     // dst = dst ? a : b
+  PatternOps
+};
+
+/**
+ * One instruction of an uploaded pattern. On the wire each is four bytes: the
+ * op, the destination register, then two source registers, or for OpConst a
+ * little endian 16 bit constant. There are no jumps, so every pixel costs at
+ * most PATTERN_MAX_INSTRUCTIONS instructions
+ */
+struct PatternInstruction {
+  uint8_t op;
+  uint8_t dst;
+  uint8_t a;
+  uint8_t b;
+};
@@ -17,10 +17,8 @@ struct PowerStatus {
   enum PowerLevel level;
 };
 
-inline bool operator==(const PowerStatus& lhs, const PowerStatus& rhs) {
-  return lhs.charging == rhs.charging && lhs.batteryPresent == rhs.batteryPresent && abs(lhs.percentage - rhs.percentage) > 5.0;
+// anything that changes how the board behaves, as opposed to a percentage tick
+inline bool levelChanged(const PowerStatus& lhs, const PowerStatus& rhs) {
+  return lhs.level != rhs.level || lhs.charging != rhs.charging
+    || lhs.doneCharging != rhs.doneCharging || lhs.batteryPresent != rhs.batteryPresent;
 }
-
-inline bool operator!=(const PowerStatus& lhs, const PowerStatus& rhs) {
-  return lhs.charging != rhs.charging || lhs.batteryPresent != rhs.batteryPresent || abs(lhs.percentage - rhs.percentage) > 5.0;
-}
\ No newline at end of file
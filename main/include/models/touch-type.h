@@ -1,6 +1,21 @@
 #pragma once
+#include <stdint.h>
+#include <stddef.h>
 
-enum TouchType {
+#define TOUCH_SEQUENCE_MAX 8
+
+enum TouchType : uint8_t {
   Tap,
   Hold
-};
\ No newline at end of file
+};
+
+// the touches of one interaction, in order. anything past TOUCH_SEQUENCE_MAX is dropped
+struct TouchSequence {
+  uint8_t count = 0;
+  TouchType touches[TOUCH_SEQUENCE_MAX];
+
+  size_t size() const { return count; }
+  TouchType operator[](size_t index) const { return touches[index]; }
+  void push_back(TouchType type) { if (count < TOUCH_SEQUENCE_MAX) touches[count++] = type; }
+  void clear() { count = 0; }
+};
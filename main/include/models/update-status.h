@@ -1,11 +1,21 @@
-#pragma once
-#include <stdint.h>
-
-enum UpdateStatus : uint8_t {
-  Start = 0,
-  End,
-  Write,
-  ErrorStart,
-  ErrorEnd,
-  ErrorWrite
+#pragma once
+#include <stdint.h>
+
+enum UpdateStatus : uint8_t {
+  Start = 0,
+  End,
+  Write,
+  ErrorStart,
+  ErrorEnd,
+  ErrorWrite,
+  // reply to a resume query or a block that didn't follow on, carries the next offset
+  Resume,
+  ErrorChecksum
+};
+
+// how far an update got, kept across reboots so it can be resumed
+struct UpdateProgress {
+  uint32_t image;
+  uint32_t partition;
+  uint32_t offset;
 };
\ No newline at end of file
@@ -0,0 +1,64 @@
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Lock-free single producer, single consumer ring buffer. The producer only
+ * writes head and the consumer only writes tail, so neither side blocks or
+ * needs a semaphore. When full, new items are dropped and counted.
+ */
+template <typename T, size_t N>
+class RingBuffer {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "RingBuffer size must be a power of two");
+
+  T _items[N];
+  std::atomic<uint32_t> _head { 0 };
+  std::atomic<uint32_t> _tail { 0 };
+  std::atomic<uint32_t> _dropped { 0 };
+
+  public:
+    // producer side
+    bool push(const T &item) {
+      auto head = _head.load(std::memory_order_relaxed);
+      if (head - _tail.load(std::memory_order_acquire) >= N) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+
+      _items[head & (N - 1)] = item;
+      _head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    // consumer side
+    bool peek(T &item) const {
+      auto tail = _tail.load(std::memory_order_relaxed);
+      if (_head.load(std::memory_order_acquire) == tail)
+        return false;
+
+      item = _items[tail & (N - 1)];
+      return true;
+    }
+
+    bool pop(T &item) {
+      return pop(&item, 1) == 1;
+    }
+
+    size_t pop(T *items, size_t max) {
+      auto tail = _tail.load(std::memory_order_relaxed);
+      size_t available = _head.load(std::memory_order_acquire) - tail;
+      size_t count = available < max ? available : max;
+
+      for (size_t i = 0; i < count; i++)
+        items[i] = _items[(tail + i) & (N - 1)];
+
+      _tail.store(tail + count, std::memory_order_release);
+      return count;
+    }
+
+    size_t size() const { return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire); }
+    bool empty() const { return size() == 0; }
+    uint32_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+    static constexpr size_t capacity() { return N; }
+};
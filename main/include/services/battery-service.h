@@ -3,8 +3,9 @@
 #include <hal/ble.h>
 #include <constants.h>
 #include <interfaces/power-listener.h>
+#include <hal/event-bus.h>
 
-class BatteryService : public PowerListener {
+class BatteryService : public PowerListener, public EventSubscriber {
   NimBLEServer *_server;
   NimBLECharacteristic* _batteryCharacteristic;
 
@@ -13,5 +14,9 @@ class BatteryService : public PowerListener {
 
     void setupService();
     void onPowerStatusChanged(PowerStatus status);
+    void onEvent(const Event &event);
     void process();
+
+    // battery level state characteristic encoding, level (1) and state flags (1)
+    static void encodeLevelState(PowerStatus status, uint8_t *data);
 };
\ No newline at end of file
@@ -6,15 +6,53 @@
 #include <string>
 #include <constants.h>
 #include <hal/config.h>
+#include <hal/trace-recorder.h>
+
+#define CONFIG_TX_PREFIX      "raw:"
+#define CONFIG_TX_TRACE_PREFIX "trace:"
+#define CONFIG_TX_BACKOFF_MS  2
+#define CONFIG_TX_TIMEOUT_MS  2000
+
+// what the transmit task has been asked to send
+#define CONFIG_TX_CONFIG      (1 << 0)
+#define CONFIG_TX_TRACE       (1 << 1)
 
 static const char* CONFIG_SERVICE_TAG = "config-service";
 
+class ConfigService;
+
+/**
+ * ArduinoJson writer that packs the serialized config into MTU sized
+ * notifications for one connection as it's produced
+ */
+struct ConfigNotifier {
+  ConfigService *_service;
+  uint16_t _conn;
+  uint16_t _packetSize;
+  const char *_prefix;
+  std::vector<uint8_t> _packet;
+  uint16_t _length = 0;
+
+  bool failed = false;
+  size_t sent = 0;
+
+  ConfigNotifier(ConfigService *service, uint16_t conn, uint16_t packetSize, const char *prefix = CONFIG_TX_PREFIX)
+    : _service(service), _conn(conn), _packetSize(packetSize), _prefix(prefix), _packet(packetSize) { }
+
+  void begin(size_t length);
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t length);
+  void flush();
+};
+
 class ConfigService : public NimBLECharacteristicCallbacks {
+  friend struct ConfigNotifier;
+
   Config *_config;
   NimBLEServer *_server;
 
   std::string rxBuffer;
-  uint16_t packetSize;
+  TaskHandle_t _transmitHandle = NULL;
   
   NimBLECharacteristic *_configRxCharacteristic;
   NimBLECharacteristic *_configTxCharacteristic;
@@ -30,9 +68,15 @@ class ConfigService : public NimBLECharacteristicCallbacks {
     void onWrite(NimBLECharacteristic *characteristic);
 
     void processCommand(std::string data);
-    void transmit(std::string data);
-    void notify(uint16_t conn_id, std::string data, bool notify);
-    std::vector<std::string> buildPackets(std::string data, size_t packetSize);
+    void notifyStatus(ConfigControl status);
+    // connection and mtu of every encrypted connection subscribed to tx
+    std::vector<std::pair<uint16_t, uint16_t>> transmitTargets();
+    void transmitConfig();
+    void transmitTrace();
+    bool sendPacket(uint16_t conn, const uint8_t *data, size_t length);
+    // starts the transmit task the first time anything is asked for
+    void requestTransmit(uint32_t requests);
+    static void transmitTask(void *parameters);
     
     FreeRTOS::Semaphore configTransceiver = FreeRTOS::Semaphore("configEvents");
 };
\ No newline at end of file
@@ -0,0 +1,37 @@
+#pragma once
+#include <NimBLEService.h>
+#include <hal/ble.h>
+#include <hal/profiler.h>
+#include <hal/lights.h>
+#include <hal/motion.h>
+#include <hal/tasks.h>
+#include <hal/memory-stats.h>
+#include <constants.h>
+
+static const char* DIAGNOSTICS_SERVICE_TAG = "diagnostics-service";
+
+// written to the performance characteristic
+enum PerformanceCommand : uint8_t {
+  // effect benchmark and motion replay, the report fills in as each finishes
+  PerformanceRun = 0x01,
+  PerformanceSaveBaseline = 0x02
+};
+
+class DiagnosticsService : public NimBLECharacteristicCallbacks {
+  NimBLEServer *_server;
+  Motion *_motion;
+  NimBLECharacteristic *_renderCharacteristic;
+  NimBLECharacteristic *_latencyCharacteristic;
+  NimBLECharacteristic *_tasksCharacteristic;
+  NimBLECharacteristic *_effectsCharacteristic;
+  NimBLECharacteristic *_memoryCharacteristic;
+  NimBLECharacteristic *_bootCharacteristic;
+  NimBLECharacteristic *_performanceCharacteristic;
+
+  public:
+    DiagnosticsService(NimBLEServer *server, Motion *motion);
+
+    void setupService();
+    void onRead(NimBLECharacteristic *characteristic);
+    void onWrite(NimBLECharacteristic *characteristic);
+};
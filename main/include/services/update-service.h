@@ -7,13 +7,15 @@
 
 static const char* UPDATE_SERVICE_TAG = "update-service";
 
-class UpdateService : public NimBLECharacteristicCallbacks, public UpdateListener {
+class UpdateService : public NimBLECharacteristicCallbacks, public UpdateListener, public EventSubscriber {
   Updater *_updater;
   NimBLEServer *_server;
   NimBLECharacteristic *_updateRxCharacteristic;
   NimBLECharacteristic *_updateControlCharacteristic;
   NimBLECharacteristic *_updateStatusCharacteristic;
 
+  bool _addressed = false;
+
   public:
     UpdateService(Updater *updater, NimBLEServer *server);
 
@@ -22,4 +24,5 @@ class UpdateService : public NimBLECharacteristicCallbacks, public UpdateListene
     void onWrite(NimBLECharacteristic *characteristic);
 
     void onUpdateStatusChanged(UpdateStatus status);
+    void onEvent(const Event &event);
 };
\ No newline at end of file
@@ -5,12 +5,42 @@
 #include <hal/ble.h>
 #include <models/control.h>
 #include <constants.h>
-#include <interfaces/motion-listener.h>
+#include <interfaces/calibration-listener.h>
 #include <interfaces/render-host.h>
+#include <services/battery-service.h>
+#include <hal/event-bus.h>
+#include <hal/sync-clock.h>
+
+// default packing of the telemetry stream, both can be changed by writing to it
+#define VEHICLE_TELEMETRY_INTERVAL  100
+#define VEHICLE_TELEMETRY_MIN_INTERVAL 20
 
 static const char* VEHICLE_SERVICE_TAG = "vehicle-service";
 
-class VehicleService : public NimBLECharacteristicCallbacks, public MotionListener, public CalibrationListener, public RenderListener {
+/**
+ * One telemetry sample on the wire. acceleration and linear are in mg,
+ * attitude in hundredths of a degree
+ */
+struct __attribute__((packed)) TelemetrySample {
+  uint32_t timestamp;
+  int16_t acceleration[3];
+  int16_t linear[3];
+  int16_t attitude[3];
+};
+
+// sequence (1), sample count (1), samples dropped by the motion buffer (2)
+#define VEHICLE_TELEMETRY_HEADER 4
+
+// state, light and battery changes closer together than this go out as one
+#define VEHICLE_NOTIFY_INTERVAL 30
+
+enum VehicleStatusChange : uint8_t {
+  StatusState = 0x01,
+  StatusLights = 0x02,
+  StatusBattery = 0x04
+};
+
+class VehicleService : public NimBLECharacteristicCallbacks, public CalibrationListener, public RenderListener, public EventSubscriber {
   Motion *_motion;
   Power *_power;
   NimBLEServer *_server;
@@ -20,16 +50,49 @@ class VehicleService : public NimBLECharacteristicCallbacks, public MotionListen
   NimBLECharacteristic *_lightCharacteristic;
   NimBLECharacteristic *_calibrationCharacteristic;
   NimBLECharacteristic *_restartCharacteristic;
+  NimBLECharacteristic *_telemetryCharacteristic;
+  NimBLECharacteristic *_statusCharacteristic;
+  NimBLECharacteristic *_clockCharacteristic;
+  NimBLECharacteristic *_traceCharacteristic;
+
+  // the latest of each value, flushed together. the status characteristic
+  // carries changed (1), state (3), lights (4), battery (2)
+  uint8_t _pendingStatus = 0;
+  uint8_t _status[10] = { 0 };
+  unsigned long _lastStatusNotify = 0;
+  void flushStatus();
+
+  // telemetry only runs while a client is subscribed. subscriptions come in on
+  // the BLE host, the packet is only touched from process
+  volatile bool _telemetrySubscribed = false;
+  volatile uint16_t _telemetryMtu = 0;
+  bool _telemetryActive = false;
+  uint16_t _telemetryPacketSize = 0;
+  uint8_t _telemetryDecimation = 1;
+  uint16_t _telemetryInterval = VEHICLE_TELEMETRY_INTERVAL;
+  uint32_t _telemetryCounter = 0;
+  uint8_t _telemetrySequence = 0;
+  unsigned long _lastTelemetry = 0;
+  std::vector<uint8_t> _telemetryPacket;
+  void setTelemetry(bool enabled);
+  void streamTelemetry();
+  void sendTelemetry();
 
   public:
     VehicleService(Motion *motion, Power *power, NimBLEServer *server, RenderHost *host);
 
     void setupService();
+    void onRead(NimBLECharacteristic *characteristic);
     void onWrite(NimBLECharacteristic *characteristic);
+    void onSubscribe(NimBLECharacteristic *characteristic, ble_gap_conn_desc *desc, uint16_t subValue);
     void process();
-    
+    // anything for process to do, idle services are skipped by the app loop
+    bool pending();
+    void onEvent(const Event &event);
+
     void onVehicleStateChanged(VehicleState state);
     void onLightsChanged(LightCommands commands);
+    void onBatteryChanged(PowerStatus status);
 
     void onCalibrateXGStarted();
     void onCalibrateXGEnded();
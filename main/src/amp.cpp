@@ -13,14 +13,13 @@ BluetoothLE* Amp::ble = BluetoothLE::instance();
 #endif
 
 void Amp::init() {
-  // listen to power changes
-  power->addPowerLevelListener(&motion);
-  power->addPowerLevelListener(lights);
-
-  // listen to lifecycle changes
-  power->addLifecycleListener(&buttons);
-  power->addLifecycleListener(&motion);
-  power->addLifecycleListener(lights);
+  // listen to lifecycle changes, everything else goes over the event bus.
+  // buttons wait for a release and the IMU for its self test, so they come up
+  // on their own tasks. lights pick the config up off the bus whenever it lands,
+  // motion needs storage mounted for its calibration
+  power->addLifecycleListener(&buttons, StartupMode::StartParallel);
+  power->addLifecycleListener(&motion, StartupMode::StartParallel, { &config });
+  power->addLifecycleListener(lights, StartupMode::StartParallel);
 
 #ifdef BLE_ENABLED
   power->addLifecycleListener(ble);
@@ -28,25 +27,6 @@ void Amp::init() {
 
   power->addLifecycleListener(&config);
 
-  // listen to config changes
-  config.addConfigListener(&motion);
-  config.addConfigListener(lights);
-
-  // listen to touch changes
-  buttons.addTouchListener(lights);
-  buttons.addTouchListener(power);
-
-#ifdef BLE_ENABLED
-  // listen to touches to start advertising
-  buttons.addTouchListener(ble);
-
-  // listen to advertising changes
-  ble->addAdvertisingListener(lights);
-#endif
-
-  // listen to ota update status changes
-  updater->addUpdateListener(lights);
-  
   // setup app
   app = new App(this);
   power->addLifecycleListener(app);
@@ -55,6 +35,13 @@ void Amp::init() {
   power->onPowerUp();
 }
 
+void Amp::wait(TickType_t timeout) {
+  if (app != nullptr)
+    app->waitForEvents(timeout);
+  else
+    vTaskDelay(timeout);
+}
+
 void Amp::process() {
   // todo: move this into the app host
   // when we're powering down, we need to halt processing
@@ -5,15 +5,21 @@ Amp* App::amp = nullptr;
 
 App::App(Amp *instance) {
   amp = instance;
-  amp->config.addConfigListener(this);
 
-  configUpdatedQueue = xQueueCreate(1, sizeof(bool));
-  vehicleQueue = xQueueCreate(5, sizeof(VehicleState));
+  // the app task sleeps in waitForEvents until one of these lands
+  EventBus::instance()->subscribe(this, EVENT_MASK(EventConfigChanged) | EVENT_MASK(EventVehicleState)
+    | EVENT_MASK(EventTouchSequence), xTaskGetCurrentTaskHandle());
 }
 
-void App::onPowerUp() { 
+/*
+  Nothing here waits on the BLE host, it comes up on its own task while the
+  lights do. The services follow from the app loop once it's ready
+*/
+void App::onPowerUp() { }
+
 #ifdef BLE_ENABLED
-  BluetoothLE::bleReady.wait();
+void App::startServices() {
+  _servicesStarted = true;
 
   // workaround for weird bug where the first initialized service is duplicated / empty
   auto dummyService = amp->ble->server->createService(NimBLEUUID((uint16_t)0x183B));
@@ -25,22 +31,24 @@ void App::onPowerUp() {
   vehicleService = new VehicleService(&(amp->motion), amp->power, amp->ble->server, this);
   configService = new ConfigService(&(amp->config), amp->ble->server);
   updateService = new UpdateService(amp->updater, amp->ble->server);
+  diagnosticsService = new DiagnosticsService(amp->ble->server, &(amp->motion));
 
-  // listen to power updates
-  amp->power->addPowerLevelListener(batteryService);
-
-  // listen to render host changes for the vehicle service
-  addRenderListener(vehicleService);
+  // everything the services missed while the host was coming up
+  auto power = amp->power->getStatus();
+  batteryService->onPowerStatusChanged(power);
+  vehicleService->onBatteryChanged(power);
+  vehicleService->onVehicleStateChanged(vehicleState);
+  notifyLightsChanged();
 
   // startup advertising
   amp->ble->startAdvertising();
-#endif
-
-  // listen to motion changes
-  amp->motion.addMotionListener(this);
+  Profiler::instance()->markBoot(BootStage::BootAdvertising);
 }
+#endif
 
 void App::onPowerDown() {
+  MemoryScope memory(MemorySubsystem::MemoryBle);
+
   ESP_LOGD(APP_TAG,"App power down");
 }
 
@@ -55,47 +63,98 @@ void App::onConfigUpdated() {
   setHeadlight(Actions::LightsReset);
 }
 
+/*
+  Effect and region patches only need the current actions applied again,
+  anything else resets motion detection too
+*/
+void App::onConfigChanged(uint8_t changes) {
+  if (changes & (ConfigChange::ConfigChannels | ConfigChange::ConfigMotion)) {
+    onConfigUpdated();
+    return;
+  }
+
+  setMotion(Actions::LightsReset);
+  setTurnLights(Actions::LightsReset);
+  setHeadlight(Actions::LightsReset);
+}
+
 void App::process() {
-  bool valid;
+  dispatchEvents();
 
-  if (uxQueueMessagesWaiting(configUpdatedQueue)) {
-    if (xQueueReceive(configUpdatedQueue, &valid, 0) && valid)
-      onConfigUpdated();
+#ifdef BLE_ENABLED
+  if (!_servicesStarted) {
+    if (!BluetoothLE::isReady())
+      return;
+    startServices();
   }
 
-  VehicleState state;
-  bool newVehicleState = false;
-
-  // consume all new vehicle states from queue
-  while (uxQueueMessagesWaiting(vehicleQueue))
-    newVehicleState = xQueueReceive(vehicleQueue, &state, 0);
-
-  if (newVehicleState) {
-    if (vehicleState.acceleration != state.acceleration)
-      onAccelerationStateChanged(state.acceleration);
-    
-    if (vehicleState.turn != state.turn)
-      onTurnStateChanged(state.turn);
-
-    if (vehicleState.orientation != state.orientation)
-      onOrientationChanged(state.orientation);
-
-  #ifdef BLE_ENABLED
-    if (vehicleService != nullptr)
-      vehicleService->onVehicleStateChanged(state);
-  #endif
-    
-    vehicleState = state;
+  // the loop wakes for the app's own events too, only services with work are run
+  if (batteryService->hasEvents())
+    batteryService->process();
+  if (vehicleService->pending())
+    vehicleService->process();
+  if (updateService->hasEvents())
+    updateService->process();
+#endif
+}
+
+void App::onEvent(const Event &event) {
+  switch (event.type) {
+    case EventConfigChanged: {
+      uint8_t changes = event.as<uint8_t>();
+      if (changes & configInterests)
+        onConfigChanged(changes);
+      break;
+    }
+
+    case EventVehicleState:
+      onVehicleStateChanged(event.as<VehicleState>());
+      break;
+
+    case EventTouchSequence: {
+      // a double tap steps to the next lighting preset
+      auto touches = event.as<TouchSequence>();
+      if (touches.size() == 2 && touches[0] == TouchType::Tap && touches[1] == TouchType::Tap)
+        amp->config.cyclePreset();
+      break;
+    }
+
+    default:
+      break;
   }
+}
+
+/*
+  Vehicle state coalesces on the bus, so this only ever sees the latest one
+*/
+void App::onVehicleStateChanged(VehicleState state) {
+  if (vehicleState.acceleration != state.acceleration)
+    onAccelerationStateChanged(state.acceleration);
+
+  if (vehicleState.turn != state.turn)
+    onTurnStateChanged(state.turn);
+
+  if (vehicleState.orientation != state.orientation)
+    onOrientationChanged(state.orientation);
 
 #ifdef BLE_ENABLED
-  vehicleService->process();
-  batteryService->process();
-  updateService->process();
+  if (vehicleService != nullptr)
+    vehicleService->onVehicleStateChanged(state);
 #endif
+
+  vehicleState = state;
+}
+
+/*
+  Blocks the app loop until anything on the app task is published to, or the
+  timeout passes. App and its services all share the one notification
+*/
+void App::waitForEvents(TickType_t timeout) {
+  xTaskNotifyWait(0, UINT32_MAX, NULL, timeout);
 }
 
 void App::onAccelerationStateChanged(AccelerationState state) {
+  Profiler::instance()->markLatency(LatencyStage::AppNotified);
   ESP_LOGD(APP_TAG, "on acceleration state changed");
   Actions command;
 
@@ -172,20 +231,21 @@ void App::onOrientationChanged(Orientation state) {
   setOrientationLights(command);
 }
 
+void App::applyAction(ActionGroup group, Actions command) {
+  if (command >= ACTION_COUNT)
+    return;
+
+  // brake and turn changes jump the renderer's queue
+  bool urgent = group == ActionGroup::ActionMotion || group == ActionGroup::ActionTurn;
+  amp->lights->applyAction(group, command, urgent);
+}
+
 void App::setHeadlight(Actions command) {
-  auto actions = config->actions;
   if (command == Actions::LightsReset)
     command = _headlightCommand;
 
-  std::string actionName = Lights::headlightActions[command];
-  ESP_LOGI(APP_TAG, "Setting headlight - Command: %d, Action name: %s", command, actionName.c_str());
-
-  if (actions.find(actionName) != actions.end()) {
-    for (auto effect : *actions[actionName]) {
-      ESP_LOGD(APP_TAG, "Applying effect %d to %s", effect.effect, effect.region.c_str());
-      amp->lights->applyEffect(effect);
-    }
-  }
+  ESP_LOGI(APP_TAG, "Setting headlight - Command: %d", command);
+  applyAction(ActionGroup::ActionHeadlight, command);
 
   _headlightCommand = command;
 
@@ -194,19 +254,11 @@ void App::setHeadlight(Actions command) {
 }
 
 void App::setMotion(Actions command) {
-  auto actions = config->actions;
   if (command == Actions::LightsReset)
     command = _motionCommand;
 
-  std::string actionName = Lights::motionActions[command];
-  ESP_LOGI(APP_TAG, "Setting motion - Command: %d, Action name: %s", command, actionName.c_str());
-
-  if (actions.find(actionName) != actions.end()) {
-    for (auto effect : *actions[actionName]) {
-      ESP_LOGD(APP_TAG, "Applying effect %d to %s", effect.effect, effect.region.c_str());
-      amp->lights->applyEffect(effect);
-    }
-  }
+  ESP_LOGI(APP_TAG, "Setting motion - Command: %d", command);
+  applyAction(ActionGroup::ActionMotion, command);
 
   _motionCommand = command;
 
@@ -215,19 +267,11 @@ void App::setMotion(Actions command) {
 }
 
 void App::setTurnLights(Actions command) {
-  auto actions = config->actions;
   if (command == Actions::LightsReset)
     command = _turnCommand;
 
-  std::string actionName = Lights::turnActions[command];
-  ESP_LOGI(APP_TAG, "Setting indicators - Command: %d, Action name: %s", command, actionName.c_str());
-  
-  if (actions.find(actionName) != actions.end()) {
-    for (auto effect : *actions[actionName]) {
-      ESP_LOGD(APP_TAG, "Applying effect %d to %s", effect.effect, effect.region.c_str());
-      amp->lights->applyEffect(effect);
-    }
-  }
+  ESP_LOGI(APP_TAG, "Setting indicators - Command: %d", command);
+  applyAction(ActionGroup::ActionTurn, command);
 
   _turnCommand = command;
 
@@ -236,19 +280,11 @@ void App::setTurnLights(Actions command) {
 }
 
 void App::setOrientationLights(Actions command) {
-  auto actions = config->actions;
   if (command == Actions::LightsReset)
     command = _orientationCommand;
 
-  std::string actionName = Lights::orientationActions[command];
-  ESP_LOGI(APP_TAG, "Setting orientation - Command: %d, Action name: %s", command, actionName.c_str());
-  
-  if (actions.find(actionName) != actions.end()) {
-    for (auto effect : *actions[actionName]) {
-      ESP_LOGD(APP_TAG, "Applying effect %d to %s", effect.effect, effect.region.c_str());
-      amp->lights->applyEffect(effect);
-    }
-  }
+  ESP_LOGI(APP_TAG, "Setting orientation - Command: %d", command);
+  applyAction(ActionGroup::ActionOrientation, command);
 
   _orientationCommand = command;
 
@@ -263,8 +299,5 @@ void App::notifyLightsChanged(Actions motionCommand, Actions turnCommand, Action
   commands.headlightCommand = headlightCommand == Actions::NoCommand || headlightCommand == Actions::LightsReset ? _headlightCommand : headlightCommand;
   commands.orientationCommand = orientationCommand == Actions::NoCommand || orientationCommand == Actions::LightsReset ? _orientationCommand : orientationCommand;
 
-  for (auto listener : renderListeners) {
-    if (listener->lightsChangedQueue != NULL)
-      xQueueSend(listener->lightsChangedQueue, &commands, 0);
-  }
+  EventBus::instance()->publish(EventLightsChanged, commands);
 }
\ No newline at end of file
@@ -0,0 +1,69 @@
+#include <filters/acceleration-detector.h>
+#include <algorithm>
+
+void AccelerationDetector::configure(const MotionConfig &config) {
+  _brakeExit = config.brakeExitThreshold;
+  _accelerationExit = config.accelerationExitThreshold;
+  setThresholds(config.brakeThreshold, config.accelerationThreshold);
+
+  _brakeJerk = std::max(config.brakeJerkThreshold, 0.0f);
+  _brakeHold = config.brakeHold;
+  _motionHold = config.motionHold;
+}
+
+void AccelerationDetector::setThresholds(float brake, float acceleration) {
+  _brakeEnter = brake;
+  _accelerationEnter = acceleration;
+  _brakeExit = std::min(_brakeExit, _brakeEnter);
+  _accelerationExit = std::min(_accelerationExit, _accelerationEnter);
+}
+
+void AccelerationDetector::update(float acceleration, float dt) {
+  if (_primed && dt > 0.0f) {
+    float jerk = (acceleration - _acceleration) / dt;
+    _jerk += (jerk - _jerk) * (dt / (ACCELERATION_JERK_TIME_CONSTANT + dt));
+    _peakJerk = std::max(_peakJerk, _jerk);
+  }
+
+  _acceleration = acceleration;
+  _primed = true;
+}
+
+void AccelerationDetector::reset() {
+  _acceleration = 0.0f;
+  _jerk = 0.0f;
+  _peakJerk = 0.0f;
+  _primed = false;
+}
+
+bool AccelerationDetector::brakeOnset() const {
+  if (_acceleration >= _brakeEnter)
+    return true;
+
+  return _moving && _brakeJerk > 0.0f && _peakJerk >= _brakeJerk && _acceleration >= _brakeExit;
+}
+
+AccelerationState AccelerationDetector::evaluate(AccelerationState current, unsigned long held) {
+  bool onset = brakeOnset();
+  _peakJerk = _jerk;
+
+  if (current != AccelerationState::Braking && onset)
+    return AccelerationState::Braking;
+
+  if (held < (current == AccelerationState::Braking ? _brakeHold : _motionHold))
+    return current;
+
+  switch (current) {
+    case AccelerationState::Braking:
+      if (_acceleration <= -_accelerationEnter)
+        return AccelerationState::Accelerating;
+      return _acceleration < _brakeExit ? AccelerationState::Neutral : current;
+
+    case AccelerationState::Accelerating:
+      return _acceleration > -_accelerationExit ? AccelerationState::Neutral : current;
+
+    case AccelerationState::Neutral:
+    default:
+      return _acceleration <= -_accelerationEnter ? AccelerationState::Accelerating : AccelerationState::Neutral;
+  }
+}
@@ -0,0 +1,124 @@
+#include <filters/gravity-filter.h>
+#include <math.h>
+
+#define PI_F          3.14159265f
+#define BUTTERWORTH_Q 0.70710678f
+
+void GravityFilter::setType(GravityFilterType type) {
+  if (type == _type)
+    return;
+
+  _type = type;
+  reset();
+}
+
+void GravityFilter::setCutoff(float hz) {
+  if (hz <= 0.0f)
+    return;
+
+  _cutoff = hz;
+  updateCoefficients();
+}
+
+void GravityFilter::setSampleRate(float hz) {
+  // sampling is off, keep the last coefficients for when it comes back
+  if (hz <= 0.0f || hz == _sampleRate)
+    return;
+
+  _sampleRate = hz;
+  updateCoefficients();
+}
+
+void GravityFilter::reset() {
+  for (auto& state : _state)
+    state = AxisState();
+  _primed = false;
+}
+
+/*
+  RBJ cookbook low pass, only recalculated on config or sample rate changes
+*/
+void GravityFilter::updateCoefficients() {
+  // keep the cutoff under nyquist or the filter goes unstable
+  float cutoff = fminf(_cutoff, _sampleRate * 0.45f);
+  float w0 = 2.0f * PI_F * cutoff / _sampleRate;
+  float cosW0 = cosf(w0);
+  float alpha = sinf(w0) / (2.0f * BUTTERWORTH_Q);
+  float a0 = 1.0f + alpha;
+
+  _b0 = (1.0f - cosW0) / 2.0f / a0;
+  _b1 = (1.0f - cosW0) / a0;
+  _b2 = _b0;
+  _a1 = -2.0f * cosW0 / a0;
+  _a2 = (1.0f - alpha) / a0;
+}
+
+/*
+  Starts every axis at steady state on the first sample so gravity doesn't
+  ramp in from zero and read as a hard brake
+*/
+void GravityFilter::prime(const AccelBatch &raw) {
+  const float first[3] = { raw.x[0], raw.y[0], raw.z[0] };
+  for (uint8_t axis = 0; axis < 3; axis++) {
+    auto& state = _state[axis];
+    state.gravity = first[axis];
+    state.z1 = first[axis] * (1.0f - _b0);
+    state.z2 = first[axis] * (_b2 - _a2);
+  }
+  _primed = true;
+}
+
+void GravityFilter::singlePole(AxisState &state, const float *in, float *gravity, float *linear, size_t count) {
+  const float alpha = _alpha;
+  const float beta = 1.0f - _alpha;
+  float g = state.gravity;
+
+  for (size_t i = 0; i < count; i++) {
+    g = alpha * g + beta * in[i];
+    gravity[i] = g;
+    linear[i] = in[i] - g;
+  }
+
+  state.gravity = g;
+}
+
+// transposed direct form II, two state values per axis
+void GravityFilter::biquad(AxisState &state, const float *in, float *gravity, float *linear, size_t count) {
+  const float b0 = _b0, b1 = _b1, b2 = _b2, a1 = _a1, a2 = _a2;
+  float z1 = state.z1;
+  float z2 = state.z2;
+
+  for (size_t i = 0; i < count; i++) {
+    float x = in[i];
+    float y = b0 * x + z1;
+    z1 = b1 * x - a1 * y + z2;
+    z2 = b2 * x - a2 * y;
+    gravity[i] = y;
+    linear[i] = x - y;
+  }
+
+  state.z1 = z1;
+  state.z2 = z2;
+  state.gravity = count > 0 ? gravity[count - 1] : state.gravity;
+}
+
+void GravityFilter::process(const AccelBatch &raw, AccelBatch &gravity, AccelBatch &linear) {
+  size_t count = raw.count;
+  gravity.count = count;
+  linear.count = count;
+  if (count == 0)
+    return;
+
+  if (!_primed)
+    prime(raw);
+
+  if (_type == GravityFilterType::Biquad) {
+    biquad(_state[0], raw.x, gravity.x, linear.x, count);
+    biquad(_state[1], raw.y, gravity.y, linear.y, count);
+    biquad(_state[2], raw.z, gravity.z, linear.z, count);
+  } else {
+    singlePole(_state[0], raw.x, gravity.x, linear.x, count);
+    singlePole(_state[1], raw.y, gravity.y, linear.y, count);
+    singlePole(_state[2], raw.z, gravity.z, linear.z, count);
+  }
+}
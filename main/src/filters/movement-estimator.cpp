@@ -0,0 +1,75 @@
+#include <filters/movement-estimator.h>
+#include <algorithm>
+#include <math.h>
+
+void MovementEstimator::update(const Vector3D &linear, float axis, float dt) {
+  const float floor = MOVEMENT_VIBRATION_FLOOR * MOVEMENT_VIBRATION_FLOOR;
+  float energy = linear.x * linear.x + linear.y * linear.y + linear.z * linear.z;
+
+  // swap the oldest sample out of the window
+  float &slot = _energy[_index];
+  if (slot > floor)
+    _active--;
+  if (energy > floor)
+    _active++;
+  _sum += energy - slot;
+  slot = energy;
+
+  _filled = std::min<uint16_t>(_filled + 1, MOVEMENT_WINDOW);
+  _index = (_index + 1) & (MOVEMENT_WINDOW - 1);
+  if (_index == 0) {
+    _sum = 0.0f;
+    for (size_t i = 0; i < MOVEMENT_WINDOW; i++)
+      _sum += _energy[i];
+  }
+
+  if (dt > 0.0f) {
+    _speed += axis * dt;
+    _speed -= _speed * (dt / (MOVEMENT_SPEED_LEAK + dt));
+  }
+}
+
+void MovementEstimator::reset() {
+  std::fill(_energy, _energy + MOVEMENT_WINDOW, 0.0f);
+  _index = 0;
+  _filled = 0;
+  _sum = 0.0f;
+  _active = 0;
+  _speed = 0.0f;
+  _class = SpeedClass::SpeedStopped;
+}
+
+/*
+  Mostly sustained vibration, a part filled window reads as a part share so a
+  single bump never counts for much
+*/
+float MovementEstimator::confidence() const {
+  float vibrating = _active / (float) MOVEMENT_WINDOW;
+  float speed = std::min(fabsf(_speed) / MOVEMENT_SPEED_REFERENCE, 1.0f);
+  return std::min(vibrating * 0.7f + speed * 0.3f, 1.0f);
+}
+
+float MovementEstimator::vibration() const {
+  return _filled > 0 ? sqrtf(std::max(_sum, 0.0f) / _filled) : 0.0f;
+}
+
+SpeedClass MovementEstimator::classify() {
+  // the boundary to leave a class is pulled back past the one to enter it
+  float margin = _class == SpeedClass::SpeedStopped ? 1.0f + MOVEMENT_HYSTERESIS : 1.0f - MOVEMENT_HYSTERESIS;
+  if (confidence() < MOVEMENT_CONFIDENT * margin) {
+    _class = SpeedClass::SpeedStopped;
+    return _class;
+  }
+
+  const float boundaries[] = { MOVEMENT_CRUISING_VIBRATION, MOVEMENT_FAST_VIBRATION };
+  float rms = vibration();
+  uint8_t speed = SpeedClass::SpeedSlow;
+  for (uint8_t i = 0; i < 2; i++) {
+    margin = _class > SpeedClass::SpeedSlow + i ? 1.0f - MOVEMENT_HYSTERESIS : 1.0f + MOVEMENT_HYSTERESIS;
+    if (rms > boundaries[i] * margin)
+      speed = SpeedClass::SpeedSlow + i + 1;
+  }
+
+  _class = (SpeedClass) speed;
+  return _class;
+}
@@ -0,0 +1,66 @@
+#include <filters/tilt-filter.h>
+#include <math.h>
+#include <string.h>
+
+#define RAD_TO_DEG    57.2957795f
+#define HALF_PI_F     1.57079633f
+#define PI_F          3.14159265f
+
+// quake style estimate with one newton step, ~0.2% error
+float TiltFilter::invSqrt(float value) {
+  float half = 0.5f * value;
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  bits = 0x5f3759df - (bits >> 1);
+  memcpy(&value, &bits, sizeof(value));
+
+  return value * (1.5f - half * value * value);
+}
+
+// polynomial approximation, max error ~0.0002 rad
+float TiltFilter::fastAtan2(float y, float x) {
+  float absX = fabsf(x);
+  float absY = fabsf(y);
+  if (absX == 0.0f && absY == 0.0f)
+    return 0.0f;
+
+  float ratio = absX > absY ? absY / absX : absX / absY;
+  float squared = ratio * ratio;
+  float angle = ((-0.0464964749f * squared + 0.15931422f) * squared - 0.327622764f) * squared * ratio + ratio;
+
+  if (absY > absX) angle = HALF_PI_F - angle;
+  if (x < 0.0f) angle = PI_F - angle;
+  if (y < 0.0f) angle = -angle;
+
+  return angle;
+}
+
+void TiltFilter::update(Vector3D accel, float dt) {
+  if (_type == AttitudeFilter::NoAttitude)
+    return;
+
+  float yz = accel.y * accel.y + accel.z * accel.z;
+  float yzLength = yz > 0.0f ? yz * invSqrt(yz) : 0.0f;
+
+  float roll = fastAtan2(accel.y, accel.z) * RAD_TO_DEG;
+  float pitch = fastAtan2(-accel.x, yzLength) * RAD_TO_DEG;
+
+  if (_type == AttitudeFilter::Tilt || dt <= 0.0f) {
+    _attitude.x = roll;
+    _attitude.y = pitch;
+    return;
+  }
+
+  // first order low pass on the angles, taking the short way round at +/-180
+  float weight = dt / (_timeConstant + dt);
+  float rollDelta = roll - _attitude.x;
+  if (rollDelta > 180.0f) rollDelta -= 360.0f;
+  else if (rollDelta < -180.0f) rollDelta += 360.0f;
+
+  _attitude.x += rollDelta * weight;
+  if (_attitude.x > 180.0f) _attitude.x -= 360.0f;
+  else if (_attitude.x < -180.0f) _attitude.x += 360.0f;
+
+  // pitch is bounded to +/-90 so never wraps
+  _attitude.y += (pitch - _attitude.y) * weight;
+}
@@ -3,15 +3,24 @@
 bool AmpButton::goingDown = false;
 QueueHandle_t AmpButton::buttonEventQueue = NULL;
 
+/*
+  Timestamps the edge and reads the level right away, so how long the task
+  takes to get to it doesn't change what it sees
+*/
 static void IRAM_ATTR button_isr_handler(void* args) {
   BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-  uint32_t io = (uint32_t) args;
-  xQueueSendFromISR(AmpButton::buttonEventQueue, &io, &xHigherPriorityTaskWoken);
+  ButtonEdge edge;
+  edge.time = (uint32_t) (esp_timer_get_time() / 1000ULL);
+  edge.level = gpio_get_level((gpio_num_t) (uintptr_t) args);
+
+  xQueueSendFromISR(AmpButton::buttonEventQueue, &edge, &xHigherPriorityTaskWoken);
+  if (xHigherPriorityTaskWoken)
+    portYIELD_FROM_ISR();
 }
 
 void AmpButton::init(TouchTaskListener *listener) {
   _listener = listener;
-  AmpButton::buttonEventQueue = xQueueCreate(10, sizeof(uint32_t));
+  AmpButton::buttonEventQueue = xQueueCreate(BUTTON_QUEUE_SIZE, sizeof(ButtonEdge));
 
   // configure input button
   gpio_config_t io_config;
@@ -29,9 +38,8 @@ void AmpButton::init(TouchTaskListener *listener) {
     delay(10);
   }
 
-  auto ret = gpio_install_isr_service(ESP_INTR_FLAG_LEVEL1);
-  ESP_ERROR_CHECK(ret);
-  ret = gpio_isr_handler_add(BUTTON_INPUT, button_isr_handler, (void*) BUTTON_INPUT);
+  // the isr service is installed by the power init before any listener starts
+  auto ret = gpio_isr_handler_add(BUTTON_INPUT, button_isr_handler, (void*) BUTTON_INPUT);
   ESP_ERROR_CHECK(ret);
 }
 
@@ -40,12 +48,37 @@ void AmpButton::deinit() {
   //detachInterrupt(digitalPinToInterrupt(BUTTON_INPUT));
 }
 
-void AmpButton::process() {
-  uint32_t button;
-  // process input events from queue
-  if (xQueueReceive(AmpButton::buttonEventQueue, &button, 0)) {
-    auto level = gpio_get_level(BUTTON_INPUT);
-    if (_listener != nullptr)
-      level ? _listener->onTouchUp() : _listener->onTouchDown();
+void AmpButton::process(TickType_t timeout) {
+  if (settling)
+    timeout = std::min(timeout, (TickType_t) (pdMS_TO_TICKS(BUTTON_DEBOUNCE_MS) + 1));
+
+  ButtonEdge edge;
+  if (xQueueReceive(AmpButton::buttonEventQueue, &edge, timeout)) {
+    if (edge.level == lastLevel)
+      return;
+
+    if (edge.time - lastEdge < BUTTON_DEBOUNCE_MS) {
+      settling = true;
+      settleStart = edge.time;
+      return;
+    }
+
+    settling = false;
+    emit(edge.level, edge.time);
   }
+  else if (settling) {
+    // quiet since the last bounce, whatever the pin reads now is where it landed
+    settling = false;
+    uint8_t level = gpio_get_level(BUTTON_INPUT);
+    if (level != lastLevel)
+      emit(level, settleStart);
+  }
+}
+
+void AmpButton::emit(uint8_t level, uint32_t time) {
+  lastLevel = level;
+  lastEdge = time;
+
+  if (_listener != nullptr)
+    level ? _listener->onTouchUp(time) : _listener->onTouchDown(time);
 }
\ No newline at end of file
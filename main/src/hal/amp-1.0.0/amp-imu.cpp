@@ -1,6 +1,19 @@
 #include <hal/amp-1.0.0/amp-imu.h>
+#include <algorithm>
+#include <math.h>
 
 lis3dh_sensor_t* AmpIMU::sensor = NULL;
+TaskHandle_t AmpIMU::sampleTask = NULL;
+
+static void IRAM_ATTR imu_isr_handler(void* args) {
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+  if (AmpIMU::sampleTask != NULL)
+    vTaskNotifyGiveFromISR(AmpIMU::sampleTask, &xHigherPriorityTaskWoken);
+
+  if (xHigherPriorityTaskWoken)
+    portYIELD_FROM_ISR();
+}
 
 AmpIMU::AmpIMU() {
   spi_bus_init(VSPI_HOST, IMU_CLK, IMU_MISO, IMU_MOSI);
@@ -9,20 +22,66 @@ AmpIMU::AmpIMU() {
 
 uint8_t AmpIMU::init() {
   sensor = lis3dh_init_sensor(VSPI_HOST, 0, IMU_CS);
-  return sensor != NULL;
+  if (sensor == NULL)
+    return false;
+
+#if defined(IMU_INT1)
+  // buffer samples in the FIFO and raise INT1 once the watermark is reached.
+  // the watermark itself is set along with the data rate
+  lis3dh_enable_int(sensor, lis3dh_int_fifo_watermark, lis3dh_int1_signal, true);
+
+  gpio_config_t io_config;
+  io_config.intr_type = GPIO_INTR_POSEDGE;
+  io_config.mode = GPIO_MODE_INPUT;
+  io_config.pull_down_en = GPIO_PULLDOWN_DISABLE;
+  io_config.pull_up_en = GPIO_PULLUP_DISABLE;
+  io_config.pin_bit_mask = IO_PIN_SELECT(IMU_INT1);
+  gpio_config(&io_config);
+
+  // the isr service is installed by the power init before any listener starts
+  auto ret = gpio_isr_handler_add(IMU_INT1, imu_isr_handler, NULL);
+  if (ret != ESP_OK)
+    ESP_LOGW(IMU_TAG, "Couldn't attach IMU interrupt, falling back to polling: %d", ret);
+#endif
+
+  return true;
 }
 
 void AmpIMU::deinit() {
-  // nothing needed
+#if defined(IMU_INT1)
+  gpio_isr_handler_remove(IMU_INT1);
+#endif
+  sampleTask = NULL;
 }
 
-void AmpIMU::process() {
-  bool newAccel = lis3dh_new_data(sensor);
-  if (newAccel && lis3dh_get_float_data(sensor, &data)) {
-    accel.x = data.ax;
-    accel.y = data.ay;
-    accel.z = data.az;
+/**
+ * Drains every sample waiting in the FIFO in a single burst read.
+ * Returns the number of samples available through getAccelSample.
+ */
+uint8_t AmpIMU::process() {
+  readLock.acquire();
+  sampleCount = lis3dh_get_float_data_fifo(sensor, samples);
+  readLock.release();
+
+  if (sampleCount > 0) {
+    auto& latest = samples[sampleCount - 1];
+    accel.x = latest.ax;
+    accel.y = latest.ay;
+    accel.z = latest.az;
   }
+
+  return sampleCount;
+}
+
+Vector3D AmpIMU::getAccelSample(uint8_t index) {
+  if (index >= sampleCount)
+    return accel;
+
+  Vector3D sample;
+  sample.x = samples[index].ax;
+  sample.y = samples[index].ay;
+  sample.z = samples[index].az;
+  return sample;
 }
 
 bool AmpIMU::accelAvailable() {
@@ -53,35 +112,187 @@ void AmpIMU::calibrateMag(Vector3D *offsets) {
   // offsets->z = imu.mBias[2];
 }
 
-void AmpIMU::calibrateXG(Vector3D *outOffsets) {
-  ESP_LOGD(IMU_TAG,"Calibrate XG not implemented");
-  // imu.calibrate(false);
-  
-  // outOffsets[0].x = imu.aBias[0];
-  // outOffsets[0].y = imu.aBias[1];
-  // outOffsets[0].z = imu.aBias[2];
+/**
+ * Estimates accelerometer bias from the FIFO while the board lies still on one
+ * face. outOffsets[0] is the accel bias with gravity removed from the axis
+ * facing down, outOffsets[1] the gyro bias (always zero, there is no gyro).
+ * Must be called from the sample task, leaves the sensor at the calibration
+ * rate so the caller has to restore its own. Returns false, leaving the
+ * offsets untouched, if the board moved or isn't level.
+ */
+bool AmpIMU::calibrateXG(Vector3D *outOffsets) {
+  if (sensor == NULL)
+    return false;
+
+  configure(IMU_CALIBRATION_RATE, lis3dh_high_res);
+
+  // running mean / variance per axis (welford)
+  Vector3D mean, m2;
+  uint16_t count = 0, skipped = 0;
+  auto started = millis();
+
+  while (count < IMU_CALIBRATION_SAMPLES) {
+    if (millis() - started > IMU_CALIBRATION_TIMEOUT) {
+      ESP_LOGW(IMU_TAG, "Calibration timed out after %d samples", count);
+      return false;
+    }
+
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(IMU_SAMPLE_TIMEOUT));
+    uint8_t available = lis3dh_get_float_data_fifo(sensor, samples);
+
+    for (uint8_t i = 0; i < available && count < IMU_CALIBRATION_SAMPLES; i++) {
+      if (skipped < IMU_CALIBRATION_SETTLE) {
+        skipped++;
+        continue;
+      }
+
+      count++;
+      const float values[3] = { samples[i].ax, samples[i].ay, samples[i].az };
+      for (uint8_t axis = 0; axis < 3; axis++) {
+        float delta = values[axis] - mean[axis];
+        mean[axis] += delta / count;
+        m2[axis] += delta * (values[axis] - mean[axis]);
+      }
+    }
+  }
+  sampleCount = 0;
+
+  // stillness check
+  uint8_t down = 0;
+  for (uint8_t axis = 0; axis < 3; axis++) {
+    float variance = m2[axis] / (count - 1);
+    if (variance > IMU_CALIBRATION_MAX_STDDEV * IMU_CALIBRATION_MAX_STDDEV) {
+      ESP_LOGW(IMU_TAG, "Calibration failed, moved on axis %d (variance %.6f)", axis, variance);
+      return false;
+    }
 
-  // outOffsets[1].x = imu.gBias[0];
-  // outOffsets[1].y = imu.gBias[1];
-  // outOffsets[1].z = imu.gBias[2];
+    if (fabsf(mean[axis]) > fabsf(mean[down]))
+      down = axis;
+  }
+
+  // whatever is left after taking 1g off the axis facing down is bias
+  float expected = mean[down] > 0 ? 1.0f : -1.0f;
+  if (fabsf(mean[down] - expected) > IMU_CALIBRATION_GRAVITY_TOLERANCE) {
+    ESP_LOGW(IMU_TAG, "Calibration failed, board isn't level (%.3f g on axis %d)", mean[down], down);
+    return false;
+  }
+
+  Vector3D bias = mean;
+  bias[down] -= expected;
+  outOffsets[0] = bias;
+  outOffsets[1] = Vector3D();
+
+  ESP_LOGD(IMU_TAG, "Calibrated from %d samples, bias %.4f %.4f %.4f", count, bias.x, bias.y, bias.z);
+  return true;
 }
 
-void AmpIMU::setPowerMode(IMUState state) {
+void AmpIMU::setPowerMode(IMUState state, uint16_t rate) {
   imuStatus = state;
-  if (sensor != NULL) {
-    switch (state) {
-      case IMUState::IMU_Disabled:
-        lis3dh_set_mode(sensor, lis3dh_power_down, lis3dh_low_power, false, false, false);
-        break;
-      case IMUState::IMU_LowPower:
-        lis3dh_set_mode(sensor, lis3dh_odr_50, lis3dh_low_power, true, true, true);
-        break;
-      case IMUState::IMU_Normal:
-        lis3dh_set_mode(sensor, lis3dh_odr_50, lis3dh_normal, true, true, true);
-        break;
-      case IMUState::IMU_Error:
-      default:
-        break;
+  switch (state) {
+    case IMUState::IMU_Disabled:
+      configure(0, lis3dh_low_power);
+      break;
+    case IMUState::IMU_LowPower:
+      configure(rate, lis3dh_low_power);
+      break;
+    case IMUState::IMU_Normal:
+      configure(rate, lis3dh_normal);
+      break;
+    case IMUState::IMU_Error:
+    default:
+      break;
+  }
+}
+
+/**
+ * Programs the sensor at the slowest output data rate that still covers the
+ * requested rate and sizes the FIFO watermark to match. Returns the rate
+ * actually in use, 0 when powered down.
+ */
+uint16_t AmpIMU::configure(uint16_t rate, lis3dh_resolution_t resolution, lis3dh_scale_t scale) {
+  if (sensor == NULL)
+    return 0;
+
+  auto odr = odrForRate(rate, &sampleRate);
+  bool enabled = odr != lis3dh_power_down;
+  lis3dh_set_mode(sensor, odr, resolution, enabled, enabled, enabled);
+  lis3dh_set_scale(sensor, scale);
+
+  uint8_t watermark = std::max(1, std::min(IMU_FIFO_MAX, sampleRate * IMU_BATCH_PERIOD / 1000));
+  lis3dh_set_fifo_mode(sensor, lis3dh_stream, watermark, lis3dh_int1_signal);
+
+  ESP_LOGD(IMU_TAG, "Sampling at %dHz, %d samples per batch", sampleRate, watermark);
+  return sampleRate;
+}
+
+/**
+ * Swaps INT1 between the FIFO watermark and a high-passed activity interrupt at
+ * a low data rate, used to wake the board from light sleep. Call configure
+ * afterwards to restore the sample rate once motion wakes us.
+ */
+void AmpIMU::setWakeOnMotion(bool enabled) {
+  if (sensor == NULL)
+    return;
+
+  lis3dh_int_event_source_t source;
+
+  if (enabled) {
+    lis3dh_enable_int(sensor, lis3dh_int_fifo_watermark, lis3dh_int1_signal, false);
+    lis3dh_set_fifo_mode(sensor, lis3dh_bypass, 0, lis3dh_int1_signal);
+    lis3dh_set_mode(sensor, lis3dh_odr_10, lis3dh_low_power, true, true, true);
+    sampleRate = 10;
+
+    // filter out gravity for the interrupt generator only
+    lis3dh_config_hpf(sensor, lis3dh_hpf_normal, 0, false, false, true, false);
+
+    lis3dh_int_event_config_t config;
+    config.mode = lis3dh_wake_up;
+    config.threshold = IMU_WAKE_THRESHOLD;
+    config.x_low_enabled = false;
+    config.x_high_enabled = true;
+    config.y_low_enabled = false;
+    config.y_high_enabled = true;
+    config.z_low_enabled = false;
+    config.z_high_enabled = true;
+    config.duration = 0;
+    config.latch = true;
+    lis3dh_set_int_event_config(sensor, &config, lis3dh_int_event1_gen);
+
+    // clear anything already latched so we don't wake straight away
+    lis3dh_get_int_event_source(sensor, &source, lis3dh_int_event1_gen);
+    lis3dh_enable_int(sensor, lis3dh_int_event1, lis3dh_int1_signal, true);
+  }
+  else {
+    lis3dh_enable_int(sensor, lis3dh_int_event1, lis3dh_int1_signal, false);
+    lis3dh_get_int_event_source(sensor, &source, lis3dh_int_event1_gen);
+    lis3dh_config_hpf(sensor, lis3dh_hpf_normal, 0, false, false, false, false);
+    lis3dh_enable_int(sensor, lis3dh_int_fifo_watermark, lis3dh_int1_signal, true);
+  }
+}
+
+lis3dh_odr_mode_t AmpIMU::odrForRate(uint16_t rate, uint16_t *actual) {
+  static const std::pair<uint16_t, lis3dh_odr_mode_t> rates[] = {
+    { 1, lis3dh_odr_1 },
+    { 10, lis3dh_odr_10 },
+    { 25, lis3dh_odr_25 },
+    { 50, lis3dh_odr_50 },
+    { 100, lis3dh_odr_100 },
+    { 200, lis3dh_odr_200 },
+    { 400, lis3dh_odr_400 },
+  };
+
+  if (rate == 0) {
+    *actual = 0;
+    return lis3dh_power_down;
+  }
+
+  for (auto& option : rates) {
+    if (option.first >= rate) {
+      *actual = option.first;
+      return option.second;
     }
   }
+
+  *actual = 400;
+  return lis3dh_odr_400;
 }
\ No newline at end of file
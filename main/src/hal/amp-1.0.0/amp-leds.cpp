@@ -1,8 +1,12 @@
 #include <hal/amp-1.0.0/amp-leds.h>
+#include <algorithm>
+#include <hal/profiler.h>
 
 FreeRTOS::Semaphore AmpLeds::ledsReady = FreeRTOS::Semaphore("leds");
 
 void AmpLeds::init() {
+  buildOutputTable();
+
   // setup the status led
   status = new OneWireLED(NeoPixel, STATUS_LED, 0, 1);
   (*status)[0] = lightOff;
@@ -14,47 +18,194 @@ void AmpLeds::deinit() {
 
 void AmpLeds::process() {
   ledsReady.wait();
-  if (dirty) {
+  if (statusDirty) {
+    ESP_LOGV(LEDS_TAG,"Status is dirty. Re-rendering");
+    statusDirty = false;
+    transmitLock.acquire();
     status->show();
-    for (auto pair : channels) {
-      if (pair.second != nullptr) {
-        if (pair.second->wait(5))
-          pair.second->show();
-      }
+  }
+
+  // only transmit channels that have changed since their last show. if a channel
+  // is still transmitting its last frame, leave it dirty and pick it up next pass.
+  // every frame is converted before any strip starts, then they're kicked off back
+  // to back. each strip has its own RMT channel (or the SPI bus for dotstars) so they
+  // go out together, and a flush costs the longest strip rather than the sum of them
+  uint16_t starting = 0;
+  for (auto pair : channels) {
+    if (pair.second != nullptr && isDirty(pair.first) && pair.second->wait(0)) {
+      ESP_LOGV(LEDS_TAG,"Channel %d is dirty. Re-rendering", pair.first);
+      auto start = Profiler::now();
+      dirty &= ~(1 << pair.first);
+      swapFrame(pair.first, pair.second);
+      Profiler::instance()->recordFlush(pair.first, start);
+      starting |= 1 << pair.first;
+    }
+  }
+
+  if (starting) {
+    transmitLock.acquire();
+    for (auto pair : channels)
+      if (starting & (1 << pair.first))
+        pair.second->show();
+
+    Profiler::instance()->markLatency(LatencyStage::Flushed);
+  }
+
+  // the renderer keeps coming back while we're pending, so this lets go once the last frame is out
+  if (transmitLock.held() && !dirty && !statusDirty && idle())
+    transmitLock.release();
+}
+
+bool AmpLeds::idle() {
+  if (!status->wait(0))
+    return false;
+
+  for (auto pair : channels)
+    if (pair.second != nullptr && !pair.second->wait(0))
+      return false;
+
+  return true;
+}
+
+// blank every strip without touching the frames, so wake can put them back
+void AmpLeds::sleep() {
+  ledsReady.wait();
+  transmitLock.acquire();
+
+  for (auto pair : channels) {
+    auto controller = pair.second;
+    if (controller == nullptr)
+      continue;
+
+    controller->wait();
+    for (uint16_t i = 0; i < leds[pair.first]; i++)
+      (*controller)[i] = wireOff;
+
+    controller->show();
+    controller->wait();
+  }
+
+  (*status)[0] = lightOff;
+  status->show();
+  status->wait();
+  transmitLock.release();
+}
+
+void AmpLeds::wake() {
+  render(true);
+}
+
+PixelFormat AmpLeds::formatForType(LEDType type) {
+  switch (type) {
+    case LEDType::SK6812_RGBW: return PixelFormat::PixelRGBW;
+    case LEDType::DotStar: return PixelFormat::PixelDotStar;
+    default: return PixelFormat::PixelRGB;
+  }
+}
+
+/*
+  Converts a frame pixel to what the controller sends as is. Dotstars keep the
+  full gamma curve and take the brightness in their global bits instead, so dim
+  frames don't lose color depth
+*/
+Color AmpLeds::wirePixel(PixelFormat format, const Color &pixel) {
+  switch (format) {
+    case PixelFormat::PixelRGBW: {
+      uint8_t r = output[pixel.r], g = output[pixel.g], b = output[pixel.b];
+      uint8_t white = std::min(r, std::min(g, b));
+      return Color(r - white, g - white, b - white, white);
     }
+    case PixelFormat::PixelDotStar:
+      return Color(gamma8[pixel.r], gamma8[pixel.g], gamma8[pixel.b], _brightness);
+    default:
+      return Color(output[pixel.r], output[pixel.g], output[pixel.b]);
   }
-  // if (statusDirty) {
-  //   ESP_LOGV(LEDS_TAG,"Status is dirty. Re-rendering");
-  //   status->wait();
-  //   status->show();
-  //   statusDirty = false;
-  // }
-
-  // // check the dirty bit for each
-  // for (auto pair : channels) {
-  //   if (pair.second != nullptr && dirty[pair.first]) {
-  //     ESP_LOGV(LEDS_TAG,"Channel %d is dirty. Re-rendering", pair.first);
-  //     pair.second->wait();
-  //     pair.second->show();
-
-  //     // unset dirty bit
-  //     dirty[pair.first] = false;
-  //   }
-  // }
 }
 
+void AmpLeds::swapFrame(uint8_t channelNumber, LightController *controller) {
+  auto& frame = frames[channelNumber];
+  auto format = formats[channelNumber];
+
+  // estimate the strip's draw from the duty cycle while the frame goes in, the white
+  // die is counted like one more color
+  uint32_t duty = 0;
+  for (uint16_t i = 0; i < frame.size(); i++) {
+    auto pixel = wirePixel(format, frame[i]);
+    (*controller)[i] = pixel;
+    duty += pixel.r + pixel.g + pixel.b + (format == PixelFormat::PixelRGBW ? pixel.a : 0);
+  }
+
+  if (format == PixelFormat::PixelDotStar)
+    duty = duty * (_brightness + 1) >> 8;
+
+  auto limit = currentLimits[channelNumber];
+  if (limit == 0)
+    return;
+
+  // scale the whole frame down if it would exceed the channel's budget
+  uint32_t idle = frame.size() * LED_IDLE_CURRENT;
+  uint32_t current = idle + duty * LED_COLOR_CURRENT / 255;
+  if (current <= limit || limit <= idle)
+    return;
+
+  uint32_t scale = ((limit - idle) << 8) / (current - idle);
+  ESP_LOGV(LEDS_TAG, "Channel %d estimated at %dmA, limiting to %dmA", channelNumber, current, limit);
+
+  for (uint16_t i = 0; i < frame.size(); i++) {
+    auto& pixel = (*controller)[i];
+    if (format == PixelFormat::PixelDotStar)
+      pixel.a = (pixel.a * scale) >> 8;
+    else
+      pixel = Color((pixel.r * scale) >> 8, (pixel.g * scale) >> 8, (pixel.b * scale) >> 8, (pixel.a * scale) >> 8);
+  }
+}
+
+void AmpLeds::buildOutputTable() {
+  for (uint16_t i = 0; i < 256; i++)
+    output[i] = (gamma8[i] * (_brightness + 1)) >> 8;
+}
+
+void AmpLeds::setBrightness(uint8_t brightness) {
+  if (brightness == _brightness)
+    return;
+
+  _brightness = brightness;
+  buildOutputTable();
+
+  // every frame has to go out again through the new table
+  for (auto pair : channels)
+    markDirty(pair.first);
+}
+
+/*
+  Creates the controller for a channel. A channel that's already running with
+  the same type and length keeps its controller, buffers and pixels
+*/
 LightController* AmpLeds::addLEDStrip(LightChannel data) {
   ledsReady.wait();
   ledsReady.take();
-  ESP_LOGD(LEDS_TAG,"Adding type %d strip on channel %d with %d LEDs", data.type, data.channel, data.leds);
   AddressableLED *controller = nullptr;
 
-  if (channels.find(data.channel) != channels.end()) {
-    // remove old controller
-    auto old = channels[data.channel];
-    delete old;
+  auto existing = channels.find(data.channel);
+  if (existing != channels.end() && existing->second != nullptr) {
+    auto& live = definitions[data.channel];
+    if (live.type == data.type && live.leds == data.leds) {
+      ESP_LOGD(LEDS_TAG,"Reusing type %d strip on channel %d with %d LEDs", data.type, data.channel, data.leds);
+      live = data;
+      currentLimits[data.channel] = data.maxCurrent;
+      markDirty(data.channel);
+
+      ledsReady.give();
+      return existing->second;
+    }
+
+    // the controllers size their buffers up front, so anything else is a new strip
+    delete existing->second;
+    channels.erase(existing);
   }
 
+  ESP_LOGD(LEDS_TAG,"Adding type %d strip on channel %d with %d LEDs", data.type, data.channel, data.leds);
+
   switch(data.type) {
     case LEDType::NeoPixel:
     case LEDType::WS2813:
@@ -68,38 +219,73 @@ LightController* AmpLeds::addLEDStrip(LightChannel data) {
       controller = new TwoWireLED(HSPI_HOST, data.leds, lightMap[data.channel], lightMap[data.channel + 4]);
       break;
     default:
+      ledsReady.give();
       return nullptr;
   }
 
   for (uint16_t i = 0; i < data.leds; i++)
-    (*controller)[i] = lightOff;
+    (*controller)[i] = wireOff;
 
+  // keeps the frame's allocation when a strip only shrinks
+  auto& frame = frames[data.channel];
+  frame.resize(data.leds);
+  std::fill(frame.begin(), frame.end(), lightOff);
   channels[data.channel] = controller;
+  definitions[data.channel] = data;
+  formats[data.channel] = formatForType(data.type);
   leds[data.channel] = data.leds;
-  // dirty[data.channel] = true;
+  currentLimits[data.channel] = data.maxCurrent;
+  markDirty(data.channel);
 
   ledsReady.give();
 
   return controller;
 }
 
+void AmpLeds::removeLEDStrip(uint8_t channelNumber) {
+  ledsReady.wait();
+  ledsReady.take();
+
+  auto existing = channels.find(channelNumber);
+  if (existing != channels.end()) {
+    ESP_LOGD(LEDS_TAG,"Removing strip on channel %d", channelNumber);
+    if (existing->second != nullptr) {
+      // leave it dark, nothing will drive it again
+      existing->second->wait();
+      for (uint16_t i = 0; i < leds[channelNumber]; i++)
+        (*existing->second)[i] = wireOff;
+      transmitLock.acquire();
+      existing->second->show();
+      existing->second->wait();
+      delete existing->second;
+    }
+
+    channels.erase(existing);
+    definitions.erase(channelNumber);
+    frames.erase(channelNumber);
+    formats.erase(channelNumber);
+    leds.erase(channelNumber);
+    currentLimits.erase(channelNumber);
+    dirty &= ~(1 << channelNumber);
+  }
+
+  ledsReady.give();
+}
+
 void AmpLeds::setStatus(Color color) {
   (*status)[0] = gammaCorrected(color);
-  dirty = true;
-  // statusDirty = true;
+  statusDirty = true;
 }
 
 void AmpLeds::render(bool all, int8_t channel) {
-  dirty = true;
-  // statusDirty = true;
+  statusDirty = true;
 
-  // // set all dirty bits
-  // if (all) {
-  //   for (auto pair : dirty)
-  //     dirty[pair.first] = true;
-  // }
-  // else if (channel != -1 && channel >= 1 && channel <= 8)
-  //   dirty[channel] = true;
+  if (all) {
+    for (auto pair : channels)
+      markDirty(pair.first);
+  }
+  else if (channel >= 1 && channel <= 8 && channels.find(channel) != channels.end())
+    markDirty(channel);
 }
 
 Color AmpLeds::gammaCorrected(Color color) {
@@ -113,11 +299,8 @@ void AmpLeds::setPixel(uint8_t channelNumber, Color color, uint16_t index) {
     return;
   }
 
-  auto controller = channels[channelNumber];
-  if (controller == nullptr)
-    return;
-
-  (*controller)[index] = color;
+  frames[channelNumber][index] = color;
+  markDirty(channelNumber);
 }
 
 Color AmpLeds::getPixel(uint8_t channelNumber, uint16_t index) {
@@ -127,23 +310,33 @@ Color AmpLeds::getPixel(uint8_t channelNumber, uint16_t index) {
     return lightOff;
   }
 
-  auto controller = channels[channelNumber];
-  if (controller == nullptr)
-    return lightOff;
-
-  return (*controller)[index];
+  return frames[channelNumber][index];
 }
 
 void AmpLeds::setPixels(uint8_t channelNumber, Color color, uint16_t start, uint16_t end) {
   ledsReady.wait();
-  auto controller = channels[channelNumber];
-  if (controller == nullptr)
+  auto& frame = frames[channelNumber];
+  if (frame.empty())
     return;
   
   for (uint16_t i = start; i < end; i++) {
     if (i < leds[channelNumber])
-      (*controller)[i] = color;
+      frame[i] = color;
     else
       ESP_LOGE(LEDS_TAG, "Pixel %d exceeds channel %d led count (%d)", i, channelNumber, leds[channelNumber]);
   }
-}
\ No newline at end of file
+
+  markDirty(channelNumber);
+}
+void AmpLeds::setFrame(uint8_t channelNumber, const std::vector<Color> &pixels) {
+  ledsReady.wait();
+  auto& frame = frames[channelNumber];
+  if (frame.empty())
+    return;
+
+  auto count = std::min(frame.size(), pixels.size());
+
+  std::copy(pixels.begin(), pixels.begin() + count, frame.begin());
+
+  markDirty(channelNumber);
+}
@@ -1,56 +1,153 @@
-#include <hal/amp-1.0.0/amp-power.h>
-
-void AmpPower::init() {
-  gpio_config_t io_config;
-
-  // power hold
-  io_config.intr_type = GPIO_INTR_DISABLE;
-  io_config.mode = GPIO_MODE_INPUT_OUTPUT;
-  io_config.pull_down_en = GPIO_PULLDOWN_DISABLE;
-  io_config.pull_up_en = GPIO_PULLUP_DISABLE;
-  io_config.pin_bit_mask = 0;
-  io_config.pin_bit_mask = IO_PIN_SELECT(POWER_HOLD);
-  auto ret = gpio_config(&io_config);
-  ESP_ERROR_CHECK(ret);
-
-  // input pin setup w/o interrupt
-  io_config.intr_type = GPIO_INTR_DISABLE;
-  io_config.mode = GPIO_MODE_INPUT;
-  io_config.pull_down_en = GPIO_PULLDOWN_DISABLE;
-  io_config.pull_up_en = GPIO_PULLUP_DISABLE;
-
-  io_config.pin_bit_mask = 0;
-  io_config.pin_bit_mask = 
-      IO_PIN_SELECT(VBAT_SENSE) |
-      IO_PIN_SELECT(BAT_CHRG)   |
-      IO_PIN_SELECT(BAT_DONE);
-  ret = gpio_config(&io_config);
-  ESP_ERROR_CHECK(ret);
-
-  // set the power hold on the STM6601 power supervisor
-  gpio_set_level(POWER_HOLD, 1);
-  gpio_hold_en(POWER_HOLD);
-
-  adc1_config_width(ADC_WIDTH_BIT_12);
-  adc1_config_channel_atten(ADC1_CHANNEL_3, ADC_ATTEN_DB_0);
-}
-
-void AmpPower::process() {
-  // TODO: add pull up resistor to done and charge inputs
-  charging = !gpio_get_level(BAT_CHRG);
-  // done = !gpio_get_level(BAT_DONE);
-
-  batteryAdcReading = adc1_get_raw(ADC1_CHANNEL_3);
-  batteryReading = (float)batteryAdcReading / 500.f;
-  batteryReading = std::min(batteryReading, 4.2f);
-  done = batteryReading >= 4.15f;
-  
-  batteryPresent = batteryReading >= 2.5;
-  batteryLevel = percentageFromReading(batteryReading);
-}
-
-void AmpPower::deinit() {
-  // release the power hold on the STM6601 power supervisor
-  gpio_hold_dis(POWER_HOLD);
-  gpio_set_level(POWER_HOLD, 0);
+#include <hal/amp-1.0.0/amp-power.h>
+
+void AmpPower::init() {
+  gpio_config_t io_config;
+
+  // power hold
+  io_config.intr_type = GPIO_INTR_DISABLE;
+  io_config.mode = GPIO_MODE_INPUT_OUTPUT;
+  io_config.pull_down_en = GPIO_PULLDOWN_DISABLE;
+  io_config.pull_up_en = GPIO_PULLUP_DISABLE;
+  io_config.pin_bit_mask = 0;
+  io_config.pin_bit_mask = IO_PIN_SELECT(POWER_HOLD);
+  auto ret = gpio_config(&io_config);
+  ESP_ERROR_CHECK(ret);
+
+  // input pin setup w/o interrupt
+  io_config.intr_type = GPIO_INTR_DISABLE;
+  io_config.mode = GPIO_MODE_INPUT;
+  io_config.pull_down_en = GPIO_PULLDOWN_DISABLE;
+  io_config.pull_up_en = GPIO_PULLUP_DISABLE;
+
+  io_config.pin_bit_mask = 0;
+  io_config.pin_bit_mask = 
+      IO_PIN_SELECT(VBAT_SENSE) |
+      IO_PIN_SELECT(BAT_CHRG)   |
+      IO_PIN_SELECT(BAT_DONE);
+  ret = gpio_config(&io_config);
+  ESP_ERROR_CHECK(ret);
+
+  // the button and the IMU both come up on their own tasks and only add handlers,
+  // so the isr service is installed once here before any of them start
+  ret = gpio_install_isr_service(ESP_INTR_FLAG_LEVEL1);
+  if (ret != ESP_ERR_INVALID_STATE)
+    ESP_ERROR_CHECK(ret);
+
+  // set the power hold on the STM6601 power supervisor
+  gpio_set_level(POWER_HOLD, 1);
+  gpio_hold_en(POWER_HOLD);
+
+  adc1_config_width(ADC_WIDTH_BIT_12);
+  adc1_config_channel_atten(ADC1_CHANNEL_3, ADC_ATTEN_DB_0);
+
+  // uses the reference burned into efuse when there is one
+  auto calibration = esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_0, ADC_WIDTH_BIT_12, BATTERY_DEFAULT_VREF, &adcCharacteristics);
+  ESP_LOGD(PM_TAG, "Battery ADC calibrated from %s", calibration == ESP_ADC_CAL_VAL_EFUSE_VREF ? "efuse vref"
+    : calibration == ESP_ADC_CAL_VAL_EFUSE_TP ? "efuse two point" : "default vref");
+
+  lastChargeChange = millis();
+
+  configurePowerManagement();
+}
+
+/*
+  Scales the cpu down whenever nothing holds a PowerLock and lets tickless idle
+  light sleep between ticks. With the controller on the main crystal it holds off
+  light sleep itself while bluetooth is up, so in practice that's frequency scaling
+  until a 32kHz crystal is fitted
+*/
+void AmpPower::configurePowerManagement() {
+#if defined(CONFIG_PM_ENABLE)
+  esp_pm_config_esp32_t config;
+  config.max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+  config.min_freq_mhz = POWER_MIN_FREQ_MHZ;
+#if defined(CONFIG_FREERTOS_USE_TICKLESS_IDLE)
+  config.light_sleep_enable = true;
+#else
+  config.light_sleep_enable = false;
+#endif
+
+  auto ret = esp_pm_configure(&config);
+  if (ret != ESP_OK)
+    ESP_LOGW(PM_TAG, "Unable to configure power management: %s", esp_err_to_name(ret));
+#endif
+}
+
+/*
+  The charger pins are cheap and read every pass, the battery is only sampled
+  when it's due: quickly for a while after the charger changes state so the
+  level settles, every few seconds otherwise
+*/
+void AmpPower::process() {
+  // TODO: add pull up resistor to done and charge inputs
+  bool nowCharging = !gpio_get_level(BAT_CHRG);
+  if (nowCharging != charging)
+    lastChargeChange = millis();
+  charging = nowCharging;
+
+  auto now = millis();
+  auto interval = now - lastChargeChange < BATTERY_FAST_WINDOW ? BATTERY_FAST_INTERVAL : BATTERY_SLOW_INTERVAL;
+  if (batteryReading == 0 || now - lastSample >= interval) {
+    lastSample = now;
+    sampleBattery();
+  }
+}
+
+/*
+  Median of a burst of raw reads, converted through the calibration curve
+*/
+uint32_t AmpPower::readBatteryMillivolts() {
+  int raw[BATTERY_OVERSAMPLE];
+  for (uint8_t i = 0; i < BATTERY_OVERSAMPLE; i++)
+    raw[i] = adc1_get_raw(ADC1_CHANNEL_3);
+
+  std::nth_element(raw, raw + BATTERY_OVERSAMPLE / 2, raw + BATTERY_OVERSAMPLE);
+  batteryAdcReading = raw[BATTERY_OVERSAMPLE / 2];
+
+  return esp_adc_cal_raw_to_voltage(batteryAdcReading, &adcCharacteristics) * BATTERY_DIVIDER_RATIO;
+}
+
+void AmpPower::sampleBattery() {
+  float reading = readBatteryMillivolts() / 1000.f;
+
+  // nothing to average against at boot or when a battery has just been plugged in
+  if (batteryReading < 2.5f || reading < 2.5f)
+    batteryReading = reading;
+  else
+    batteryReading += (reading - batteryReading) * BATTERY_FILTER_WEIGHT;
+
+  float voltage = std::min(batteryReading, 4.2f);
+  done = voltage >= 4.15f;
+  batteryPresent = voltage >= 2.5f;
+  batteryLevel = percentageFromReading(voltage);
+}
+
+esp_sleep_wakeup_cause_t AmpPower::lightSleep() {
+  // wake on IMU activity or a button press
+#if defined(IMU_INT1)
+  gpio_wakeup_enable(IMU_INT1, GPIO_INTR_HIGH_LEVEL);
+#endif
+  gpio_wakeup_enable(BUTTON_INPUT, GPIO_INTR_LOW_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+
+  esp_light_sleep_start();
+
+#if defined(IMU_INT1)
+  gpio_wakeup_disable(IMU_INT1);
+#endif
+  gpio_wakeup_disable(BUTTON_INPUT);
+
+  // the wakeup config switches the pins to level interrupts, put the edge triggers back
+#if defined(IMU_INT1)
+  gpio_set_intr_type(IMU_INT1, GPIO_INTR_POSEDGE);
+#endif
+  gpio_set_intr_type(BUTTON_INPUT, GPIO_INTR_ANYEDGE);
+
+  return esp_sleep_get_wakeup_cause();
+}
+
+void AmpPower::deinit() {
+  // release the power hold on the STM6601 power supervisor
+  gpio_hold_dis(POWER_HOLD);
+  gpio_set_level(POWER_HOLD, 0);
 }
\ No newline at end of file
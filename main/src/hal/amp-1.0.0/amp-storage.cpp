@@ -9,6 +9,11 @@ esp_vfs_spiffs_conf_t AmpStorage::conf = {
   .format_if_mount_failed = true
 };
 
+std::map<std::string, PendingSetting> AmpStorage::pending;
+FreeRTOS::Semaphore AmpStorage::pendingLock = FreeRTOS::Semaphore("settings");
+FreeRTOS::Semaphore AmpStorage::flushLock = FreeRTOS::Semaphore("settingsFlush");
+TaskHandle_t AmpStorage::writerHandle = NULL;
+
 bool AmpStorage::init() {
   // NVS
   auto err = nvs_flash_init();
@@ -17,15 +22,115 @@ bool AmpStorage::init() {
       err = nvs_flash_init();
   }
 
+  if (writerHandle == NULL)
+    Tasks::create(TaskStorageWriter, writerTask, NULL, &writerHandle);
+
   // SPIFFS
   err = esp_vfs_spiffs_register(&conf);
   return err == ESP_OK;
 }
 
 void AmpStorage::deinit() {
+  flush();
   esp_vfs_spiffs_unregister(conf.partition_label);
 }
 
+/*
+  Records a setting for the writer task. Only the map is touched under the
+  lock, the caller never waits on flash
+*/
+void AmpStorage::queue(const char* key, const PendingSetting &setting) {
+  pendingLock.take(STORAGE_TAG);
+  pending[key] = setting;
+  pendingLock.give();
+
+  wakeWriter();
+}
+
+// saves made before init are picked up by the first flush
+void AmpStorage::wakeWriter() {
+  if (writerHandle != NULL)
+    xTaskNotifyGive(writerHandle);
+}
+
+bool AmpStorage::pendingValue(const char* key, PendingSetting *setting) {
+  pendingLock.take(STORAGE_TAG);
+  auto it = pending.find(key);
+  bool found = it != pending.end();
+  if (found)
+    *setting = it->second;
+  pendingLock.give();
+
+  return found;
+}
+
+void AmpStorage::flush() {
+  flushLock.take(STORAGE_TAG);
+
+  // copied rather than taken, reads keep seeing the batch until it's committed
+  pendingLock.take(STORAGE_TAG);
+  std::map<std::string, PendingSetting> batch = pending;
+  pendingLock.give();
+
+  if (batch.empty()) {
+    flushLock.give();
+    return;
+  }
+
+  nvs_handle handle;
+  auto err = nvs_open(storage, NVS_READWRITE, &handle);
+  if (err == ESP_OK) {
+    // a key that couldn't be set leaves the batch so it stays pending, whatever the commit does
+    for (auto it = batch.begin(); it != batch.end();) {
+      auto& setting = it->second;
+      esp_err_t set;
+      if (setting.type == SettingU8)
+        set = nvs_set_u8(handle, it->first.c_str(), setting.value);
+      else if (setting.type == SettingU32)
+        set = nvs_set_u32(handle, it->first.c_str(), setting.value);
+      else
+        set = nvs_set_str(handle, it->first.c_str(), setting.text.c_str());
+
+      if (set != ESP_OK) {
+        ESP_LOGW(STORAGE_TAG, "Unable to save %s to NVS", it->first.c_str());
+        it = batch.erase(it);
+      }
+      else
+        ++it;
+    }
+
+    // one commit for the whole batch, values saved together land together
+    err = nvs_commit(handle);
+    nvs_close(handle);
+  }
+
+  if (err != ESP_OK)
+    ESP_LOGW(STORAGE_TAG, "Unable to commit %d settings to NVS", batch.size());
+  else
+    ESP_LOGD(STORAGE_TAG, "Committed %d settings", batch.size());
+
+  // a failed batch stays pending for the next flush, as does anything saved again mid commit
+  pendingLock.take(STORAGE_TAG);
+  for (auto const& [key, setting] : batch) {
+    auto it = pending.find(key);
+    if (err == ESP_OK && it != pending.end() && it->second.value == setting.value && it->second.text == setting.text)
+      pending.erase(it);
+  }
+  pendingLock.give();
+
+  flushLock.give();
+}
+
+void AmpStorage::writerTask(void *parameters) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // the first save of a burst wakes the writer, the rest arrive while it waits
+    vTaskDelay(Tasks::period(TaskStorageWriter));
+    flush();
+  }
+}
+
 std::string AmpStorage::getHardwareRevision() {
   uint32_t hardwareRevisionBytes = __builtin_bswap32(REG_READ(EFUSE_BLK3_RDATA0_REG));
   uint8_t HARDWARE_REVISION_MAJOR = (hardwareRevisionBytes >> (8*3)) & 0xff;
@@ -68,7 +173,7 @@ FILE* AmpStorage::openFile(std::string filename, std::string attributes) {
 }
 
 std::string AmpStorage::readFile(std::string filename) {
-  FILE* file = fopen(filename.c_str(), "r");
+  FILE* file = fopen(filename.c_str(), "rb");
 
   if (file == NULL) {
     ESP_LOGE(STORAGE_TAG, "Could not open file: %s", filename.c_str());
@@ -79,9 +184,11 @@ std::string AmpStorage::readFile(std::string filename) {
   stat(filename.c_str(), &st);
   auto size = st.st_size;
 
-  char* buffer[size + 1];
-  fread((uint8_t*)&buffer, 1, size, file);
-  std::string data((char*)buffer, size + 1);
+  // on the heap, configs are far too big for the caller's stack
+  std::string data(size, '\0');
+  auto read = fread(&data[0], 1, size, file);
+  fclose(file);
+  data.resize(read);
 
   return data;
 }
@@ -116,9 +223,9 @@ void AmpStorage::saveTurnZero(float value) {
 }
 
 void AmpStorage::saveAccelBias(Vector3D *bias) {
-  saveFloat("accel-bias-x", bias->x);
-  saveFloat("accel-bias-y", bias->y);
-  saveFloat("accel-bias-z", bias->z);  
+  const char* keys[] = { "accel-bias-x", "accel-bias-y", "accel-bias-z" };
+  const float values[] = { bias->x, bias->y, bias->z };
+  saveFloats(keys, values, 3);
 }
 
 void AmpStorage::getAccelBias(Vector3D *bias) {
@@ -135,6 +242,12 @@ float AmpStorage::getFloat(const char *key, float defaultValue) {
     uint32_t raw;
   } converter;
 
+  PendingSetting setting;
+  if (pendingValue(key, &setting)) {
+    converter.raw = setting.value;
+    return converter.decimal;
+  }
+
   // open NVS
   auto err = nvs_open(storage, NVS_READWRITE, &handle);
 
@@ -152,47 +265,102 @@ float AmpStorage::getFloat(const char *key, float defaultValue) {
 }
 
 void AmpStorage::saveFloat(const char* key, float value) {
-  nvs_handle handle;
-
   union {
     float decimal;
     uint32_t raw;
   } converter;
 
   converter.decimal = value;
+  queue(key, { SettingU32, converter.raw, "" });
+}
 
-  // open NVS
-  auto err = nvs_open(storage, NVS_READWRITE, &handle);
+// queued under one lock, so the values always share a batch and a commit
+void AmpStorage::saveFloats(const char** keys, const float* values, size_t count) {
+  union {
+    float decimal;
+    uint32_t raw;
+  } converter;
 
-  // set uint32_t cast of value
-  err = nvs_set_u32(handle, key, converter.raw);
+  pendingLock.take(STORAGE_TAG);
+  for (size_t i = 0; i < count; i++) {
+    converter.decimal = values[i];
+    pending[keys[i]] = { SettingU32, converter.raw, "" };
+  }
+  pendingLock.give();
 
-  // commit changes
-  err = nvs_commit(handle);
+  wakeWriter();
+}
+
+void AmpStorage::saveUpdateProgress(const UpdateProgress &progress) {
+  nvs_handle handle;
+
+  auto err = nvs_open(storage, NVS_READWRITE, &handle);
+  if (err == ESP_OK) {
+    err = nvs_set_blob(handle, "ota-progress", &progress, sizeof(UpdateProgress));
+    if (err == ESP_OK)
+      err = nvs_commit(handle);
+    nvs_close(handle);
+  }
 
-  nvs_close(handle);
-  
   if (err != ESP_OK)
-    ESP_LOGW(STORAGE_TAG, "Unable to save %s to NVS", key);
+    ESP_LOGW(STORAGE_TAG, "Unable to save update progress to NVS");
 }
 
-void AmpStorage::saveString(std::string key, std::string value) {
+bool AmpStorage::getUpdateProgress(UpdateProgress *progress) {
   nvs_handle handle;
-  
+  size_t size = sizeof(UpdateProgress);
+
   auto err = nvs_open(storage, NVS_READWRITE, &handle);
-  err = nvs_set_str(handle, key.c_str(), value.c_str());
+  if (err == ESP_OK) {
+    err = nvs_get_blob(handle, "ota-progress", progress, &size);
+    nvs_close(handle);
+  }
+
+  return err == ESP_OK && size == sizeof(UpdateProgress);
+}
 
-  err = nvs_commit(handle);
+void AmpStorage::clearUpdateProgress() {
+  nvs_handle handle;
 
-  nvs_close(handle);
+  if (nvs_open(storage, NVS_READWRITE, &handle) == ESP_OK) {
+    if (nvs_erase_key(handle, "ota-progress") == ESP_OK)
+      nvs_commit(handle);
+    nvs_close(handle);
+  }
+}
 
-  if (err != ESP_OK)
-    ESP_LOGW(STORAGE_TAG, "Unable to save %s:%s to NVS", key.c_str(), value.c_str());
+uint8_t AmpStorage::getActivePreset(uint8_t defaultValue) {
+  nvs_handle handle;
+  uint8_t slot = defaultValue;
+
+  PendingSetting setting;
+  if (pendingValue("preset", &setting))
+    return setting.value;
+
+  if (nvs_open(storage, NVS_READONLY, &handle) == ESP_OK) {
+    if (nvs_get_u8(handle, "preset", &slot) != ESP_OK)
+      slot = defaultValue;
+    nvs_close(handle);
+  }
+
+  return slot;
+}
+
+void AmpStorage::saveActivePreset(uint8_t slot) {
+  queue("preset", { SettingU8, slot, "" });
+}
+
+void AmpStorage::saveString(std::string key, std::string value) {
+  queue(key.c_str(), { SettingString, 0, value });
 }
 
 std::string AmpStorage::getString(std::string key) {
   nvs_handle handle;
 
+  PendingSetting setting;
+  if (pendingValue(key.c_str(), &setting))
+    return setting.text;
+
   // open NVS
   auto err = nvs_open(storage, NVS_READWRITE, &handle);
 
@@ -1,14 +1,16 @@
 #include <hal/ble.h>
 
 FreeRTOS::Semaphore BluetoothLE::bleReady = FreeRTOS::Semaphore("ble");
+volatile bool BluetoothLE::ready = false;
 
 BluetoothLE::BluetoothLE() {
-  touchEventQueue = xQueueCreate(10, sizeof(std::vector<TouchType>));
+  EventBus::instance()->subscribe(this, EVENT_MASK(EventTouchSequence));
+  connectQueue = xQueueCreate(BLE_CONNECT_QUEUE, sizeof(uint16_t));
   bleReady.take();
 }
 
 void BluetoothLE::onPowerUp() {
-  xTaskCreatePinnedToCore(startServer, "ble-server", 4096, NULL, 3, &bleTaskHandle, 0);
+  Tasks::create(TaskBle, startServer, NULL, &bleTaskHandle);
 }
 
 void BluetoothLE::onPowerDown() {
@@ -16,12 +18,18 @@ void BluetoothLE::onPowerDown() {
 }
 
 void BluetoothLE::process() {
-  if (uxQueueMessagesWaiting(touchEventQueue)) {
-    xQueueReceive(touchEventQueue, &touches, 0);
-
-    onTouchEvent(&touches);
+  dispatchEvents();
+
+  // new connections pick up whatever the link is at before it's reconsidered
+  uint16_t conn;
+  while (xQueueReceive(connectQueue, &conn, 0) == pdTRUE) {
+    if (std::find(connections.begin(), connections.end(), conn) == connections.end())
+      connections.push_back(conn);
+    applyLinkPolicy(conn, fastLink);
   }
 
+  updateLinkPolicy();
+
   if (publicAdvertising && millis() - publicAdvertiseStart >= PUBLIC_ADVERTISEMENT_MS) {
     notifyListeners(false);
     // updateAdvertising(AmpStorage::getDeviceName(), false);
@@ -43,11 +51,12 @@ void BluetoothLE::startServer(void *params) {
   ble->advertising = ble->server->getAdvertising();
   ble->server->start();
   ble->server->setCallbacks(ble, true);
+  ready = true;
   bleReady.give();
 
   for (;;) {
     ble->process();
-    delay(1000);
+    xTaskNotifyWait(0, UINT32_MAX, NULL, Tasks::period(TaskBle));
   }
 }
 
@@ -109,9 +118,15 @@ void BluetoothLE::onConnect(NimBLEServer *server, ble_gap_conn_desc *desc) {
       auto addr = desc->peer_id_addr.val;
       ESP_LOGD(BLE_TAG, "Not bonded to device %02X:%02X:%02X:%02X:%02X:%02X - disconnecting", addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
       server->disconnect(desc->conn_handle);
+      advertising->start();
+      return;
     }
   }
 
+  // this is the host task, the ble task applies the policy
+  xQueueSend(connectQueue, &desc->conn_handle, 0);
+  xTaskNotify(bleTaskHandle, BLE_LINK_WAKE_BIT, eSetBits);
+
   advertising->start();
 }
 
@@ -119,23 +134,88 @@ void BluetoothLE::onDisconnect(NimBLEServer *server) {
   advertising->start();
 }
 
-void BluetoothLE::onTouchEvent(std::vector<TouchType> *touches) {
-  if (touches->size() == 3) {
+/*
+  Demand bits are only ever set, they just say the timestamp next to them is
+  real. Expiry is down to the timestamps alone, so a refresh landing mid check
+  can't be wiped out
+*/
+uint8_t BluetoothLE::activeDemand() {
+  uint8_t requested = linkDemand.load();
+  uint8_t active = 0;
+  auto now = millis();
+
+  for (uint8_t i = 0; i < 3; i++)
+    if ((requested & (1 << i)) && now - linkDemandAt[i] < BLE_FAST_LINK_HOLD_MS)
+      active |= 1 << i;
+
+  return active;
+}
+
+void BluetoothLE::applyLinkPolicy(uint16_t conn, bool fast) {
+  if (fast) {
+    server->updateConnParams(conn, BLE_FAST_INTERVAL_MIN, BLE_FAST_INTERVAL_MAX, BLE_FAST_LATENCY, BLE_FAST_TIMEOUT);
+    ble_gap_set_prefered_le_phy(conn, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_CODED_ANY);
+  }
+  else {
+    // 1M idles with the better range, slave latency lets the radio skip most events
+    server->updateConnParams(conn, BLE_IDLE_INTERVAL_MIN, BLE_IDLE_INTERVAL_MAX, BLE_IDLE_LATENCY, BLE_IDLE_TIMEOUT);
+    ble_gap_set_prefered_le_phy(conn, BLE_GAP_LE_PHY_1M_MASK, BLE_GAP_LE_PHY_1M_MASK, BLE_GAP_LE_PHY_CODED_ANY);
+  }
+}
+
+/*
+  Moves every connection to the policy when it changes, dropping handles that
+  have since disconnected
+*/
+void BluetoothLE::updateLinkPolicy() {
+  bool fast = activeDemand() != 0;
+  if (fast == fastLink)
+    return;
+
+  fastLink = fast;
+  ESP_LOGD(BLE_TAG, "Switching to %s link", fast ? "fast" : "idle");
+  fast ? linkLock.acquire() : linkLock.release();
+
+  for (auto it = connections.begin(); it != connections.end();) {
+    struct ble_gap_conn_desc desc;
+    if (ble_gap_conn_find(*it, &desc) != 0) {
+      it = connections.erase(it);
+      continue;
+    }
+
+    applyLinkPolicy(*it, fast);
+    ++it;
+  }
+}
+
+void BluetoothLE::requestFastLink(BleLinkDemand demand) {
+  for (uint8_t i = 0; i < 3; i++)
+    if (demand & (1 << i))
+      linkDemandAt[i] = millis();
+
+  linkDemand.fetch_or(demand);
+
+  // refreshing is just the timestamp, the switch itself happens on the ble task
+  if (!fastLink && bleTaskHandle != NULL)
+    xTaskNotify(bleTaskHandle, BLE_LINK_WAKE_BIT, eSetBits);
+}
+
+void BluetoothLE::onEvent(const Event &event) {
+  if (event.type == EventTouchSequence)
+    onTouchEvent(event.as<TouchSequence>());
+}
+
+void BluetoothLE::onTouchEvent(const TouchSequence &touches) {
+  if (touches.size() == 3) {
     notifyListeners(true);
     updateAdvertising(AmpStorage::getDeviceName(), true);
     NimBLEDevice::setSecurityAuth(true, true, true);
   }
 }
 
-void BluetoothLE::addAdvertisingListener(BleListener *listener) {
-  listeners.push_back(listener);
-}
-
 void BluetoothLE::notifyListeners(bool isPublic) {
   publicAdvertising = isPublic;
   publicAdvertiseStart = millis();
 
-  for (auto listener : listeners)
-    if (listener->advertisingQueue != NULL)
-      xQueueSend(listener->advertisingQueue, &isPublic, 0);
+  EventBus::instance()->publish(EventAdvertising, isPublic);
 }
\ No newline at end of file
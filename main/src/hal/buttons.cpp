@@ -2,7 +2,7 @@
 
 void Buttons::onPowerUp() {
   ampButtons.init(this);
-  xTaskCreatePinnedToCore(inputTask, "buttons", 2048, this, 2, &inputTaskHandle, 1);
+  Tasks::create(TaskButtons, inputTask, this, &inputTaskHandle);
 }
 
 void Buttons::onPowerDown() {
@@ -12,40 +12,50 @@ void Buttons::onPowerDown() {
 }
 
 void Buttons::process() {
-  ampButtons.process();
+  ampButtons.process(inputTimeout());
 
   if (touchEnd > touchStart && millis() - touchEnd > touchEventTimeout && touches.size() > 0) {
     ESP_LOGD(BUTTONS_TAG,"Touch interaction ended. Touches: %d", touches.size());
 
-    for (auto listener : touchListeners)
-      if (listener->touchEventQueue != NULL)
-        xQueueSendToBack(listener->touchEventQueue, &touches, 0);
+    EventBus::instance()->publish(EventTouchSequence, touches);
 
     // reset touches
     touches.clear();
   }
 }
 
-void Buttons::onTouchDown() {
-  touchStart = millis();
+/*
+  Sleeps on the button interrupt, only waking early to close the interaction
+  once the button has been left alone for touchEventTimeout
+*/
+TickType_t Buttons::inputTimeout() {
+  if (touches.size() == 0 || touchEnd < touchStart)
+    return portMAX_DELAY;
+
+  long idle = (long) (millis() - touchEnd);
+  if (idle >= touchEventTimeout)
+    return 0;
+
+  return pdMS_TO_TICKS(touchEventTimeout - idle) + 1;
+}
+
+void Buttons::onTouchDown(unsigned long time) {
+  touchStart = time;
   ESP_LOGD(BUTTONS_TAG,"Primary Button: Pressed");
 
-  bool touch = true;
-  for (auto listener : touchListeners)
-    if (listener->touchQueue != NULL)
-      xQueueSendToBack(listener->touchQueue, &touch, 0);
+  EventBus::instance()->publish(EventTouch, true);
 }
 
-void Buttons::onTouchUp() {
+/*
+  Taps and holds are told apart by the edge times, so a busy core delaying
+  this task doesn't turn a tap into a hold or merge a multi tap
+*/
+void Buttons::onTouchUp(unsigned long time) {
   if (touchEnd < touchStart) {
-    touchEnd = millis();
+    touchEnd = time;
     ESP_LOGD(BUTTONS_TAG,"Primary Button: Released");
 
-    bool touch = false;
-    for (auto listener : touchListeners)
-      if (listener->touchQueue != NULL)
-        xQueueSendToBack(listener->touchQueue, &touch, 0);
-      // listener->onTouchUp();
+    EventBus::instance()->publish(EventTouch, false);
 
     long duration = touchEnd - touchStart;
     TouchType type = duration < holdDuration ? Tap : Hold;
@@ -53,16 +63,11 @@ void Buttons::onTouchUp() {
   }
 }
 
-void Buttons::addTouchListener(TouchListener *listener) {
-  touchListeners.push_back(listener);
-}
-
 void Buttons::inputTask(void *parameters) {
   Buttons *buttons = (Buttons*)parameters;
 
   for (;;) {
     Power::powerDown.wait("power");
     buttons->process();
-    delay(10);
   }
 }
\ No newline at end of file
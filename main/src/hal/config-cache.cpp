@@ -0,0 +1,309 @@
+#include <hal/config-cache.h>
+#include <sys/stat.h>
+#include <type_traits>
+
+static_assert(std::is_trivially_copyable<MotionConfig>::value, "MotionConfig is written to the config cache as is");
+static_assert(std::is_trivially_copyable<LightChannel>::value, "LightChannel is written to the config cache as is");
+static_assert(std::is_trivially_copyable<LightSection>::value, "LightSection is written to the config cache as is");
+static_assert(std::is_trivially_copyable<LightPixel>::value, "LightPixel is written to the config cache as is");
+static_assert(std::is_trivially_copyable<LightingParameters>::value, "LightingParameters is written to the config cache as is");
+
+struct ConfigCacheHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t sourceHash;
+  uint32_t bodyHash;
+  uint32_t length;
+};
+
+template <typename T>
+static void append(std::string &out, const T *values, size_t count = 1) {
+  out.append((const char*) values, sizeof(T) * count);
+}
+
+static void appendName(std::string &out, const std::string &name) {
+  uint8_t length = std::min(name.length(), (size_t) UINT8_MAX);
+  append(out, &length);
+  out.append(name, 0, length);
+}
+
+// count (1) + { length (2), string }
+static void appendStrings(std::string &out, const std::vector<std::string> &strings) {
+  uint8_t count = std::min(strings.size(), (size_t) UINT8_MAX);
+  append(out, &count);
+  for (uint8_t i = 0; i < count; i++) {
+    uint16_t length = std::min(strings[i].length(), (size_t) UINT16_MAX);
+    append(out, &length);
+    out.append(strings[i], 0, length);
+  }
+}
+
+/*
+  Bounds checked cursor over the image body
+*/
+struct ConfigCacheReader {
+  const uint8_t *_data;
+  size_t _length;
+  size_t _offset = 0;
+  bool valid = true;
+
+  ConfigCacheReader(const uint8_t *data, size_t length) : _data(data), _length(length) { }
+
+  template <typename T>
+  bool read(T *values, size_t count = 1) {
+    size_t size = sizeof(T) * count;
+    if (!valid || _length - _offset < size)
+      return valid = false;
+
+    memcpy((void*) values, _data + _offset, size);
+    _offset += size;
+    return true;
+  }
+
+  bool readName(std::string &name) {
+    uint8_t length;
+    if (!read(&length) || _length - _offset < length)
+      return valid = false;
+
+    name.assign((const char*) _data + _offset, length);
+    _offset += length;
+    return true;
+  }
+
+  bool readStrings(std::vector<std::string> &strings) {
+    uint8_t count = 0;
+    read(&count);
+    for (uint8_t i = 0; i < count && valid; i++) {
+      uint16_t length = 0;
+      if (!read(&length) || _length - _offset < length)
+        return valid = false;
+
+      strings.emplace_back((const char*) _data + _offset, length);
+      _offset += length;
+    }
+
+    return valid;
+  }
+};
+
+// fnv-1a
+uint32_t ConfigCache::hash(const uint8_t *data, size_t length, uint32_t seed) {
+  uint32_t hash = seed;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+// everything that changes the image layout
+uint32_t ConfigCache::layoutSeed() {
+  const uint32_t layout[] = {
+    CONFIG_CACHE_VERSION,
+    sizeof(MotionConfig), sizeof(LightChannel), sizeof(LightSection),
+    sizeof(LightPixel), sizeof(LightingParameters)
+  };
+
+  uint32_t seed = hash((const uint8_t*) layout, sizeof(layout));
+  return hash((const uint8_t*) FIRMWARE_VERSION, strlen(FIRMWARE_VERSION), seed);
+}
+
+/*
+  Hash of a source config, seeded with the layout
+*/
+uint32_t ConfigCache::hash(const std::string &data) {
+  return hash((const uint8_t*) data.data(), data.length(), layoutSeed());
+}
+
+bool ConfigCache::hashFile(std::string path, uint32_t *hash) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == NULL)
+    return false;
+
+  uint8_t block[CONFIG_CACHE_BLOCK_SIZE];
+  uint32_t value = layoutSeed();
+  size_t total = 0, read;
+  while ((read = fread(block, 1, sizeof(block), file)) > 0) {
+    value = ConfigCache::hash(block, read, value);
+    total += read;
+  }
+
+  bool ok = !ferror(file) && total > 0;
+  fclose(file);
+
+  *hash = value;
+  return ok;
+}
+
+bool ConfigCache::save(std::string path, uint32_t sourceHash, const AmpConfig &config) {
+  std::string body;
+  body.reserve(2048);
+
+  append(body, &config.motion);
+
+  uint8_t channels = config.lights.channels.size();
+  append(body, &channels);
+  for (auto const& [id, channel] : config.lights.channels)
+    append(body, &channel);
+
+  uint8_t regions = config.lights.regions.size();
+  append(body, &regions);
+  for (auto const& region : config.lights.regions) {
+    appendName(body, region.name);
+
+    uint8_t sections = region.sections.size();
+    append(body, &sections);
+    append(body, region.sections.data(), sections);
+
+    uint32_t pixels = region.pixels.size();
+    append(body, &pixels);
+    append(body, region.pixels.data(), pixels);
+  }
+
+  uint8_t actions = std::min(config.actions.size(), (size_t) UINT8_MAX);
+  append(body, &actions);
+  for (auto const& [name, effects] : config.actions) {
+    if (actions-- == 0)
+      break;
+
+    appendName(body, name);
+
+    uint16_t count = effects.size();
+    append(body, &count);
+    if (count > 0)
+      append(body, effects.data(), count);
+  }
+
+  appendStrings(body, config.lights.patterns);
+  appendStrings(body, config.lights.palettes);
+
+  ConfigCacheHeader header;
+  header.magic = CONFIG_CACHE_MAGIC;
+  header.version = CONFIG_CACHE_VERSION;
+  header.reserved = 0;
+  header.sourceHash = sourceHash;
+  header.bodyHash = hash((const uint8_t*) body.data(), body.length());
+  header.length = body.length();
+
+  // write alongside and swap in, so a brownout mid write never leaves a half image
+  std::string temp = path + ".tmp";
+  FILE *file = fopen(temp.c_str(), "wb");
+  if (file == NULL) {
+    ESP_LOGW(CONFIG_CACHE_TAG, "Unable to open %s", temp.c_str());
+    return false;
+  }
+
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1
+    && fwrite(body.data(), 1, body.length(), file) == body.length();
+  fclose(file);
+
+  struct stat st;
+  if (written && stat(path.c_str(), &st) == 0)
+    unlink(path.c_str());
+
+  if (!written || rename(temp.c_str(), path.c_str()) != 0) {
+    ESP_LOGW(CONFIG_CACHE_TAG, "Unable to write config cache");
+    unlink(temp.c_str());
+    return false;
+  }
+
+  ESP_LOGD(CONFIG_CACHE_TAG, "Wrote %d byte config cache", sizeof(header) + body.length());
+  return true;
+}
+
+bool ConfigCache::load(std::string path, uint32_t sourceHash, AmpConfig &config) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == NULL)
+    return false;
+
+  ConfigCacheHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != CONFIG_CACHE_MAGIC
+    || header.version != CONFIG_CACHE_VERSION || header.sourceHash != sourceHash) {
+    ESP_LOGD(CONFIG_CACHE_TAG, "Config cache is stale");
+    fclose(file);
+    return false;
+  }
+
+  std::string body(header.length, '\0');
+  bool read = fread(&body[0], 1, header.length, file) == header.length;
+  fclose(file);
+
+  if (!read || hash((const uint8_t*) body.data(), body.length()) != header.bodyHash) {
+    ESP_LOGW(CONFIG_CACHE_TAG, "Config cache is corrupt");
+    return false;
+  }
+
+  ConfigCacheReader reader((const uint8_t*) body.data(), body.length());
+  MotionConfig motion;
+  LightsConfig lights;
+  std::map<std::string, std::vector<LightingParameters>> actions;
+
+  reader.read(&motion);
+
+  uint8_t channels = 0;
+  reader.read(&channels);
+  for (uint8_t i = 0; i < channels && reader.valid; i++) {
+    LightChannel channel;
+    if (reader.read(&channel))
+      lights.channels[channel.channel] = channel;
+  }
+
+  uint8_t regions = 0;
+  reader.read(&regions);
+  lights.regions.reserve(regions);
+  for (uint8_t i = 0; i < regions && reader.valid; i++) {
+    LightRegion region;
+    reader.readName(region.name);
+
+    uint8_t sections = 0;
+    if (reader.read(&sections)) {
+      region.sections.resize(sections);
+      reader.read(region.sections.data(), sections);
+    }
+
+    uint32_t pixels = 0;
+    if (reader.read(&pixels) && pixels <= body.length() / sizeof(LightPixel)) {
+      region.pixels.resize(pixels);
+      reader.read(region.pixels.data(), pixels);
+    }
+    else
+      reader.valid = false;
+
+    region.id = i;
+    region.count = region.pixels.size();
+    lights.regionIds[region.name] = region.id;
+    lights.regions.push_back(region);
+  }
+
+  uint8_t actionCount = 0;
+  reader.read(&actionCount);
+  for (uint8_t i = 0; i < actionCount && reader.valid; i++) {
+    std::string name;
+    uint16_t count = 0;
+    if (!reader.readName(name) || !reader.read(&count) || count > body.length() / sizeof(LightingParameters)) {
+      reader.valid = false;
+      break;
+    }
+
+    auto& effects = actions[name];
+    effects.resize(count);
+    reader.read(effects.data(), count);
+  }
+
+  reader.readStrings(lights.patterns);
+  reader.readStrings(lights.palettes);
+
+  if (!reader.valid) {
+    ESP_LOGW(CONFIG_CACHE_TAG, "Config cache is truncated");
+    return false;
+  }
+
+  config.motion = motion;
+  config.lights = std::move(lights);
+  config.actions = std::move(actions);
+
+  ESP_LOGD(CONFIG_CACHE_TAG, "Loaded config cache, %d regions, %d actions", regions, actionCount);
+  return true;
+}
@@ -4,8 +4,11 @@
 AmpConfig Config::ampConfig;
 
 FreeRTOS::Semaphore Config::effectsUpdating = FreeRTOS::Semaphore("effects");
+DoubleBuffer<ActionTable> Config::actionTables;
 
 void Config::onPowerUp() {
+  MemoryScope memory(MemorySubsystem::MemoryConfig);
+
   if (!ampStorage.init()) {
     ESP_LOGE(CONFIG_TAG,"Unable to mount filsystem");
     _filesystemError = true;
@@ -19,21 +22,26 @@ void Config::onPowerUp() {
   ESP_LOGI(CONFIG_TAG,"Copyright %d %s", COPYRIGHT_YEAR, ampConfig.info.manufacturer.c_str());
   ESP_LOGI(CONFIG_TAG,"IDF version: %s", esp_get_idf_version());
 
-  if (ampStorage.fileExists(userConfigPath) && loadConfigFile(userConfigPath)) {
+  if (ampStorage.fileExists(userConfigPath) && loadConfigSource(userConfigPath)) {
     _isUserConfig = true;
     _valid = true;
-    loadConfig();
 
     notifyConfigListeners();
   }
-  else if (ampStorage.fileExists(configPath) && loadConfigFile(configPath)) {
+  else if (ampStorage.fileExists(configPath) && loadConfigSource(configPath)) {
     _valid = true;
-    loadConfig();
 
     notifyConfigListeners();
   }
   else
     ESP_LOGW(CONFIG_TAG, "No valid configuration exists on this Amp");
+
+  // come back up in the mode the rider left it in
+  auto preset = AmpStorage::getActivePreset(CONFIG_PRESET_NONE);
+  if (_valid && preset != CONFIG_PRESET_NONE && !selectPreset(preset))
+    setActivePreset(CONFIG_PRESET_NONE);
+
+  Profiler::instance()->markBoot(BootStage::BootConfigLoaded);
 }
 
 void Config::onPowerDown() {
@@ -42,23 +50,54 @@ void Config::onPowerDown() {
 
 void Config::process() { }
 
-void Config::addConfigListener(ConfigListener *listener) {
-  configListeners.push_back(listener);
+/*
+  Every change to the actions ends up here, so this is where the new table
+  is published, always before anyone hears about the change. The bus merges
+  the changes into whatever each subscriber hasn't picked up yet
+*/
+void Config::notifyConfigListeners(uint8_t changes) {
+  if (!_valid)
+    changes = 0;
+
+  if (changes & (ConfigChange::ConfigRegions | ConfigChange::ConfigActions))
+    buildActionTable();
+
+  EventBus::instance()->publish(EventConfigChanged, changes);
 }
 
-void Config::notifyConfigListeners() {
-  for (auto listener : configListeners)
-    if (listener->configUpdatedQueue != NULL)
-      xQueueSendToFront(listener->configUpdatedQueue, &_valid, 0);
+bool Config::parseDocument(const std::string &data) {
+  if (document == nullptr)
+    document = new DynamicJsonDocument(CONFIG_DOCUMENT_SIZE);
+
+  if (deserializeMsgPack(*document, data) != DeserializationError::Ok) {
+    releaseDocument();
+    return false;
+  }
+
+  return true;
 }
 
 bool Config::loadConfigFile(std::string path) {
-  auto file = ampStorage.openFile(path);
-
   if (!_filesystemError) {
+    auto file = ampStorage.openFile(path, "rb");
+    if (file == NULL)
+      return false;
+
+    if (document == nullptr)
+      document = new DynamicJsonDocument(CONFIG_DOCUMENT_SIZE);
+
     MsgPackFileReader reader(file);
-    auto err = deserializeMsgPack(document, reader);
-    return err == DeserializationError::Ok;
+    auto err = deserializeMsgPack(*document, reader);
+    fclose(file);
+
+    if (err != DeserializationError::Ok) {
+      ESP_LOGW(CONFIG_TAG, "Unable to parse %s: %s", path.c_str(), err.c_str());
+      delete document;
+      document = nullptr;
+      return false;
+    }
+
+    return true;
   }
   else {
     ESP_LOGE(CONFIG_TAG,"Cannot load config due to error with filesystem.");
@@ -66,7 +105,228 @@ bool Config::loadConfigFile(std::string path) {
   }
 }
 
+void Config::releaseDocument() {
+#if !defined(CONFIG_RETAIN_DOCUMENT)
+  delete document;
+  document = nullptr;
+#endif
+}
+
+#if defined(CONFIG_RETAIN_DOCUMENT)
+bool Config::ensureDocument() {
+  if (document == nullptr && !_sourcePath.empty())
+    loadConfigFile(_sourcePath);
+
+  return document != nullptr;
+}
+#endif
+
+/*
+  Loads the running config from a source file, straight from the compiled cache
+  when it was built from the same bytes, otherwise by parsing and then caching it
+*/
+bool Config::loadConfigSource(std::string path) {
+  if (_filesystemError) {
+    ESP_LOGE(CONFIG_TAG,"Cannot load config due to error with filesystem.");
+    return false;
+  }
+
+  // hashed and parsed straight off the file, the source is never held in memory
+  uint32_t hash;
+  if (!ConfigCache::hashFile(path, &hash))
+    return false;
+
+  _sourcePath = path;
+  auto start = Profiler::now();
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+  bool cached = ConfigCache::load(configCachePath, hash, ampConfig);
+  effectsUpdating.give();
+
+  if (cached) {
+    Profiler::instance()->recordConfigLoad(ConfigLoadPath::ConfigLoadCache, start);
+    return true;
+  }
+
+  start = Profiler::now();
+  if (!loadConfigFile(path))
+    return false;
+
+  loadConfig();
+  Profiler::instance()->recordConfigLoad(ConfigLoadPath::ConfigLoadParse, start);
+  saveCache(hash);
+  releaseDocument();
+  return true;
+}
+
+void Config::saveCache(uint32_t sourceHash) {
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+  ConfigCache::save(configCachePath, sourceHash, ampConfig);
+  effectsUpdating.give();
+}
+
+std::string Config::presetPath(uint8_t slot) {
+  return "/spiffs/preset." + std::to_string(slot) + ".cache";
+}
+
+/*
+  A preset has no source file to hash, so images are keyed on the layout
+  alone and one from another build is still never loaded
+*/
+uint32_t Config::presetHash() {
+  return ConfigCache::hash(std::string());
+}
+
+void Config::setActivePreset(uint8_t slot) {
+  if (_activePreset == slot)
+    return;
+
+  _activePreset = slot;
+  AmpStorage::saveActivePreset(slot);
+}
+
+bool Config::presetExists(uint8_t slot) {
+  return slot < CONFIG_PRESETS && !_filesystemError && ampStorage.fileExists(presetPath(slot));
+}
+
+/*
+  Snapshots the running config into a preset slot
+*/
+bool Config::savePreset(uint8_t slot) {
+  if (slot >= CONFIG_PRESETS || !_valid || _filesystemError)
+    return false;
+
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+  bool saved = ConfigCache::save(presetPath(slot), presetHash(), ampConfig);
+  effectsUpdating.give();
+
+  if (saved)
+    ESP_LOGI(CONFIG_TAG, "Saved preset %d", slot);
+
+  return saved;
+}
+
+/*
+  Swaps the running config for a preset, or back to the source config with
+  CONFIG_PRESET_NONE. Only the parts that differ are notified, so a preset on
+  the same strips never recreates the LED controllers
+*/
+bool Config::selectPreset(uint8_t slot) {
+  MemoryScope memory(MemorySubsystem::MemoryConfig);
+
+  if (!_valid || _filesystemError || (slot != CONFIG_PRESET_NONE && slot >= CONFIG_PRESETS))
+    return false;
+
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+  auto channels = ampConfig.lights.channels;
+  auto motion = ampConfig.motion;
+  effectsUpdating.give();
+
+  bool loaded;
+  if (slot == CONFIG_PRESET_NONE)
+    // takes the effects lock itself
+    loaded = loadConfigSource(_sourcePath);
+  else {
+    effectsUpdating.wait(CONFIG_TAG);
+    effectsUpdating.take(CONFIG_TAG);
+    loaded = ConfigCache::load(presetPath(slot), presetHash(), ampConfig);
+    effectsUpdating.give();
+  }
+
+  if (!loaded) {
+    ESP_LOGW(CONFIG_TAG, "Unable to load preset %d", slot);
+    return false;
+  }
+
+  uint8_t changes = ConfigChange::ConfigRegions | ConfigChange::ConfigActions;
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+  auto& current = ampConfig.lights.channels;
+  bool sameChannels = channels.size() == current.size() && std::equal(channels.begin(), channels.end(), current.begin(),
+    [](const std::pair<const uint8_t, LightChannel> &a, const std::pair<const uint8_t, LightChannel> &b) {
+      return a.first == b.first && memcmp(&a.second, &b.second, sizeof(LightChannel)) == 0;
+    });
+  bool sameMotion = memcmp(&motion, &ampConfig.motion, sizeof(MotionConfig)) == 0;
+  effectsUpdating.give();
+
+  if (!sameChannels)
+    changes |= ConfigChange::ConfigChannels;
+  if (!sameMotion)
+    changes |= ConfigChange::ConfigMotion;
+
+  setActivePreset(slot);
+  ESP_LOGI(CONFIG_TAG, "Switched to preset %d", slot);
+  notifyConfigListeners(changes);
+  return true;
+}
+
+bool Config::deletePreset(uint8_t slot) {
+  if (!presetExists(slot))
+    return false;
+
+  // the running config stays as it is, it just stops being saved into the slot
+  if (_activePreset == slot)
+    setActivePreset(CONFIG_PRESET_NONE);
+
+  return unlink(presetPath(slot).c_str()) == 0;
+}
+
+/*
+  Steps through the saved presets and then back to the source config
+*/
+bool Config::cyclePreset() {
+  uint8_t next = _activePreset == CONFIG_PRESET_NONE ? 0 : _activePreset + 1;
+  for (; next < CONFIG_PRESETS; next++)
+    if (presetExists(next))
+      return selectPreset(next);
+
+  return _activePreset != CONFIG_PRESET_NONE && selectPreset(CONFIG_PRESET_NONE);
+}
+
+/*
+  MsgPack for the running config. Without a resident DOM it's regenerated from
+  AmpConfig, so keys the firmware doesn't understand aren't carried over
+*/
+std::string Config::serializeConfig() {
+  std::string data;
+
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+#if defined(CONFIG_RETAIN_DOCUMENT)
+  if (ensureDocument())
+    serializeMsgPack(*document, data);
+#else
+  DynamicJsonDocument out(CONFIG_DOCUMENT_SIZE);
+  buildDocument(out);
+  serializeMsgPack(out, data);
+#endif
+  effectsUpdating.give();
+
+  return data;
+}
+
+std::string Config::getRawConfig() {
+  return serializeConfig();
+}
+
 void Config::saveConfig() {
+  // edits made while a preset is running belong to that preset
+  if (_activePreset != CONFIG_PRESET_NONE) {
+    savePreset(_activePreset);
+    return;
+  }
+
+  std::string data = serializeConfig();
+
+  // never overwrite the source with an empty config
+  if (!_valid || data.empty()) {
+    ESP_LOGE(CONFIG_TAG,"No config to save");
+    return;
+  }
+
   std::string path = _isUserConfig ? userConfigPath : configPath;
   auto file = ampStorage.writeFile(path);
 
@@ -75,15 +335,19 @@ void Config::saveConfig() {
     return;
   }
 
-  // serialize effects
   ESP_LOGD(CONFIG_TAG,"Writing config to file");
-  MsgPackFileWriter writer(file);
-  serializeMsgPack(document, writer);
+  fwrite(data.data(), 1, data.length(), file);
 
   fclose(file);
+
+  // the running config already has the change, recache it against the new source
+  _sourcePath = path;
+  saveCache(ConfigCache::hash(data));
 }
 
 void Config::saveUserConfig(std::string data, bool load) {
+  MemoryScope memory(MemorySubsystem::MemoryConfig);
+
   auto file = ampStorage.writeFile(userConfigPath);
 
   if (!file) {
@@ -92,25 +356,210 @@ void Config::saveUserConfig(std::string data, bool load) {
   }
 
   ESP_LOGD(CONFIG_TAG, "Writing user config to file");
-  fputs(data.c_str(), file);
+  fwrite(data.data(), 1, data.length(), file);
   fclose(file);
 
-  if (load) {
-    auto err = deserializeMsgPack(document, data);
-    if (err == DeserializationError::Ok) {
-      _isUserConfig = true;
-      loadConfig();
-      notifyConfigListeners();
+  if (load && parseDocument(data)) {
+    setActivePreset(CONFIG_PRESET_NONE);
+    _isUserConfig = true;
+    _valid = true;
+    _sourcePath = userConfigPath;
+    loadConfig();
+    saveCache(ConfigCache::hash(data));
+    releaseDocument();
+    notifyConfigListeners();
+  }
+}
+
+bool Config::beginUpload(uint32_t length, uint32_t crc) {
+  closeUpload(true);
+
+  if (_filesystemError || length == 0) {
+    ESP_LOGE(CONFIG_TAG,"Cannot receive config");
+    return false;
+  }
+
+  _upload = ampStorage.writeFile(uploadPath);
+  if (!_upload) {
+    ESP_LOGE(CONFIG_TAG,"Could not open file: %s", uploadPath.c_str());
+    return false;
+  }
+
+  _uploadLength = length;
+  _uploadReceived = 0;
+  _uploadCrc = 0;
+  _uploadExpectedCrc = crc;
+  return true;
+}
+
+bool Config::appendUpload(const uint8_t *data, size_t length) {
+  if (!_upload)
+    return false;
+
+  if (_uploadReceived + length > _uploadLength) {
+    ESP_LOGW(CONFIG_TAG, "Exceeded expected bytes %d/%d", _uploadReceived + length, _uploadLength);
+    closeUpload(true);
+    return false;
+  }
+
+  if (fwrite(data, 1, length, _upload) != length) {
+    ESP_LOGE(CONFIG_TAG, "Unable to write %s", uploadPath.c_str());
+    closeUpload(true);
+    return false;
+  }
+
+  _uploadCrc = crc32_le(_uploadCrc, data, length);
+  _uploadReceived += length;
+  return true;
+}
+
+void Config::closeUpload(bool remove) {
+  if (_upload) {
+    fclose(_upload);
+    _upload = nullptr;
+  }
+
+  if (remove && ampStorage.fileExists(uploadPath))
+    unlink(uploadPath.c_str());
+}
+
+/*
+  Checks the received file, and only once it's known to parse replaces the user
+  config with it. A bad upload leaves the running config and its file alone
+*/
+bool Config::finishUpload() {
+  MemoryScope memory(MemorySubsystem::MemoryConfig);
+
+  if (!uploadReceived())
+    return false;
+
+  closeUpload(false);
+
+  if (_uploadCrc != _uploadExpectedCrc) {
+    ESP_LOGW(CONFIG_TAG, "Config upload crc mismatch %08x/%08x", _uploadCrc, _uploadExpectedCrc);
+    closeUpload(true);
+    return false;
+  }
+
+  uint32_t hash;
+  if (!ConfigCache::hashFile(uploadPath, &hash) || !loadConfigFile(uploadPath)) {
+    closeUpload(true);
+    return false;
+  }
+
+  if (ampStorage.fileExists(userConfigPath))
+    unlink(userConfigPath.c_str());
+
+  if (rename(uploadPath.c_str(), userConfigPath.c_str()) != 0) {
+    ESP_LOGE(CONFIG_TAG,"Could not replace %s", userConfigPath.c_str());
+    releaseDocument();
+    closeUpload(true);
+    return false;
+  }
+
+  ESP_LOGI(CONFIG_TAG, "Received %d byte user config", _uploadLength);
+  setActivePreset(CONFIG_PRESET_NONE);
+  _isUserConfig = true;
+  _valid = true;
+  _sourcePath = userConfigPath;
+  loadConfig();
+  saveCache(hash);
+  releaseDocument();
+  notifyConfigListeners();
+  return true;
+}
+
+/*
+  Inverse of the load functions, used to write the config back out
+*/
+void Config::buildDocument(JsonDocument &out) {
+  JsonObject lightsJson = out.createNestedObject("lights");
+
+  JsonArray channelsJson = lightsJson.createNestedArray("channels");
+  for (auto const& [id, channel] : ampConfig.lights.channels) {
+    JsonObject channelJson = channelsJson.createNestedObject();
+    channelJson["channel"] = channel.channel;
+    channelJson["leds"] = channel.leds;
+    channelJson["type"] = (uint8_t) channel.type;
+    if (channel.maxCurrent > 0)
+      channelJson["maxCurrent"] = channel.maxCurrent;
+  }
+
+  JsonObject regionsJson = lightsJson.createNestedObject("regions");
+  for (auto const& region : ampConfig.lights.regions) {
+    JsonArray sectionsJson = regionsJson.createNestedArray(region.name);
+    for (auto const& section : region.sections) {
+      JsonObject sectionJson = sectionsJson.createNestedObject();
+      sectionJson["channel"] = section.channel;
+      sectionJson["start"] = section.start;
+      sectionJson["end"] = section.end;
     }
   }
+
+  if (!ampConfig.lights.palettes.empty()) {
+    JsonArray palettesJson = lightsJson.createNestedArray("palettes");
+    for (auto const& palette : ampConfig.lights.palettes)
+      palettesJson.add(palette);
+  }
+
+  if (!ampConfig.lights.patterns.empty()) {
+    JsonArray patternsJson = lightsJson.createNestedArray("patterns");
+    for (auto const& pattern : ampConfig.lights.patterns)
+      patternsJson.add(pattern);
+  }
+
+  JsonObject actionsJson = out.createNestedObject("actions");
+  for (auto const& [action, effects] : ampConfig.actions) {
+    JsonArray effectsJson = actionsJson.createNestedArray(action);
+    for (auto const& effect : effects) {
+      if (effect.region >= ampConfig.lights.regions.size())
+        continue;
+
+      JsonObject effectJson = effectsJson.createNestedObject();
+      effectJson["region"] = ampConfig.lights.regions[effect.region].name;
+      effectJson["effect"] = serializeEffect(effect);
+    }
+  }
+
+  serializeMotionConfig(out.createNestedObject("motion"));
+}
+
+void Config::serializeMotionConfig(JsonObject motionJson) {
+  auto motion = ampConfig.motion;
+  motionJson["autoOrientation"] = motion.autoOrientation;
+  motionJson["autoMotion"] = motion.autoMotion;
+  motionJson["autoTurn"] = motion.autoTurn;
+  motionJson["relativeTurnZero"] = motion.relativeTurnZero;
+  motionJson["brakeThreshold"] = motion.brakeThreshold;
+  motionJson["accelerationThreshold"] = motion.accelerationThreshold;
+  motionJson["brakeExitThreshold"] = motion.brakeExitThreshold;
+  motionJson["accelerationExitThreshold"] = motion.accelerationExitThreshold;
+  motionJson["brakeJerkThreshold"] = motion.brakeJerkThreshold;
+  motionJson["brakeHold"] = motion.brakeHold;
+  motionJson["motionHold"] = motion.motionHold;
+  motionJson["turnThreshold"] = motion.turnThreshold;
+  motionJson["sampleRate"] = motion.sampleRate;
+  motionJson["parkedSampleRate"] = motion.parkedSampleRate;
+  motionJson["motionAxis"] = (uint8_t) motion.motionAxis;
+  motionJson["turnAxis"] = (uint8_t) motion.turnAxis;
+  motionJson["orientation"] = (uint8_t) motion.orientationTrigger;
+  motionJson["attitudeFilter"] = (uint8_t) motion.attitudeFilter;
+  motionJson["gravityFilter"] = (uint8_t) motion.gravityFilter;
+  motionJson["gravityCutoff"] = motion.gravityCutoff;
 }
 
 void Config::loadConfig() {
-  JsonObject configJson = document.as<JsonObject>();
+  JsonObject configJson = document->as<JsonObject>();
 
   JsonObject lightsJson = configJson["lights"].as<JsonObject>();
   loadLightsConfig(lightsJson);
 
+  // a new config replaces every action, it doesn't merge into the old ones
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+  ampConfig.actions.clear();
+  effectsUpdating.give();
+
   JsonObject actionsJson = configJson["actions"].as<JsonObject>();
   loadActionConfig(actionsJson);
 
@@ -130,7 +579,14 @@ void Config::loadMotionConfig(JsonObject motionJson) {
 
   config.brakeThreshold = motionJson["brakeThreshold"] | DEFAULT_BRAKE_THRESHOLD;
   config.accelerationThreshold = motionJson["accelerationThreshold"] | DEFAULT_ACCELERATION_THRESHOLD;
+  config.brakeExitThreshold = motionJson["brakeExitThreshold"] | config.brakeThreshold * DEFAULT_MOTION_EXIT_RATIO;
+  config.accelerationExitThreshold = motionJson["accelerationExitThreshold"] | config.accelerationThreshold * DEFAULT_MOTION_EXIT_RATIO;
+  config.brakeJerkThreshold = motionJson["brakeJerkThreshold"] | DEFAULT_BRAKE_JERK_THRESHOLD;
+  config.brakeHold = motionJson["brakeHold"] | DEFAULT_BRAKE_HOLD;
+  config.motionHold = motionJson["motionHold"] | DEFAULT_MOTION_HOLD;
   config.turnThreshold = motionJson["turnThreshold"] | DEFAULT_TURN_THRESHOLD;
+  config.sampleRate = motionJson["sampleRate"] | DEFAULT_SAMPLE_RATE;
+  config.parkedSampleRate = motionJson["parkedSampleRate"] | DEFAULT_PARKED_SAMPLE_RATE;
 
   uint8_t motionAxis = (motionJson["motionAxis"].as<uint8_t>()) | AccelerationAxis::X_Pos;
   config.motionAxis = (AccelerationAxis)motionAxis;
@@ -141,14 +597,26 @@ void Config::loadMotionConfig(JsonObject motionJson) {
   uint8_t orientationTrigger = (Orientation)(motionJson["orientation"].as<uint8_t>()) | Orientation::UnknownSideUp;
   config.orientationTrigger = (Orientation)orientationTrigger;
 
+  uint8_t attitudeFilter = motionJson["attitudeFilter"] | AttitudeFilter::SmoothedTilt;
+  config.attitudeFilter = (AttitudeFilter)attitudeFilter;
+
+  uint8_t gravityFilter = motionJson["gravityFilter"] | GravityFilterType::SinglePole;
+  config.gravityFilter = (GravityFilterType)gravityFilter;
+  config.gravityCutoff = motionJson["gravityCutoff"] | DEFAULT_GRAVITY_CUTOFF;
+
   ESP_LOGV(CONFIG_TAG,"auto orientation config: %s", config.autoOrientation ? "true" : "false");
   ESP_LOGV(CONFIG_TAG,"auto motion config: %s", config.autoMotion ? "true" : "false");
   ESP_LOGV(CONFIG_TAG,"auto turn config: %s", config.autoTurn ? "true" : "false");
 
   ESP_LOGV(CONFIG_TAG,"motion axis: %d brake threshold: %.2f acceleration threshold: %.2f", config.motionAxis, config.brakeThreshold, config.accelerationThreshold);
+  ESP_LOGV(CONFIG_TAG,"brake exit: %.2f acceleration exit: %.2f brake jerk: %.2f holds: %d / %dms", config.brakeExitThreshold,
+    config.accelerationExitThreshold, config.brakeJerkThreshold, config.brakeHold, config.motionHold);
   ESP_LOGV(CONFIG_TAG,"orientation trigger: %d", config.orientationTrigger);
 
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
   ampConfig.motion = config;
+  effectsUpdating.give();
 }
 
 void Config::loadLightsConfig(JsonObject lightsJson) {
@@ -162,18 +630,26 @@ void Config::loadLightsConfig(JsonObject lightsJson) {
     ch.channel = channel["channel"].as<uint8_t>();
     ch.leds = channel["leds"].as<uint16_t>();
     ch.type = channel["type"].as<LEDType>();
+    ch.maxCurrent = channel["maxCurrent"] | 0;
     channels[ch.channel] = ch;
   }
 
   // load light regions
-  std::map<std::string, LightRegion> regions;
-  for (auto lightRegion : lightsJson["regions"].as<JsonObject>()) {
+  JsonObject regionsJson = lightsJson["regions"].as<JsonObject>();
+  std::vector<LightRegion> regions;
+  regions.reserve(std::min(regionsJson.size(), (size_t) REGION_NONE));
+  std::map<std::string, uint8_t> regionIds;
+  for (auto lightRegion : regionsJson) {
     std::string regionName = std::string(lightRegion.key().c_str());
+
+    if (regions.size() >= REGION_NONE) {
+      ESP_LOGW(CONFIG_TAG, "Too many regions - skipping region %s", regionName.c_str());
+      continue;
+    }
     JsonArray sectionsJson = lightRegion.value().as<JsonArray>();
 
     LightRegion region;
     std::vector<LightSection> sections;
-    region.count = 0;
 
     for (auto sect : sectionsJson) {
       LightSection section;
@@ -195,29 +671,68 @@ void Config::loadLightsConfig(JsonObject lightsJson) {
       else
         _validSection = false;
 
-      if (_validSection) {
+      // sections are 1-indexed and inclusive of the end pixel
+      if (_validSection && section.start > 0 && section.end >= section.start)
         sections.push_back(section);
-        uint16_t count = section.end - section.start;
-        region.count += count;
-        region.breaks.push_back(count);
-      }
     }
+    region.id = regions.size();
+    region.name = regionName;
     region.sections = sections;
-    regions[regionName] = region;
+    buildRegionPixels(region);
+    regionIds[regionName] = region.id;
+    regions.push_back(region);
+  }
+
+  for (auto palette : lightsJson["palettes"].as<JsonArray>()) {
+    if (config.palettes.size() >= PALETTE_MAX)
+      break;
+    config.palettes.push_back(palette.as<std::string>());
+  }
+
+  // pattern programs stay hex until the renderer compiles them
+  for (auto pattern : lightsJson["patterns"].as<JsonArray>()) {
+    if (config.patterns.size() >= PATTERN_MAX_PATTERNS)
+      break;
+    config.patterns.push_back(pattern.as<std::string>());
   }
 
   // set lights config
   config.channels = channels;
   config.regions = regions;
+  config.regionIds = regionIds;
+
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+  ampConfig.lights = std::move(config);
+  effectsUpdating.give();
+}
+
+void Config::buildRegionPixels(LightRegion &region) {
+  size_t count = 0;
+  for (auto const& section : region.sections)
+    count += section.end - section.start + 1;
 
-  ampConfig.lights = config;
+  // sized once, a region's pixel map never grows in pieces
+  region.pixels.clear();
+  region.pixels.reserve(count);
+  for (auto const& section : region.sections)
+    for (uint16_t offset = section.start - 1; offset < section.end; offset++)
+      region.pixels.push_back({ section.channel, offset });
+
+  region.count = region.pixels.size();
 }
 
 void Config::loadActionConfig(JsonObject actionJson) {
   for (auto actionPair : actionJson) {
     std::string action = std::string(actionPair.key().c_str());
     JsonArray regionEffects = actionPair.value().as<JsonArray>();
-    
+
+    // one effect per region at most, so the json size bounds the vector
+    effectsUpdating.wait(CONFIG_TAG);
+    effectsUpdating.take(CONFIG_TAG);
+    ampConfig.actions[action].reserve(regionEffects.size());
+    effectsUpdating.give();
+
     // parse all regional effects for action
     for (auto regionEffect : regionEffects) {
       if (regionEffect.containsKey("region") && regionEffect.containsKey("effect")) {
@@ -252,47 +767,44 @@ DeviceInfo Config::getDeviceInfo() {
 }
 
 bool Config::addEffect(std::string action, std::string region, std::string data, bool updateJson) {
-  effectsUpdating.wait(CONFIG_TAG);
-  effectsUpdating.take(CONFIG_TAG);
-
-  bool found = false;
-
-  for (auto const& [command, actionName] : Lights::headlightActions)
-    if (actionName.compare(action) == 0) {
-      found = true;
-      break;
-    }
-
-  if (!found)
-    for (auto const& [command, actionName] : Lights::turnActions)
-      if (actionName.compare(action) == 0) {
-        found = true;
-        break;
-      }
-
-  if (!found)
-    for (auto const& [command, actionName] : Lights::motionActions)
-      if (actionName.compare(action) == 0) {
-        found = true;
-        break;
-      }
+  auto named = [&](const std::map<Actions, std::string> &actions) {
+    return std::any_of(actions.begin(), actions.end(),
+      [&](const std::pair<const Actions, std::string> &entry) { return entry.second == action; });
+  };
 
-  if (!found)
+  if (!named(Lights::headlightActions) && !named(Lights::turnActions) && !named(Lights::motionActions)
+    && !named(Lights::orientationActions))
     return false;
 
   LightingParameters effect;
   if (!parseEffect(data, &effect))
     return false;
 
-  effect.region = region;
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+
+  auto regionId = ampConfig.lights.regionIds.find(region);
+  if (regionId == ampConfig.lights.regionIds.end()) {
+    effectsUpdating.give();
+    ESP_LOGW(CONFIG_TAG, "Region %s does not exist", region.c_str());
+    return false;
+  }
+
+  effect.region = regionId->second;
 
-  if (ampConfig.actions.find(action) == ampConfig.actions.end())
-    ampConfig.actions[action] = new std::vector<LightingParameters>();
+  // a region only shows one effect per action, so a new one replaces the old
+  auto& effects = ampConfig.actions[action];
+  auto existing = std::find_if(effects.begin(), effects.end(),
+    [&](const LightingParameters &other) { return other.region == effect.region; });
 
-  ampConfig.actions[action]->push_back(effect);
+  if (existing != effects.end())
+    *existing = effect;
+  else
+    effects.push_back(effect);
 
-  if (updateJson) {
-    auto actionsRoot = document["actions"].as<JsonObject>();
+#if defined(CONFIG_RETAIN_DOCUMENT)
+  if (updateJson && ensureDocument()) {
+    auto actionsRoot = (*document)["actions"].as<JsonObject>();
     JsonArray actionRoot;
 
     if (!actionsRoot.containsKey(action))
@@ -302,7 +814,7 @@ bool Config::addEffect(std::string action, std::string region, std::string data,
 
     bool foundJson = false;
     for (auto effect : actionRoot) {
-      if (effect[region].as<std::string>().compare(region) == 0) {
+      if (effect["region"].as<std::string>().compare(region) == 0) {
         foundJson = true;
         effect["effect"] = data.c_str();
       }
@@ -313,17 +825,184 @@ bool Config::addEffect(std::string action, std::string region, std::string data,
       effectRoot["effect"] = data.c_str();
     }
   }
+#endif
 
   effectsUpdating.give();  
 
   return true;
 }
 
-std::vector<LightingParameters>* Config::getActionEffects(std::string action) {
-  if (ampConfig.actions.find(action) == ampConfig.actions.end())
-    return NULL;
+/*
+  Adds or replaces one region's effect for an action
+*/
+bool Config::setEffect(std::string action, std::string region, std::string data, bool save) {
+  MemoryScope memory(MemorySubsystem::MemoryConfig);
+
+  if (!addEffect(action, region, data))
+    return false;
+
+  notifyConfigListeners(ConfigChange::ConfigActions);
+
+  if (save)
+    saveConfig();
+
+  return true;
+}
+
+/*
+  Adds or replaces a region from channel:start:end sections separated by commas.
+  Existing regions keep their id so effects already pointing at them stay valid
+*/
+bool Config::setRegion(std::string name, std::string sectionsData, bool save) {
+  MemoryScope memory(MemorySubsystem::MemoryConfig);
+
+  std::vector<LightSection> sections;
+  for (auto sectionData : split(sectionsData, ',')) {
+    auto parts = split(sectionData, ':');
+    if (parts.size() < 3)
+      return false;
+
+    LightSection section;
+    section.channel = atoi(parts[0].c_str());
+    section.start = atoi(parts[1].c_str());
+    section.end = atoi(parts[2].c_str());
+
+    if (section.start == 0 || section.end < section.start)
+      return false;
+
+    sections.push_back(section);
+  }
+
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+
+  auto& lights = ampConfig.lights;
+  auto id = lights.regionIds.find(name);
+  if (id == lights.regionIds.end() && lights.regions.size() >= REGION_NONE) {
+    effectsUpdating.give();
+    ESP_LOGW(CONFIG_TAG, "Too many regions - cannot add region %s", name.c_str());
+    return false;
+  }
+
+  if (id == lights.regionIds.end()) {
+    LightRegion region;
+    region.id = lights.regions.size();
+    region.name = name;
+    lights.regionIds[name] = region.id;
+    lights.regions.push_back(region);
+  }
 
-  return ampConfig.actions[action];
+  auto& region = lights.regions[lights.regionIds[name]];
+  region.sections = sections;
+  buildRegionPixels(region);
+  auto count = region.count;
+
+  effectsUpdating.give();
+
+  ESP_LOGD(CONFIG_TAG, "Region %s set to %d pixels", name.c_str(), count);
+  notifyConfigListeners(ConfigChange::ConfigRegions);
+
+  if (save)
+    saveConfig();
+
+  return true;
+}
+
+/*
+  Replaces or appends a pattern program. Compiling is left to the renderer, this
+  only rejects what could never compile
+*/
+bool Config::setPattern(uint8_t index, std::string program, bool save) {
+  MemoryScope memory(MemorySubsystem::MemoryConfig);
+
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+
+  auto& patterns = ampConfig.lights.patterns;
+  if (index > patterns.size() || index >= PATTERN_MAX_PATTERNS || program.empty()
+    || program.length() % (2 * sizeof(PatternInstruction)) != 0) {
+    effectsUpdating.give();
+    ESP_LOGW(CONFIG_TAG, "Invalid pattern %d", index);
+    return false;
+  }
+
+  if (index == patterns.size())
+    patterns.push_back(program);
+  else
+    patterns[index] = program;
+  effectsUpdating.give();
+
+  notifyConfigListeners(ConfigChange::ConfigActions);
+
+  if (save)
+    saveConfig();
+
+  return true;
+}
+
+/*
+  Changes a single motion config key, parsed the same way as a full config load
+*/
+bool Config::setMotionValue(std::string key, std::string value, bool save) {
+  StaticJsonDocument<JSON_OBJECT_SIZE(24)> motionDocument;
+  JsonObject motionJson = motionDocument.to<JsonObject>();
+  serializeMotionConfig(motionJson);
+
+  if (!motionJson.containsKey(key)) {
+    ESP_LOGW(CONFIG_TAG, "Unknown motion setting %s", key.c_str());
+    return false;
+  }
+
+  if (value == "true" || value == "false")
+    motionJson[key] = value == "true";
+  else if (value.find('.') != std::string::npos)
+    motionJson[key] = atof(value.c_str());
+  else
+    motionJson[key] = atol(value.c_str());
+
+  loadMotionConfig(motionJson);
+  notifyConfigListeners(ConfigChange::ConfigMotion);
+
+  if (save)
+    saveConfig();
+
+  return true;
+}
+
+/*
+  Points every group and command at its action's effects, so applying a command
+  never has to build or look up the action's name
+*/
+void Config::buildActionTable() {
+  const std::map<Actions, std::string> *names[ActionGroups] = {
+    &Lights::headlightActions, &Lights::motionActions, &Lights::turnActions, &Lights::orientationActions
+  };
+
+  // held across the publish, so two writers can never fill the same side
+  effectsUpdating.wait(CONFIG_TAG);
+  effectsUpdating.take(CONFIG_TAG);
+
+  auto& table = actionTables.back();
+  table.effects.clear();
+
+  for (uint8_t group = 0; group < ActionGroups; group++) {
+    for (uint8_t command = 0; command < ACTION_COUNT; command++) {
+      table.offsets[group][command] = table.effects.size();
+
+      auto name = names[group]->find((Actions) command);
+      if (name == names[group]->end())
+        continue;
+
+      auto effects = ampConfig.actions.find(name->second);
+      if (effects != ampConfig.actions.end())
+        table.effects.insert(table.effects.end(), effects->second.begin(), effects->second.end());
+    }
+
+    table.offsets[group][ACTION_COUNT] = table.effects.size();
+  }
+
+  actionTables.publish();
+  effectsUpdating.give();
 }
 
 // void Config::removeEffect(std::string action, std::string region, bool updateJson) {
@@ -363,7 +1042,16 @@ bool Config::parseEffect(std::string data, LightingParameters *params) {
   auto parts = split(data, ',');
   params->effect = (LightEffect) atoi(parts[0].c_str());
   params->layer = 0;
+  params->opacity = 255;
+
+  // a flag rather than a position, so it can follow whatever optional args are given
+  params->adaptive = parts.size() > 1 && parts.back() == "adaptive";
+  if (params->adaptive)
+    parts.pop_back();
+
   auto numParts = parts.size();
+  // index of the optional layer arg, followed by an optional opacity
+  uint8_t layerArg;
 
   switch (params->effect) {
     case LightEffect::Static:
@@ -373,9 +1061,7 @@ bool Config::parseEffect(std::string data, LightingParameters *params) {
       }
 
       params->first = parseColorOption(parts[1]);
-
-      if (numParts == 3)
-        params->layer = atoi(parts[2].c_str());
+      layerArg = 2;
       break;
     case LightEffect::TheaterChase:
       if (numParts < 3) {
@@ -385,9 +1071,7 @@ bool Config::parseEffect(std::string data, LightingParameters *params) {
 
       params->first = parseColorOption(parts[1]);
       params->duration = atoll(parts[2].c_str());
-
-      if (numParts == 4)
-        params->layer = atoi(parts[2].c_str());
+      layerArg = 3;
       break;
     case LightEffect::Scan:
     case LightEffect::ColorWipe:
@@ -406,9 +1090,21 @@ bool Config::parseEffect(std::string data, LightingParameters *params) {
       params->first = parseColorOption(parts[1]);
       params->second = parseColorOption(parts[2]);
       params->duration = atoll(parts[3].c_str());
+      layerArg = 4;
+      break;
+    case LightEffect::Pattern:
+      // pattern, three colors, then the duration the phase register runs over
+      if (numParts < 6) {
+        ESP_LOGW(CONFIG_TAG, "Missing required number of args for light effect %d", params->effect);
+        return false;
+      }
 
-      if (numParts == 5)
-        params->layer = atoi(parts[4].c_str());
+      params->pattern = atoi(parts[1].c_str());
+      params->first = parseColorOption(parts[2]);
+      params->second = parseColorOption(parts[3]);
+      params->third = parseColorOption(parts[4]);
+      params->duration = atoll(parts[5].c_str());
+      layerArg = 6;
       break;
     case LightEffect::Rainbow:
     case LightEffect::RainbowCycle:
@@ -417,21 +1113,31 @@ bool Config::parseEffect(std::string data, LightingParameters *params) {
         return false;
       }
 
+      // a palette can follow the layer and opacity, the rainbow otherwise
+      params->first = { lightOff, false, true };
       params->duration = atoll(parts[1].c_str());
-
-      if (numParts == 3)
-        params->layer = atoi(parts[2].c_str());
+      if (numParts > 4)
+        params->first.palette = atoi(parts[4].c_str());
+      layerArg = 2;
       break;
     case LightEffect::Transparent:
     case LightEffect::Off:
-      params->first = { lightOff, false, false };
-
-      if (numParts == 2)
-        params->layer = atoi(parts[1].c_str());
     default:
+      params->first = { lightOff, false, false };
+      layerArg = 1;
       break;
   }
 
+  if (numParts > layerArg)
+    params->layer = atoi(parts[layerArg].c_str());
+
+  if (numParts > layerArg + 1)
+    params->opacity = atoi(parts[layerArg + 1].c_str());
+
+  // transparent layers only ever reveal what's beneath them
+  if (params->effect == LightEffect::Transparent)
+    params->opacity = 0;
+
   return true;
 }
 
@@ -442,8 +1148,80 @@ ColorOption Config::parseColorOption(std::string data) {
     option.random = true;
   else if (data == "rainbow")
     option.rainbow = true;
+  else if (data.compare(0, 8, "palette:") == 0)
+    option.palette = atoi(data.c_str() + 8);
   else
     option.color = hexToColor(data);
 
   return option;
-}
\ No newline at end of file
+}
+
+std::string Config::serializeColorOption(const ColorOption &option) {
+  if (option.random)
+    return "random";
+  if (option.rainbow)
+    return "rainbow";
+  if (option.palette != PALETTE_NONE)
+    return "palette:" + std::to_string(option.palette);
+
+  return colorToHex(option.color);
+}
+
+/*
+  Inverse of parseEffect, layer and opacity are only written when they aren't the defaults
+*/
+std::string Config::serializeEffect(const LightingParameters &params) {
+  std::string data = std::to_string(params.effect);
+
+  switch (params.effect) {
+    case LightEffect::Static:
+      data += "," + serializeColorOption(params.first);
+      break;
+    case LightEffect::TheaterChase:
+      data += "," + serializeColorOption(params.first) + "," + std::to_string(params.duration);
+      break;
+    case LightEffect::Scan:
+    case LightEffect::ColorWipe:
+    case LightEffect::Blink:
+    case LightEffect::Breathe:
+    case LightEffect::Fade:
+    case LightEffect::Twinkle:
+    case LightEffect::Sparkle:
+    case LightEffect::Alternate:
+    case LightEffect::ColorChase:
+      data += "," + serializeColorOption(params.first) + "," + serializeColorOption(params.second)
+        + "," + std::to_string(params.duration);
+      break;
+    case LightEffect::Pattern:
+      data += "," + std::to_string(params.pattern) + "," + serializeColorOption(params.first)
+        + "," + serializeColorOption(params.second) + "," + serializeColorOption(params.third)
+        + "," + std::to_string(params.duration);
+      break;
+    case LightEffect::Rainbow:
+    case LightEffect::RainbowCycle:
+      data += "," + std::to_string(params.duration);
+      break;
+    case LightEffect::Transparent:
+    case LightEffect::Off:
+    default:
+      break;
+  }
+
+  // a rainbow's palette comes after both of them
+  bool writePalette = (params.effect == LightEffect::Rainbow || params.effect == LightEffect::RainbowCycle)
+    && params.first.palette != PALETTE_NONE;
+  bool writeOpacity = (params.opacity != 255 && params.effect != LightEffect::Transparent) || writePalette;
+  if (params.layer != 0 || writeOpacity)
+    data += "," + std::to_string(params.layer);
+
+  if (writeOpacity)
+    data += "," + std::to_string(params.opacity);
+
+  if (writePalette)
+    data += "," + std::to_string(params.first.palette);
+
+  if (params.adaptive)
+    data += ",adaptive";
+
+  return data;
+}
@@ -0,0 +1,104 @@
+#include <hal/event-bus.h>
+
+// state events only ever matter as their latest value
+static bool isStateEvent(EventType type) {
+  return type < EventUpdateStatus;
+}
+
+/*
+  Folds an event into the mailbox. State replaces a pending event of the same
+  type, config changes accumulate their bits unless either side says invalid.
+  Returns false when the mailbox is full and the event had to be dropped.
+*/
+bool EventSubscriber::deliver(const Event &event) {
+  bool delivered = true;
+
+  portENTER_CRITICAL(&_mailboxLock);
+  bool merged = false;
+  if (isStateEvent(event.type)) {
+    for (uint8_t i = 0; i < _count && !merged; i++) {
+      Event &pending = _mailbox[(_head + i) % EVENT_MAILBOX_SIZE];
+      if (pending.type != event.type)
+        continue;
+
+      if (event.type == EventConfigChanged && pending.payload[0] != 0 && event.payload[0] != 0)
+        pending.payload[0] |= event.payload[0];
+      else
+        pending = event;
+      merged = true;
+    }
+  }
+
+  if (!merged) {
+    if (_count < EVENT_MAILBOX_SIZE)
+      _mailbox[(_head + _count++) % EVENT_MAILBOX_SIZE] = event;
+    else {
+      _dropped++;
+      delivered = false;
+    }
+  }
+  portEXIT_CRITICAL(&_mailboxLock);
+
+  return delivered;
+}
+
+bool EventSubscriber::nextEvent(Event *event) {
+  bool available = false;
+
+  portENTER_CRITICAL(&_mailboxLock);
+  if (_count > 0) {
+    *event = _mailbox[_head];
+    _head = (_head + 1) % EVENT_MAILBOX_SIZE;
+    _count--;
+    available = true;
+  }
+  portEXIT_CRITICAL(&_mailboxLock);
+
+  return available;
+}
+
+bool EventSubscriber::hasEvents() {
+  portENTER_CRITICAL(&_mailboxLock);
+  bool pending = _count > 0;
+  portEXIT_CRITICAL(&_mailboxLock);
+
+  return pending;
+}
+
+void EventSubscriber::dispatchEvents() {
+  Event event;
+  while (nextEvent(&event))
+    onEvent(event);
+}
+
+void EventBus::subscribe(EventSubscriber *subscriber, uint32_t interests, TaskHandle_t task) {
+  uint8_t index = _subscriberCount.load();
+  if (index >= EVENT_SUBSCRIBERS) {
+    ESP_LOGE(EVENTS_TAG, "Too many subscribers, raise EVENT_SUBSCRIBERS");
+    return;
+  }
+
+  subscriber->eventInterests = interests;
+  subscriber->eventTask = task;
+
+  // publishers only look at slots below the count, so fill the slot first
+  _subscribers[index] = subscriber;
+  _subscriberCount.store(index + 1);
+}
+
+void EventBus::publish(const Event &event) {
+  uint32_t mask = EVENT_MASK(event.type);
+  uint8_t count = _subscriberCount.load();
+
+  for (uint8_t i = 0; i < count; i++) {
+    EventSubscriber *subscriber = _subscribers[i];
+    if ((subscriber->eventInterests & mask) == 0)
+      continue;
+
+    if (!subscriber->deliver(event))
+      ESP_LOGW(EVENTS_TAG, "Mailbox full, dropped event %d (%d dropped)", event.type, subscriber->_dropped);
+
+    if (subscriber->eventTask != NULL)
+      xTaskNotify(subscriber->eventTask, EVENT_NOTIFY_BIT, eSetBits);
+  }
+}
@@ -33,18 +33,27 @@ std::map<Actions, std::string> Lights::orientationActions = {
 };
 
 Lights::Lights() {
-  touchQueue = xQueueCreate(2, sizeof(bool));
-  calibrateXGQueue = xQueueCreate(1, sizeof(CalibrationState));
-  calibrateMagQueue = xQueueCreate(1, sizeof(CalibrationState));
-  configUpdatedQueue = xQueueCreate(1, sizeof(bool));
-  powerStatusQueue = xQueueCreate(1, sizeof(PowerStatus));
-  updateStatusQueue = xQueueCreate(5, sizeof(UpdateStatus));
-  advertisingQueue = xQueueCreate(1, sizeof(bool));
+  configInterests = ConfigChange::ConfigChannels | ConfigChange::ConfigRegions | ConfigChange::ConfigActions;
+
+  for (uint16_t i = 0; i < PALETTE_SIZE; i++) {
+    _rainbow[i] = colorWheel(i);
+    _breathe[i] = BREATHE_FLOOR + (255 - BREATHE_FLOOR) * (1 - cosf(2 * M_PI * i / PALETTE_SIZE)) / 2;
+  }
+
+  // the renderer is attached as the wake task once it exists, until then events just wait
+  EventBus::instance()->subscribe(this,
+    EVENT_MASK(EventTouch) | EVENT_MASK(EventCalibrateXG) | EVENT_MASK(EventCalibrateMag) |
+    EVENT_MASK(EventConfigChanged) | EVENT_MASK(EventPowerLevel) | EVENT_MASK(EventUpdateStatus) |
+    EVENT_MASK(EventAdvertising) | EVENT_MASK(EventMovement));
 }
 
 void Lights::onPowerUp() {
   leds.init();
-  xTaskCreatePinnedToCore(renderer, "renderer", 4096, NULL, 3, &renderHandle, 1);
+  Tasks::create(TaskRenderer, renderer, NULL, &renderHandle);
+  eventTask = renderHandle;
+
+  // the config may have loaded alongside us and published before there was a task to wake
+  wake();
   ESP_LOGD(LIGHTS_TAG,"Lights started");
 }
 
@@ -53,91 +62,251 @@ void Lights::onPowerDown() {
   ESP_LOGD(LIGHTS_TAG,"Lights stopped");
 }
 
+void Lights::onSleep() {
+  // hold the leds so the renderer is never suspended mid-flush
+  AmpLeds::ledsReady.take("sleep");
+  vTaskSuspend(renderHandle);
+  AmpLeds::ledsReady.give();
+
+  leds.sleep();
+  ESP_LOGD(LIGHTS_TAG,"Lights asleep");
+}
+
+void Lights::onWake() {
+  leds.wake();
+  vTaskResume(renderHandle);
+  wake();
+}
+
 void Lights::process() {
-  if (uxQueueMessagesWaiting(touchQueue)) {
-    bool touched;
-    if (xQueueReceive(touchQueue, &touched, 0))
-      touched ? onTouchDown() : onTouchUp();
-  }
+  dispatchEvents();
+  leds.process();
+}
 
-  if (uxQueueMessagesWaiting(calibrateXGQueue)) {
-    CalibrationState state;
-    if (xQueueReceive(calibrateXGQueue, &state, 0))
-      state == CalibrationState::Started ? onCalibrateXGStarted() : onCalibrateXGEnded();
-  }
-  else if (uxQueueMessagesWaiting(calibrateMagQueue)) {
-    CalibrationState state;
-    if (xQueueReceive(calibrateMagQueue, &state, 0))
-      state == CalibrationState::Started ? onCalibrateMagStarted() : onCalibrateMagEnded();
-  }
+void Lights::processEvents(TickType_t timeout) {
+  // events and wakes share the renderer's notification, either one ends the wait
+  xTaskNotifyWait(0, UINT32_MAX, NULL, timeout);
+  dispatchEvents();
+}
 
-  if (uxQueueMessagesWaiting(configUpdatedQueue)) {
-    bool valid;
-    if (xQueueReceive(configUpdatedQueue, &valid, 0) && valid)
-      onConfigUpdated();
-  }
+void Lights::onEvent(const Event &event) {
+  switch (event.type) {
+    case EventTouch:
+      event.as<bool>() ? onTouchDown() : onTouchUp();
+      break;
 
-  if (uxQueueMessagesWaiting(powerStatusQueue)) {
-    PowerStatus status;
-    if (xQueueReceive(powerStatusQueue, &status, 0))
-      onPowerStatusChanged(status);
+    case EventCalibrateXG:
+      event.as<CalibrationState>() == CalibrationState::Started ? onCalibrateXGStarted() : onCalibrateXGEnded();
+      break;
+
+    case EventCalibrateMag:
+      event.as<CalibrationState>() == CalibrationState::Started ? onCalibrateMagStarted() : onCalibrateMagEnded();
+      break;
+
+    case EventConfigChanged: {
+      uint8_t changes = event.as<uint8_t>();
+      if (changes & configInterests)
+        onConfigChanged(changes);
+      break;
+    }
+
+    case EventPowerLevel:
+      onPowerStatusChanged(event.as<PowerStatus>());
+      break;
+
+    case EventUpdateStatus:
+      onUpdateStatusChanged(event.as<UpdateStatus>());
+      break;
+
+    case EventAdvertising:
+      event.as<bool>() ? onAdvertisingStarted() : onAdvertisingStopped();
+      break;
+
+    case EventMovement:
+      onMovementChanged(event.as<MovementState>());
+      break;
+
+    default:
+      break;
   }
+}
+
+void Lights::wake() {
+  if (renderHandle != NULL)
+    xTaskNotify(renderHandle, RENDER_WAKE_BIT, eSetBits);
+}
+
+TickType_t Lights::nextFrameDelay() {
+  // a channel was still transmitting at the last flush - retry on the next tick
+  if (leds.pending())
+    return 1;
 
-  if (uxQueueMessagesWaiting(updateStatusQueue)) {
-    UpdateStatus status;
-    if (xQueueReceive(updateStatusQueue, &status, 0))
-      onUpdateStatusChanged(status);
+  auto now = millis();
+  bool scheduled = false;
+  unsigned long earliest = 0;
+
+  for (auto& step : _steps) {
+    if (!step.active || step.next == REFRESH_NEVER)
+      continue;
+
+    if (step.next <= now)
+      return 0;
+
+    if (!scheduled || step.next < earliest) {
+      earliest = step.next;
+      scheduled = true;
+    }
   }
 
-  if (uxQueueMessagesWaiting(advertisingQueue)) {
-    uint8_t status;
-    if (xQueueReceive(advertisingQueue, &status, 0))
-      status == 1 ? onAdvertisingStarted() : onAdvertisingStopped();
+  if (_statusStep.active && _statusStep.next != REFRESH_NEVER) {
+    if (_statusStep.next <= now)
+      return 0;
+
+    if (!scheduled || _statusStep.next < earliest) {
+      earliest = _statusStep.next;
+      scheduled = true;
+    }
   }
 
-  leds.process();
+  if (!scheduled)
+    return portMAX_DELAY;
+
+  // round up so we never wake before the frame is due
+  return (earliest - now + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
 }
 
 void Lights::onAdvertisingStarted() {
   advertising = true;
-  xTaskCreate(startAdvertisingLight, "advertise-light", 2048, this, 3, &advertisingLightHandle);
+  updateStatusEffect();
 }
 
 void Lights::onAdvertisingStopped() {
   advertising = false;
-  vTaskDelete(advertisingLightHandle);
-  advertisingLightHandle = NULL;
+  updateStatusEffect();
+}
+
+// a little slower than real time when stopped, up to 1.75x when fast
+static const uint16_t speedScales[SpeedClasses] = { 192, 256, 352, 448 };
+
+/*
+  Rescales the clock adaptive effects run on. Each one's start is moved so it
+  carries on from the frame it was showing instead of jumping
+*/
+void Lights::onMovementChanged(MovementState movement) {
+  auto scale = speedScales[std::min(movement.speed, (SpeedClass) (SpeedClasses - 1))];
+  if (scale == _speedScale)
+    return;
+
+  ESP_LOGD(LIGHTS_TAG, "Speed %s, adaptive effects at %d/%d", SpeedClassMap[movement.speed].c_str(), scale, SPEED_SCALE_ONE);
+
+  auto now = millis();
+  for (auto& step : _steps) {
+    if (!step.active || !step.adaptive)
+      continue;
+
+    uint64_t elapsed = (uint64_t) (now - step.start) * _speedScale / scale;
+    step.start = now - elapsed;
+    step.next = now;
+  }
+
+  _speedScale = scale;
+  wake();
+}
+
+/*
+  Picks the status animation for the current state. An animation that's
+  already running keeps its phase, with nothing to animate the status led
+  goes back to showing the power status
+*/
+void Lights::updateStatusEffect() {
+  StatusAnimation animation = StatusAnimation::StatusNone;
+  if (calibratingXG)
+    animation = StatusAnimation::StatusCalibratingXG;
+  else if (calibratingMag)
+    animation = StatusAnimation::StatusCalibratingMag;
+  else if (updating && _updateStatus == UpdateStatus::Write)
+    animation = StatusAnimation::StatusUpdating;
+  else if (advertising)
+    animation = StatusAnimation::StatusAdvertising;
+
+  if (animation == _statusAnimation)
+    return;
+
+  _statusAnimation = animation;
+  if (animation == StatusAnimation::StatusNone) {
+    _statusStep.active = false;
+    updateLightForPowerStatus(_powerStatus);
+    return;
+  }
+
+  LightingParameters effect;
+  effect.effect = LightEffect::Blink;
+  effect.first = { lightOff, false, false };
+  effect.second = { lightOff, false, false };
+
+  switch (animation) {
+    case StatusAnimation::StatusCalibratingXG:
+      effect.first.color = Color(127, 127, 0);
+      effect.duration = 200;
+      break;
+    case StatusAnimation::StatusCalibratingMag:
+      effect.first.color = Color(0, 127, 127);
+      effect.duration = 200;
+      break;
+    case StatusAnimation::StatusUpdating:
+      effect.first.color = ampOrange;
+      effect.duration = 200;
+      break;
+    case StatusAnimation::StatusAdvertising:
+    default:
+      effect.first.color = Color(0, 0, 127);
+      effect.duration = 100;
+      break;
+  }
+
+  _statusEffect = effect;
+  auto now = millis();
+  _statusStep = { true, true, false, false, 0, now, now, { 0 }, 0 };
+  wake();
+}
+
+/*
+  Blinks between the slot's two colors, painted straight to the status led
+*/
+void Lights::renderStatusEffect() {
+  auto& step = _statusStep;
+  auto frame = frameAt(&step, _statusEffect.duration);
+  step.step = frame;
+  leds.setStatus(getStepColor(&step, frame % 2 == 0 ? _statusEffect.first : _statusEffect.second));
+
+  scheduleFrame(&step, frame, _statusEffect.duration);
 }
 
 void Lights::onUpdateStatusChanged(UpdateStatus status) {
+  // replies to the sender, the update itself carries on
+  if (status == UpdateStatus::Resume || status == UpdateStatus::ErrorChecksum)
+    return;
+
   ESP_LOGD(LIGHTS_TAG,"Updating light for update status change");
   if (_updateStatus != status) {
     _updateStatus = status;
 
-    if (updateLightHandle != NULL) {
-      vTaskDelete(updateLightHandle);
-      updateLightHandle = NULL;
-      updateLightForPowerStatus(_powerStatus);
-    }
-
     switch (_updateStatus) {
       case UpdateStatus::Start:
-        updating = true;
-        setStatus(updateStart);
-        break;
-      case UpdateStatus::End:
-        updating = false;
-        setStatus(updateEnd);
-      break;
       case UpdateStatus::Write:
-        setStatus(updateToggle);
-        xTaskCreate(startUpdateLight, "update-light", 2048, this, 3, &updateLightHandle);
+        updating = true;
         break;
       default:
         updating = false;
-      break;
+        break;
     }
 
+    updateStatusEffect();
+
+    // start and end are shown solid, unless something more important is animating
+    if (!_statusStep.active && (status == UpdateStatus::Start || status == UpdateStatus::End))
+      leds.setStatus(status == UpdateStatus::Start ? updateStart : updateEnd);
+
     leds.render(false);
   }
 }
@@ -149,7 +318,7 @@ void Lights::onPowerStatusChanged(PowerStatus status) {
 }
 
 void Lights::updateLightForPowerStatus(PowerStatus status) {
-  if (!updating && !advertising) {
+  if (!updating && !_statusStep.active) {
     if (status.charging) {
       if (status.level != PowerLevel::Charged) {
         leds.setStatus(ampOrange);
@@ -192,6 +361,7 @@ void Lights::updateLightForPowerStatus(PowerStatus status) {
 
 void Lights::setStatus(Color color) {
   leds.setStatus(color);
+  wake();
 }
 
 void Lights::onTouchDown() {
@@ -203,132 +373,318 @@ void Lights::onTouchUp() {
 }
 
 void Lights::onConfigUpdated() {
-  lightsConfig = &Config::ampConfig.lights;
-  
-  for (auto channel : lightsConfig->channels) {
+  onConfigChanged(ConfigChange::ConfigAll);
+}
+
+/*
+  Region only changes keep the strips and canvases, only channel changes rebuild them
+*/
+void Lights::onConfigChanged(uint8_t changes) {
+  MemoryScope memory(MemorySubsystem::MemoryLights);
+
+  // the renderer works from its own copy so nothing it reads changes mid frame,
+  // writers hold the lock while they edit the config
+  auto& config = Config::ampConfig.lights;
+  Config::effectsUpdating.wait(LIGHTS_TAG);
+  Config::effectsUpdating.take(LIGHTS_TAG);
+  if (changes & ConfigChange::ConfigChannels)
+    lightsConfig.channels = config.channels;
+  if (changes & (ConfigChange::ConfigChannels | ConfigChange::ConfigRegions)) {
+    lightsConfig.regions = config.regions;
+    lightsConfig.regionIds = config.regionIds;
+  }
+  if (changes & ConfigChange::ConfigActions) {
+    lightsConfig.palettes = config.palettes;
+    lightsConfig.patterns = config.patterns;
+  }
+  Config::effectsUpdating.give();
+
+  if (changes & ConfigChange::ConfigChannels)
+    configureChannels();
+  else if (changes & ConfigChange::ConfigRegions)
+    configureRegions();
+
+  if (changes & ConfigChange::ConfigActions) {
+    configurePalettes();
+    configurePatterns();
+  }
+
+  if (changes & (ConfigChange::ConfigChannels | ConfigChange::ConfigRegions | ConfigChange::ConfigActions))
+    configureSafety();
+}
+
+/*
+  Brake and turn lights are whatever the motion and turn actions paint, so
+  that's decided by the action table rather than by region names
+*/
+void Lights::configureSafety() {
+  _safety.assign(lightsConfig.regions.size(), false);
+
+  DoubleBuffer<ActionTable>::Reader table(Config::actionTables);
+  for (auto group : { ActionGroup::ActionMotion, ActionGroup::ActionTurn }) {
+    auto effect = table->begin(group, (Actions) 0);
+    auto end = table->end(group, (Actions) (ACTION_COUNT - 1));
+    for (; effect != end; effect++)
+      if (effect->region < _safety.size())
+        _safety[effect->region] = true;
+  }
+}
+
+/*
+  Stops without a position are spread evenly between the ones around them,
+  so "ff0000,00ff00,0000ff" runs red to green to blue across the table
+*/
+bool Lights::bakePalette(const std::string &stops, Palette &out) {
+  std::vector<std::pair<int, Color>> points;
+  for (auto stop : split(stops, ',')) {
+    auto at = stop.find('@');
+    auto hex = stop.substr(0, at);
+    if (hex.length() != 6)
+      return false;
+
+    int position = at == std::string::npos ? -1 : std::min(atoi(stop.c_str() + at + 1), PALETTE_SIZE - 1);
+    points.push_back(std::make_pair(position, hexToColor(hex)));
+  }
+
+  if (points.empty())
+    return false;
+
+  if (points.front().first < 0)
+    points.front().first = 0;
+  if (points.back().first < 0)
+    points.back().first = PALETTE_SIZE - 1;
+
+  // fill in unpositioned stops between their positioned neighbours
+  for (size_t i = 1, last = 0; i < points.size(); i++) {
+    if (points[i].first < 0)
+      continue;
+
+    for (size_t j = last + 1; j < i; j++)
+      points[j].first = points[last].first + (points[i].first - points[last].first) * (int) (j - last) / (int) (i - last);
+    last = i;
+  }
+
+  for (int i = 0; i < points.front().first; i++)
+    out[i] = points.front().second;
+
+  for (size_t i = 1; i < points.size(); i++) {
+    auto& from = points[i - 1];
+    auto& to = points[i];
+    int span = std::max(to.first - from.first, 1);
+    for (int p = from.first; p <= to.first && p < PALETTE_SIZE; p++)
+      out[p] = blend(to.second, from.second, (p - from.first) * 256 / span);
+  }
+
+  for (int i = points.back().first; i < PALETTE_SIZE; i++)
+    out[i] = points.back().second;
+
+  return true;
+}
+
+void Lights::configurePalettes() {
+  auto& sources = lightsConfig.palettes;
+  _palettes.assign(std::min(sources.size(), (size_t) PALETTE_MAX), _rainbow);
+
+  for (uint8_t i = 0; i < _palettes.size(); i++)
+    if (!bakePalette(sources[i], _palettes[i]))
+      ESP_LOGW(LIGHTS_TAG, "Palette %d is invalid, using the rainbow", i);
+}
+
+const Lights::Palette& Lights::paletteFor(const ColorOption &option) {
+  return option.palette < _palettes.size() ? _palettes[option.palette] : _rainbow;
+}
+
+/*
+  Compiled here rather than at config load so the renderer owns the programs,
+  both run on the render task. A pattern that fails to compile renders dark
+*/
+void Lights::configurePatterns() {
+  auto& sources = lightsConfig.patterns;
+  _patterns.assign(std::min(sources.size(), (size_t) PATTERN_MAX_PATTERNS), PatternProgram());
+
+  for (uint8_t i = 0; i < _patterns.size(); i++)
+    if (!PatternProgram::compile(sources[i], &_patterns[i]))
+      ESP_LOGW(LIGHTS_TAG, "Pattern %d failed to compile", i);
+
+  // running patterns pick up their new program
+  for (uint8_t region = 0; region < _effects.size(); region++) {
+    auto& step = _steps[region];
+    if (step.active && _effects[region].effect == LightEffect::Pattern) {
+      step.next = step.start;
+      step.changed = true;
+    }
+  }
+}
+
+void Lights::configureRegions() {
+  // size effect slots for the configured regions, keeping effects on regions that still exist
+  auto regionCount = lightsConfig.regions.size();
+  _effects.resize(regionCount, LightingParameters());
+  _steps.resize(regionCount, RenderStep { false, false, false, false, 0, REFRESH_NEVER, 0, { 0 }, 0 });
+  _kernels.resize(regionCount, selectKernel(LightingParameters()));
+
+  _layers.resize(regionCount);
+  for (auto& region : lightsConfig.regions)
+    _layers[region.id].assign(region.count, lightOff);
+
+  // layers start blank, so running effects repaint straight away
+  // effects are functions of time, so they pick up where they were. the ones that
+  // build up over frames replay from the start to refill the blank layer
+  auto now = millis();
+  for (auto& step : _steps) {
+    if (step.active) {
+      step.changed = true;
+      step.next = now;
+      step.step = 0;
+      step.state = {};
+    }
+  }
+  _layerOrderChanged = true;
+
+  // pixels may have left a region, recomposite everything
+  for (auto channel : lightsConfig.channels) {
+    auto number = channel.second.channel;
+    if (number < _damage.size()) {
+      std::fill(_damage[number].begin(), _damage[number].end(), true);
+      _damagedChannels |= 1 << number;
+    }
+  }
+
+  wake();
+}
+
+void Lights::configureChannels() {
+  // size effect slots for the configured regions
+  auto regionCount = lightsConfig.regions.size();
+  _effects.assign(regionCount, LightingParameters());
+  _steps.assign(regionCount, RenderStep { false, false, false, false, 0, REFRESH_NEVER, 0, { 0 }, 0 });
+  _kernels.assign(regionCount, selectKernel(LightingParameters()));
+  _compositor.clear();
+  _compositor.reserve(regionCount);
+  _layerOrder.clear();
+  _layerOrder.reserve(regionCount);
+  _layerOrderChanged = false;
+
+  _layers.resize(regionCount);
+  for (auto& region : lightsConfig.regions)
+    _layers[region.id].assign(region.count, lightOff);
+
+  // canvases are indexed by channel number
+  uint8_t maxChannel = 0;
+  for (auto channel : lightsConfig.channels)
+    maxChannel = std::max(maxChannel, channel.second.channel);
+
+  _canvas.assign(maxChannel + 1, std::vector<Color>());
+  _damage.assign(maxChannel + 1, std::vector<bool>());
+  for (auto channel : lightsConfig.channels) {
+    _canvas[channel.second.channel].assign(channel.second.leds, lightOff);
+    _damage[channel.second.channel].assign(channel.second.leds, false);
+  }
+  _damagedChannels = 0;
+
+  // strips that left the config go dark, the rest are reused where they haven't changed
+  for (auto it = controllers.begin(); it != controllers.end();) {
+    if (lightsConfig.channels.find(it->first) == lightsConfig.channels.end()) {
+      leds.removeLEDStrip(it->first);
+      it = controllers.erase(it);
+    }
+    else
+      ++it;
+  }
+
+  for (auto channel : lightsConfig.channels) {
     auto channelNum = channel.second.channel;
 
     // don't allow channels 5 - 8 to be added if the corresponding 1 - 4 channel is a DotStar
-    if (channelNum < 5 || (channelNum >= 5 && lightsConfig->channels[channelNum - 4].type != 2))
+    if (channelNum < 5 || (channelNum >= 5 && lightsConfig.channels[channelNum - 4].type != 2))
       controllers[channel.first] = leds.addLEDStrip(channel.second);
+    else if (controllers.find(channel.first) != controllers.end()) {
+      leds.removeLEDStrip(channel.first);
+      controllers.erase(channel.first);
+    }
   }
 
   init = true;
 }
 
 LightRegion Lights::getLightRegion(std::string name) {
-  return lightsConfig->regions[name];
+  auto id = lightsConfig.regionIds.find(name);
+  if (id == lightsConfig.regionIds.end())
+    return LightRegion();
+
+  return lightsConfig.regions[id->second];
 }
 
 std::map<uint8_t, LightChannel> Lights::getAvailableChannels() {
-  return lightsConfig->channels;
+  return lightsConfig.channels;
 }
 
-std::map<std::string, LightRegion> Lights::getAvailableRegions() {
-  return lightsConfig->regions;
+std::vector<LightRegion> Lights::getAvailableRegions() {
+  return lightsConfig.regions;
 }
 
-void Lights::colorRegion(std::string regionName, Color color) {
-  auto region = lightsConfig->regions[regionName];
+void Lights::colorRegion(uint8_t regionId, Color color) {
+  auto& region = lightsConfig.regions[regionId];
+  ESP_LOGV(LIGHTS_TAG,"Color region: %s -> RGB(%d, %d, %d)", region.name.c_str(), color.r, color.g, color.b);
 
-  for (auto section : region.sections) {
-    ESP_LOGV(LIGHTS_TAG,"Color section: %d (%d - %d) -> RGB(%d, %d, %d)", section.channel, section.start, section.end, color.r, color.g, color.b);
-    colorLEDs(section.channel, section.start, section.end, color);
-  }
+  fillRegion(region, color);
 }
 
-void Lights::colorRegionSection(std::string regionName, uint8_t sectionIndex, Color color) {
-  auto region = lightsConfig->regions[regionName];
+void Lights::fillRegion(const LightRegion &region, Color color) {
+  auto& layer = _layers[region.id];
+  std::fill(layer.begin(), layer.end(), color);
+  damageRegion(region);
+}
 
-  if (sectionIndex < region.sections.size()) {
-    auto section = region.sections[sectionIndex];
-    colorLEDs(section.channel, section.start, section.end, color);
-  }
+void Lights::colorRegionSection(uint8_t regionId, uint8_t sectionIndex, Color color) {
+  auto& region = lightsConfig.regions[regionId];
+
+  if (sectionIndex >= region.sections.size())
+    return;
+
+  // sections are laid out back to back in the region's pixel map
+  uint32_t start = 0;
+  for (uint8_t i = 0; i < sectionIndex; i++)
+    start += region.sections[i].end - region.sections[i].start + 1;
+
+  auto& section = region.sections[sectionIndex];
+  uint32_t end = std::min(start + section.end - section.start + 1, region.count);
+
+  for (uint32_t i = start; i < end; i++)
+    setRegionPixel(region, i, color);
 }
 
 void Lights::colorLEDs(uint8_t channel, uint16_t start, uint16_t end, Color color) {
   ESP_LOGV(LIGHTS_TAG,"Color section: %d (%d - %d)", channel, start, end);
-  auto corrected = leds.gammaCorrected(color);
-  leds.setPixels(channel, corrected, start - 1, end);
+  leds.setPixels(channel, color, start - 1, end);
 }
 
 void Lights::render(bool all, int8_t channel) {
   ESP_LOGV(LIGHTS_TAG,"Rendering lights");
   leds.render(all, channel);
+  wake();
 }
 
 void Lights::onCalibrateXGStarted() {
   calibratingXG = true;
   calibratingMag = false;
-
-  xTaskCreate(startCalibrateLight, "calibrate-light", 2048, this, 3, &calibrateLightHandle);
+  updateStatusEffect();
 }
 
 void Lights::onCalibrateXGEnded() {
   calibratingXG = false;
-
-  if (calibrateLightHandle != NULL) {
-    vTaskDelete(calibrateLightHandle);
-    calibrateLightHandle = NULL;
-  }
+  updateStatusEffect();
 }
 
 void Lights::onCalibrateMagStarted() {
   calibratingXG = false;
   calibratingMag = true;
-
-  xTaskCreate(startCalibrateLight, "calibrate-light", 2048, this, 3, &calibrateLightHandle);
+  updateStatusEffect();
 }
 
 void Lights::onCalibrateMagEnded() {
   calibratingMag = false;
-
-  if (calibrateLightHandle != NULL) {
-    vTaskDelete(calibrateLightHandle);
-    calibrateLightHandle = NULL;
-  }
-}
-
-void Lights::startCalibrateLight(void* params) {
-  Lights* lights = (Lights*)params;
-  auto color = lights->calibratingXG ? Color(127, 127, 0) : Color(0, 127, 127);
-
-  for (;;) {
-    lights->setStatus(color);
-    delay(200);
-    lights->setStatus(lightOff);
-    delay(200);
-  }
-
-  vTaskDelete(NULL);
-}
-
-void Lights::startUpdateLight(void* params) {
-  Lights* lights = (Lights*)params;
-  auto color = ampOrange;
-
-  for (;;) {
-    lights->setStatus(color);
-    delay(200);
-    lights->setStatus(lightOff);
-    delay(200);
-  }
-
-  vTaskDelete(NULL);
-}
-
-void Lights::startAdvertisingLight(void* params) {
-  Lights* lights = (Lights*)params;
-  auto color = Color(0, 0, 127);
-
-  for (;;) {
-    lights->setStatus(color);
-    delay(100);
-    lights->setStatus(lightOff);
-    delay(100);
-  }
-
-  vTaskDelete(NULL);
+  updateStatusEffect();
 }
 
 // Input a value 0 to 255 to get a color value.
@@ -347,432 +703,760 @@ Color Lights::colorWheel(uint8_t pos) {
 }
 
 Color Lights::randomColor() {
-  return colorWheel(rand() % 256); 
+  return colorWheel(esp_random() & 0xFF);
 }
 
-void Lights::applyEffect(LightingParameters parameters) {
-  auto region = parameters.region;
+void Lights::applyAction(ActionGroup group, Actions command, bool urgent) {
+  ActionCommand action = { group, command, urgent };
 
-  // replace existing effect if it exists + reset render steps
-  if (lightsConfig->regions.find(region) != lightsConfig->regions.end()) {
-    LightingParameters last;
-    bool replacingOldEffect = false;
-
-    // see if we've got an existing effect for this region
-    if (_effects.find(region) != _effects.end()) {
-      last = _effects[region];
-      replacingOldEffect = true;
-    }
+  portENTER_CRITICAL(&_commandLock);
+  bool queued = _commands.push(action);
+  portEXIT_CRITICAL(&_commandLock);
+
+  if (!queued)
+    ESP_LOGW(LIGHTS_TAG, "Action queue full, dropped action %d for group %d", command, group);
+
+  wake();
+}
 
-    // set the new effect
-    _effects[region] = parameters;
+/*
+  Starts the effects of every queued action in the order they were applied,
+  returns whether any of them were urgent
+*/
+bool Lights::applyCommands() {
+  ActionCommand action;
+  bool urgent = false;
 
-    // do teardown of step data for the old effect
-    if (replacingOldEffect)
-      endEffect(last);
+  if (_commands.empty())
+    return false;
 
-    // initialize step data for effect
+  DoubleBuffer<ActionTable>::Reader table(Config::actionTables);
+  while (_commands.pop(action)) {
+    if (action.command >= ACTION_COUNT)
+      continue;
+
+    for (auto effect = table->begin(action.group, action.command); effect != table->end(action.group, action.command); effect++)
+      applyEffect(*effect);
+
+    urgent |= action.urgent;
+  }
+
+  if (urgent)
+    Profiler::instance()->markLatency(LatencyStage::EffectApplied);
+
+  return urgent;
+}
+
+void Lights::requestBenchmark() {
+  Profiler::instance()->requestEffectBenchmark();
+  wake();
+}
+
+void Lights::applyEffect(const LightingParameters &parameters) {
+  // replace existing effect if it exists + reset render steps
+  if (parameters.region < _effects.size()) {
+    _effects[parameters.region] = parameters;
     startEffect(parameters);
   }
   else
-    ESP_LOGW(LIGHTS_TAG, "Cannot apply effect - Region %s does not exist.", region.c_str());
+    ESP_LOGW(LIGHTS_TAG, "Cannot apply effect - Region %d does not exist.", parameters.region);
 }
 
-void Lights::startEffect(LightingParameters parameters) {
-  switch (parameters.effect) {
-    case LightEffect::Sparkle:
-      _steps[parameters.region] = { 0, millis(), new uint32_t(0) };
-      break;
-    case LightEffect::Scan:
-      _steps[parameters.region] = { 0, millis(), new bool(1) };
-      break;
-    default:
-      _steps[parameters.region] = { 0, millis(), NULL };
+void Lights::startEffect(const LightingParameters &parameters) {
+  auto& step = _steps[parameters.region];
+  auto now = millis();
+  // hardware entropy once per effect, the generator is cheap and lock free from there
+  step = { true, true, false, parameters.adaptive, 0, now, now, { 0 }, esp_random() | 1 };
+  _kernels[parameters.region] = selectKernel(parameters);
+
+  // devices on the same vehicle show the same frame of a repeating effect at the same time.
+  // adaptive effects each follow their own idea of the speed, so they can't share a phase
+  auto clock = SyncClock::instance();
+  if (clock->synced() && isPeriodic(parameters.effect) && !parameters.adaptive) {
+    step.synced = true;
+    step.start = clock->epoch();
   }
 }
 
-void Lights::endEffect(LightingParameters parameters) {
-  switch (parameters.effect) {
-    case LightEffect::Sparkle:
-      delete (uint32_t*) _steps[parameters.region].data;
-      break;
+/*
+  Effects that loop forever, any frame is as good as the first to start on
+*/
+bool Lights::isPeriodic(LightEffect effect) {
+  switch (effect) {
+    case LightEffect::Blink:
+    case LightEffect::Alternate:
+    case LightEffect::Breathe:
+    case LightEffect::Fade:
     case LightEffect::Scan:
-      delete (bool*) _steps[parameters.region].data;
-      break;
+    case LightEffect::Rainbow:
+    case LightEffect::RainbowCycle:
+    case LightEffect::ColorChase:
+    case LightEffect::TheaterChase:
+    case LightEffect::Pattern:
+      return true;
     default:
-      break;
+      return false;
   }
 }
 
 void Lights::renderer(void *args) {
   auto lights = Lights::instance();
-  std::priority_queue<LightingParameters, std::vector<LightingParameters>, std::greater<LightingParameters>> compositor;
-  std::vector<LightingParameters> staticEffects;
+  auto profiler = Profiler::instance();
+  auto& compositor = lights->_compositor;
+  auto byLayer = [lights](uint8_t a, uint8_t b) { 
+    auto& first = lights->_effects[a];
+    auto& second = lights->_effects[b];
+    return first.layer == second.layer ? a < b : first.layer < second.layer;
+  };
+  // safety regions first, then whichever has waited longest so deferred regions can't starve
+  auto byUrgency = [lights](uint8_t a, uint8_t b) {
+    bool first = lights->_safety[a], second = lights->_safety[b];
+    return first != second ? first : lights->_steps[a].next < lights->_steps[b].next;
+  };
+  bool deferred = false;
 
   for (;;) {
-    // process any messages
-    lights->process();
+    // sleep until the next frame is due or something needs our attention. deferred
+    // regions are already due, so give everyone else a tick before painting them
+    auto delay = lights->nextFrameDelay();
+    lights->processEvents(deferred ? std::max<TickType_t>(delay, 1) : delay);
 
-    // schedule effects to be rendered
+    // a safety pass paints just the safety regions, composites and flushes, whatever
+    // else is due stays due and goes out on the pass straight after
+    bool urgent = lights->applyCommands();
+
+    if (profiler->takeEffectBenchmark())
+      lights->benchmarkEffects();
+
+    // schedule effects to be rendered. static layers paint once and stay cached
+    auto frameStart = Profiler::now();
     auto now = millis();
-    for (auto const& [region, step] : lights->_steps) {
-      auto& effect = lights->_effects[region];
+    // every effect painted this pass is evaluated at the same instant
+    lights->_frameTime = now;
+    unsigned long lateness = 0;
+    for (uint8_t region = 0; region < lights->_steps.size(); region++) {
+      auto& step = lights->_steps[region];
+      if (!step.active)
+        continue;
+
+      // a new effect may have changed the region's layer or opacity, so everything
+      // it covers has to be recomposited, not just the pixels it paints
+      if (step.changed) {
+        step.changed = false;
+        lights->_layerOrderChanged = true;
+        lights->damageRegion(lights->lightsConfig.regions[region]);
+      }
+
+      if (urgent && !lights->_safety[region])
+        continue;
 
-      if (step.next != REFRESH_NEVER && step.next <= now)
-        compositor.push(effect);
-      else if (effect.effect == LightEffect::Static || effect.effect == LightEffect::Off)
-        staticEffects.push_back(effect);
+      if (step.next != REFRESH_NEVER && step.next <= now) {
+        compositor.push_back(region);
+        lateness = std::max(lateness, now - step.next);
+      }
     }
 
-    bool updatesNeeded = compositor.size() > 0;
-    
-    // re-render static/off effects if we've got updates
-    if (updatesNeeded)
-      for (auto& effect : staticEffects)
-        compositor.push(effect);
-
-    staticEffects.clear();
-
-    // apply effects
-    while (compositor.size() > 0) {
-      auto next = compositor.top();
-      auto& effect = lights->_effects[next.region];
-      auto& step = lights->_steps[next.region];
-      ESP_LOGV(LIGHTS_TAG, "Painting effect %d on %s", effect.effect, next.region.c_str());
-      lights->renderLightingEffect(&effect, &step);
-      compositor.pop();
+    bool painting = compositor.size() > 0;
+
+    if (lights->_statusStep.active && lights->_statusStep.next <= now)
+      lights->renderStatusEffect();
+
+    if (compositor.size() > 1)
+      std::sort(compositor.begin(), compositor.end(), byUrgency);
+
+    // paint each due effect into its own layer. once the pass is over budget
+    // decorative regions stay due and are picked up on the next one
+    uint8_t skipped = 0;
+    for (auto region : compositor) {
+      if (!lights->_safety[region] && Profiler::now() - frameStart > RENDER_FRAME_BUDGET) {
+        skipped++;
+        continue;
+      }
+
+      auto& effect = lights->_effects[region];
+      auto& step = lights->_steps[region];
+      ESP_LOGV(LIGHTS_TAG, "Painting effect %d on %s", effect.effect, lights->lightsConfig.regions[region].name.c_str());
+      auto start = Profiler::now();
+      lights->renderLightingEffect(lights->_kernels[region], lights->lightsConfig.regions[region], &effect, &step);
+      profiler->recordEffect(effect.effect, start);
+    }
+
+    compositor.clear();
+    deferred = skipped > 0;
+    if (deferred)
+      profiler->recordSkipped(skipped);
+
+    if (lights->_layerOrderChanged) {
+      lights->_layerOrderChanged = false;
+      lights->_layerOrder.clear();
+      for (uint8_t region = 0; region < lights->_steps.size(); region++)
+        if (lights->_steps[region].active)
+          lights->_layerOrder.push_back(region);
+
+      std::sort(lights->_layerOrder.begin(), lights->_layerOrder.end(), byLayer);
     }
 
-    // render lights
-    if (updatesNeeded)
-      lights->render(true);
-      
-    delay(10);
+    auto compositeStart = Profiler::now();
+    lights->composite();
+    profiler->recordComposite(compositeStart);
+
+    // painted pixels mark their own channels dirty
+    lights->leds.process();
+
+    if (painting) {
+      profiler->recordFrame(frameStart, lateness);
+      if (!profiler->booted(BootStage::BootFirstLight))
+        profiler->markBoot(BootStage::BootFirstLight);
+    }
   }
 }
 
-void Lights::renderLightingEffect(LightingParameters *params, RenderStep *step) {
-  switch (params->effect) {
+void Lights::renderLightingEffect(EffectKernel kernel, const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  // follow the shared clock as it's refined
+  if (step->synced)
+    step->start = SyncClock::instance()->epoch();
+
+  (this->*kernel)(region, params, step);
+}
+
+#define EFFECT_KERNEL(name) (dynamic ? &Lights::name<true> : &Lights::name<false>)
+
+Lights::EffectKernel Lights::selectKernel(const LightingParameters &params) {
+  auto isDynamic = [](const ColorOption &option) { return option.random || option.rainbow || option.palette != PALETTE_NONE; };
+  bool dynamic = isDynamic(params.first) || isDynamic(params.second) || isDynamic(params.third);
+
+  switch (params.effect) {
+    case LightEffect::Blink: return EFFECT_KERNEL(blink);
+    case LightEffect::Alternate: return EFFECT_KERNEL(alternate);
+    case LightEffect::ColorWipe: return EFFECT_KERNEL(colorWipe);
+    case LightEffect::Breathe: return EFFECT_KERNEL(breathe);
+    case LightEffect::Fade: return EFFECT_KERNEL(fade);
+    case LightEffect::Scan: return EFFECT_KERNEL(scan);
+    case LightEffect::Rainbow: return &Lights::rainbow;
+    case LightEffect::RainbowCycle: return &Lights::rainbowCycle;
+    case LightEffect::ColorChase: return EFFECT_KERNEL(colorChase);
+    case LightEffect::TheaterChase: return EFFECT_KERNEL(theaterChase);
+    case LightEffect::Twinkle: return EFFECT_KERNEL(twinkle);
+    case LightEffect::Sparkle: return EFFECT_KERNEL(sparkle);
+    case LightEffect::Transparent: return &Lights::transparent;
+    case LightEffect::Pattern: return &Lights::pattern;
     case LightEffect::Off:
     case LightEffect::Static:
-      color(params, step);
-      break;
-    case LightEffect::Blink:
-      blink(params, step);
-      break;
-    case LightEffect::Alternate:
-      alternate(params, step);
-      break;
-    case LightEffect::ColorWipe:
-      colorWipe(params, step);
-      break;
-    case LightEffect::Breathe:
-      breathe(params, step);
-      break;
-    case LightEffect::Fade:
-      fade(params, step);
-      break;
-    case LightEffect::Scan:
-      scan(params, step);
-      break;
-    case LightEffect::Rainbow:
-      rainbow(params, step);
-      break;
-    case LightEffect::RainbowCycle:
-      rainbowCycle(params, step);
-      break;
-    case LightEffect::ColorChase:
-      colorChase(params, step);
-      break;
-    case LightEffect::TheaterChase:
-      theaterChase(params, step);
-      break;
-    case LightEffect::Twinkle:
-      twinkle(params, step);
-      break;
-    case LightEffect::Sparkle:
-      sparkle(params, step);
-      break;
-    case LightEffect::Transparent:
-      break;
+    default:
+      return EFFECT_KERNEL(color);
   }
 }
 
-void Lights::setRegionPixel(std::string regionName, uint32_t index, Color pixel) {
-  auto region = lightsConfig->regions[regionName];
-  if (index > region.count)
-    return;
-
-  uint32_t base = 0;
-  for (int i = 0; i < region.breaks.size(); i++) {
-    if (index <= base + region.breaks[i]) {
-      auto& section = region.sections[i];
-      uint16_t regionIndex = index - base;
-      leds.setPixel(section.channel, pixel, regionIndex);
-      break;
+#undef EFFECT_KERNEL
+
+/*
+  Paints every effect over synthetic regions into a scratch layer. The
+  regions sit on a channel that doesn't exist so nothing is composited or
+  sent, only the effect itself is timed. Runs on the renderer between frames
+*/
+void Lights::benchmarkEffects() {
+  auto profiler = Profiler::instance();
+  auto frameTime = _frameTime;
+
+  LightingParameters params;
+  params.first = { ampPink, false, false };
+  params.second = { lightOff, false, false };
+  params.third = { ampPurple, false, false };
+  params.duration = 1000;
+
+  LightRegion region;
+  region.id = _layers.size();
+  _layers.emplace_back();
+
+  for (uint8_t layout = 0; layout < PROFILER_BENCH_LAYOUTS; layout++) {
+    region.count = profilerBenchLayouts[layout];
+    region.pixels.assign(region.count, LightPixel { UINT8_MAX, 0 });
+    for (uint32_t i = 0; i < region.count; i++)
+      region.pixels[i].offset = i;
+    _layers.back().assign(region.count, lightOff);
+
+    for (uint8_t effect = LightEffect::Static; effect < PROFILER_EFFECTS; effect++) {
+      params.effect = (LightEffect) effect;
+      RenderStep step = { true, true, false, false, 0, 0, 0, { 0 }, 0 };
+      auto kernel = selectKernel(params);
+
+      // advance a frame of the effect per call so every path is exercised
+      auto start = Profiler::now();
+      for (uint32_t frame = 0; frame < PROFILER_BENCH_FRAMES; frame++) {
+        _frameTime = step.next;
+        renderLightingEffect(kernel, region, &params, &step);
+        if (step.next == REFRESH_NEVER)
+          step.next = _frameTime + 1;
+      }
+      profiler->recordEffectCost(params.effect, layout, start, PROFILER_BENCH_FRAMES);
     }
-    base += region.breaks[i];
   }
+
+  _layers.pop_back();
+  _frameTime = frameTime;
+  ESP_LOGI(LIGHTS_TAG, "Effect benchmark complete");
 }
 
-Color Lights::getRegionPixel(std::string regionName, uint32_t index) {
-  auto region = lightsConfig->regions[regionName];
-  if (index > region.count)
+void Lights::setRegionPixel(const LightRegion &region, uint32_t index, Color pixel) {
+  auto& layer = _layers[region.id];
+  if (index >= region.count || index >= layer.size())
+    return;
+
+  layer[index] = pixel;
+  damagePixel(region.pixels[index]);
+}
+
+Color Lights::getRegionPixel(const LightRegion &region, uint32_t index) {
+  auto& layer = _layers[region.id];
+  if (index >= region.count || index >= layer.size())
     return lightOff;
 
-  uint32_t base = 0;
-  for (int i = 0; i < region.breaks.size(); i++) {
-    if (index <= base + region.breaks[i]) {
-      auto& section = region.sections[i];
-      uint16_t regionIndex = index - base;
-      return leds.getPixel(section.channel, regionIndex);
+  return layer[index];
+}
+
+void Lights::damagePixel(const LightPixel &pixel) {
+  if (pixel.channel >= _damage.size() || pixel.offset >= _damage[pixel.channel].size())
+    return;
+
+  _damage[pixel.channel][pixel.offset] = true;
+  _damagedChannels |= 1 << pixel.channel;
+}
+
+void Lights::damageRegion(const LightRegion &region) {
+  for (auto& pixel : region.pixels)
+    damagePixel(pixel);
+}
+
+void Lights::composite() {
+  if (_damagedChannels == 0)
+    return;
+
+  // damaged pixels start from black and are rebuilt from every layer covering them
+  for (uint8_t channel = 0; channel < _canvas.size(); channel++) {
+    if (!(_damagedChannels & (1 << channel)))
+      continue;
+
+    auto& canvas = _canvas[channel];
+    auto& damage = _damage[channel];
+    for (uint16_t i = 0; i < canvas.size(); i++)
+      if (damage[i])
+        canvas[i] = lightOff;
+  }
+
+  for (auto regionId : _layerOrder) {
+    auto opacity = _effects[regionId].opacity;
+    if (opacity == 0)
+      continue;
+
+    auto& region = lightsConfig.regions[regionId];
+    auto& layer = _layers[regionId];
+    uint32_t count = std::min<uint32_t>(region.count, layer.size());
+
+    for (uint32_t i = 0; i < count; i++) {
+      auto& pixel = region.pixels[i];
+      if (!(_damagedChannels & (1 << pixel.channel)) || pixel.offset >= _damage[pixel.channel].size()
+        || !_damage[pixel.channel][pixel.offset])
+        continue;
+
+      auto& out = _canvas[pixel.channel][pixel.offset];
+      out = opacity == 255 ? layer[i] : blend(layer[i], out, opacity + (opacity >> 7));
     }
-    base += region.breaks[i];
   }
 
-  return lightOff;
+  for (uint8_t channel = 0; channel < _canvas.size(); channel++) {
+    if (!(_damagedChannels & (1 << channel)))
+      continue;
+
+    leds.setFrame(channel, _canvas[channel]);
+    std::fill(_damage[channel].begin(), _damage[channel].end(), false);
+  }
+
+  _damagedChannels = 0;
+  Profiler::instance()->markLatency(LatencyStage::Composited);
 }
 
-Color Lights::blend(Color first, Color second, float weight) {
-  Color blended;
+// weight is 8.8 fixed point, 0 gives all of second and 256 gives all of first
+Color Lights::blend(Color first, Color second, uint16_t weight) {
+  uint16_t inverse = 256 - weight;
 
-  blended.r = (uint8_t)(round(first.r * weight) + round(second.r * (1.f - weight)));
-  blended.g = (uint8_t)(round(first.g * weight) + round(second.g * (1.f - weight)));
-  blended.b = (uint8_t)(round(first.b * weight) + round(second.b * (1.f - weight)));
+  return Color(
+    (first.r * weight + second.r * inverse) >> 8,
+    (first.g * weight + second.g * inverse) >> 8,
+    (first.b * weight + second.b * inverse) >> 8);
+}
 
-  return blended;
+// xorshift32, each region's step carries its own state so nothing is shared between tasks
+uint32_t Lights::stepRandom(RenderStep *step) {
+  uint32_t x = step->seed != 0 ? step->seed : RENDER_SEED;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  step->seed = x;
+  return x;
 }
 
 Color Lights::getStepColor(RenderStep *step, ColorOption option) {
-  if (option.random)
-    return Color(random() % 255, random() % 255, random() % 255);
-  else if (option.rainbow)
-    return colorWheel(step->step % 256);
+  if (option.random) {
+    // one draw is enough for all three channels, each can reach the full 255
+    uint32_t bits = stepRandom(step);
+    return Color(bits >> 24, (bits >> 16) & 0xFF, (bits >> 8) & 0xFF);
+  }
+  else if (option.rainbow || option.palette != PALETTE_NONE)
+    return paletteFor(option)[step->step % PALETTE_SIZE];
   else
     return option.color;
 }
 
-void Lights::color(LightingParameters *params, RenderStep *step) {
-  auto first = getStepColor(step, params->first);
-  colorRegion(params->region, first);
+template <bool Dynamic>
+Color Lights::stepColor(RenderStep *step, const ColorOption &option) {
+  if constexpr (Dynamic)
+    return getStepColor(step, option);
+  else
+    return option.color;
+}
 
-  // set time to render next frame
-  step->next = REFRESH_NEVER;
+/*
+  The frame an effect with the given frame period is on at _frameTime. Effects
+  are painted from this rather than counting their own calls, so a late frame
+  skips ahead instead of slowing the animation down
+*/
+// time since the step started, on the speed scaled clock for adaptive effects
+unsigned long Lights::stepTime(RenderStep *step) {
+  unsigned long elapsed = _frameTime - step->start;
+  return step->adaptive ? (uint64_t) elapsed * _speedScale / SPEED_SCALE_ONE : elapsed;
 }
 
-void Lights::blink(LightingParameters *params, RenderStep *step) {
-  // set color depending on odd or even step
-  auto first = getStepColor(step, params->first);
-  auto second = getStepColor(step, params->second);
+unsigned long Lights::frameAt(RenderStep *step, unsigned long period) {
+  return stepTime(step) / std::max(period, 1UL);
+}
 
-  step->step % 2 == 0 ? colorRegion(params->region, first) : colorRegion(params->region, second);
+// next frame boundary, anchored to the start so lateness never accumulates
+void Lights::scheduleFrame(RenderStep *step, unsigned long frame, unsigned long period) {
+  uint64_t offset = (uint64_t) (frame + 1) * std::max(period, 1UL);
+  if (step->adaptive)
+    offset = (offset * SPEED_SCALE_ONE + _speedScale - 1) / _speedScale;
+  step->next = step->start + offset;
+}
+
+template <bool Dynamic>
+void Lights::color(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  auto first = stepColor<Dynamic>(step, params->first);
+  fillRegion(region, first);
 
   // set time to render next frame
-  step->next = millis() + params->duration;
-  step->step++;
+  step->next = REFRESH_NEVER;
 }
 
-void Lights::colorWipe(LightingParameters *params, RenderStep *step) {
-  auto region = lightsConfig->regions[params->region];
-  auto total = region.count;
+template <bool Dynamic>
+void Lights::blink(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  auto frame = frameAt(step, params->duration);
+  step->step = frame;
 
-  auto first = getStepColor(step, params->first);
-  auto second = getStepColor(step, params->second);
+  // set color depending on odd or even frame
+  auto first = stepColor<Dynamic>(step, params->first);
+  auto second = stepColor<Dynamic>(step, params->second);
 
-  // the animation is complete
-  if (step->step > total * 2) {
+  frame % 2 == 0 ? fillRegion(region, first) : fillRegion(region, second);
+
+  scheduleFrame(step, frame, params->duration);
+}
+
+/*
+  Wipes first across the region, then second. step counts the pixels painted
+  so far, a late frame catches up on every pixel it missed
+*/
+template <bool Dynamic>
+void Lights::colorWipe(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  auto total = region.count;
+  if (total == 0) {
     step->next = REFRESH_NEVER;
     return;
   }
-  
-  uint8_t position = step->step > total ? step->step % total : step->step;
 
-  if (step->step < total)
-    setRegionPixel(params->region, position, first);
+  auto first = stepColor<Dynamic>(step, params->first);
+  auto second = stepColor<Dynamic>(step, params->second);
+
+  unsigned long period = params->duration / (total * 2);
+  auto frame = std::min(frameAt(step, period), (unsigned long) total * 2 - 1);
+
+  for (; step->step <= frame; step->step++) {
+    uint32_t position = step->step % total;
+    setRegionPixel(region, position, step->step < total ? first : second);
+  }
+
+  // the animation is complete
+  if (frame == total * 2 - 1)
+    step->next = REFRESH_NEVER;
   else
-    setRegionPixel(params->region, position, second);
-  
-  // calculate next animation step
-  unsigned long next = params->duration / (total * 2);
-  step->next = millis() + next;
-  step->step++;
+    scheduleFrame(step, frame, period);
 }
 
-void Lights::breathe(LightingParameters *params, RenderStep *step) {
-  uint16_t lum = step->step % 512;
-  if (lum > 255) lum = 511 - lum;
-  float weight = lum / 256.f;
-  
-  uint16_t delay;
-  if(lum == 15) delay = 970;
-  else if(lum <=  25) delay = 38;
-  else if(lum <=  50) delay = 36;
-  else if(lum <=  75) delay = 28;
-  else if(lum <= 100) delay = 20;
-  else if(lum <= 125) delay = 14;
-  else if(lum <= 150) delay = 11;
-  else delay = 10;
-
-  auto first = getStepColor(step, params->first);
-  auto second = getStepColor(step, params->second);
-  auto color = blend(second, first, weight);
-  colorRegion(params->region, color);
+/*
+  Holds dim for a moment then swells to full and back, the curve is eased so
+  it lingers at both ends like the old stepped delay table did
+*/
+template <bool Dynamic>
+void Lights::breathe(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  auto elapsed = stepTime(step) % BREATHE_CYCLE;
+  uint16_t weight = BREATHE_FLOOR;
 
-  step->step += 2;
-  if (step->step > 512 - 15)
-    step->step = 15;
+  if (elapsed >= BREATHE_HOLD)
+    weight = _breathe[(elapsed - BREATHE_HOLD) * PALETTE_SIZE / (BREATHE_CYCLE - BREATHE_HOLD)];
 
-  step->next = millis() + delay;
+  auto first = stepColor<Dynamic>(step, params->first);
+  auto second = stepColor<Dynamic>(step, params->second);
+  auto color = blend(second, first, weight);
+  fillRegion(region, color);
+
+  // nothing moves while holding, sleep through it
+  auto frame = frameAt(step, BREATHE_FRAME);
+  if (elapsed < BREATHE_HOLD) {
+    unsigned long hold = BREATHE_HOLD - elapsed;
+    if (step->adaptive)
+      hold = ((uint64_t) hold * SPEED_SCALE_ONE + _speedScale - 1) / _speedScale;
+    step->next = _frameTime + hold;
+  }
+  else
+    scheduleFrame(step, frame, BREATHE_FRAME);
+  step->step = frame;
 }
 
-void Lights::fade(LightingParameters *params, RenderStep *step) {
-  uint16_t lum = step->step % 512;
+template <bool Dynamic>
+void Lights::fade(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  unsigned long period = params->duration / 128;
+  auto frame = frameAt(step, period);
+  step->step = frame;
+
+  // 128 frames from first to second and back
+  uint16_t lum = (frame * 4) % 512;
   if (lum > 255) lum = 511 - lum;
-  float weight = lum / 256.f;
+  uint16_t weight = lum;
 
-  auto first = getStepColor(step, params->first);
-  auto second = getStepColor(step, params->second);
+  auto first = stepColor<Dynamic>(step, params->first);
+  auto second = stepColor<Dynamic>(step, params->second);
   auto color = blend(first, second, weight);
-  colorRegion(params->region, color);
+  fillRegion(region, color);
+
+  scheduleFrame(step, frame, period);
+}
+
+template <bool Dynamic>
+void Lights::scan(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  auto count = std::max(region.count, (uint32_t) 1);
+  unsigned long period = params->duration / (count * 2);
+  auto frame = frameAt(step, period);
+  step->step = frame;
+
+  auto first = stepColor<Dynamic>(step, params->first);
+  auto second = stepColor<Dynamic>(step, params->second);
 
-  step->step += 4;
-  if (step->step > 511)
-    step->step = 0;
+  // out to the end and back again
+  uint32_t position = frame % (count * 2);
+  if (position > count)
+    position = count * 2 - position;
 
-  step->next = millis() + params->duration / 128;
+  fillRegion(region, first);
+  setRegionPixel(region, position, second);
+
+  scheduleFrame(step, frame, period);
 }
 
-void Lights::scan(LightingParameters *params, RenderStep *step) {
-  auto region = lightsConfig->regions[params->region];
-  auto first = getStepColor(step, params->first);
-  auto second = getStepColor(step, params->second);
+void Lights::rainbow(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  unsigned long period = params->duration / 256;
+  auto frame = frameAt(step, period);
+  step->step = frame;
+  uint8_t position = frame % 256;
 
-  bool direction;
-  memcpy(&direction, step->data, sizeof(bool));
+  // hue advances by 256 / count per pixel, in 16.16 fixed point to keep the divide out of the loop
+  auto& palette = paletteFor(params->first);
+  uint32_t hueStep = region.count > 0 ? (256 << 16) / region.count : 0;
+  uint32_t hue = 0;
+  for (uint32_t i = 0; i < region.count; i++, hue += hueStep)
+    setRegionPixel(region, i, palette[((hue >> 16) + position) & 0xFF]);
 
-  colorRegion(params->region, first);
-  setRegionPixel(params->region, step->step, second);
+  scheduleFrame(step, frame, period);
+}
 
-  step->step += direction ? 1 : -1;
+void Lights::rainbowCycle(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  unsigned long period = params->duration / 256;
+  auto frame = frameAt(step, period);
+  step->step = frame;
 
-  // swap directions when we hit the end
-  if (step->step == 0 || step->step >= region.count)
-    direction = !direction;
+  fillRegion(region, paletteFor(params->first)[frame % PALETTE_SIZE]);
 
-  memcpy(step->data, &direction, sizeof(bool));
-  step->next = millis() + params->duration / (region.count * 2);
+  scheduleFrame(step, frame, period);
 }
 
-void Lights::rainbow(LightingParameters *params, RenderStep *step) {
-  auto region = lightsConfig->regions[params->region];
-  uint8_t position = step->step % 256;
+template <bool Dynamic>
+void Lights::colorChase(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  unsigned long period = params->duration / 3;
+  auto frame = frameAt(step, period);
+  step->step = frame;
+
+  auto first = stepColor<Dynamic>(step, params->first);
+  auto second = stepColor<Dynamic>(step, params->second);
+  auto third = stepColor<Dynamic>(step, params->third);
 
+  const Color colors[3] = { first, second, third };
+  uint8_t index = frame % 3;
   for (uint32_t i = 0; i < region.count; i++) {
-    auto color = colorWheel(((i * 256 / region.count) + position) & 0xFF);
-    setRegionPixel(params->region, i, color);
+    setRegionPixel(region, i, colors[index]);
+    if (++index == 3)
+      index = 0;
   }
-  
-  step->next = millis() + params->duration / 256;
-  step->step++;
+
+  scheduleFrame(step, frame, period);
 }
 
-void Lights::rainbowCycle(LightingParameters *params, RenderStep *step) {
-  uint8_t position = step->step % 256;
-  auto color = colorWheel(position);
-  colorRegion(params->region, color);
+/*
+  Frames alternate lighting and clearing every third pixel, moving the offset
+  along each frame. Each pixel shows whatever the last frame to touch its
+  offset left it as, so the whole region can be painted from the frame alone
+*/
+template <bool Dynamic>
+void Lights::theaterChase(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  auto frame = frameAt(step, params->duration);
+  step->step = frame;
+  auto first = stepColor<Dynamic>(step, params->first);
+
+  Color offsets[3];
+  for (uint8_t offset = 0; offset < 3; offset++) {
+    unsigned long back = (frame + 3 - offset) % 3;
+    offsets[offset] = back <= frame && (frame - back) % 2 == 0 ? first : lightOff;
+  }
+
+  for (uint32_t i = 0; i < region.count; i++)
+    setRegionPixel(region, i, offsets[i % 3]);
 
-  step->next = millis() + params->duration / 256;
-  step->step++;
+  scheduleFrame(step, frame, params->duration);
 }
 
-void Lights::colorChase(LightingParameters *params, RenderStep *step) {
-  auto region = lightsConfig->regions[params->region];
-  auto first = getStepColor(step, params->first);
-  auto second = getStepColor(step, params->second);
-  auto third = getStepColor(step, params->third);
-  
-  uint8_t index = step->step % 3;
-  for (uint32_t i = 0; i < region.count; i++, index++) {
-    index %= 3;
-    Color color;
-    switch (index) {
-      case 0: color = first; break;
-      case 1: color = second; break;
-      case 2: color = third; break;
-      default: color = first;
-    }
-    setRegionPixel(params->region, i, color);
+/*
+  Lights random pixels until a random fraction of the region is lit, then
+  starts again from second. step counts frames painted, missed frames are
+  caught up on but never more than a region's worth at once
+*/
+template <bool Dynamic>
+void Lights::twinkle(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  if (region.count == 0) {
+    step->next = REFRESH_NEVER;
+    return;
   }
 
-  step->next = millis() + params->duration / 3;
-  step->step++;
-}
+  auto first = stepColor<Dynamic>(step, params->first);
+  auto second = stepColor<Dynamic>(step, params->second);
 
-void Lights::theaterChase(LightingParameters *params, RenderStep *step) {
-  auto region = lightsConfig->regions[params->region];
-  bool on = step->step % 2 == 0;
-  auto first = getStepColor(step, params->first);
+  unsigned long period = params->duration / region.count;
+  auto frame = frameAt(step, period);
+  if (frame >= step->step + region.count)
+    step->step = frame + 1 - region.count;
 
-  for (uint32_t i = step->step % 3; i < region.count; i += 3) {
-    if (on) setRegionPixel(params->region, i, first);
-    else setRegionPixel(params->region, i, lightOff);
+  for (; step->step <= frame; step->step++) {
+    if (step->state.remaining == 0) {
+      fillRegion(region, second);
+      uint32_t min = (region.count / 4) + 1;
+      step->state.remaining = stepRandom(step, min) + min;
+    }
+
+    setRegionPixel(region, stepRandom(step, region.count), first);
+    step->state.remaining--;
   }
 
-  step->next = millis() + params->duration;
-  step->step++;
+  scheduleFrame(step, frame, period);
 }
 
-void Lights::twinkle(LightingParameters *params, RenderStep *step) {
-  auto region = lightsConfig->regions[params->region];
-
-  auto first = getStepColor(step, params->first);
-  auto second = getStepColor(step, params->second);
+template <bool Dynamic>
+void Lights::sparkle(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  if (region.count == 0) {
+    step->next = REFRESH_NEVER;
+    return;
+  }
 
-  if (step->step == 0) {
-    colorRegion(params->region, second);
-    uint32_t min = (region.count / 4) + 1;
-    step->step = rand() % min + min;
+  unsigned long period = params->duration / region.count;
+  auto frame = frameAt(step, period);
+  if (step->step > frame) {
+    scheduleFrame(step, frame, period);
+    return;
   }
 
-  setRegionPixel(params->region, rand() % region.count, first);
-  step->step--;
+  auto first = stepColor<Dynamic>(step, params->first);
+  auto second = stepColor<Dynamic>(step, params->second);
 
-  step->next = millis() + region.count > 0 ? params->duration / region.count : REFRESH_NEVER;
+  // only the latest sparkle is ever visible, skipped frames cost nothing
+  if (step->step == 0)
+    fillRegion(region, first);
+  else
+    setRegionPixel(region, step->state.pixel, first);
+
+  step->state.pixel = stepRandom(step, region.count);
+  setRegionPixel(region, step->state.pixel, second);
+
+  step->step = frame + 1;
+  scheduleFrame(step, frame, period);
 }
 
-void Lights::sparkle(LightingParameters *params, RenderStep *step) {
-  auto region = lightsConfig->regions[params->region];
-  auto first = getStepColor(step, params->first);
-  auto second = getStepColor(step, params->second);
+template <bool Dynamic>
+void Lights::alternate(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  auto frame = frameAt(step, params->duration);
+  step->step = frame;
 
-  uint32_t pixel;
+  auto first = stepColor<Dynamic>(step, params->first);
+  auto second = stepColor<Dynamic>(step, params->second);
 
-  if (step->step == 0)
-    colorRegion(params->region, first);
-  else {
-    memcpy(&pixel, step->data, sizeof(uint32_t));
-    setRegionPixel(params->region, pixel, first);
+  bool toggle = frame % 2 == 0;
+  for (uint32_t i = 0; i < region.count; i++) {
+    setRegionPixel(region, i, toggle ? first : second);
+    toggle = !toggle;
   }
 
-  pixel = region.count > 0 ? rand() % region.count : 0;
-  memcpy(step->data, &pixel, sizeof(uint32_t));
-  setRegionPixel(params->region, pixel, second);
+  scheduleFrame(step, frame, params->duration);
+}
 
-  step->next = millis() + region.count > 0 ? params->duration / region.count : REFRESH_NEVER;
-  step->step++;
+void Lights::transparent(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  // nothing to paint, the region was damaged when the effect started
+  step->next = REFRESH_NEVER;
 }
 
-void Lights::alternate(LightingParameters *params, RenderStep *step) {
-  auto region = lightsConfig->regions[params->region];
-  auto first = getStepColor(step, params->first);
-  auto second = getStepColor(step, params->second);
+/*
+  Runs a user pattern for every pixel, mixing across the three colors. A pattern
+  that never reads the time is painted once
+*/
+void Lights::pattern(const LightRegion &region, LightingParameters *params, RenderStep *step) {
+  if (params->pattern >= _patterns.size() || !_patterns[params->pattern].valid()) {
+    fillRegion(region, lightOff);
+    step->next = REFRESH_NEVER;
+    return;
+  }
+
+  auto& program = _patterns[params->pattern];
+  auto frame = frameAt(step, PATTERN_FRAME);
+  uint32_t elapsed = stepTime(step);
+  uint32_t phase = params->duration > 0 ? (elapsed % params->duration) * 256 / params->duration : 0;
+  const Color colors[3] = {
+    getStepColor(step, params->first), getStepColor(step, params->second), getStepColor(step, params->third)
+  };
+
+  auto palette = params->first.palette != PALETTE_NONE ? &paletteFor(params->first) : nullptr;
 
-  bool toggle = step->step % 2 == 0;
+  program.beginFrame(region.count, elapsed, phase);
   for (uint32_t i = 0; i < region.count; i++) {
-    setRegionPixel(params->region, i, toggle ? first : second);
-    toggle = !toggle;
+    int32_t mix, level;
+    program.evaluate(i, &mix, &level);
+    mix = std::min(std::max(mix, (int32_t) 0), (int32_t) 511);
+    level = std::min(std::max(level, (int32_t) 0), (int32_t) 255);
+
+    // a palette on the first color spreads the mix across the palette instead
+    Color color;
+    if (palette != nullptr)
+      color = (*palette)[mix >> 1];
+    else
+      color = mix < 256 ? blend(colors[1], colors[0], mix) : blend(colors[2], colors[1], mix - 256);
+    setRegionPixel(region, i, blend(color, lightOff, level + (level >> 7)));
   }
-  
-  step->next = millis() + params->duration;
-  step->step++;
-}
\ No newline at end of file
+
+  step->step = frame;
+  if (program.animated())
+    scheduleFrame(step, frame, PATTERN_FRAME);
+  else
+    step->next = REFRESH_NEVER;
+}
@@ -0,0 +1,59 @@
+#include <hal/memory-stats.h>
+
+MemoryUsage MemoryStats::usage[MemorySubsystems];
+
+static const char* subsystemNames[MemorySubsystems] = { "config", "lights", "ble" };
+
+void MemoryStats::record(MemorySubsystem subsystem, int32_t retained) {
+  if (subsystem >= MemorySubsystems)
+    return;
+
+  auto& stats = usage[subsystem];
+  stats.retained += retained;
+  stats.scopes++;
+
+  int32_t largest = stats.largest;
+  while (retained > largest && !stats.largest.compare_exchange_weak(largest, retained)) { }
+
+  auto block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  if (block < MEMORY_LOW_BLOCK)
+    ESP_LOGW(MEMORY_TAG, "Largest free block is %d bytes after %s kept %d", block, subsystemNames[subsystem], retained);
+}
+
+/*
+  version (1), free heap (4), largest free block (4), minimum ever free (4),
+  subsystem count (1) + { retained (4, signed), scopes (4), largest (4, signed) }
+*/
+std::string MemoryStats::serialize() {
+  std::string out;
+  out.reserve(14 + MemorySubsystems * 12);
+  out.push_back(MEMORY_STATS_VERSION);
+
+  uint32_t heap[] = {
+    (uint32_t) heap_caps_get_free_size(MALLOC_CAP_8BIT),
+    (uint32_t) heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+    (uint32_t) heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT)
+  };
+  out.append((const char*) heap, sizeof(heap));
+
+  out.push_back(MemorySubsystems);
+  for (auto& stats : usage) {
+    int32_t retained = stats.retained, largest = stats.largest;
+    uint32_t scopes = stats.scopes;
+    out.append((const char*) &retained, sizeof(retained));
+    out.append((const char*) &scopes, sizeof(scopes));
+    out.append((const char*) &largest, sizeof(largest));
+  }
+
+  return out;
+}
+
+void MemoryStats::log() {
+  ESP_LOGI(MEMORY_TAG, "free %d largest block %d minimum free %d",
+    heap_caps_get_free_size(MALLOC_CAP_8BIT), heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+    heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+
+  for (uint8_t i = 0; i < MemorySubsystems; i++)
+    ESP_LOGI(MEMORY_TAG, "%-8s retained %7d over %5d scopes, largest %6d", subsystemNames[i],
+      (int32_t) usage[i].retained, (uint32_t) usage[i].scopes, (int32_t) usage[i].largest);
+}
@@ -1,13 +1,19 @@
 #include <hal/motion.h>
+#include <math.h>
 
-QueueHandle_t Motion::calibrationRequestQueue = NULL;
-FreeRTOS::Semaphore Motion::holdInterface = FreeRTOS::Semaphore("spi");
 AmpIMU Motion::ampIMU;
 
 Motion::Motion() {
-  configUpdatedQueue = xQueueCreate(1, sizeof(bool));
-  calibrationRequestQueue = xQueueCreate(2, sizeof(uint8_t));
-  powerStatusQueue = xQueueCreate(2, sizeof(PowerStatus));
+  configInterests = ConfigChange::ConfigMotion;
+  commandQueue = xQueueCreate(4, sizeof(MotionCommand));
+  commandDone = xSemaphoreCreateBinary();
+
+  // an axis is up within half the up band of vertical, compared squared so detection never takes a root
+  float tilt = (DEFAULT_ORIENTATION_UP_MAX - DEFAULT_ORIENTATION_UP_MIN) / 2.0f * PI / 180.0f;
+  _orientationUp = cosf(tilt) * cosf(tilt);
+
+  // drained from process(), the sampler's own notifications are for the IMU
+  EventBus::instance()->subscribe(this, EVENT_MASK(EventConfigChanged) | EVENT_MASK(EventPowerLevel));
 }
 
 void Motion::onPowerUp() {
@@ -21,8 +27,9 @@ void Motion::onPowerUp() {
     // load motion biases
     AmpStorage::getAccelBias(&accelBias);
 
-    // start motion process
-    xTaskCreatePinnedToCore(sampleTask, "motion", 4096, this, 1, &samplerHandle, 0);    
+    // start motion process, from here on only the sampler touches the IMU
+    Tasks::create(TaskMotion, sampleTask, this, &samplerHandle);
+    ampIMU.setSampleTask(samplerHandle);
   }
 }
 
@@ -32,15 +39,31 @@ void Motion::sampleTask(void *parameters) {
   // reset last update
   motion->_lastUpdate = micros();
 
-  VehicleState old = motion->_vehicleState;
   for (;;) {
-    Power::powerDown.wait("power");
     motion->process();
+    if (motion->_shutdown)
+      break;
 
     if (motion->_enabled && motion->imuState > IMUState::IMU_Disabled) {
       motion->sample();
+
+      // drop to the parked rate when we've been still for a while, back up on any movement
+      bool parked = millis() - motion->_lastMovement > motion->MOTION_PARKED_TIMEOUT;
+      if (parked != motion->_parked) {
+        motion->_parked = parked;
+        ESP_LOGD(MOTION_TAG,"Vehicle %s", parked ? "parked" : "moving");
+        motion->updateSampleRate();
+      }
+
+#if defined(IMU_INT1)
+      // only the IMU's interrupt can wake us once the rider moves off
+      if (parked && !motion->_powerStatus.charging && millis() - motion->_lastMovement > motion->MOTION_SLEEP_TIMEOUT)
+        Power::instance()->requestSleep();
+#endif
       
       if (!motion->_calibrating) {
+        motion->detectMovement();
+
         if (motion->_autoOrientation)
           motion->detectOrientation();
 
@@ -52,26 +75,121 @@ void Motion::sampleTask(void *parameters) {
       }
     }
 
-    if (old != motion->_vehicleState) {
+    if (motion->_notifiedState != motion->_vehicleState) {
       ESP_LOGD(MOTION_TAG,"vehicle state changed in motion");
-
-      for (auto listener : motion->motionListeners)
-        if (listener->vehicleQueue != NULL)
-          xQueueSendToFront(listener->vehicleQueue, (void*) &motion->_vehicleState, 0);
-
-      old = motion->_vehicleState;
+      motion->notifyMotionListeners();
     }
 
-    delay(10);
+    // sleep until the IMU's FIFO fills up or a command arrives
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(IMU_SAMPLE_TIMEOUT));
   }
 
+  motion->samplerHandle = NULL;
   vTaskDelete(NULL);
 }
 
+/*
+  Queues a command for the sampler and wakes it. Lifecycle commands wait for
+  the sampler to finish so the caller can rely on the IMU's state afterwards.
+*/
+bool Motion::sendCommand(MotionCommand command, bool wait) {
+  if (samplerHandle == NULL)
+    return false;
+
+  if (wait)
+    xSemaphoreTake(commandDone, 0);
+
+  if (xQueueSendToBack(commandQueue, &command, 0) != pdTRUE) {
+    ESP_LOGW(MOTION_TAG,"Command %d dropped, queue full", command);
+    return false;
+  }
+  xTaskNotifyGive(samplerHandle);
+
+  if (wait && xSemaphoreTake(commandDone, pdMS_TO_TICKS(MOTION_COMMAND_TIMEOUT)) != pdTRUE) {
+    ESP_LOGW(MOTION_TAG,"Command %d timed out", command);
+    return false;
+  }
+
+  return true;
+}
+
+/*
+  Runs on the sampler task. Returns false once the IMU has been shut down.
+*/
+bool Motion::handleCommand(MotionCommand command) {
+  switch (command) {
+    case MotionCommand::CalibrateXG:
+      calibrateXG();
+      break;
+    case MotionCommand::CalibrateMag:
+      calibrateMag();
+      break;
+    case MotionCommand::SleepIMU:
+      sleepIMU();
+      break;
+    case MotionCommand::ReplayTrace:
+      replayTrace();
+      break;
+    case MotionCommand::ShutdownIMU:
+      imuState = IMUState::IMU_Disabled;
+      ampIMU.deinit();
+      xSemaphoreGive(commandDone);
+      return false;
+    default:
+      break;
+  }
+
+  return true;
+}
+
+/*
+  Arms wake on motion and parks the sampler on the command queue until power
+  wakes us, nothing else can reach the IMU while we're blocked here
+*/
+void Motion::sleepIMU() {
+  ampIMU.setWakeOnMotion(true);
+  xSemaphoreGive(commandDone);
+
+  MotionCommand command;
+  while (xQueueReceive(commandQueue, &command, portMAX_DELAY) == pdTRUE) {
+    if (command == MotionCommand::WakeIMU)
+      break;
+    if (command == MotionCommand::ShutdownIMU) {
+      // leave it queued for the sampler loop to finish the shutdown
+      xQueueSendToFront(commandQueue, &command, 0);
+      return;
+    }
+  }
+
+  ampIMU.setWakeOnMotion(false);
+
+  // whatever woke us, start again from riding
+  _parked = false;
+  _lastMovement = millis();
+  updateSampleRate();
+
+  xSemaphoreGive(commandDone);
+}
+
 void Motion::onPowerDown() {
   ESP_LOGD(MOTION_TAG,"Motion on power down");
-  imuState = IMUState::IMU_Disabled;
-  ampIMU.deinit();
+  if (!sendCommand(MotionCommand::ShutdownIMU, true)) {
+    imuState = IMUState::IMU_Disabled;
+    ampIMU.deinit();
+  }
+}
+
+void Motion::onSleep() {
+  sendCommand(MotionCommand::SleepIMU, true);
+}
+
+void Motion::onWake() {
+  sendCommand(MotionCommand::WakeIMU, true);
+}
+
+void Motion::requestCalibration(uint8_t request) {
+  if (request == MotionCommand::CalibrateXG || request == MotionCommand::CalibrateMag)
+    sendCommand((MotionCommand)request, false);
 }
 
 void Motion::onPowerStatusChanged(PowerStatus status) {
@@ -82,178 +200,223 @@ void Motion::onPowerStatusChanged(PowerStatus status) {
 void Motion::updateMotionForPowerStatus(PowerStatus status) {
   if (imuState > IMUState::IMU_Error)
   {
-    if (status.charging) {
+    if (status.charging)
       imuState = IMUState::IMU_Normal;
-      _sampleRate = 50000;  // 50 kHz
-    }
     else {
       switch (_powerStatus.level) {
         case PowerLevel::Low:
           imuState = IMUState::IMU_LowPower;
           ESP_LOGV(MOTION_TAG,"IMU: Low power mode");
-          _sampleRate = 1500; // 1.5 kHz
-
-#if defined(USE_MADGWICK_FILTER)
-          filter = filter == nullptr ? new Madgwick() : filter;
-#elif defined(USE_SIMPLE_AHRS_FILTER)
-          filter = filter == nullptr ? new SimpleAHRS() : filter;
-#endif
           break;
         case PowerLevel::Normal:
         case PowerLevel::Charged:
           imuState = IMUState::IMU_Normal;
           ESP_LOGV(MOTION_TAG,"IMU: Normal, high power mode");
-          _sampleRate = 50000;  // 50 kHz
-
-#if defined(USE_MADGWICK_FILTER)
-          filter = filter == nullptr ? new Madgwick() : filter;
-#elif defined(USE_SIMPLE_AHRS_FILTER)
-          filter = filter == nullptr ? new SimpleAHRS() : filter;
-#endif
           break;
         case PowerLevel::Critical:
         case PowerLevel::Unknown:
         default:
           imuState = IMUState::IMU_Disabled;
           ESP_LOGV(MOTION_TAG,"IMU: Disabled");
-          _sampleRate = 0;
-
-#if defined(USE_MADGWICK_FILTER) or defined(USE_SIMPLE_AHRS_FILTER)
-          filter = nullptr;
-#endif
           break;
       }
     }
 
-    holdInterface.wait("spi");
-    holdInterface.take("spi");
-    ESP_LOGV(MOTION_TAG,"New IMU State: %d", imuState);
-    ampIMU.setPowerMode(imuState);
-    holdInterface.give();
+    updateSampleRate();
   }
 }
 
-void Motion::process() {
-  if (uxQueueMessagesWaiting(configUpdatedQueue)) {
-    bool valid;
-    xQueueReceive(configUpdatedQueue, &valid, 0);
+/*
+  Programs the IMU for the current power state, config and parked state
+*/
+void Motion::updateSampleRate() {
+  if (imuState <= IMUState::IMU_Error)
+    return;
 
-    if (valid)
-      onConfigUpdated();
-  }
+  uint16_t rate = _parked ? _parkedSampleRate : _ridingSampleRate;
 
-  if (uxQueueMessagesWaiting(powerStatusQueue)) {
-    xQueueReceive(powerStatusQueue, &_powerStatus, 0);
-    onPowerStatusChanged(_powerStatus);
-  }
+  // low battery caps the rate, it only needs to be good enough for brake lights
+  if (imuState == IMUState::IMU_LowPower)
+    rate = std::min(rate, (uint16_t) 50);
+  else if (imuState == IMUState::IMU_Disabled)
+    rate = 0;
 
-  if (uxQueueMessagesWaiting(calibrationRequestQueue)) {
-    uint8_t request;
-    xQueueReceive(calibrationRequestQueue, &request, 0);
-    ESP_LOGD(MOTION_TAG,"calibration request: %d", request);
+  ESP_LOGV(MOTION_TAG,"New IMU State: %d at %dHz", imuState, rate);
+  ampIMU.setPowerMode(imuState, rate);
+  _sampleRate = ampIMU.getSampleRate();
 
-    if (request == 0x01)
-      calibrateXG();
-    else if (request == 0x02)
-      calibrateMag();
+  _gravityFilter.setSampleRate(_sampleRate);
+}
+
+void Motion::process() {
+  dispatchEvents();
+
+  MotionCommand command;
+  while (xQueueReceive(commandQueue, &command, 0) == pdTRUE) {
+    ESP_LOGD(MOTION_TAG,"command: %d", command);
+    if (!handleCommand(command)) {
+      _shutdown = true;
+      return;
+    }
   }
 }
 
 void Motion::calibrateXG() {
-  holdInterface.wait("spi");
-  holdInterface.take("spi");
-
   _calibrating = true;
   CalibrationState state = CalibrationState::Started;
 
-  for (auto listener : calibrationListeners)
-    if (listener->calibrateXGQueue != NULL)
-      xQueueSendToBack(listener->calibrateXGQueue, &state, 0);
+  EventBus::instance()->publish(EventCalibrateXG, state);
 
   Vector3D biases[2];
-  ampIMU.calibrateXG(&biases[0]);
-  accelBias = biases[0];
+  if (ampIMU.calibrateXG(&biases[0])) {
+    accelBias = biases[0];
+    AmpStorage::saveAccelBias(&accelBias);
+    printf("accel bias: %.3f, %.3f, %.3f\n", accelBias.x, accelBias.y, accelBias.z);
+
+    // filters settled on the old bias
+    _gravityFilter.reset();
+    _tilt.reset();
+    _accelerationDetector.reset();
+    _movement.reset();
+  }
+  else
+    ESP_LOGW(MOTION_TAG,"Accel calibration failed, keeping the previous bias");
 
-  AmpStorage::saveAccelBias(&accelBias);
-  printf("accel bias: %.3f, %.3f, %.3f\n", accelBias.x, accelBias.y, accelBias.z);
+  // calibration leaves the sensor at its own rate
+  _lastSampleTime = 0;
+  updateSampleRate();
 
   state = CalibrationState::Ended;
 
-  for (auto listener : calibrationListeners)
-    if (listener->calibrateXGQueue != NULL)
-      xQueueSendToBack(listener->calibrateXGQueue, &state, 0);
+  EventBus::instance()->publish(EventCalibrateXG, state);
   
   _calibrating = false;
-
-  holdInterface.give();
 }
 
 void Motion::calibrateMag() {
-  holdInterface.wait("spi");
-  holdInterface.take("spi");
-
   _calibrating = true;
   CalibrationState state = CalibrationState::Started;
 
-  for (auto listener : calibrationListeners)
-    if (listener->calibrateMagQueue != NULL)
-      xQueueSendToBack(listener->calibrateMagQueue, &state, 0);
+  EventBus::instance()->publish(EventCalibrateMag, state);
 
   ampIMU.calibrateMag(&magBias);
   state = CalibrationState::Ended;
 
-  for (auto listener : calibrationListeners)
-    if (listener->calibrateMagQueue != NULL)
-      xQueueSendToBack(listener->calibrateMagQueue, &state, 0);
+  EventBus::instance()->publish(EventCalibrateMag, state);
 
   _calibrating = false;
-
-  holdInterface.give();
 }
 
 /*
-  Updates gravity and linear acceleration vectors
+  Updates gravity and linear acceleration vectors for a single sample
 */
 void Motion::calculateAccelerations(Vector3D raw) {
-  // gravity calculation
-  gravity.x = _alpha * gravity.x + (1 - _alpha) * raw[0];
-  gravity.y = _alpha * gravity.y + (1 - _alpha) * raw[1];
-  gravity.z = _alpha * gravity.z + (1 - _alpha) * raw[2];
+  _rawBatch.x[0] = raw.x;
+  _rawBatch.y[0] = raw.y;
+  _rawBatch.z[0] = raw.z;
+  _rawBatch.count = 1;
+  calculateAccelerations(_rawBatch);
+}
 
-  absoluteGravity.x = abs(gravity.x);
-  absoluteGravity.y = abs(gravity.y);
-  absoluteGravity.z = abs(gravity.z);
+/*
+  Filters a batch into _gravityBatch / _linearBatch and leaves the gravity and
+  linear acceleration vectors at the newest sample
+*/
+void Motion::calculateAccelerations(const AccelBatch &raw) {
+  if (raw.count == 0)
+    return;
+
+  _gravityFilter.process(raw, _gravityBatch, _linearBatch);
+
+  size_t last = raw.count - 1;
+  gravity.x = _gravityBatch.x[last];
+  gravity.y = _gravityBatch.y[last];
+  gravity.z = _gravityBatch.z[last];
 
 #if defined(LOG_MOTION_GRAVITY)
   ESP_LOGV(MOTION_TAG,"Gravity - X: %F Y: %F Z: %F", gravity.x, gravity.y, gravity.z);
 #endif
 
-  // linear acceleration
-  linearAcceleration.x = raw[0] - gravity.x;
-  linearAcceleration.y = raw[1] - gravity.y;
-  linearAcceleration.z = raw[2] - gravity.z;
+  linearAcceleration.x = _linearBatch.x[last];
+  linearAcceleration.y = _linearBatch.y[last];
+  linearAcceleration.z = _linearBatch.z[last];
 
 #if defined(LOG_MOTION_LINEAR_ACCELERATION)
   ESP_LOGV(MOTION_TAG,"$%.2f %.2f %.2f;", linearAcceleration.x, linearAcceleration.y, linearAcceleration.z);
 #endif
 }
 
-void Motion::sample() {
-  unsigned long current = micros();
-  float diff = (current - _lastSample) / 1000000.0f;
-  float frequency = 1.0f / diff;
-  if (_sampleRate > 0 && frequency <= _sampleRate) {
-    holdInterface.wait("spi");
-    holdInterface.take("spi");
-    ampIMU.process();
-
-    // accelerometer
-    rawAccel = ampIMU.getAccelData();
-    rawAccel = rawAccel - accelBias;
+/*
+  Filters queued samples in the order they were taken and hands them on to telemetry
+*/
+void Motion::processSamples() {
+  MotionSample batch[MOTION_SAMPLE_BATCH];
+  size_t count;
+
+  while ((count = _samples.pop(batch, MOTION_SAMPLE_BATCH)) > 0) {
+    // remove bias and split into axes for the filter kernels
+    for (size_t i = 0; i < count; i++) {
+      auto& accel = batch[i].acceleration;
+      accel = accel - accelBias;
+      _rawBatch.x[i] = accel.x;
+      _rawBatch.y[i] = accel.y;
+      _rawBatch.z[i] = accel.z;
+    }
+    _rawBatch.count = count;
+    rawAccel = batch[count - 1].acceleration;
 #if defined(LOG_MOTION_RAW_ACCELERATION)
     // printf("Raw Accel - X: %.3f Y: %.3f Z: %.3f\n", rawAccel.x, rawAccel.y, rawAccel.z);
 #endif
-    calculateAccelerations(rawAccel);
+    calculateAccelerations(_rawBatch);
+
+    for (size_t i = 0; i < count; i++) {
+      auto& sample = batch[i];
+
+      // attitude, one fixed cost step per sample
+      float dt = _lastSampleTime > 0 ? (sample.timestamp - _lastSampleTime) / 1000000.0f : 0.0f;
+      _tilt.update(sample.acceleration, dt);
+      _lastSampleTime = sample.timestamp;
+
+      float x = _linearBatch.x[i], y = _linearBatch.y[i], z = _linearBatch.z[i];
+      if (x * x + y * y + z * z > MOTION_STILL_THRESHOLD * MOTION_STILL_THRESHOLD)
+        _lastMovement = motionTime();
+
+      Vector3D linear;
+      linear.x = x;
+      linear.y = y;
+      linear.z = z;
+      float axis = getAccelerationFromAxis(_motionAxis, linear);
+      _accelerationDetector.update(axis, dt);
+      _movement.update(linear, axis, dt);
+
+      if (_telemetryEnabled && !_replaying) {
+        sample.linear.x = x;
+        sample.linear.y = y;
+        sample.linear.z = z;
+        sample.attitude = _tilt.getAttitude();
+        _telemetry.push(sample);
+      }
+    }
+    attitude = _tilt.getAttitude();
+  }
+}
+
+void Motion::sample() {
+  unsigned long current = micros();
+  // the FIFO paces us at the sensor's data rate, so just make sure it's running
+  if (_sampleRate > 0) {
+    auto samples = ampIMU.process();
+    _sampleArrival = Profiler::now();
+
+    // queue every sample from the FIFO, timestamped back from the time of the read
+    unsigned long period = 1000000 / _sampleRate;
+    for (uint8_t i = 0; i < samples; i++) {
+      MotionSample sample;
+      sample.timestamp = current - (samples - 1 - i) * period;
+      sample.acceleration = ampIMU.getAccelSample(i);
+      _samples.push(sample);
+      TraceRecorder::instance()->record(sample.timestamp, sample.acceleration);
+    }
     
     // gyro
     rawGyro = ampIMU.getGyroData();
@@ -270,54 +433,24 @@ void Motion::sample() {
     printf("Raw Mag - X: %.3f Y: %.3f Z: %.3f\n", rawMag.x, rawMag.y, rawMag.z);
 #endif
 
-    holdInterface.give();
-    _lastSample = current;
-
-    // update AHRS
-    current = micros();
-    _lastUpdate = current;
-
-#if defined(USE_MADGWICK_FILTER)
-    float diff = (current - _lastUpdate) / 1000000.0f;
-    filter->update(
-          rawAccel.x, rawAccel.y, rawAccel.z,
-          rawGyro.x * PI / 180.0f, rawGyro.y * PI / 180.0f, rawGyro.z * PI / 180.0f,
-          -rawMag.y, -rawMag.x, rawMag.z, diff);    
-#elif defined(USE_SIMPLE_AHRS_FILTER)
-    filter->update(rawAccel, rawMag);
+#if defined(LOG_SAMPLE_RATE)
+    float diff = (current - _lastSample) / 1000000.0f;
+    printf("Delta time: %.6f, %d samples at %d Hz\n", diff, samples, _sampleRate);
 #endif
-    
-    // filter->update(rawAccel, rawMag);
+    _lastSample = current;
 
-#if defined(USE_MADGWICK_FILTER) or defined(USE_SIMPLE_AHRS_FILTER)
-    attitude = filter->getAHRS();
+    processSamples();
 
 #if defined(LOG_MOTION_AHRS)
     printf("%lu - Orientation: %.3f %.3f %.3f\n", millis(), attitude.x, attitude.y, attitude.z);
 #endif
 
-    // compensate roll for orientation using the gravity vector
-    if (_vehicleState.orientation != TopSideUp && _vehicleState.orientation != BottomSideUp)
-      if (absoluteGravity.x > absoluteGravity.y)
-        attitude.x += attitude.x * gravity.x;
-      else
-        attitude.x += attitude.x * gravity.y;
-
-#if defined(LOG_MOTION_AHRS_COMPENSATED)
-    printf("%lu - Orientation: %.3f %.3f %.3f\n", millis(), attitude.x, attitude.y, attitude.z);
-#endif
-#endif
-
     // printf("step:a - %.4f, %.4f, %.4f\tg - %.4f, %.4f, %.4f\tm - %.4f, %.4f, %.4f\n");
-
-#if defined(LOG_SAMPLE_RATE)
-    printf("Delta time: %.6f, frequency: %.2f Hz\n", diff, 1.0f / diff);
-#endif
   }
 }
 
 void Motion::updateGravityFilter(float alpha) {
-  _alpha = alpha;
+  _gravityFilter.setAlpha(alpha);
 }
 
 void Motion::updateTurnCenter(float turnCenter) {
@@ -334,19 +467,39 @@ void Motion::onConfigUpdated() {
   else
     _enabled = true;
 
+  _accelerationDetector.configure(motion);
   setMotionDetection(motion.autoMotion, motion.motionAxis, motion.brakeThreshold, motion.accelerationThreshold);
   setTurnDetection(motion.autoTurn, motion.relativeTurnZero, motion.turnAxis, motion.turnThreshold);
   setOrientationDetection(motion.autoOrientation, motion.orientationTrigger);
 
+  _tilt.setType(motion.attitudeFilter);
+  _tilt.reset();
+
+  _gravityFilter.setType(motion.gravityFilter);
+  _gravityFilter.setCutoff(motion.gravityCutoff);
+
+  _ridingSampleRate = motion.sampleRate;
+  _parkedSampleRate = motion.parkedSampleRate;
+  updateSampleRate();
+
   resetMotionDetection();
 }
 
-void Motion::addMotionListener(MotionListener *listener) {
-  motionListeners.push_back(listener);
-}
+void Motion::onEvent(const Event &event) {
+  switch (event.type) {
+    case EventConfigChanged:
+      if (event.as<uint8_t>() & configInterests)
+        onConfigUpdated();
+      break;
+
+    case EventPowerLevel:
+      _powerStatus = event.as<PowerStatus>();
+      onPowerStatusChanged(_powerStatus);
+      break;
 
-void Motion::removeMotionListener(MotionListener *listener) {
-  motionListeners.erase(std::remove(motionListeners.begin(), motionListeners.end(), listener));
+    default:
+      break;
+  }
 }
 
 void Motion::resetMotionDetection() {
@@ -362,20 +515,24 @@ void Motion::resetMotionDetection() {
   notifyMotionListeners();
 }
 
+/*
+  Publishes the current state. Vehicle state coalesces in each mailbox, so
+  changes made faster than they're consumed never queue up.
+*/
 void Motion::notifyMotionListeners() {
-  // notify any listeners of the reset
-  for (auto listener : motionListeners) {
-    // vehicle state changed
-    if (listener->vehicleQueue != NULL)
-      xQueueSend(listener->vehicleQueue, &_vehicleState, 0);
-  }
+  if (_replaying)
+    return;
+
+  VehicleState state = _vehicleState;
+  _notifiedState = state;
+
+  EventBus::instance()->publish(EventVehicleState, state);
 }
 
 void Motion::setMotionDetection(bool enabled, AccelerationAxis axis, float brakeTreshold, float accelerationTreshold) {
   _autoMotion = enabled;
   _motionAxis = axis;
-  _brakeThreshold = brakeTreshold;
-  _accelerationThreshold = accelerationTreshold;
+  _accelerationDetector.setThresholds(brakeTreshold, accelerationTreshold);
 
   if (_autoMotion || _autoTurn || _autoOrientation)
     _enabled = true;
@@ -430,46 +587,42 @@ void Motion::triggerOrientationState(Orientation state, bool autoOrientation) {
   triggerVehicleState(_vehicleState, _autoMotion, _autoTurn, autoOrientation);
 }
 
-bool Motion::detectMotion() {
-  AccelerationState newAcceleration;
-  unsigned long now = millis();
-  auto debounce = _vehicleState.acceleration == AccelerationState::Braking ? MOTION_ACTIVE_DEBOUNCE : MOTION_DEBOUNCE;
-  if (now - _lastMotionUpdate > debounce) {
-    float acceleration = getAccelerationFromAxis(_motionAxis);
-
-    switch (_vehicleState.acceleration) {
-      case Braking:
-        if (acceleration <= -_accelerationThreshold)
-          newAcceleration = AccelerationState::Accelerating;
-        else if (acceleration <= _brakeThreshold)
-          newAcceleration = AccelerationState::Neutral;
-        break;
-      case Accelerating:
-        if (acceleration >= _brakeThreshold)
-          newAcceleration = AccelerationState::Braking;
-        else if (acceleration >= -_accelerationThreshold)
-          newAcceleration = AccelerationState::Neutral;
-      default:
-        if (acceleration > _brakeThreshold)
-          newAcceleration = AccelerationState::Braking;
-        else if (acceleration < -_accelerationThreshold)
-          newAcceleration = AccelerationState::Accelerating;
-    }
+/*
+  Publishes the speed class as it changes, and the confidence in coarse steps
+  so lighting that scales with it isn't woken every batch
+*/
+bool Motion::detectMovement() {
+  auto speed = _movement.classify();
+  _accelerationDetector.setMoving(_movement.moving());
 
-    if (acceleration >= _brakeThreshold)
-      newAcceleration = AccelerationState::Braking;
-    else if (acceleration <= -_accelerationThreshold)
-      newAcceleration = AccelerationState::Accelerating;
-    else
-      newAcceleration = AccelerationState::Neutral;
+  uint8_t confidence = _movement.confidence() * 255;
+  if (speed == _notifiedMovement.speed && abs(confidence - _notifiedMovement.confidence) < MOTION_MOVEMENT_STEP)
+    return false;
 
-    // ESP_LOGV(MOTION_TAG,"%.3f, %d", acceleration, newAcceleration);
+  if (_replaying)
+    return true;
 
-    if (newAcceleration != _vehicleState.acceleration) {
-      triggerAccelerationState(newAcceleration, true);
-      _lastMotionUpdate = millis();
-      return true;
-    }
+  _notifiedMovement = { speed, confidence };
+  EventBus::instance()->publish(EventMovement, _notifiedMovement);
+  return true;
+}
+
+/*
+  Thresholds, hysteresis and holds all live in the detector, this only
+  publishes what it decides
+*/
+bool Motion::detectMotion() {
+  unsigned long now = motionTime();
+  auto newAcceleration = _accelerationDetector.evaluate(_vehicleState.acceleration, now - _lastMotionUpdate);
+
+  // ESP_LOGV(MOTION_TAG,"%.3f, %.2f, %d", _accelerationDetector.acceleration(), _accelerationDetector.jerk(), newAcceleration);
+
+  if (newAcceleration != _vehicleState.acceleration) {
+    if (!_replaying)
+      Profiler::instance()->beginLatency(_sampleArrival);
+    triggerAccelerationState(newAcceleration, true);
+    _lastMotionUpdate = now;
+    return true;
   }
 
   return false;
@@ -502,44 +655,56 @@ bool Motion::detectTurning() {
 }
 
 bool Motion::detectOrientation() {
-  Orientation newOrientation = Orientation::UnknownSideUp;
+  float x = gravity.x * gravity.x, y = gravity.y * gravity.y, z = gravity.z * gravity.z;
+  float up = (x + y + z) * _orientationUp;
+  unsigned long now = motionTime();
+
+  // nothing changes in the dead band between sides, only once another side is clearly up.
+  // a settling filter's gravity is too short to point anywhere
+  Orientation candidate = _vehicleState.orientation;
+  if (x + y + z >= MOTION_ORIENTATION_MIN_GRAVITY * MOTION_ORIENTATION_MIN_GRAVITY) {
+    if (x >= up)
+      candidate = gravity.x > 0 ? FrontSideUp : BackSideUp;
+    else if (y >= up)
+      candidate = gravity.y > 0 ? RightSideUp : LeftSideUp;
+    else if (z >= up)
+      candidate = gravity.z > 0 ? TopSideUp : BottomSideUp;
+  }
 
-  if (absoluteGravity.x > absoluteGravity.y && absoluteGravity.x > absoluteGravity.z)
-    newOrientation = gravity.x > 0 ? FrontSideUp : BackSideUp;
-  else if (absoluteGravity.y > absoluteGravity.x && absoluteGravity.y > absoluteGravity.z)
-    newOrientation = gravity.y > 0 ? RightSideUp : LeftSideUp;
-  else if (absoluteGravity.z > absoluteGravity.x && absoluteGravity.z > absoluteGravity.y)
-    newOrientation = gravity.z > 0 ? TopSideUp : BottomSideUp;
+  if (candidate != _orientationCandidate) {
+    _orientationCandidate = candidate;
+    _orientationSince = now;
+  }
 
-  if (newOrientation != _vehicleState.orientation) {
-    triggerOrientationState(newOrientation, true);
+  if (candidate != _vehicleState.orientation && now - _orientationSince >= MOTION_ORIENTATION_DWELL) {
+    triggerOrientationState(candidate, true);
     return true;
   }
-  
+
   return false;
 }
 
-float Motion::getAccelerationFromAxis(AccelerationAxis axis) {
+float Motion::getAccelerationFromAxis(AccelerationAxis axis, const Vector3D &linear) {
   float acceleration = 0.0f;
 
   switch (axis) {
     case AccelerationAxis::X_Neg:
-      acceleration = -linearAcceleration.x;
+      acceleration = -linear.x;
       break;
     case AccelerationAxis::X_Pos:
-      acceleration = linearAcceleration.x;
+      acceleration = linear.x;
       break;
     case AccelerationAxis::Y_Neg:
-      acceleration = -linearAcceleration.y;
+      acceleration = -linear.y;
       break;
     case AccelerationAxis::Y_Pos:
-      acceleration = linearAcceleration.y;
+      acceleration = linear.y;
       break;
     case AccelerationAxis::Z_Neg:
-      acceleration = -linearAcceleration.z;
+      acceleration = -linear.z;
       break;
     case AccelerationAxis::Z_Pos:
-      acceleration = linearAcceleration.z;
+      acceleration = linear.z;
       break;
   }
 
@@ -570,4 +735,179 @@ float Motion::getAttitudeFromAxis(AttitudeAxis axis) {
   }
 
   return angle;
+}
+
+/*
+  Feeds a recorded trace through the same filtering and detection the live
+  samples take, a FIFO's worth at a time. Everything the replay touches is
+  put back afterwards, live sampling just pauses while it runs. That includes
+  brake detection, so it's refused unless we're parked and still
+*/
+void Motion::replayTrace() {
+  if (!canReplay()) {
+    ESP_LOGW(MOTION_TAG,"Trace replay refused, vehicle isn't parked");
+    return;
+  }
+
+  FILE *file = fopen(MOTION_TRACE_PATH, "rb");
+  if (file == NULL) {
+    ESP_LOGW(MOTION_TAG,"No trace to replay");
+    return;
+  }
+
+  MotionTraceHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != MOTION_TRACE_MAGIC
+    || header.version != MOTION_TRACE_VERSION) {
+    ESP_LOGW(MOTION_TAG,"Trace is not readable");
+    fclose(file);
+    return;
+  }
+
+  auto gravityFilter = _gravityFilter;
+  auto tilt = _tilt;
+  auto accelerationDetector = _accelerationDetector;
+  auto movement = _movement;
+  auto orientationCandidate = _orientationCandidate;
+  auto orientationSince = _orientationSince;
+  auto state = _vehicleState;
+  auto lastSampleTime = _lastSampleTime, lastMotionUpdate = _lastMotionUpdate, lastMovement = _lastMovement;
+  bool autoMotion = _autoMotion, autoTurn = _autoTurn, autoOrientation = _autoOrientation;
+
+  _gravityFilter.setSampleRate(header.sampleRate);
+  _gravityFilter.reset();
+  _accelerationDetector.reset();
+  _movement.reset();
+  _orientationCandidate = Orientation::UnknownSideUp;
+  _orientationSince = 0;
+  _lastSampleTime = 0;
+  _lastMotionUpdate = 0;
+  _vehicleState = { AccelerationState::Neutral, TurnState::Center, Orientation::UnknownSideUp };
+  _replay = MotionReplayStats();
+  _replay.running = true;
+  _replaying = true;
+
+  // the label still waiting on its detection for each detector, -1 once found
+  unsigned long labelTime[MotionTraceLabels] = { 0 };
+  int16_t labelState[MotionTraceLabels] = { -1, -1, -1 };
+
+  MotionTraceRecord records[MOTION_SAMPLE_BATCH];
+  uint32_t remaining = header.records;
+  size_t read;
+  while (remaining > 0 && (read = fread(records, sizeof(MotionTraceRecord), std::min(remaining, (uint32_t) MOTION_SAMPLE_BATCH), file)) > 0) {
+    remaining -= read;
+    size_t samples = 0;
+    for (size_t i = 0; i < read; i++) {
+      auto& record = records[i];
+      if (record.type == MotionTraceType::TraceLabel) {
+        if (record.x < MotionTraceLabels) {
+          _replay.detectors[record.x].labels++;
+          labelTime[record.x] = record.timestamp / 1000;
+          labelState[record.x] = record.y;
+        }
+        continue;
+      }
+
+      MotionSample sample;
+      sample.timestamp = record.timestamp;
+      sample.acceleration.x = record.x / 1000.0f;
+      sample.acceleration.y = record.y / 1000.0f;
+      sample.acceleration.z = record.z / 1000.0f;
+      _samples.push(sample);
+      _replayTime = record.timestamp / 1000;
+      samples++;
+    }
+
+    if (samples == 0)
+      continue;
+
+    auto before = _vehicleState;
+    auto start = Profiler::now();
+    processSamples();
+    detectMovement();
+    detectOrientation();
+    detectMotion();
+    detectTurning();
+    _replay.cost.record((Profiler::now() - start) / samples);
+    _replay.samples += samples;
+
+    if (_vehicleState.acceleration != before.acceleration)
+      replayDetection(LabelAcceleration, _vehicleState.acceleration, labelTime, labelState);
+    if (_vehicleState.turn != before.turn)
+      replayDetection(LabelTurn, _vehicleState.turn, labelTime, labelState);
+    if (_vehicleState.orientation != before.orientation)
+      replayDetection(LabelOrientation, _vehicleState.orientation, labelTime, labelState);
+  }
+
+  fclose(file);
+
+  _replaying = false;
+  _replay.running = false;
+  _gravityFilter = gravityFilter;
+  _tilt = tilt;
+  _accelerationDetector = accelerationDetector;
+  _movement = movement;
+  _orientationCandidate = orientationCandidate;
+  _orientationSince = orientationSince;
+  _vehicleState = state;
+  _lastSampleTime = lastSampleTime;
+  _lastMotionUpdate = lastMotionUpdate;
+  _lastMovement = lastMovement;
+  _autoMotion = autoMotion;
+  _autoTurn = autoTurn;
+  _autoOrientation = autoOrientation;
+
+  uint32_t falsePositives = 0;
+  for (auto& detector : _replay.detectors)
+    falsePositives += detector.falsePositives;
+  Profiler::instance()->recordReplay(_replay.cost, _replay.detectors[LabelAcceleration].latency, falsePositives);
+
+  ESP_LOGI(MOTION_TAG,"Replayed %u samples, %uus per sample", _replay.samples, _replay.cost.average());
+}
+
+/*
+  A detection matches the label before it when it lands on the labelled
+  state inside the window, anything else is a false positive
+*/
+void Motion::replayDetection(MotionTraceLabel label, uint8_t state, unsigned long *labelTime, int16_t *labelState) {
+  auto& detector = _replay.detectors[label];
+  // a batch can end on samples from just before its label, that's still a match
+  long latency = (long) (_replayTime - labelTime[label]);
+  if (labelState[label] == state && latency <= MOTION_REPLAY_WINDOW) {
+    detector.matched++;
+    detector.latency.record(std::max(latency, 0L));
+    labelState[label] = -1;
+  }
+  else
+    detector.falsePositives++;
+}
+
+static void writeUint32(std::string &out, uint32_t value) {
+  for (uint8_t i = 0; i < 4; i++)
+    out.push_back((char)((value >> (i * 8)) & 0xFF));
+}
+
+static void writeRange(std::string &out, const TimingStats &stats) {
+  writeUint32(out, stats.count > 0 ? stats.min : 0);
+  writeUint32(out, stats.average());
+  writeUint32(out, stats.max);
+}
+
+std::string Motion::serializeReplay() {
+  std::string out;
+  out.reserve(20 + MotionTraceLabels * 24);
+
+  out.push_back((char)MOTION_REPLAY_VERSION);
+  out.push_back((char)_replay.running);
+  writeUint32(out, _replay.samples);
+  writeRange(out, _replay.cost);
+
+  out.push_back((char)MotionTraceLabels);
+  for (auto& detector : _replay.detectors) {
+    writeUint32(out, detector.labels);
+    writeUint32(out, detector.matched);
+    writeUint32(out, detector.falsePositives);
+    writeRange(out, detector.latency);
+  }
+
+  return out;
 }
\ No newline at end of file
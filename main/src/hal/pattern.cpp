@@ -0,0 +1,169 @@
+#include <hal/pattern.h>
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// registers an instruction reads, as a mask
+static uint8_t sources(const PatternInstruction &instruction) {
+  switch (instruction.op) {
+    case OpConst:
+      return 0;
+    case OpMove:
+    case OpWave:
+    case OpTriangle:
+      return 1 << instruction.a;
+    case OpSelect:
+      return (1 << instruction.dst) | (1 << instruction.a) | (1 << instruction.b);
+    default:
+      return (1 << instruction.a) | (1 << instruction.b);
+  }
+}
+
+bool PatternProgram::compile(const std::string &source, PatternProgram *out) {
+  const size_t width = 2 * sizeof(PatternInstruction);
+  if (source.empty() || source.length() % width != 0 || source.length() / width > PATTERN_MAX_INSTRUCTIONS) {
+    ESP_LOGW(PATTERN_TAG, "Pattern is empty or longer than %d instructions", PATTERN_MAX_INSTRUCTIONS);
+    return false;
+  }
+
+  std::vector<PatternInstruction> program;
+  program.reserve(source.length() / width);
+  for (size_t i = 0; i < source.length(); i += width) {
+    uint8_t bytes[sizeof(PatternInstruction)];
+    for (size_t j = 0; j < sizeof(bytes); j++) {
+      int high = hexValue(source[i + 2 * j]), low = hexValue(source[i + 2 * j + 1]);
+      if (high < 0 || low < 0)
+        return false;
+      bytes[j] = (high << 4) | low;
+    }
+
+    PatternInstruction instruction = { bytes[0], bytes[1], bytes[2], bytes[3] };
+    bool registers = instruction.op == OpConst
+      || (instruction.a < PATTERN_REGISTERS && instruction.b < PATTERN_REGISTERS);
+    if (instruction.op >= PatternOps || instruction.dst >= PATTERN_REGISTERS || !registers) {
+      ESP_LOGW(PATTERN_TAG, "Invalid pattern instruction %d", i / width);
+      return false;
+    }
+
+    program.push_back(instruction);
+  }
+
+  // anything written twice or read before its only write has to stay in order per pixel
+  uint8_t written = 0, rewritten = 0, readEarly = 0, read = 0;
+  for (auto& instruction : program) {
+    uint8_t reads = sources(instruction);
+    uint8_t dst = 1 << instruction.dst;
+    read |= reads;
+    readEarly |= reads & ~written;
+    rewritten |= written & dst;
+    written |= dst;
+  }
+
+  uint8_t varying = (1 << PATTERN_REG_INDEX) | rewritten | (readEarly & written);
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto& instruction : program) {
+      uint8_t dst = 1 << instruction.dst;
+      if ((sources(instruction) & varying) && !(varying & dst)) {
+        varying |= dst;
+        changed = true;
+      }
+    }
+  }
+
+  out->_frame.clear();
+  out->_pixel.clear();
+  for (auto& instruction : program)
+    (varying & (1 << instruction.dst) ? out->_pixel : out->_frame).push_back(instruction);
+
+  out->_pixelRegisters = varying;
+  out->_animated = read & ((1 << PATTERN_REG_TIME) | (1 << PATTERN_REG_PHASE));
+
+  ESP_LOGD(PATTERN_TAG, "Compiled pattern, %d frame and %d pixel instructions", out->_frame.size(), out->_pixel.size());
+  return true;
+}
+
+void PatternProgram::reset(uint8_t mask) {
+  for (uint8_t i = PATTERN_REG_PHASE + 1; i < PATTERN_REGISTERS; i++)
+    if (mask & (1 << i))
+      _registers[i] = i == PATTERN_REG_LEVEL ? 255 : 0;
+}
+
+void PatternProgram::beginFrame(uint32_t count, uint32_t time, uint32_t phase) {
+  _registers[PATTERN_REG_INDEX] = 0;
+  _registers[PATTERN_REG_COUNT] = count;
+  _registers[PATTERN_REG_TIME] = time;
+  _registers[PATTERN_REG_PHASE] = phase;
+  reset(0xFF);
+
+  execute(_frame, _registers);
+
+  // the inputs are only ever restored to these, pixel registers start over each pixel
+  _count = count;
+  _time = time;
+  _phase = phase;
+}
+
+void PatternProgram::evaluate(uint32_t index, int32_t *mix, int32_t *level) {
+  auto r = _registers;
+  if (_pixelRegisters & (1 << PATTERN_REG_COUNT)) r[PATTERN_REG_COUNT] = _count;
+  if (_pixelRegisters & (1 << PATTERN_REG_TIME)) r[PATTERN_REG_TIME] = _time;
+  if (_pixelRegisters & (1 << PATTERN_REG_PHASE)) r[PATTERN_REG_PHASE] = _phase;
+  r[PATTERN_REG_INDEX] = index;
+  reset(_pixelRegisters);
+
+  execute(_pixel, r);
+
+  *mix = r[PATTERN_REG_MIX];
+  *level = r[PATTERN_REG_LEVEL];
+}
+
+static inline int32_t triangle(int32_t value) {
+  uint8_t x = value;
+  return x < 128 ? x << 1 : (255 - x) << 1;
+}
+
+void PatternProgram::execute(const std::vector<PatternInstruction> &program, int32_t *r) {
+  for (auto& instruction : program) {
+    int32_t a = r[instruction.a & (PATTERN_REGISTERS - 1)];
+    int32_t b = r[instruction.b & (PATTERN_REGISTERS - 1)];
+    int32_t &dst = r[instruction.dst];
+
+    switch (instruction.op) {
+      case OpConst: dst = instruction.a | (instruction.b << 8); break;
+      case OpMove: dst = a; break;
+      case OpAdd: dst = a + b; break;
+      case OpSub: dst = a - b; break;
+      case OpMul: dst = a * b; break;
+      case OpScale: dst = (a * b) >> 8; break;
+      case OpDiv: dst = b != 0 ? a / b : 0; break;
+      case OpMod: dst = b != 0 ? a % b : 0; break;
+      case OpMin: dst = std::min(a, b); break;
+      case OpMax: dst = std::max(a, b); break;
+      case OpAnd: dst = a & b; break;
+      case OpOr: dst = a | b; break;
+      case OpXor: dst = a ^ b; break;
+      case OpShl: dst = a << (b & 31); break;
+      case OpShr: dst = a >> (b & 31); break;
+      case OpWave: {
+        // smoothstep over the triangle, t * t * (3 - 2t)
+        int32_t t = triangle(a);
+        dst = (t * t * (768 - 2 * t)) >> 16;
+        break;
+      }
+      case OpTriangle: dst = triangle(a); break;
+      case OpNoise: {
+        uint32_t hash = (uint32_t) a * 2654435761u ^ (uint32_t) b * 2246822519u;
+        hash ^= hash >> 15;
+        dst = (hash >> 8) & 0xFF;
+        break;
+      }
+      case OpLess: dst = a < b; break;
+      case OpSelect: dst = dst ? a : b; break;
+    }
+  }
+}
@@ -1,21 +1,33 @@
 #include <hal/power.h>
+#include <hal/profiler.h>
+#include <hal/tasks.h>
+#include <algorithm>
+
+// handed to a startup task, which signals done once its listener is up
+struct StartupJob {
+  LifecycleBase *listener;
+  EventGroupHandle_t done;
+  EventBits_t bit;
+};
 
 FreeRTOS::Semaphore Power::powerDown = FreeRTOS::Semaphore("power");
 
 Power::Power() {
-  touchEventQueue = xQueueCreate(10, sizeof(std::vector<TouchType>));
+  EventBus::instance()->subscribe(this, EVENT_MASK(EventTouchSequence));
 }
 
 void Power::onPowerUp() {
+  // touches are handled on the app task, wake it for them rather than waiting for the next pass
+  eventTask = xTaskGetCurrentTaskHandle();
   ampPower.init();
 
-  for (auto listener : lifecycleListeners)
-    listener->onPowerUp();
+  startListeners();
+  Profiler::instance()->markBoot(BootStage::BootPoweredUp);
 
   ampPower.process();
   status = calculatePowerStatus(ampPower.batteryPresent, ampPower.charging, ampPower.done, ampPower.batteryLevel);
 
-  notifyPowerListeners();
+  notifyPowerListeners(true);
 }
 
 void Power::onPowerDown() {
@@ -28,37 +40,135 @@ void Power::onPowerDown() {
 }
 
 void Power::process() {
-  if (uxQueueMessagesWaiting(touchEventQueue)) {
-    xQueueReceive(touchEventQueue, &touches, 0);
+  dispatchEvents();
 
-    onTouchEvent(&touches);
-  }
-  
   PowerStatus newStatus;
   ampPower.process();
   newStatus = calculatePowerStatus(ampPower.batteryPresent, ampPower.charging, ampPower.done, ampPower.batteryLevel);
 
-  // if the power status has changed, notify our listeners
-  if (status != newStatus) {
+  // level changes wake everything, percentage ticks only the listeners that report it
+  bool level = levelChanged(status, newStatus);
+  if (level || abs(newStatus.percentage - status.percentage) >= BATTERY_PERCENTAGE_STEP) {
     status = newStatus;
-    notifyPowerListeners();
+    notifyPowerListeners(level);
   }
-}
 
-void Power::addPowerLevelListener(PowerListener *listener) {
-  powerLevelListeners.push_back(listener);
+  if (sleepRequested) {
+    sleepRequested = false;
+
+    if (lastSleepAttempt == 0 || millis() - lastSleepAttempt >= SLEEP_RETRY_MS) {
+      lastSleepAttempt = millis();
+      sleep();
+    }
+  }
 }
 
-void Power::addLifecycleListener(LifecycleBase *listener) {
+void Power::addLifecycleListener(LifecycleBase *listener, StartupMode mode, std::vector<LifecycleBase*> dependencies) {
+  if (lifecycleListeners.size() >= POWER_STARTUP_LISTENERS) {
+    ESP_LOGE(POWER_TAG, "Too many lifecycle listeners, raise POWER_STARTUP_LISTENERS");
+    return;
+  }
+
   lifecycleListeners.push_back(listener);
+  startupSteps.push_back({ mode, 0, dependencies });
+}
+
+/*
+  Brings every listener up as soon as what it depends on is. Parallel listeners
+  each get a startup task, inline ones run here in registration order, and
+  whenever nothing inline is ready this waits on whichever parallel one ends first
+*/
+void Power::startListeners() {
+  size_t count = lifecycleListeners.size();
+  for (auto& step : startupSteps) {
+    step.after = 0;
+    for (auto dependency : step.dependencies) {
+      auto index = std::find(lifecycleListeners.begin(), lifecycleListeners.end(), dependency) - lifecycleListeners.begin();
+      if (index < (int) count)
+        step.after |= 1UL << index;
+    }
+  }
+
+  EventGroupHandle_t done = xEventGroupCreate();
+  EventBits_t all = (1UL << count) - 1, started = 0, finished = 0;
+
+  while (finished != all) {
+    int next = -1;
+    for (size_t i = 0; i < count; i++) {
+      auto& step = startupSteps[i];
+      EventBits_t bit = 1UL << i;
+      if ((started & bit) || (step.after & finished) != step.after)
+        continue;
+
+      if (step.mode == StartupMode::StartInline) {
+        if (next < 0)
+          next = i;
+        continue;
+      }
+
+      started |= bit;
+      auto job = new StartupJob { lifecycleListeners[i], done, bit };
+      if (!Tasks::create(TaskStartup, startupTask, job, NULL)) {
+        // no room for a task, bring it up here instead
+        delete job;
+        lifecycleListeners[i]->onPowerUp();
+        xEventGroupSetBits(done, bit);
+      }
+    }
+
+    if (next >= 0) {
+      started |= 1UL << next;
+      lifecycleListeners[next]->onPowerUp();
+      xEventGroupSetBits(done, 1UL << next);
+      finished = xEventGroupWaitBits(done, all, pdFALSE, pdFALSE, 0) & all;
+    }
+    else if (started == finished) {
+      ESP_LOGE(POWER_TAG, "Lifecycle listeners depend on each other, %04x never started", all & ~started);
+      break;
+    }
+    else
+      finished = xEventGroupWaitBits(done, started & ~finished, pdFALSE, pdFALSE, portMAX_DELAY) & all;
+  }
+
+  vEventGroupDelete(done);
+  ESP_LOGD(POWER_TAG, "%d listeners up after %lldms", count, Profiler::now() / 1000);
 }
 
-void Power::notifyPowerListeners() {
+void Power::startupTask(void *parameters) {
+  auto job = static_cast<StartupJob*>(parameters);
+  job->listener->onPowerUp();
+  xEventGroupSetBits(job->done, job->bit);
+
+  delete job;
+  vTaskDelete(NULL);
+}
+
+void Power::notifyPowerListeners(bool levelChanged) {
   ESP_LOGV(POWER_TAG,"Power status notification: Charging: %s, Level: %d (%d %%), Battery Present: %s", status.charging ? "true" : "false", status.level, status.percentage, status.batteryPresent ? "true" : "false");
 
-  for(auto listener : powerLevelListeners)
-    if (listener->powerStatusQueue != NULL)
-      xQueueSend(listener->powerStatusQueue, &status, 0);
+  EventBus::instance()->publish(EventPowerStatus, status);
+  if (levelChanged)
+    EventBus::instance()->publish(EventPowerLevel, status);
+}
+
+/*
+  Thresholds are sticky, moving down a level happens at the threshold but
+  moving back up needs BATTERY_HYSTERESIS more so a reading sitting on the
+  line doesn't flap between the two
+*/
+PowerLevel Power::levelForPercentage(uint8_t percentage) {
+  uint8_t low = BATTERY_LOW, normal = BATTERY_NORMAL;
+  if (status.level == PowerLevel::Critical)
+    low += BATTERY_HYSTERESIS;
+  if (status.level == PowerLevel::Critical || status.level == PowerLevel::Low)
+    normal += BATTERY_HYSTERESIS;
+
+  if (percentage < low)
+    return PowerLevel::Critical;
+  else if (percentage < normal)
+    return PowerLevel::Low;
+
+  return PowerLevel::Normal;
 }
 
 PowerStatus Power::calculatePowerStatus(bool batteryPresent, bool charging, bool done, uint8_t batteryLevel) {
@@ -74,24 +184,55 @@ PowerStatus Power::calculatePowerStatus(bool batteryPresent, bool charging, bool
   }
   else if (ns.doneCharging)
     ns.level = PowerLevel::Charged;
-  else if (batteryLevel < BATTERY_LOW)
-    ns.level = PowerLevel::Critical;
-  else if (batteryLevel < BATTERY_NORMAL)
-    ns.level = PowerLevel::Low;
   else
-    ns.level = PowerLevel::Normal;
+    ns.level = levelForPercentage(batteryLevel);
 
   return ns;
 }
 
-void Power::onTouchEvent(std::vector<TouchType> *touches) {
-  if (touches->size() == 1) {
-    if ((*touches)[0] == TouchType::Hold) {
+void Power::onEvent(const Event &event) {
+  if (event.type == EventTouchSequence)
+    onTouchEvent(event.as<TouchSequence>());
+}
+
+void Power::onTouchEvent(const TouchSequence &touches) {
+  if (touches.size() == 1) {
+    if (touches[0] == TouchType::Hold) {
       shutdown();
     }
   }
 }
 
+/*
+  Light sleeps until the IMU sees motion or the button is pressed.
+  Holding powerDown keeps the other tasks parked outside their critical sections.
+*/
+void Power::sleep() {
+  if (status.charging)
+    return;
+
+  for (auto listener : lifecycleListeners) {
+    if (!listener->canSleep()) {
+      ESP_LOGD(POWER_TAG,"Sleep deferred, a listener is busy");
+      return;
+    }
+  }
+
+  ESP_LOGD(POWER_TAG,"Entering light sleep");
+  powerDown.take("power");
+
+  for (auto listener = lifecycleListeners.rbegin(); listener != lifecycleListeners.rend(); ++listener)
+    (*listener)->onSleep();
+
+  auto cause = ampPower.lightSleep();
+  ESP_LOGD(POWER_TAG,"Woke from light sleep, cause: %d", cause);
+
+  for (auto listener : lifecycleListeners)
+    listener->onWake();
+
+  powerDown.give();
+}
+
 void Power::shutdown(bool restart) {
   powerDown.take("power");
   restartNext = restart;
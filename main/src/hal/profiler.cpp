@@ -0,0 +1,344 @@
+#include <hal/profiler.h>
+#include <algorithm>
+
+static void writeUint32(std::string &out, uint32_t value) {
+  for (uint8_t i = 0; i < 4; i++)
+    out.push_back((char)((value >> (i * 8)) & 0xFF));
+}
+
+static void writeStats(std::string &out, uint8_t id, const TimingStats &stats) {
+  out.push_back((char)id);
+  writeUint32(out, stats.count);
+  writeUint32(out, stats.count > 0 ? stats.min : 0);
+  writeUint32(out, stats.average());
+  writeUint32(out, stats.max);
+}
+
+void Profiler::recordEffect(LightEffect effect, int64_t start) {
+  if (effect < PROFILER_EFFECTS)
+    _effects[effect].record(now() - start);
+}
+
+void Profiler::recordEffectCost(LightEffect effect, uint8_t layout, int64_t start, uint32_t frames) {
+  if (effect < PROFILER_EFFECTS && layout < PROFILER_BENCH_LAYOUTS && frames > 0)
+    _effectCost[effect][layout] = (uint32_t) ((now() - start) * 1000 / frames);
+}
+
+void Profiler::recordComposite(int64_t start) {
+  _composite.record(now() - start);
+}
+
+void Profiler::recordFrame(int64_t start, unsigned long lateness) {
+  _frame.record(now() - start);
+  _frames++;
+
+  if (lateness > PROFILER_FRAME_BUDGET) {
+    _dropped++;
+    ESP_LOGV(PROFILER_TAG, "Frame painted %lums late", lateness);
+  }
+}
+
+void Profiler::recordFlush(uint8_t channel, int64_t start) {
+  if (channel < PROFILER_CHANNELS)
+    _flush[channel].record(now() - start);
+}
+
+void Profiler::reset() {
+  for (auto& stats : _effects)
+    stats = TimingStats();
+
+  for (auto& stats : _flush)
+    stats = TimingStats();
+
+  _composite = TimingStats();
+  _frame = TimingStats();
+  _frames = 0;
+  _dropped = 0;
+  _skipped = 0;
+}
+
+void Profiler::setBenchmarking(bool enabled) {
+  portENTER_CRITICAL(&_traceLock);
+  _traceStage = LatencyStages;
+  for (auto& stats : _stages)
+    stats = TimingStats();
+  _latency = TimingStats();
+  for (auto& bucket : _histogram)
+    bucket = 0;
+  _benchmarking = enabled;
+  portEXIT_CRITICAL(&_traceLock);
+
+  ESP_LOGI(PROFILER_TAG, "Latency benchmark %s", enabled ? "started" : "stopped");
+}
+
+/*
+  Starts a new trace when motion changes state, dropping any unfinished one
+*/
+void Profiler::beginLatency(int64_t sampleArrived) {
+  if (!_benchmarking)
+    return;
+
+  auto current = now();
+  portENTER_CRITICAL(&_traceLock);
+  _trace[LatencyStage::SampleArrived] = sampleArrived;
+  _trace[LatencyStage::StateChanged] = current;
+  _traceStage = LatencyStage::AppNotified;
+  portEXIT_CRITICAL(&_traceLock);
+}
+
+void Profiler::mark(LatencyStage stage) {
+  auto current = now();
+  bool complete = false;
+
+  portENTER_CRITICAL(&_traceLock);
+  if (stage == _traceStage) {
+    _trace[stage] = current;
+    _traceStage++;
+    complete = stage == LatencyStage::Flushed;
+  }
+  portEXIT_CRITICAL(&_traceLock);
+
+  if (complete)
+    completeTrace();
+}
+
+void Profiler::completeTrace() {
+  // each stage is timed from the one before it
+  for (uint8_t stage = LatencyStage::StateChanged; stage < LatencyStages; stage++)
+    _stages[stage].record(_trace[stage] - _trace[stage - 1]);
+
+  uint32_t total = _trace[LatencyStage::Flushed] - _trace[LatencyStage::SampleArrived];
+  _latency.record(total);
+  _histogram[std::min(total / PROFILER_LATENCY_BUCKET_US, (uint32_t)PROFILER_LATENCY_BUCKETS - 1)]++;
+
+  ESP_LOGI(PROFILER_TAG, "Latency %uus: state +%lld app +%lld effect +%lld composite +%lld flush +%lld", total,
+    _trace[StateChanged] - _trace[SampleArrived], _trace[AppNotified] - _trace[StateChanged],
+    _trace[EffectApplied] - _trace[AppNotified], _trace[Composited] - _trace[EffectApplied],
+    _trace[Flushed] - _trace[Composited]);
+}
+
+/**
+ * version (1), frames (4), dropped (4), skipped (4), then 17 byte stat entries of
+ * id (1), count (4), min (4), avg (4), max (4):
+ *    frame, composite, effect count, effect entries by effect type, channel count,
+ *    flush entries by channel number. only effects/channels with samples are sent
+ */
+std::string Profiler::serialize() {
+  std::string out;
+  out.reserve(256);
+
+  out.push_back((char)PROFILER_VERSION);
+  writeUint32(out, _frames);
+  writeUint32(out, _dropped);
+  writeUint32(out, _skipped);
+  writeStats(out, 0, _frame);
+  writeStats(out, 0, _composite);
+
+  uint8_t effects = 0;
+  for (auto& stats : _effects)
+    if (stats.count > 0) effects++;
+
+  out.push_back((char)effects);
+  for (uint8_t i = 0; i < PROFILER_EFFECTS; i++)
+    if (_effects[i].count > 0)
+      writeStats(out, i, _effects[i]);
+
+  uint8_t channels = 0;
+  for (auto& stats : _flush)
+    if (stats.count > 0) channels++;
+
+  out.push_back((char)channels);
+  for (uint8_t i = 0; i < PROFILER_CHANNELS; i++)
+    if (_flush[i].count > 0)
+      writeStats(out, i, _flush[i]);
+
+  return out;
+}
+
+/**
+ * version (1), benchmarking (1), total latency entry, stage count, stage entries
+ * by LatencyStage (time since the previous stage), bucket width in us (4),
+ * bucket count (1), buckets (4 each). entries use the same 17 byte layout as above
+ */
+std::string Profiler::serializeLatency() {
+  std::string out;
+  out.reserve(192);
+
+  out.push_back((char)PROFILER_VERSION);
+  out.push_back((char)_benchmarking);
+  writeStats(out, 0, _latency);
+
+  out.push_back((char)(LatencyStages - 1));
+  for (uint8_t stage = LatencyStage::StateChanged; stage < LatencyStages; stage++)
+    writeStats(out, stage, _stages[stage]);
+
+  writeUint32(out, PROFILER_LATENCY_BUCKET_US);
+  out.push_back((char)PROFILER_LATENCY_BUCKETS);
+  for (auto bucket : _histogram)
+    writeUint32(out, bucket);
+
+  return out;
+}
+
+/**
+ * version (1), frames per run (2), layout count (1), pixels per layout (2 each),
+ * effect count (1), then per effect id (1) and ns per frame for each layout (4 each)
+ */
+std::string Profiler::serializeEffectCost() {
+  std::string out;
+  out.reserve(8 + PROFILER_EFFECTS * (1 + 4 * PROFILER_BENCH_LAYOUTS));
+
+  out.push_back((char)PROFILER_VERSION);
+  out.push_back((char)(PROFILER_BENCH_FRAMES & 0xFF));
+  out.push_back((char)(PROFILER_BENCH_FRAMES >> 8));
+  out.push_back((char)PROFILER_BENCH_LAYOUTS);
+  for (auto pixels : profilerBenchLayouts) {
+    out.push_back((char)(pixels & 0xFF));
+    out.push_back((char)(pixels >> 8));
+  }
+
+  out.push_back((char)PROFILER_EFFECTS);
+  for (uint8_t i = 0; i < PROFILER_EFFECTS; i++) {
+    out.push_back((char)i);
+    for (auto cost : _effectCost[i])
+      writeUint32(out, cost);
+  }
+
+  return out;
+}
+
+void Profiler::markBoot(BootStage stage) {
+  if (_boot[stage] != 0)
+    return;
+
+  _boot[stage] = std::max(now(), (int64_t) 1);
+  ESP_LOGI(PROFILER_TAG, "Boot stage %d reached at %dms", stage, _boot[stage] / 1000);
+}
+
+/**
+ * version (1), stage count (1), then per BootStage the us since reset it was
+ * first reached (4), 0 for stages not reached yet
+ */
+std::string Profiler::serializeBoot() {
+  std::string out;
+  out.reserve(2 + BootStages * sizeof(uint32_t));
+
+  out.push_back((char)PROFILER_VERSION);
+  out.push_back((char)BootStages);
+  for (auto elapsed : _boot)
+    writeUint32(out, elapsed);
+
+  return out;
+}
+
+void Profiler::recordReplay(const TimingStats &cost, const TimingStats &latency, uint32_t falsePositives) {
+  _replayCost = cost;
+  _replayLatency = latency;
+  _replayFalsePositives = falsePositives;
+  _replayed = true;
+}
+
+/*
+  Every metric is lower is better, and only measured ones are written so a
+  benchmark that hasn't run never reads as an improvement
+*/
+void Profiler::collectMetrics(JsonObject metrics) {
+  if (_frame.count > 0) {
+    metrics["frame.avg"] = _frame.average();
+    metrics["frame.max"] = _frame.max;
+    metrics["frame.dropped"] = _dropped;
+    metrics["frame.skipped"] = _skipped;
+  }
+
+  if (_composite.count > 0)
+    metrics["composite.avg"] = _composite.average();
+
+  // ns per frame of every effect together, per benchmark layout
+  for (uint8_t layout = 0; layout < PROFILER_BENCH_LAYOUTS; layout++) {
+    uint32_t total = 0;
+    for (uint8_t effect = 0; effect < PROFILER_EFFECTS; effect++)
+      total += _effectCost[effect][layout];
+
+    if (total > 0)
+      metrics["effects." + std::to_string(profilerBenchLayouts[layout])] = total;
+  }
+
+  const char *boot[BootStages] = { "boot.config", "boot.power", "boot.light", "boot.adv" };
+  for (uint8_t stage = 0; stage < BootStages; stage++)
+    if (_boot[stage] != 0)
+      metrics[boot[stage]] = _boot[stage];
+
+  if (_configLoad[ConfigLoadCache].count > 0)
+    metrics["config.cache"] = _configLoad[ConfigLoadCache].average();
+  if (_configLoad[ConfigLoadParse].count > 0)
+    metrics["config.parse"] = _configLoad[ConfigLoadParse].average();
+
+  if (_replayed) {
+    metrics["replay.cost"] = _replayCost.average();
+    metrics["replay.latency"] = _replayLatency.average();
+    metrics["replay.false"] = _replayFalsePositives;
+  }
+}
+
+/**
+ * { "v": version, "fw": firmware, "m": { metric: value }, "r": [ regressed metrics ] }
+ * metrics are us unless named otherwise: effects.<pixels> ns per frame,
+ * replay.cost us per sample, replay.latency ms. "r" is left out without a baseline
+ */
+std::string Profiler::report() {
+  DynamicJsonDocument doc(PROFILER_REPORT_SIZE);
+  doc["v"] = PROFILER_REPORT_VERSION;
+  doc["fw"] = FIRMWARE_VERSION;
+  JsonObject metrics = doc.createNestedObject("m");
+  collectMetrics(metrics);
+
+  FILE *file = fopen(PROFILER_BASELINE_PATH, "rb");
+  if (file != NULL) {
+    DynamicJsonDocument baseline(PROFILER_REPORT_SIZE);
+    std::string data;
+    char block[128];
+    size_t read;
+    while ((read = fread(block, 1, sizeof(block), file)) > 0)
+      data.append(block, read);
+    fclose(file);
+
+    if (deserializeJson(baseline, data) == DeserializationError::Ok) {
+      JsonArray regressions = doc.createNestedArray("r");
+      for (auto metric : metrics) {
+        uint32_t value = metric.value().as<uint32_t>();
+        uint32_t base = baseline[metric.key()].as<uint32_t>();
+        if (base > 0 && (uint64_t) value * 100 > (uint64_t) base * (100 + PROFILER_REGRESSION_PERCENT))
+          regressions.add(metric.key());
+      }
+    }
+    else
+      ESP_LOGW(PROFILER_TAG, "Performance baseline is unreadable");
+  }
+
+  std::string out;
+  serializeJson(doc, out);
+  return out;
+}
+
+/*
+  Keeps the current metrics as the baseline later reports are compared to
+*/
+bool Profiler::saveBaseline() {
+  DynamicJsonDocument doc(PROFILER_REPORT_SIZE);
+  collectMetrics(doc.to<JsonObject>());
+
+  std::string data;
+  serializeJson(doc, data);
+
+  FILE *file = fopen(PROFILER_BASELINE_PATH, "wb");
+  if (file == NULL) {
+    ESP_LOGW(PROFILER_TAG, "Unable to write performance baseline");
+    return false;
+  }
+
+  bool written = fwrite(data.data(), 1, data.length(), file) == data.length();
+  fclose(file);
+
+  ESP_LOGI(PROFILER_TAG, "Saved performance baseline, %d bytes", data.length());
+  return written;
+}
\ No newline at end of file
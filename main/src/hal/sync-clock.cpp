@@ -0,0 +1,14 @@
+#include <hal/sync-clock.h>
+
+void SyncClock::sync(uint32_t sharedTime) {
+  auto local = millis();
+  uint32_t offset = sharedTime - local;
+
+  if (_synced && (int32_t) (offset - _offset) <= 0 && local - _lastAccepted < SYNC_CLOCK_WINDOW)
+    return;
+
+  ESP_LOGD(SYNC_CLOCK_TAG, "Clock offset %d ms", (int32_t) (offset - _offset));
+  _offset = offset;
+  _lastAccepted = local;
+  _synced = true;
+}
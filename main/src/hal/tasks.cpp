@@ -0,0 +1,109 @@
+#include <hal/tasks.h>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+/*
+  Core 0 belongs to the radio: the controller, NimBLE's host and everything
+  that only feeds it. Core 1 runs the vehicle: motion first so a NimBLE burst
+  can never hold off brake detection, then the app that reacts to it and the
+  renderer that shows it
+*/
+const TaskSpec Tasks::table[TaskIds] = {
+  // name               core  priority  stack     period
+  // the app wakes on any event it or its services subscribe to, its period only paces polled work
+  { "app_main",         1,    5,        8192,     50 },
+  { "motion",           1,    6,        4096,     0 },
+  { "renderer",         1,    3,        4096,     0 },
+  { "buttons",          1,    2,        2048,     0 },
+  { "ble-server",       0,    2,        4096,     1000 },
+  { "ota-writer",       0,    2,        6144,     0 },
+  // started by the first config or trace read
+  { "config-tx",        0,    2,        4096,     0 },
+  // only started the first time a trace is recorded
+  { "trace-writer",     0,    1,        4096,     0 },
+  // its period is how long a burst of settings saves is batched for
+  { "nvs-writer",       0,    1,        3072,     250 },
+  // one per parallel lifecycle listener while powering up, gone once it's up.
+  // on the radio's core since NimBLE is still coming up, core 1 is loading the config
+  { "startup",          0,    3,        4096,     0 },
+};
+
+std::map<UBaseType_t, uint32_t> Tasks::lastRunTime;
+uint32_t Tasks::lastTotalRunTime = 0;
+
+bool Tasks::create(TaskId id, TaskFunction_t task, void *parameters, TaskHandle_t *handle) {
+  const TaskSpec &spec = table[id];
+  if (xTaskCreatePinnedToCore(task, spec.name, spec.stack, parameters, spec.priority, handle, spec.core) != pdPASS) {
+    ESP_LOGE(TASKS_TAG, "Unable to start %s", spec.name);
+    return false;
+  }
+
+  return true;
+}
+
+/*
+  version (1), window (4, run time ticks since the last snapshot), task count (1), then per task:
+  name length (1), name, core (1, 0xFF when unpinned), priority (1), stack high water mark (2, bytes),
+  cpu use over the window (2, tenths of a percent)
+*/
+std::string Tasks::serialize() {
+  std::string out;
+  out.push_back(TASKS_VERSION);
+
+#if (configUSE_TRACE_FACILITY == 1)
+  UBaseType_t count = uxTaskGetNumberOfTasks();
+  std::vector<TaskStatus_t> tasks(count);
+  uint32_t total = 0;
+  count = uxTaskGetSystemState(tasks.data(), count, &total);
+
+  uint32_t window = total - lastTotalRunTime;
+  lastTotalRunTime = total;
+  out.append((const char*) &window, sizeof(window));
+
+  count = std::min(count, (UBaseType_t) UINT8_MAX);
+  out.push_back(count);
+
+  for (UBaseType_t i = 0; i < count; i++) {
+    const TaskStatus_t &task = tasks[i];
+
+    uint8_t length = std::min(strlen(task.pcTaskName), (size_t) UINT8_MAX);
+    out.push_back(length);
+    out.append(task.pcTaskName, length);
+
+    out.push_back(task.xCoreID > 1 ? 0xFF : task.xCoreID);
+    out.push_back(task.uxCurrentPriority);
+
+    uint16_t stack = std::min(task.usStackHighWaterMark, (uint32_t) UINT16_MAX);
+    out.append((const char*) &stack, sizeof(stack));
+
+    uint16_t usage = 0;
+  #if (configGENERATE_RUN_TIME_STATS == 1)
+    uint32_t ran = task.ulRunTimeCounter - lastRunTime[task.xTaskNumber];
+    lastRunTime[task.xTaskNumber] = task.ulRunTimeCounter;
+    // the total is wall time, so this is share of one core and both together add up to 200%
+    if (window > 0)
+      usage = std::min((uint64_t) ran * 1000 / window, (uint64_t) 1000);
+  #endif
+    out.append((const char*) &usage, sizeof(usage));
+  }
+#else
+  uint32_t window = 0;
+  out.append((const char*) &window, sizeof(window));
+  out.push_back(0);
+#endif
+
+  return out;
+}
+
+void Tasks::log() {
+#if (configUSE_TRACE_FACILITY == 1)
+  UBaseType_t count = uxTaskGetNumberOfTasks();
+  std::vector<TaskStatus_t> tasks(count);
+  count = uxTaskGetSystemState(tasks.data(), count, NULL);
+
+  for (UBaseType_t i = 0; i < count; i++)
+    ESP_LOGI(TASKS_TAG, "%-16s core %2d priority %2d stack free %5d", tasks[i].pcTaskName,
+      tasks[i].xCoreID > 1 ? -1 : tasks[i].xCoreID, tasks[i].uxCurrentPriority, tasks[i].usStackHighWaterMark);
+#endif
+}
@@ -0,0 +1,163 @@
+#include <hal/trace-recorder.h>
+#include <sys/stat.h>
+#include <cstddef>
+
+void TraceRecorder::start(uint16_t sampleRate) {
+  if (recording())
+    return;
+
+  _sampleRate = sampleRate;
+  _stopRequested = false;
+  _startRequested = true;
+
+  if (_writerHandle == NULL)
+    Tasks::create(TaskTraceWriter, writerTask, this, &_writerHandle);
+  else
+    xTaskNotifyGive(_writerHandle);
+}
+
+void TraceRecorder::stop() {
+  if (!recording())
+    return;
+
+  _stopRequested = true;
+  if (_writerHandle != NULL)
+    xTaskNotifyGive(_writerHandle);
+}
+
+void TraceRecorder::label(MotionTraceLabel label, uint8_t state) {
+  if (!_recording)
+    return;
+
+  MotionTraceRecord record = { (uint32_t) micros(), MotionTraceType::TraceLabel, label, state, 0 };
+  _labels.push(record);
+}
+
+void TraceRecorder::open() {
+  size_t total = 0, used = 0;
+  esp_spiffs_info(NULL, &total, &used);
+
+  // an old trace is about to be replaced, its space counts as free
+  struct stat st;
+  if (stat(MOTION_TRACE_PATH, &st) == 0)
+    used -= std::min(used, (size_t) st.st_size);
+
+  if (total - used < TRACE_MAX_SIZE) {
+    ESP_LOGW(TRACE_TAG, "Not enough space for a trace, %d bytes free", total - used);
+    return;
+  }
+
+  _file = fopen(MOTION_TRACE_PATH, "wb");
+  if (_file == NULL) {
+    ESP_LOGW(TRACE_TAG, "Unable to open %s", MOTION_TRACE_PATH);
+    return;
+  }
+
+  // the record count is filled in when the trace is closed
+  MotionTraceHeader header = { MOTION_TRACE_MAGIC, MOTION_TRACE_VERSION, _sampleRate, 0 };
+  memcpy(_sector, &header, sizeof(header));
+  _fill = sizeof(header);
+  _written = 0;
+  _records = 0;
+
+  _recording = true;
+  ESP_LOGI(TRACE_TAG, "Recording at %dHz", _sampleRate);
+}
+
+/*
+  Merges the two buffers back into time order, replay matches records in the
+  order they're in the file. A label waits for a sample from after it, the
+  sampler may still be holding earlier ones, unless this is the final flush
+*/
+void TraceRecorder::drain(bool flush) {
+  MotionTraceRecord sample, label;
+
+  while (_file != nullptr) {
+    bool haveSample = _samples.peek(sample);
+    bool haveLabel = _labels.peek(label);
+
+    if (haveLabel && (haveSample ? (int32_t) (label.timestamp - sample.timestamp) <= 0 : flush)) {
+      _labels.pop(label);
+      append(label);
+    }
+    else if (haveSample) {
+      _samples.pop(sample);
+      append(sample);
+    }
+    else
+      break;
+  }
+}
+
+void TraceRecorder::append(const MotionTraceRecord &record) {
+  if (_written + _fill + sizeof(record) > TRACE_MAX_SIZE) {
+    ESP_LOGI(TRACE_TAG, "Trace is full");
+    close();
+    return;
+  }
+
+  // records straddle sectors, only whole sectors are written until the end
+  auto bytes = (const uint8_t*) &record;
+  size_t first = std::min(sizeof(record), TRACE_SECTOR_SIZE - _fill);
+  memcpy(&_sector[_fill], bytes, first);
+  _fill += first;
+
+  if (_fill == TRACE_SECTOR_SIZE) {
+    if (!writeSector())
+      return;
+    memcpy(_sector, bytes + first, sizeof(record) - first);
+    _fill = sizeof(record) - first;
+  }
+
+  _records++;
+}
+
+// a failed write abandons the trace, its header still says it's empty
+bool TraceRecorder::writeSector() {
+  if (fwrite(_sector, 1, _fill, _file) != _fill) {
+    ESP_LOGW(TRACE_TAG, "Trace write failed");
+    fclose(_file);
+    _file = nullptr;
+    _recording = false;
+    return false;
+  }
+
+  _written += _fill;
+  _fill = 0;
+  return true;
+}
+
+void TraceRecorder::close() {
+  _recording = false;
+  if (_file == nullptr || (_fill > 0 && !writeSector()))
+    return;
+
+  fseek(_file, offsetof(MotionTraceHeader, records), SEEK_SET);
+  fwrite(&_records, sizeof(_records), 1, _file);
+  fclose(_file);
+  _file = nullptr;
+
+  ESP_LOGI(TRACE_TAG, "Trace closed, %u records dropped %u", _records, _samples.dropped());
+}
+
+void TraceRecorder::writerTask(void *parameters) {
+  auto recorder = static_cast<TraceRecorder*>(parameters);
+
+  for (;;) {
+    if (recorder->_startRequested) {
+      recorder->open();
+      recorder->_startRequested = false;
+    }
+
+    recorder->drain();
+
+    if (recorder->_stopRequested) {
+      recorder->_stopRequested = false;
+      recorder->_recording = false;
+      recorder->drain(true);
+      recorder->close();
+    }
+
+    ulTaskNotifyTake(pdTRUE, recorder->_recording ? pdMS_TO_TICKS(TRACE_DRAIN_INTERVAL) : portMAX_DELAY);
+  }
+}
@@ -0,0 +1,217 @@
+#include <update-decoder.h>
+
+UpdateDecoder::UpdateDecoder(UpdateSink sink, void *context, UpdateFormat format) {
+  _sink = sink;
+  _context = context;
+  _format = format;
+}
+
+UpdateDecoder::~UpdateDecoder() {
+  free(_inflator);
+  free(_window);
+}
+
+bool UpdateDecoder::emit(const uint8_t *data, size_t length) {
+  _output += length;
+  if (_format != UpdateRaw && _output > _header.imageLength) {
+    ESP_LOGE(UPDATE_DECODER_TAG, "Image is longer than its header");
+    return false;
+  }
+
+  return _sink(_context, data, length);
+}
+
+/*
+  Sets up for the format in the header once it's complete
+*/
+bool UpdateDecoder::begin() {
+  if (_header.magic == UPDATE_COMPRESSED_MAGIC)
+    _format = UpdateCompressed;
+  else if (_header.magic == UPDATE_DELTA_MAGIC)
+    _format = UpdateDelta;
+  else {
+    ESP_LOGE(UPDATE_DECODER_TAG, "Unknown image format %08x", _header.magic);
+    return false;
+  }
+
+  if (_format == UpdateDelta) {
+    // a delta only applies to the exact image it was built from
+    _base = esp_ota_get_running_partition();
+    if (_base == NULL || _header.baseLength > _base->size) {
+      ESP_LOGE(UPDATE_DECODER_TAG, "Delta base doesn't fit the running partition");
+      return false;
+    }
+
+    uint8_t chunk[UPDATE_COPY_CHUNK];
+    uint32_t crc = 0;
+    for (size_t offset = 0; offset < _header.baseLength; offset += sizeof(chunk)) {
+      size_t length = std::min(sizeof(chunk), (size_t)(_header.baseLength - offset));
+      if (esp_partition_read(_base, offset, chunk, length) != ESP_OK)
+        return false;
+      crc = crc32_le(crc, chunk, length);
+    }
+
+    if (crc != _header.baseCrc) {
+      ESP_LOGE(UPDATE_DECODER_TAG, "Delta was built against a different image");
+      return false;
+    }
+  }
+
+  _inflator = (tinfl_decompressor*) malloc(sizeof(tinfl_decompressor));
+  _window = (uint8_t*) malloc(TINFL_LZ_DICT_SIZE);
+  if (_inflator == nullptr || _window == nullptr) {
+    ESP_LOGE(UPDATE_DECODER_TAG, "Unable to allocate inflate window");
+    return false;
+  }
+
+  tinfl_init(_inflator);
+  ESP_LOGI(UPDATE_DECODER_TAG, "%s image, %d bytes", _format == UpdateDelta ? "Delta" : "Compressed", _header.imageLength);
+  return true;
+}
+
+bool UpdateDecoder::write(const uint8_t *data, size_t length) {
+  if (length == 0)
+    return true;
+
+  if (_format == UpdateUnknown && _headerFill == 0 && data[0] == UPDATE_IMAGE_MAGIC)
+    _format = UpdateRaw;
+
+  if (_format == UpdateRaw)
+    return emit(data, length);
+
+  if (_format == UpdateUnknown) {
+    size_t count = std::min(length, sizeof(UpdateImageHeader) - _headerFill);
+    memcpy((uint8_t*) &_header + _headerFill, data, count);
+    _headerFill += count;
+    data += count;
+    length -= count;
+
+    if (_headerFill < sizeof(UpdateImageHeader))
+      return true;
+
+    if (!begin())
+      return false;
+  }
+
+  return inflate(data, length);
+}
+
+/*
+  Runs the zlib stream through the window, handing on whatever comes out
+*/
+bool UpdateDecoder::inflate(const uint8_t *data, size_t length) {
+  while (!_inflated) {
+    size_t in = length;
+    size_t out = TINFL_LZ_DICT_SIZE - _windowOffset;
+    auto status = tinfl_decompress(_inflator, data, &in, _window, _window + _windowOffset, &out,
+      TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+
+    data += in;
+    length -= in;
+
+    if (out > 0) {
+      auto produced = _window + _windowOffset;
+      bool ok = _format == UpdateDelta ? applyDelta(produced, out) : emit(produced, out);
+      if (!ok)
+        return false;
+
+      _windowOffset = (_windowOffset + out) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+
+    if (status < TINFL_STATUS_DONE) {
+      ESP_LOGE(UPDATE_DECODER_TAG, "Inflate failed: %d", status);
+      return false;
+    }
+
+    if (status == TINFL_STATUS_DONE)
+      _inflated = true;
+    else if (status == TINFL_STATUS_NEEDS_MORE_INPUT && length == 0)
+      break;
+  }
+
+  return true;
+}
+
+bool UpdateDecoder::copyBase(uint32_t offset, uint32_t length) {
+  if (offset > _header.baseLength || length > _header.baseLength - offset) {
+    ESP_LOGE(UPDATE_DECODER_TAG, "Delta copy outside the base image");
+    return false;
+  }
+
+  uint8_t chunk[UPDATE_COPY_CHUNK];
+  while (length > 0) {
+    size_t count = std::min(sizeof(chunk), (size_t) length);
+    if (esp_partition_read(_base, offset, chunk, count) != ESP_OK || !emit(chunk, count))
+      return false;
+
+    offset += count;
+    length -= count;
+  }
+
+  return true;
+}
+
+/*
+  Op parser, ops and their arguments can be split anywhere across calls
+*/
+bool UpdateDecoder::applyDelta(const uint8_t *data, size_t length) {
+  while (length > 0) {
+    if (_insertRemaining > 0) {
+      size_t count = std::min(length, (size_t) _insertRemaining);
+      if (!emit(data, count))
+        return false;
+
+      _insertRemaining -= count;
+      data += count;
+      length -= count;
+      continue;
+    }
+
+    if (_op == 0) {
+      _op = *data++;
+      length--;
+      _argsFill = 0;
+
+      if (_op != DeltaCopy && _op != DeltaInsert) {
+        ESP_LOGE(UPDATE_DECODER_TAG, "Unknown delta op %02x", _op);
+        return false;
+      }
+      continue;
+    }
+
+    size_t needed = _op == DeltaCopy ? 8 : 4;
+    size_t count = std::min(length, needed - _argsFill);
+    memcpy(_args + _argsFill, data, count);
+    _argsFill += count;
+    data += count;
+    length -= count;
+
+    if (_argsFill < needed)
+      continue;
+
+    uint32_t first, second;
+    memcpy(&first, _args, sizeof(uint32_t));
+    memcpy(&second, _args + 4, sizeof(uint32_t));
+
+    if (_op == DeltaCopy && !copyBase(first, second))
+      return false;
+    else if (_op == DeltaInsert)
+      _insertRemaining = first;
+
+    _op = 0;
+  }
+
+  return true;
+}
+
+bool UpdateDecoder::finish() {
+  if (_format == UpdateRaw)
+    return true;
+
+  if (!_inflated || _op != 0 || _insertRemaining > 0 || _output != _header.imageLength) {
+    ESP_LOGE(UPDATE_DECODER_TAG, "Image incomplete, %d/%d bytes", _output, _header.imageLength);
+    return false;
+  }
+
+  return true;
+}
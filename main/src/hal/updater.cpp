@@ -1,68 +1,265 @@
 #include <updater.h>
 
-void Updater::startUpdate() {
-  status = UpdateStatus::Start;
-  updatePacketsCount = 0;
-  
+/*
+  Offset a saved update for this image can carry on from, 0 when there isn't one
+*/
+static size_t resumableOffset(uint32_t image, const esp_partition_t *partition) {
+  UpdateProgress progress;
+  if (image == 0 || partition == NULL || !AmpStorage::getUpdateProgress(&progress))
+    return 0;
+
+  if (progress.image != image || progress.partition != partition->address || progress.offset > partition->size)
+    return 0;
+
+  return progress.offset;
+}
+
+void Updater::startUpdate(uint32_t imageId) {
+  if (writerHandle != NULL) {
+    // a reconnect carrying on with the same image picks up the running update
+    if (imageId != 0 && imageId == image && !ending) {
+      notifyUpdateListeners(UpdateStatus::Start);
+      return;
+    }
+
+    stopWriter();
+  }
+
   // get next ota partition
   updatePartition = esp_ota_get_next_update_partition(NULL);
 
-  // start update + set update handle
-  auto error = esp_ota_begin(updatePartition, OTA_SIZE_UNKNOWN, &updateHandle);
-  if (error != ESP_OK)
+  image = imageId;
+  ending = false;
+  aborting = false;
+  received = written = checkpoint = resumableOffset(image, updatePartition);
+  lastProgress = 0;
+  status = UpdateStatus::Start;
+
+  if (received == 0)
+    AmpStorage::clearUpdateProgress();
+  else
+    ESP_LOGI(UPDATER_TAG,"Resuming update %08x at %d bytes", image, received);
+
+  if (updatePartition != NULL) {
+    updateStream = xStreamBufferCreate(UPDATER_BUFFER_SIZE, 1);
+    updateBlock = (uint8_t*) malloc(UPDATER_BLOCK_SIZE);
+  }
+
+  if (updateStream == NULL || updateBlock == nullptr ||
+    !Tasks::create(TaskOtaWriter, writerTask, this, &writerHandle)) {
+    ESP_LOGE(UPDATER_TAG,"Unable to start update");
     status = UpdateStatus::ErrorStart;
+    if (updateStream != NULL)
+      vStreamBufferDelete(updateStream);
+    free(updateBlock);
+    updateStream = NULL;
+    updateBlock = nullptr;
+    writerHandle = NULL;
+  }
 
   notifyUpdateListeners();
 }
 
 void Updater::endUpdate() {
-  status = UpdateStatus::End;
-  ESP_LOGV(UPDATER_TAG,"Ending update. Total written: %d bytes", dataLength);
+  if (writerHandle == NULL)
+    return;
 
-  // end the ota update and verify it's good
-  auto error = esp_ota_end(updateHandle);
-  if (error != ESP_OK) {
-    status = UpdateStatus::ErrorEnd;
-    ESP_LOGV(UPDATER_TAG,"Error ending update: %d", status);
-  }
-  else {
-    // set next boot partition
-    error = esp_ota_set_boot_partition(updatePartition);
-    if (error != ESP_OK)
-      status = UpdateStatus::ErrorEnd;
+  // the writer flushes what's left and finishes once the buffer runs dry
+  ending = true;
+  xTaskNotifyGive(writerHandle);
+}
+
+void Updater::queryResume(uint32_t imageId) {
+  if (writerHandle == NULL || imageId != image)
+    received = resumableOffset(imageId, esp_ota_get_next_update_partition(NULL));
+
+  notifyUpdateListeners(UpdateStatus::Resume);
+}
+
+/*
+  Abandons a running update, its last checkpoint is kept
+*/
+void Updater::stopWriter() {
+  aborting = true;
+  xTaskNotifyGive(writerHandle);
+
+  while (writerHandle != NULL)
+    delay(10);
+}
+
+void Updater::queueData(const uint8_t *data, size_t length) {
+  auto sent = xStreamBufferSend(updateStream, data, length, pdMS_TO_TICKS(UPDATER_SEND_TIMEOUT));
+  received += sent;
+
+  if (sent != length) {
+    ESP_LOGE(UPDATER_TAG,"Update buffer overrun at %d bytes", received);
+    status = UpdateStatus::ErrorWrite;
+    notifyUpdateListeners();
   }
+}
 
-  notifyUpdateListeners();
+void Updater::writeUpdate(const uint8_t *data, size_t length) {
+  if (updateStream == NULL || ending || status >= UpdateStatus::ErrorStart)
+    return;
+
+  queueData(data, length);
 }
 
-void Updater::writeUpdate(std::string data) {
-  updatePacketsCount++;
-  ESP_LOGV(UPDATER_TAG,"Update packet %d", updatePacketsCount);
+/*
+  Accepts the next block in order. Blocks that were already received are
+  dropped, anything past a gap or failing its crc is answered with the offset
+  the sender has to go back to
+*/
+void Updater::writeBlock(uint32_t offset, uint32_t crc, const uint8_t *data, size_t length) {
+  if (updateStream == NULL || ending || status >= UpdateStatus::ErrorStart)
+    return;
+
+  if (crc32_le(0, data, length) != crc) {
+    ESP_LOGW(UPDATER_TAG,"Checksum failed for block at %d", offset);
+    notifyUpdateListeners(UpdateStatus::ErrorChecksum);
+    return;
+  }
+
+  if (offset > received) {
+    notifyUpdateListeners(UpdateStatus::Resume);
+    return;
+  }
 
-  const char* dataC = data.data();
-  auto size = data.length();
-  dataLength += size;
+  size_t skip = received - offset;
+  if (skip >= length)
+    return;
+
+  queueData(data + skip, length - skip);
+}
+
+bool Updater::writeBlock(const uint8_t *data, size_t length) {
+  // blocks always start on a sector boundary, so each write erases exactly its own sector
+  auto error = esp_partition_erase_range(updatePartition, written, UPDATER_BLOCK_SIZE);
+  if (error == ESP_OK)
+    error = esp_partition_write(updatePartition, written, data, length);
 
-  printf("Data: ");
-  for (int i = 0; i < size; i++)
-    printf("%d ", dataC[i]);
-  printf("\n");
-  
-  auto error = esp_ota_write(updateHandle, (const void*) dataC, size);
   if (error != ESP_OK) {
+    ESP_LOGE(UPDATER_TAG,"Write error at %d: %d", written, error);
     status = UpdateStatus::ErrorWrite;
-    ESP_LOGV(UPDATER_TAG,"Write error: %d", status);
+    notifyUpdateListeners();
+    return false;
   }
-  
+
+  written += length;
+
+  if (image != 0 && decoder->format() == UpdateRaw && written - checkpoint >= UPDATER_CHECKPOINT_SIZE) {
+    checkpoint = written;
+    AmpStorage::saveUpdateProgress({ image, updatePartition->address, (uint32_t) checkpoint });
+  }
+
+  // progress is rate limited, it's only there to drive the status light and app
+  if (millis() - lastProgress >= UPDATER_PROGRESS_MS) {
+    lastProgress = millis();
+    status = UpdateStatus::Write;
+    notifyUpdateListeners();
+  }
+
+  return true;
+}
+
+void Updater::finishUpdate() {
+  ESP_LOGI(UPDATER_TAG,"Ending update. Total written: %d bytes", written);
+
+  // verifies the whole image before it's made the boot partition
+  auto error = esp_ota_set_boot_partition(updatePartition);
+  if (error != ESP_OK)
+    ESP_LOGE(UPDATER_TAG,"Error ending update: %d", error);
+
+  // a finished image, good or bad, is never resumed
+  AmpStorage::clearUpdateProgress();
+
+  status = error == ESP_OK ? UpdateStatus::End : UpdateStatus::ErrorEnd;
   notifyUpdateListeners();
 }
 
-void Updater::addUpdateListener(UpdateListener *listener) {
-  updateListeners.push_back(listener);
+/*
+  Decoded image bytes, gathered into whole sectors for flash
+*/
+bool Updater::emitDecoded(void *context, const uint8_t *data, size_t length) {
+  auto updater = static_cast<Updater*>(context);
+
+  while (length > 0) {
+    size_t count = std::min(length, UPDATER_BLOCK_SIZE - updater->blockFill);
+    memcpy(updater->updateBlock + updater->blockFill, data, count);
+    updater->blockFill += count;
+    data += count;
+    length -= count;
+
+    if (updater->blockFill == UPDATER_BLOCK_SIZE) {
+      if (!updater->writeBlock(updater->updateBlock, UPDATER_BLOCK_SIZE))
+        return false;
+      updater->blockFill = 0;
+    }
+  }
+
+  return true;
+}
+
+void Updater::writerTask(void *parameters) {
+  auto updater = static_cast<Updater*>(parameters);
+  uint8_t input[UPDATER_INPUT_SIZE];
+
+  // a resumed update is always raw, compressed updates are never checkpointed
+  UpdateDecoder decoder(emitDecoded, updater, updater->written > 0 ? UpdateRaw : UpdateUnknown);
+  updater->decoder = &decoder;
+  updater->blockFill = 0;
+
+  while (!updater->aborting) {
+    size_t count = xStreamBufferReceive(updater->updateStream, input, sizeof(input), pdMS_TO_TICKS(UPDATER_PROGRESS_MS));
+
+    if (updater->aborting)
+      break;
+
+    // after a failure keep draining, a write may still be blocked on the buffer,
+    // until the sender ends or restarts the update
+    if (updater->status >= UpdateStatus::ErrorStart) {
+      if (updater->ending)
+        break;
+      continue;
+    }
+
+    if (count > 0 && !decoder.write(input, count)) {
+      if (updater->status < UpdateStatus::ErrorStart) {
+        updater->status = UpdateStatus::ErrorWrite;
+        updater->notifyUpdateListeners();
+      }
+      continue;
+    }
+
+    // ending is only set once the last write is queued, so an empty buffer is the end of the image
+    if (updater->ending && xStreamBufferIsEmpty(updater->updateStream)) {
+      bool complete = decoder.finish()
+        && (updater->blockFill == 0 || updater->writeBlock(updater->updateBlock, updater->blockFill));
+
+      if (complete)
+        updater->finishUpdate();
+      else if (updater->status < UpdateStatus::ErrorStart) {
+        AmpStorage::clearUpdateProgress();
+        updater->status = UpdateStatus::ErrorEnd;
+        updater->notifyUpdateListeners();
+      }
+      break;
+    }
+  }
+
+  updater->decoder = nullptr;
+
+  auto stream = updater->updateStream;
+  auto block = updater->updateBlock;
+  updater->updateStream = NULL;
+  updater->updateBlock = nullptr;
+  vStreamBufferDelete(stream);
+  free(block);
+
+  updater->writerHandle = NULL;
+  vTaskDelete(NULL);
 }
 
-void Updater::notifyUpdateListeners() {
-  for(auto listener : updateListeners)
-    if (listener->updateStatusQueue != NULL)
-      xQueueSend(listener->updateStatusQueue, &status, 0);
-}
\ No newline at end of file
+void Updater::notifyUpdateListeners(UpdateStatus update) {
+  EventBus::instance()->publish(EventUpdateStatus, update);
+}
@@ -6,12 +6,12 @@ void appLoop(void *params) {
   
   for (;;) {
     amp->process();
-    delay(50);
+    amp->wait(Tasks::period(TaskApp));
   }
 
   vTaskDelete(NULL);
 }
 
 extern "C" void app_main(void) {
-  xTaskCreatePinnedToCore(appLoop, "app_main", 1024 * 8, NULL, 5, &mainHandle, 1);
+  Tasks::create(TaskApp, appLoop, NULL, &mainHandle);
 }
\ No newline at end of file
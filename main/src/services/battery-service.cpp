@@ -2,14 +2,20 @@
 
 BatteryService::BatteryService(BLEServer *server) {
   _server = server;
-  powerStatusQueue = xQueueCreate(1, sizeof(PowerStatus));
+
+  // created on the app task, which drains the service from process()
+  EventBus::instance()->subscribe(this, EVENT_MASK(EventPowerStatus), xTaskGetCurrentTaskHandle());
 
   setupService();
 }
 
 void BatteryService::process() {
-  if (uxQueueMessagesWaiting(powerStatusQueue)) {
-    xQueueReceive(powerStatusQueue, &_powerStatus, 0);
+  dispatchEvents();
+}
+
+void BatteryService::onEvent(const Event &event) {
+  if (event.type == EventPowerStatus) {
+    _powerStatus = event.as<PowerStatus>();
     onPowerStatusChanged(_powerStatus);
   }
 }
@@ -28,6 +34,13 @@ void BatteryService::setupService() {
 
 void BatteryService::onPowerStatusChanged(PowerStatus status) {
   uint8_t data[2];
+  encodeLevelState(status, data);
+
+  _batteryCharacteristic->setValue(data, sizeof(data));
+  _batteryCharacteristic->notify();
+}
+
+void BatteryService::encodeLevelState(PowerStatus status, uint8_t *data) {
   data[0] = status.percentage;
 
   // present or not
@@ -58,7 +71,4 @@ void BatteryService::onPowerStatusChanged(PowerStatus status) {
       data[1] |= 0x03 << 6;
       break;
   }
-
-  _batteryCharacteristic->setValue(data, sizeof(data));
-  _batteryCharacteristic->notify();
 }
\ No newline at end of file
@@ -39,22 +39,43 @@ void ConfigService::setupService() {
 }
 
 void ConfigService::onWrite(NimBLECharacteristic* characteristic) {
+  MemoryScope memory(MemorySubsystem::MemoryBle);
+
   std::string uuid = characteristic->getUUID().toString();
   std::string received = characteristic->getValue();
+  BluetoothLE::instance()->requestFastLink(BleLinkDemand::LinkConfig);
 
   if (uuid.compare(configStatusCharacteristicUUID) == 0) {
     const char* data = received.data();
 
     // start buffer
-    if (data[0] == ConfigControl::ReceiveStart) {
+    if (data[0] == ConfigControl::ReceiveStart && received.length() >= 1 + sizeof(uint32_t)) {
       memcpy(&_toReceive, (void*)&data[1], sizeof(uint32_t));
       rxBuffer.clear(); 
       _received = 0;
       ESP_LOGD(CONFIG_SERVICE_TAG, "Profile receive started. Expecting %d bytes", _toReceive);
     }
+    // start streaming a config file, the rx writes go straight to flash
+    else if (data[0] == ConfigControl::UploadStart && received.length() >= 1 + 2 * sizeof(uint32_t)) {
+      uint32_t length, crc;
+      memcpy(&length, (void*)&data[1], sizeof(uint32_t));
+      memcpy(&crc, (void*)&data[1 + sizeof(uint32_t)], sizeof(uint32_t));
+      _toReceive = _received = 0;
+
+      if (_config->beginUpload(length, crc))
+        ESP_LOGD(CONFIG_SERVICE_TAG, "Config upload started. Expecting %d bytes", length);
+      else
+        notifyStatus(ConfigControl::UploadFailed);
+    }
   }
   else if (uuid.compare(configRxCharacteristicUUID) == 0) {
-    if (_received < _toReceive) {
+    if (_config->isUploading()) {
+      if (!_config->appendUpload((const uint8_t*) received.data(), received.length()))
+        notifyStatus(ConfigControl::UploadFailed);
+      else if (_config->uploadReceived())
+        notifyStatus(_config->finishUpload() ? ConfigControl::UploadComplete : ConfigControl::UploadFailed);
+    }
+    else if (_received < _toReceive) {
       rxBuffer.append(received);
       _received += received.length();
       ESP_LOGD(CONFIG_SERVICE_TAG, "Received %d bytes", _received);
@@ -95,18 +116,36 @@ void ConfigService::processCommand(std::string data) {
       std::string region = regionString.substr(0, regionLocation);
       std::string effect = regionString.substr(regionLocation + 1);
 
-      bool valid = _config->addEffect(action, region, effect, save);
-      if (valid) {
+      bool valid = _config->setEffect(action, region, effect, save);
+      if (valid)
         ESP_LOGI(CONFIG_SERVICE_TAG, "Effect received - action: %s region: %s effect: %s",
           action.c_str(), region.c_str(), effect.c_str());
-        
-        if (save)
-          _config->saveConfig();
-      }
       else
         ESP_LOGW(CONFIG_SERVICE_TAG, "Invalid effect received - action: %s region: %s effect: %s",
           action.c_str(), region.c_str(), effect.c_str());
     }
+    else if (key == "region" || key == "saveRegion") {
+      // region:<name>,<channel>:<start>:<end>[,<channel>:<start>:<end>...]
+      size_t nameLocation = value.find_first_of(",");
+      std::string name = value.substr(0, nameLocation);
+      std::string sections = nameLocation == std::string::npos ? "" : value.substr(nameLocation + 1);
+
+      if (!_config->setRegion(name, sections, key == "saveRegion"))
+        ESP_LOGW(CONFIG_SERVICE_TAG, "Invalid region received - %s", value.c_str());
+    }
+    else if (key == "motion" || key == "saveMotion") {
+      // motion:<key>,<value>
+      size_t keyLocation = value.find_first_of(",");
+      if (keyLocation == std::string::npos || !_config->setMotionValue(value.substr(0, keyLocation), value.substr(keyLocation + 1), key == "saveMotion"))
+        ESP_LOGW(CONFIG_SERVICE_TAG, "Invalid motion setting received - %s", value.c_str());
+    }
+    else if (key == "pattern" || key == "savePattern") {
+      // pattern:<index>,<hex program>
+      size_t indexLocation = value.find_first_of(",");
+      if (indexLocation == std::string::npos
+        || !_config->setPattern(atoi(value.substr(0, indexLocation).c_str()), value.substr(indexLocation + 1), key == "savePattern"))
+        ESP_LOGW(CONFIG_SERVICE_TAG, "Invalid pattern received - %s", value.c_str());
+    }
     else if (key == "removeEffect") {
       // size_t actionLocation = value.find_first_of(",");
       // std::string action = value.substr(0, actionLocation);
@@ -118,134 +157,208 @@ void ConfigService::processCommand(std::string data) {
     else if (key == "get") {
       if (value == "config") {
         ESP_LOGD(CONFIG_SERVICE_TAG, "Config requested");
-        std::string data = std::string("raw:").append(_config->getRawConfig());
-        uint32_t length = data.length();
-        uint8_t raw[5];
-        raw[0] = ConfigControl::TransmitStart;
-        memcpy(&raw[1], &length, sizeof(uint32_t));
-        _configStatusCharacteristic->setValue(raw);
-        _configStatusCharacteristic->notify(true);
-        transmit(data);
+        requestTransmit(CONFIG_TX_CONFIG);
       }
+      else if (value == "trace") {
+        ESP_LOGD(CONFIG_SERVICE_TAG, "Motion trace requested");
+        requestTransmit(CONFIG_TX_TRACE);
+      }
+    }
+    else if (key == "preset") {
+      // preset:<slot> or preset:none for the source config
+      uint8_t slot = value == "none" ? CONFIG_PRESET_NONE : atoi(value.c_str());
+      if (!_config->selectPreset(slot))
+        ESP_LOGW(CONFIG_SERVICE_TAG, "Unable to switch to preset %s", value.c_str());
     }
+    else if (key == "savePreset") {
+      if (!_config->savePreset(atoi(value.c_str())))
+        ESP_LOGW(CONFIG_SERVICE_TAG, "Unable to save preset %s", value.c_str());
+    }
+    else if (key == "deletePreset")
+      _config->deletePreset(atoi(value.c_str()));
     else if (key == "save")
       _config->saveConfig();
   }
 }
 
-std::vector<std::string> ConfigService::buildPackets(std::string data, size_t packetSize) {
-  // calculate how many packets
-  size_t packetCount = data.length() / packetSize;
-  packetCount = data.length() % packetSize == 0 ? packetCount : packetCount + 1;
-
-  std::vector<std::string> packets;
-  // construct each packet
-  for (int i = 0; i < packetCount; i++) {
-    // start of packet
-    std::string packet = i == packetCount - 1 ? data.substr(i * packetSize) : data.substr(i * packetSize, packetSize);
-    // add to vector of packets
-    packets.push_back(packet);
-  }
-
-  return packets;
+void ConfigService::notifyStatus(ConfigControl status) {
+  uint8_t value = status;
+  _configStatusCharacteristic->setValue(&value, 1);
+  _configStatusCharacteristic->notify(true);
 }
 
-void ConfigService::transmit(std::string data) {
-  size_t chars = data.length();
-  auto m_properties = _configTxCharacteristic->m_properties;
-  auto m_subscribedVec = _configTxCharacteristic->m_subscribedVec;
-  bool is_notification = true;
+/*
+  Sends one packet to a connection, backing off while the host is out of
+  buffers rather than assuming a fixed pace will keep up
+*/
+bool ConfigService::sendPacket(uint16_t conn, const uint8_t *data, size_t length) {
+  auto start = millis();
 
-  if (m_subscribedVec.size() == 0) {
-    return;
-  }
+  for (;;) {
+    auto om = ble_hs_mbuf_from_flat(data, length);
+    int rc = om == nullptr ? BLE_HS_ENOMEM : ble_gattc_notify_custom(conn, _configTxCharacteristic->m_handle, om);
 
-  _configTxCharacteristic->m_pCallbacks->onNotify(_configTxCharacteristic);
+    if (rc == 0)
+      return true;
 
-  bool reqSec = (m_properties & BLE_GATT_CHR_F_READ_AUTHEN) ||
-                (m_properties & BLE_GATT_CHR_F_READ_AUTHOR) ||
-                (m_properties & BLE_GATT_CHR_F_READ_ENC);
-  int rc = 0;
+    if ((rc != BLE_HS_ENOMEM && rc != BLE_HS_EBUSY) || millis() - start >= CONFIG_TX_TIMEOUT_MS) {
+      ESP_LOGW(CONFIG_SERVICE_TAG, "Config transmit failed (%d)", rc);
+      return false;
+    }
 
-  for (auto &it : m_subscribedVec) {
-    uint16_t _mtu = _configTxCharacteristic->getService()->getServer()->getPeerMTU(it.first);
-    uint16_t packetSize = _mtu - 3;
+    delay(CONFIG_TX_BACKOFF_MS);
+  }
+}
 
-    // check if connected and subscribed
-    if(_mtu == 0 || it.second == 0)
-      continue;    
+std::vector<std::pair<uint16_t, uint16_t>> ConfigService::transmitTargets() {
+  std::vector<std::pair<uint16_t, uint16_t>> targets;
+  auto subscribers = _configTxCharacteristic->m_subscribedVec;
+
+  for (auto &it : subscribers) {
+    uint16_t mtu = _server->getPeerMTU(it.first);
+
+    // check if connected and subscribed to notifications
+    if (mtu <= 3 || !(it.second & 0x0001))
+      continue;
 
     // check if security requirements are satisfied
-    if(reqSec) {
-      struct ble_gap_conn_desc desc;
-      rc = ble_gap_conn_find(it.first, &desc);
-      if(rc != 0 || !desc.sec_state.encrypted)
-        continue;
-    }
+    struct ble_gap_conn_desc desc;
+    if (ble_gap_conn_find(it.first, &desc) != 0 || !desc.sec_state.encrypted)
+      continue;
 
-    if(!(it.second & 0x0001))
-      is_notification = false;
+    targets.push_back({ it.first, mtu });
+  }
+
+  return targets;
+}
 
-    if(!(it.second & 0x0002))
-      is_notification = true;
+void ConfigService::transmitConfig() {
+  MemoryScope memory(MemorySubsystem::MemoryBle);
 
-    // notify that we're starting a transmission
+  for (auto &target : transmitTargets()) {
     configTransceiver.wait("config");
     configTransceiver.take("config");
 
-    // send packets
-    auto packets = buildPackets(data, packetSize);
-    for (auto packet : packets) {
-      notify(it.first, packet, is_notification);
-      delay(10);
-    }
-    
+    ConfigNotifier notifier(this, target.first, target.second - 3);
+    _config->streamConfig(notifier);
+    notifier.flush();
+
+    if (notifier.failed)
+      ESP_LOGW(CONFIG_SERVICE_TAG, "Config transmit to %d aborted after %d bytes", target.first, notifier.sent);
+    else
+      ESP_LOGD(CONFIG_SERVICE_TAG, "Config transmitted to %d, %d bytes", target.first, notifier.sent);
+
     configTransceiver.give();
   }
 }
 
-void ConfigService::notify(uint16_t conn_id, std::string value, bool is_notification) {
-  int rc = 0;
-  auto m_properties = _configTxCharacteristic->m_properties;
-  auto m_handle = _configTxCharacteristic->m_handle;
+/*
+  Streams the recorded motion trace the same way as the config, a block of
+  the file at a time. Nothing is sent while a recording is still running
+*/
+void ConfigService::transmitTrace() {
+  MemoryScope memory(MemorySubsystem::MemoryBle);
 
-  // don't create the m_buf until we are sure to send the data or else
-  // we could be allocating a buffer that doesn't get released.
-  // We also must create it in each loop iteration because it is consumed with each host call.
-  os_mbuf *om = ble_hs_mbuf_from_flat((uint8_t*)value.data(), value.length());
+  if (TraceRecorder::instance()->recording()) {
+    ESP_LOGW(CONFIG_SERVICE_TAG, "Motion trace is still recording");
+    return;
+  }
 
-  NimBLECharacteristicCallbacks::Status statusRC;
+  for (auto &target : transmitTargets()) {
+    FILE *file = fopen(MOTION_TRACE_PATH, "rb");
+    MotionTraceHeader header;
+    if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 || header.magic != MOTION_TRACE_MAGIC) {
+      ESP_LOGW(CONFIG_SERVICE_TAG, "No motion trace to send");
+      if (file != NULL)
+        fclose(file);
+      return;
+    }
 
-  if(!is_notification && (m_properties & NIMBLE_PROPERTY::INDICATE)) {
-    ble_task_data_t taskData = {nullptr, xTaskGetCurrentTaskHandle(),0, nullptr};
-    _configTxCharacteristic->m_pTaskData = &taskData;
+    ConfigNotifier notifier(this, target.first, target.second - 3, CONFIG_TX_TRACE_PREFIX);
+    notifier.begin(sizeof(header) + header.records * sizeof(MotionTraceRecord));
+    notifier.write((const uint8_t*) &header, sizeof(header));
 
-    rc = ble_gattc_indicate_custom(conn_id, m_handle, om);
-    if (rc != 0)
-      statusRC = NimBLECharacteristicCallbacks::Status::ERROR_GATT;
-    else {
-      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-      rc = _configTxCharacteristic->m_pTaskData->rc;
+    // an abandoned recording can leave more on disk than its header counts
+    uint8_t block[TRACE_SECTOR_SIZE / 8];
+    size_t remaining = header.records * sizeof(MotionTraceRecord), read;
+    while (!notifier.failed && remaining > 0 && (read = fread(block, 1, std::min(remaining, sizeof(block)), file)) > 0) {
+      notifier.write(block, read);
+      remaining -= read;
     }
+    notifier.flush();
+    fclose(file);
 
-    _configTxCharacteristic->m_pTaskData = nullptr;
-
-    if (rc == BLE_HS_EDONE) {
-      rc = 0;
-      statusRC = NimBLECharacteristicCallbacks::Status::SUCCESS_INDICATE;
-    } 
-    else if (rc == BLE_HS_ETIMEOUT)
-      statusRC = NimBLECharacteristicCallbacks::Status::ERROR_INDICATE_TIMEOUT;
-    else
-      statusRC = NimBLECharacteristicCallbacks::Status::ERROR_INDICATE_FAILURE;
-  } 
-  else {
-    rc = ble_gattc_notify_custom(conn_id, m_handle, om);
-    if (rc == 0)
-      statusRC = NimBLECharacteristicCallbacks::Status::SUCCESS_NOTIFY;
+    if (notifier.failed)
+      ESP_LOGW(CONFIG_SERVICE_TAG, "Motion trace transmit to %d aborted after %d bytes", target.first, notifier.sent);
     else
-      statusRC = NimBLECharacteristicCallbacks::Status::ERROR_GATT;
+      ESP_LOGD(CONFIG_SERVICE_TAG, "Motion trace transmitted to %d, %d bytes", target.first, notifier.sent);
+  }
+}
+
+/*
+  Most connections never read the config back, so the task and its stack
+  only exist once one does
+*/
+void ConfigService::requestTransmit(uint32_t requests) {
+  if (_transmitHandle == NULL && !Tasks::create(TaskConfigTx, transmitTask, this, &_transmitHandle))
+    return;
+
+  xTaskNotify(_transmitHandle, requests, eSetBits);
+}
+
+/*
+  Transfers wait on the host to free buffers, so they can't run on the host's
+  own task from inside a write callback
+*/
+void ConfigService::transmitTask(void *parameters) {
+  auto service = static_cast<ConfigService*>(parameters);
+
+  for (;;) {
+    uint32_t requests = 0;
+    xTaskNotifyWait(0, UINT32_MAX, &requests, portMAX_DELAY);
+
+    if (requests & CONFIG_TX_CONFIG)
+      service->transmitConfig();
+    if (requests & CONFIG_TX_TRACE)
+      service->transmitTrace();
+  }
+}
+
+void ConfigNotifier::begin(size_t length) {
+  uint32_t total = strlen(_prefix) + length;
+  uint8_t raw[5];
+  raw[0] = ConfigControl::TransmitStart;
+  memcpy(&raw[1], &total, sizeof(uint32_t));
+  _service->_configStatusCharacteristic->setValue(raw);
+  _service->_configStatusCharacteristic->notify(true);
+
+  write((const uint8_t*) _prefix, strlen(_prefix));
+}
+
+size_t ConfigNotifier::write(const uint8_t *buffer, size_t length) {
+  for (size_t i = 0; i < length && !failed;) {
+    size_t count = std::min(length - i, (size_t)(_packetSize - _length));
+    memcpy(&_packet[_length], buffer + i, count);
+    _length += count;
+    i += count;
+
+    if (_length == _packetSize)
+      flush();
   }
 
-  _configTxCharacteristic->m_pCallbacks->onStatus(_configTxCharacteristic, statusRC, rc);
-}
\ No newline at end of file
+  return failed ? 0 : length;
+}
+
+void ConfigNotifier::flush() {
+  if (_length == 0 || failed)
+    return;
+
+  BluetoothLE::instance()->requestFastLink(BleLinkDemand::LinkConfig);
+
+  if (_service->sendPacket(_conn, _packet.data(), _length))
+    sent += _length;
+  else
+    failed = true;
+
+  _length = 0;
+}
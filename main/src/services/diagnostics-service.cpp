@@ -0,0 +1,142 @@
+#include <services/diagnostics-service.h>
+
+DiagnosticsService::DiagnosticsService(NimBLEServer *server, Motion *motion) {
+  _server = server;
+  _motion = motion;
+
+  setupService();
+}
+
+void DiagnosticsService::setupService() {
+  auto service = _server->createService(diagnosticsServiceUUID);
+
+  // render pipeline timings, see Profiler::serialize for the layout. writing 0x01 resets them
+  _renderCharacteristic = service->createCharacteristic(
+    NimBLEUUID::fromString(diagnosticsRenderCharacteristicUUID),
+    NIMBLE_PROPERTY::READ |
+    NIMBLE_PROPERTY::READ_ENC |
+    NIMBLE_PROPERTY::WRITE |
+    NIMBLE_PROPERTY::WRITE_NR |
+    NIMBLE_PROPERTY::WRITE_ENC);
+
+  _renderCharacteristic->setCallbacks(this);
+
+  // brake latency benchmark, see Profiler::serializeLatency. writing 0x01 starts it, 0x00 stops it
+  _latencyCharacteristic = service->createCharacteristic(
+    NimBLEUUID::fromString(diagnosticsLatencyCharacteristicUUID),
+    NIMBLE_PROPERTY::READ |
+    NIMBLE_PROPERTY::READ_ENC |
+    NIMBLE_PROPERTY::WRITE |
+    NIMBLE_PROPERTY::WRITE_NR |
+    NIMBLE_PROPERTY::WRITE_ENC);
+
+  _latencyCharacteristic->setCallbacks(this);
+
+  // per task placement, stack and cpu use since the previous read, see Tasks::serialize
+  _tasksCharacteristic = service->createCharacteristic(
+    NimBLEUUID::fromString(diagnosticsTasksCharacteristicUUID),
+    NIMBLE_PROPERTY::READ |
+    NIMBLE_PROPERTY::READ_ENC);
+
+  _tasksCharacteristic->setCallbacks(this);
+
+  // cost of every effect over synthetic regions, see Profiler::serializeEffectCost. writing 0x01 runs it
+  _effectsCharacteristic = service->createCharacteristic(
+    NimBLEUUID::fromString(diagnosticsEffectsCharacteristicUUID),
+    NIMBLE_PROPERTY::READ |
+    NIMBLE_PROPERTY::READ_ENC |
+    NIMBLE_PROPERTY::WRITE |
+    NIMBLE_PROPERTY::WRITE_NR |
+    NIMBLE_PROPERTY::WRITE_ENC);
+
+  _effectsCharacteristic->setCallbacks(this);
+
+  // heap state and per subsystem retention, see MemoryStats::serialize
+  _memoryCharacteristic = service->createCharacteristic(
+    NimBLEUUID::fromString(diagnosticsMemoryCharacteristicUUID),
+    NIMBLE_PROPERTY::READ |
+    NIMBLE_PROPERTY::READ_ENC);
+
+  _memoryCharacteristic->setCallbacks(this);
+
+  // how long after reset the board reached each boot stage, see Profiler::serializeBoot
+  _bootCharacteristic = service->createCharacteristic(
+    NimBLEUUID::fromString(diagnosticsBootCharacteristicUUID),
+    NIMBLE_PROPERTY::READ |
+    NIMBLE_PROPERTY::READ_ENC);
+
+  _bootCharacteristic->setCallbacks(this);
+
+  // json report of the metrics releases are gated on, see Profiler::report. written with a PerformanceCommand
+  _performanceCharacteristic = service->createCharacteristic(
+    NimBLEUUID::fromString(diagnosticsPerformanceCharacteristicUUID),
+    NIMBLE_PROPERTY::READ |
+    NIMBLE_PROPERTY::READ_ENC |
+    NIMBLE_PROPERTY::WRITE |
+    NIMBLE_PROPERTY::WRITE_NR |
+    NIMBLE_PROPERTY::WRITE_ENC);
+
+  _performanceCharacteristic->setCallbacks(this);
+
+  service->start();
+}
+
+void DiagnosticsService::onRead(NimBLECharacteristic *characteristic) {
+  if (characteristic->getUUID().equals(_renderCharacteristic->getUUID()))
+    _renderCharacteristic->setValue(Profiler::instance()->serialize());
+  else if (characteristic->getUUID().equals(_latencyCharacteristic->getUUID()))
+    _latencyCharacteristic->setValue(Profiler::instance()->serializeLatency());
+  else if (characteristic->getUUID().equals(_tasksCharacteristic->getUUID())) {
+    _tasksCharacteristic->setValue(Tasks::serialize());
+    Tasks::log();
+  }
+  else if (characteristic->getUUID().equals(_effectsCharacteristic->getUUID()))
+    _effectsCharacteristic->setValue(Profiler::instance()->serializeEffectCost());
+  else if (characteristic->getUUID().equals(_memoryCharacteristic->getUUID())) {
+    _memoryCharacteristic->setValue(MemoryStats::serialize());
+    MemoryStats::log();
+  }
+  else if (characteristic->getUUID().equals(_bootCharacteristic->getUUID()))
+    _bootCharacteristic->setValue(Profiler::instance()->serializeBoot());
+  else if (characteristic->getUUID().equals(_performanceCharacteristic->getUUID())) {
+    auto report = Profiler::instance()->report();
+    // also on the console, so a bench rig can gate a release off the serial log
+    ESP_LOGI(DIAGNOSTICS_SERVICE_TAG, "perf %s", report.c_str());
+    _performanceCharacteristic->setValue(report);
+  }
+}
+
+void DiagnosticsService::onWrite(NimBLECharacteristic *characteristic) {
+  std::string data = characteristic->getValue();
+
+  if (characteristic->getUUID().equals(_renderCharacteristic->getUUID())) {
+    if (data.length() >= 1 && data[0] == 0x01) {
+      ESP_LOGD(DIAGNOSTICS_SERVICE_TAG, "Resetting render timings");
+      Profiler::instance()->reset();
+    }
+  }
+  else if (characteristic->getUUID().equals(_latencyCharacteristic->getUUID())) {
+    if (data.length() >= 1)
+      Profiler::instance()->setBenchmarking(data[0] == 0x01);
+  }
+  else if (characteristic->getUUID().equals(_effectsCharacteristic->getUUID())) {
+    if (data.length() >= 1 && data[0] == 0x01) {
+      ESP_LOGD(DIAGNOSTICS_SERVICE_TAG, "Running effect benchmark");
+      Lights::instance()->requestBenchmark();
+    }
+  }
+  else if (characteristic->getUUID().equals(_performanceCharacteristic->getUUID())) {
+    // the suite includes a trace replay, which holds up brake detection while it runs
+    if (data.length() >= 1 && data[0] == PerformanceCommand::PerformanceRun) {
+      if (!_motion->canReplay())
+        ESP_LOGW(DIAGNOSTICS_SERVICE_TAG, "Performance suite needs the vehicle parked");
+      else {
+        ESP_LOGD(DIAGNOSTICS_SERVICE_TAG, "Running performance suite");
+        Lights::instance()->requestBenchmark();
+        _motion->requestReplay();
+      }
+    }
+    else if (data.length() >= 1 && data[0] == PerformanceCommand::PerformanceSaveBaseline)
+      Profiler::instance()->saveBaseline();
+  }
+}
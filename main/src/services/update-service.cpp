@@ -4,9 +4,8 @@ UpdateService::UpdateService(Updater *updater, NimBLEServer *server) {
   _updater = updater;
   _server = server;  
 
-  // listen to ota status updates
-  updateStatusQueue = xQueueCreate(5, sizeof(UpdateStatus));
-  updater->addUpdateListener(this);
+  // listen to ota status updates, on the app task that drains us from process()
+  EventBus::instance()->subscribe(this, EVENT_MASK(EventUpdateStatus), xTaskGetCurrentTaskHandle());
 
   setupService();
 }
@@ -43,45 +42,75 @@ void UpdateService::setupService() {
 }
 
 void UpdateService::process() {
-  if (uxQueueMessagesWaiting(updateStatusQueue)) {
-    UpdateStatus status;
-    xQueueReceive(updateStatusQueue, &status, 0);
-    onUpdateStatusChanged(status);
-  }
+  dispatchEvents();
+}
+
+void UpdateService::onEvent(const Event &event) {
+  if (event.type == EventUpdateStatus)
+    onUpdateStatusChanged(event.as<UpdateStatus>());
 }
 
 void UpdateService::onWrite(NimBLECharacteristic* characteristic) {
   auto uuid = characteristic->getUUID();
   std::string dataStr = characteristic->getValue();
+  BluetoothLE::instance()->requestFastLink(BleLinkDemand::LinkUpdate);
 
   if (uuid.equals(_updateControlCharacteristic->getUUID())) {
     ESP_LOGD(UPDATE_SERVICE_TAG,"update control");
     const char* data = dataStr.data();
-    size_t len = sizeof(data);
+    size_t len = dataStr.length();
+
+    // an image id after the control byte makes the update offset addressed and resumable
+    uint32_t image = 0;
+    if (len >= 1 + sizeof(uint32_t))
+      memcpy(&image, &data[1], sizeof(uint32_t));
 
     if (len >= 1) {
       switch (data[0]) {
         case UpdateStatus::Start:
-          ESP_LOGD(UPDATE_SERVICE_TAG,"Start update");
-          _updater->startUpdate();
+          ESP_LOGD(UPDATE_SERVICE_TAG,"Start update %08x", image);
+          _addressed = image != 0;
+          _updater->startUpdate(image);
           break;
         case UpdateStatus::End:
           ESP_LOGD(UPDATE_SERVICE_TAG,"End update");
           _updater->endUpdate();
           break;
+        case UpdateStatus::Resume:
+          _updater->queryResume(image);
+          break;
         default: break;
       }
     }
   }
   if (uuid.equals(_updateRxCharacteristic->getUUID())) {
-    ESP_LOGD(UPDATE_SERVICE_TAG,"update data - length: %d", dataStr.length());
-    _updater->writeUpdate(dataStr);
+    const uint8_t *data = (const uint8_t*) dataStr.data();
+
+    if (!_addressed)
+      _updater->writeUpdate(data, dataStr.length());
+    else if (dataStr.length() > UPDATER_BLOCK_HEADER) {
+      uint32_t offset, crc;
+      memcpy(&offset, data, sizeof(uint32_t));
+      memcpy(&crc, data + sizeof(uint32_t), sizeof(uint32_t));
+      _updater->writeBlock(offset, crc, data + UPDATER_BLOCK_HEADER, dataStr.length() - UPDATER_BLOCK_HEADER);
+    }
   }
 }
 
+/*
+  Every status carries the next offset the updater expects. Progress and the
+  resume replies repeat, the rest only go out when they change
+*/
 void UpdateService::onUpdateStatusChanged(UpdateStatus status) {
-  if (_updateStatus != status) {
-    _updateStatusCharacteristic->setValue<UpdateStatus>(status);
+  bool repeats = status == UpdateStatus::Write || status == UpdateStatus::Resume
+    || status == UpdateStatus::ErrorChecksum || status == UpdateStatus::Start;
+
+  if (_updateStatus != status || repeats) {
+    uint8_t value[5];
+    uint32_t written = _updater->nextOffset();
+    value[0] = status;
+    memcpy(&value[1], &written, sizeof(uint32_t));
+    _updateStatusCharacteristic->setValue(value, sizeof(value));
     _updateStatusCharacteristic->notify();
 
     _updateStatus = status;
@@ -6,9 +6,11 @@ VehicleService::VehicleService(Motion *motion, Power *power, NimBLEServer *serve
   _power = power;
   _renderHost = host;
   
-  calibrateXGQueue = xQueueCreate(2, sizeof(CalibrationState));
-  calibrateMagQueue = xQueueCreate(2, sizeof(CalibrationState));
-  lightsChangedQueue = xQueueCreate(4, sizeof(LightCommands));
+  // vehicle state comes straight from the app, everything else off the bus on the app task
+  EventBus::instance()->subscribe(this,
+    EVENT_MASK(EventCalibrateXG) | EVENT_MASK(EventCalibrateMag) |
+    EVENT_MASK(EventLightsChanged) | EVENT_MASK(EventPowerStatus),
+    xTaskGetCurrentTaskHandle());
 
   setupService();
 }
@@ -69,9 +71,51 @@ void VehicleService::setupService() {
   
   _restartCharacteristic->setCallbacks(this);
 
+  // write decimation (1) and interval in ms (2) to change how samples are packed
+  _telemetryCharacteristic = service->createCharacteristic(
+    NimBLEUUID::fromString(vehicleTelemetryCharacteristicUUID),
+    NIMBLE_PROPERTY::WRITE |
+    NIMBLE_PROPERTY::WRITE_ENC |
+    NIMBLE_PROPERTY::NOTIFY);
+
+  _telemetryCharacteristic->setCallbacks(this);
+
+  // state, lights and battery in one notification, for clients that want all three
+  _statusCharacteristic = service->createCharacteristic(
+    NimBLEUUID::fromString(vehicleStatusCharacteristicUUID),
+    NIMBLE_PROPERTY::READ |
+    NIMBLE_PROPERTY::NOTIFY);
+
+  // the phone writes its clock in ms (4) to every device on the vehicle, so
+  // their periodic effects blink in phase
+  _clockCharacteristic = service->createCharacteristic(
+    NimBLEUUID::fromString(vehicleClockCharacteristicUUID),
+    NIMBLE_PROPERTY::WRITE |
+    NIMBLE_PROPERTY::WRITE_NR |
+    NIMBLE_PROPERTY::WRITE_ENC);
+
+  _clockCharacteristic->setCallbacks(this);
+
+  // motion traces. writing 0x01 replays the stored trace, 0x02 starts recording
+  // one, 0x03 stops it and 0x04 followed by a MotionTraceLabel (1) and state (1)
+  // labels it. reading gives the results of the last replay, see Motion::serializeReplay
+  _traceCharacteristic = service->createCharacteristic(
+    NimBLEUUID::fromString(vehicleTraceCharacteristicUUID),
+    NIMBLE_PROPERTY::READ |
+    NIMBLE_PROPERTY::READ_ENC |
+    NIMBLE_PROPERTY::WRITE |
+    NIMBLE_PROPERTY::WRITE_ENC);
+
+  _traceCharacteristic->setCallbacks(this);
+
   service->start();
 }
 
+void VehicleService::onRead(NimBLECharacteristic *characteristic) {
+  if (characteristic->getUUID().equals(_traceCharacteristic->getUUID()))
+    _traceCharacteristic->setValue(_motion->serializeReplay());
+}
+
 void VehicleService::onWrite(NimBLECharacteristic *characteristic) {
   auto uuid = characteristic->getUUID();
   std::string dataStr = characteristic->getValue();
@@ -147,57 +191,239 @@ void VehicleService::onWrite(NimBLECharacteristic *characteristic) {
     ESP_LOGD(VEHICLE_SERVICE_TAG,"vehicle restart onwrite: %d", data[0]);
     _power->shutdown(true);
   }
+  else if (uuid.equals(_telemetryCharacteristic->getUUID())) {
+    if (len >= 1 && data[0] != 0x00)
+      _telemetryDecimation = data[0];
+
+    if (len >= 3) {
+      uint16_t interval;
+      memcpy(&interval, &data[1], sizeof(uint16_t));
+      _telemetryInterval = std::max(interval, (uint16_t) VEHICLE_TELEMETRY_MIN_INTERVAL);
+    }
+
+    ESP_LOGD(VEHICLE_SERVICE_TAG,"telemetry every %d samples, %dms", _telemetryDecimation, _telemetryInterval);
+  }
+  else if (uuid.equals(_traceCharacteristic->getUUID())) {
+    auto recorder = TraceRecorder::instance();
+    if (len >= 1 && data[0] == 0x01 && !recorder->recording()) {
+      if (!_motion->requestReplay())
+        ESP_LOGW(VEHICLE_SERVICE_TAG,"motion trace replay needs the vehicle parked");
+    }
+    else if (len >= 1 && data[0] == 0x02)
+      recorder->start(_motion->getSampleRate());
+    else if (len >= 1 && data[0] == 0x03)
+      recorder->stop();
+    else if (len >= 3 && data[0] == 0x04 && data[1] < MotionTraceLabels)
+      recorder->label((MotionTraceLabel) data[1], data[2]);
+  }
+  else if (uuid.equals(_clockCharacteristic->getUUID())) {
+    if (len >= 4) {
+      uint32_t sharedTime;
+      memcpy(&sharedTime, data, sizeof(uint32_t));
+      SyncClock::instance()->sync(sharedTime);
+    }
+  }
   else if (uuid.equals(_calibrationCharacteristic->getUUID())) {
     ESP_LOGD(VEHICLE_SERVICE_TAG,"vehicle calibration onwrite");
     if (len >= 1) {
-      xQueueSendToBack(_motion->calibrationRequestQueue, &data[0], 0);
+      _motion->requestCalibration(data[0]);
     }
   }
 }
 
 void VehicleService::onVehicleStateChanged(VehicleState state) {
   // ESP_LOGD(VEHICLE_SERVICE_TAG,"broadcast vehicle state changed");
-  uint8_t value[3];
+  uint8_t *value = &_status[1];
   value[0] = state.acceleration;
   value[1] = state.turn;
   value[2] = state.orientation;
-  
-  _stateCharacteristic->setValue((uint8_t*)value, sizeof(state));
-  _stateCharacteristic->notify();
+
+  _stateCharacteristic->setValue(value, 3);
+  _pendingStatus |= VehicleStatusChange::StatusState;
 }
 
-void VehicleService::process() {
-  if (uxQueueMessagesWaiting(calibrateXGQueue)) {
-    CalibrationState state;
-    xQueueReceive(calibrateXGQueue, &state, 0);
+void VehicleService::onBatteryChanged(PowerStatus status) {
+  BatteryService::encodeLevelState(status, &_status[8]);
+  _pendingStatus |= VehicleStatusChange::StatusBattery;
+}
+
+/*
+  Sends everything that changed since the last flush, at most once per
+  interval, so flicker collapses into the latest value of each
+*/
+void VehicleService::flushStatus() {
+  if (_pendingStatus == 0 || millis() - _lastStatusNotify < VEHICLE_NOTIFY_INTERVAL)
+    return;
+
+  if (_pendingStatus & VehicleStatusChange::StatusState)
+    _stateCharacteristic->notify();
 
-    state == CalibrationState::Started ? onCalibrateXGStarted() : onCalibrateXGEnded();
+  if (_pendingStatus & VehicleStatusChange::StatusLights)
+    _lightCharacteristic->notify(true);
+
+  _status[0] = _pendingStatus;
+  _statusCharacteristic->setValue(_status, sizeof(_status));
+  _statusCharacteristic->notify();
+
+  _pendingStatus = 0;
+  _lastStatusNotify = millis();
+}
+
+void VehicleService::onSubscribe(NimBLECharacteristic *characteristic, ble_gap_conn_desc *desc, uint16_t subValue) {
+  if (characteristic == _telemetryCharacteristic) {
+    bool subscribed = subValue & 0x0001;
+    _telemetryMtu = _server->getPeerMTU(desc->conn_handle);
+    _telemetrySubscribed = subscribed;
+    _motion->setTelemetry(subscribed);
   }
-  
-  if (uxQueueMessagesWaiting(calibrateMagQueue)) {
-    CalibrationState state;
-    xQueueReceive(calibrateMagQueue, &state, 0);
+}
+
+void VehicleService::setTelemetry(bool enabled) {
+  // as many whole samples as fit the peer's MTU
+  uint16_t payload = std::max((uint16_t) _telemetryMtu, (uint16_t) 23) - 3;
+  size_t samples = (payload - VEHICLE_TELEMETRY_HEADER) / sizeof(TelemetrySample);
+
+  // a packet that can't hold a single sample would only ever be truncated
+  if (enabled && samples == 0) {
+    ESP_LOGW(VEHICLE_SERVICE_TAG,"telemetry needs an MTU of %d, peer has %d",
+      (int) (VEHICLE_TELEMETRY_HEADER + sizeof(TelemetrySample) + 3), _telemetryMtu);
+    _telemetrySubscribed = false;
+    _motion->setTelemetry(false);
+    enabled = false;
+  }
+
+  if (enabled) {
+    _telemetryPacketSize = VEHICLE_TELEMETRY_HEADER + samples * sizeof(TelemetrySample);
+    _telemetryPacket.reserve(_telemetryPacketSize);
+    _telemetryPacket.clear();
+    _lastTelemetry = millis();
+  }
+  else
+    _telemetryPacket = std::vector<uint8_t>();
+
+  ESP_LOGD(VEHICLE_SERVICE_TAG,"telemetry %s", enabled ? "subscribed" : "unsubscribed");
+  _telemetryActive = enabled;
+}
+
+void VehicleService::sendTelemetry() {
+  if (_telemetryPacket.size() <= VEHICLE_TELEMETRY_HEADER)
+    return;
+
+  uint16_t dropped = _motion->telemetry().dropped();
+  _telemetryPacket[0] = _telemetrySequence++;
+  _telemetryPacket[1] = (_telemetryPacket.size() - VEHICLE_TELEMETRY_HEADER) / sizeof(TelemetrySample);
+  memcpy(&_telemetryPacket[2], &dropped, sizeof(uint16_t));
+
+  _telemetryCharacteristic->setValue(_telemetryPacket.data(), _telemetryPacket.size());
+  _telemetryCharacteristic->notify();
+  BluetoothLE::instance()->requestFastLink(BleLinkDemand::LinkStreaming);
+
+  _telemetryPacket.clear();
+  _lastTelemetry = millis();
+}
 
-    state == CalibrationState::Started ? onCalibrateMagStarted() : onCalibrateMagEnded();
+/*
+  Packs everything the motion buffer has into MTU sized notifications, a
+  partial packet goes out once the interval is up
+*/
+void VehicleService::streamTelemetry() {
+  // a client that drops doesn't always unsubscribe first
+  if (_telemetrySubscribed && _server->getConnectedCount() == 0) {
+    _telemetrySubscribed = false;
+    _motion->setTelemetry(false);
   }
 
-  if (uxQueueMessagesWaiting(lightsChangedQueue)) {
-    LightCommands commands;
-    xQueueReceive(lightsChangedQueue, &commands, 0);
+  if (_telemetrySubscribed != _telemetryActive)
+    setTelemetry(_telemetrySubscribed);
+
+  if (!_telemetryActive) {
+    // whatever was published before the unsubscribe
+    MotionSample discard;
+    while (_motion->telemetry().pop(discard)) { }
+    return;
+  }
+
+  auto toFixed = [](float value, float scale) {
+    return (int16_t) std::max(-32768.0f, std::min(32767.0f, value * scale));
+  };
+
+  MotionSample samples[MOTION_SAMPLE_BATCH];
+  size_t count;
+  while ((count = _motion->telemetry().pop(samples, MOTION_SAMPLE_BATCH)) > 0) {
+    for (size_t i = 0; i < count; i++) {
+      if (_telemetryCounter++ % _telemetryDecimation != 0)
+        continue;
+
+      auto& sample = samples[i];
+      TelemetrySample packed;
+      packed.timestamp = sample.timestamp;
+      packed.acceleration[0] = toFixed(sample.acceleration.x, 1000.0f);
+      packed.acceleration[1] = toFixed(sample.acceleration.y, 1000.0f);
+      packed.acceleration[2] = toFixed(sample.acceleration.z, 1000.0f);
+      packed.linear[0] = toFixed(sample.linear.x, 1000.0f);
+      packed.linear[1] = toFixed(sample.linear.y, 1000.0f);
+      packed.linear[2] = toFixed(sample.linear.z, 1000.0f);
+      packed.attitude[0] = toFixed(sample.attitude.x, 100.0f);
+      packed.attitude[1] = toFixed(sample.attitude.y, 100.0f);
+      packed.attitude[2] = toFixed(sample.attitude.z, 100.0f);
+
+      if (_telemetryPacket.empty())
+        _telemetryPacket.resize(VEHICLE_TELEMETRY_HEADER);
+
+      auto bytes = (const uint8_t*) &packed;
+      _telemetryPacket.insert(_telemetryPacket.end(), bytes, bytes + sizeof(TelemetrySample));
+
+      if (_telemetryPacket.size() + sizeof(TelemetrySample) > _telemetryPacketSize)
+        sendTelemetry();
+    }
+  }
+
+  if (millis() - _lastTelemetry >= _telemetryInterval)
+    sendTelemetry();
+}
+
+bool VehicleService::pending() {
+  return _pendingStatus != 0 || _telemetrySubscribed || _telemetryActive || hasEvents();
+}
+
+void VehicleService::process() {
+  streamTelemetry();
+  dispatchEvents();
+  flushStatus();
+}
+
+void VehicleService::onEvent(const Event &event) {
+  switch (event.type) {
+    case EventCalibrateXG:
+      event.as<CalibrationState>() == CalibrationState::Started ? onCalibrateXGStarted() : onCalibrateXGEnded();
+      break;
+
+    case EventCalibrateMag:
+      event.as<CalibrationState>() == CalibrationState::Started ? onCalibrateMagStarted() : onCalibrateMagEnded();
+      break;
+
+    case EventLightsChanged:
+      onLightsChanged(event.as<LightCommands>());
+      break;
+
+    case EventPowerStatus:
+      onBatteryChanged(event.as<PowerStatus>());
+      break;
 
-    onLightsChanged(commands);
+    default:
+      break;
   }
 }
 
 void VehicleService::onLightsChanged(LightCommands commands) {
-  uint8_t payload[4];
+  uint8_t *payload = &_status[4];
   payload[0] = commands.motionCommand;
   payload[1] = commands.headlightCommand;
   payload[2] = commands.turnCommand;
   payload[3] = commands.orientationCommand;
 
-  _lightCharacteristic->setValue(&payload[0], sizeof(payload));
-  _lightCharacteristic->notify(true);
+  _lightCharacteristic->setValue(payload, 4);
+  _pendingStatus |= VehicleStatusChange::StatusLights;
 }
 
 void VehicleService::onCalibrateXGStarted() {